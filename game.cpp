@@ -1,32 +1,598 @@
-﻿#include "game.h"
+﻿#ifdef _WIN32
+#include <winsock2.h>  // Must come before windows.h
+#include <io.h>
+#include <conio.h>
+#include <intrin.h>  // __mulh, for rule division by a constant
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#include "game.h"
 
-// First: Implement King class methods
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+
+// MemoryTracker class implementation
+// Header in front of every tracked block; keeps the block 16-byte aligned
+struct MemoryHeader {
+    unsigned long long size;
+    unsigned short account;
+    unsigned short site;  // 0xFFFF for none
+    unsigned char tag;
+    unsigned char padding[3];
+};
+static_assert(sizeof(MemoryHeader) == 16, "MemoryHeader must keep blocks 16-byte aligned");
+
+struct MemoryCounters {
+    atomic<long long> liveBytes;
+    atomic<long long> liveCount;
+    atomic<long long> allocatedBytes;
+    atomic<long long> allocationCount;
+
+    void add(long long size) {
+        liveBytes.fetch_add(size, memory_order_relaxed);
+        liveCount.fetch_add(1, memory_order_relaxed);
+        allocatedBytes.fetch_add(size, memory_order_relaxed);
+        allocationCount.fetch_add(1, memory_order_relaxed);
+    }
+    void remove(long long size) {
+        liveBytes.fetch_sub(size, memory_order_relaxed);
+        liveCount.fetch_sub(1, memory_order_relaxed);
+    }
+    MemoryStats load() const {
+        MemoryStats stats;
+        stats.liveBytes = liveBytes.load(memory_order_relaxed);
+        stats.liveCount = liveCount.load(memory_order_relaxed);
+        stats.allocatedBytes = allocatedBytes.load(memory_order_relaxed);
+        stats.allocationCount = allocationCount.load(memory_order_relaxed);
+        return stats;
+    }
+    void reset() {
+        liveBytes = 0;
+        liveCount = 0;
+        allocatedBytes = 0;
+        allocationCount = 0;
+    }
+};
+
+struct MemoryAccountSlot {
+    MemoryCounters tags[MEMORY_TAG_COUNT];
+    char name[32];
+    bool isOpen;
+    bool isUsed;
+    MemoryStats turnStart;  // Totals when the current turn began
+    MemoryStats lastTurn;
+};
+
+struct MemorySite {
+    atomic<const char*> name;
+    MemoryCounters counters;
+};
+
+// All of this is zero-initialized, so it is ready before any static constructor allocates
+static MemoryAccountSlot memoryAccounts[MemoryTracker::MAX_ACCOUNTS];
+static MemorySite memorySites[MemoryTracker::MAX_SITES];
+static MemoryCounters memoryActions[MemoryTracker::MAX_ACTIONS];
+static atomic<long long> memoryActionRuns[MemoryTracker::MAX_ACTIONS];
+static mutex memoryAccountLock;
+static MemoryTracker::TraceEntry memoryTrace[MemoryTracker::TRACE_SIZE];
+static atomic<unsigned long long> memoryTraceCount;
+static atomic_flag memoryTraceLock = ATOMIC_FLAG_INIT;
+static atomic<int> memorySampleRate;
+static thread_local int memoryAccount = 0;
+static thread_local int memoryTag = MEMORY_OTHER;
+static thread_local int memorySite = -1;
+static thread_local int memorySampleCountdown = 0;
+
+// Menu actions, as used by executeCommand
+static const char* const ACTION_NAMES[] = {
+    "no action", "view status", "collect taxes", "train army", "pay soldiers", "take loan",
+    "repay loan", "trade", "hold election", "make treaty", "break treaty", "save game",
+    "load game", "fund services", "update equipment", "send message", "view messages", "set policy"
+};
+static const int ACTION_NAME_COUNT = (int)(sizeof(ACTION_NAMES) / sizeof(ACTION_NAMES[0]));
+
+static void addTraceEntry(const MemoryHeader& header) {
+    while (memoryTraceLock.test_and_set(memory_order_acquire)) {
+    }
+    unsigned long long sequence = memoryTraceCount.load(memory_order_relaxed);
+    MemoryTracker::TraceEntry& entry = memoryTrace[sequence % MemoryTracker::TRACE_SIZE];
+    entry.sequence = sequence;
+    entry.size = header.size;
+    entry.account = header.account;
+    entry.tag = header.tag;
+    entry.site = header.site != 0xFFFF ? memorySites[header.site].name.load(memory_order_relaxed) : nullptr;
+    memoryTraceCount.store(sequence + 1, memory_order_relaxed);
+    memoryTraceLock.clear(memory_order_release);
+}
+
+void* MemoryTracker::allocate(size_t size) {
+    MemoryHeader* header = (MemoryHeader*)malloc(sizeof(MemoryHeader) + size);
+    if (header == nullptr) {
+        return nullptr;
+    }
+    header->size = size;
+    header->account = (unsigned short)memoryAccount;
+    header->site = memorySite >= 0 ? (unsigned short)memorySite : 0xFFFF;
+    header->tag = (unsigned char)memoryTag;
+    memoryAccounts[memoryAccount].tags[memoryTag].add((long long)size);
+    if (memorySite >= 0) {
+        memorySites[memorySite].counters.add((long long)size);
+    }
+
+    int sampleRate = memorySampleRate.load(memory_order_relaxed);
+    if (sampleRate > 0 && --memorySampleCountdown <= 0) {
+        memorySampleCountdown = sampleRate;
+        addTraceEntry(*header);
+    }
+    return header + 1;
+}
+
+void MemoryTracker::release(void* block) {
+    if (block == nullptr) {
+        return;
+    }
+    MemoryHeader* header = (MemoryHeader*)block - 1;
+    memoryAccounts[header->account].tags[header->tag].remove((long long)header->size);
+    if (header->site != 0xFFFF) {
+        memorySites[header->site].counters.remove((long long)header->size);
+    }
+    free(header);
+}
+
+int MemoryTracker::openAccount(const char* name) {
+    lock_guard<mutex> guard(memoryAccountLock);
+    for (int i = 1; i < MAX_ACCOUNTS; i++) {
+        MemoryAccountSlot& slot = memoryAccounts[i];
+        // A closed account is reused once everything charged to it is freed
+        if (slot.isUsed && (slot.isOpen || getTotal(i).liveCount != 0)) {
+            continue;
+        }
+        for (MemoryCounters& counters : slot.tags) {
+            counters.reset();
+        }
+        strncpy(slot.name, name, sizeof(slot.name) - 1);
+        slot.name[sizeof(slot.name) - 1] = '\0';
+        slot.isOpen = true;
+        slot.isUsed = true;
+        slot.turnStart = MemoryStats();
+        slot.lastTurn = MemoryStats();
+        return i;
+    }
+    return 0;
+}
+
+void MemoryTracker::closeAccount(int account) {
+    lock_guard<mutex> guard(memoryAccountLock);
+    if (account > 0 && account < MAX_ACCOUNTS) {
+        memoryAccounts[account].isOpen = false;
+    }
+}
+
+int MemoryTracker::findSite(const char* site) {
+    size_t start = ((size_t)site >> 4) % MAX_SITES;
+    for (int probe = 0; probe < MAX_SITES; probe++) {
+        int index = (int)((start + probe) % MAX_SITES);
+        const char* current = memorySites[index].name.load(memory_order_acquire);
+        if (current == site) {
+            return index;
+        }
+        if (current == nullptr) {
+            const char* empty = nullptr;
+            if (memorySites[index].name.compare_exchange_strong(empty, site) || empty == site) {
+                return index;
+            }
+        }
+    }
+    return -1;
+}
+
+void MemoryTracker::endTurn(int account) {
+    MemoryAccountSlot& slot = memoryAccounts[account];
+    MemoryStats now = getTotal(account);
+    slot.lastTurn.liveBytes = now.liveBytes - slot.turnStart.liveBytes;  // Net growth
+    slot.lastTurn.liveCount = now.liveCount - slot.turnStart.liveCount;
+    slot.lastTurn.allocatedBytes = now.allocatedBytes - slot.turnStart.allocatedBytes;
+    slot.lastTurn.allocationCount = now.allocationCount - slot.turnStart.allocationCount;
+    slot.turnStart = now;
+}
+
+void MemoryTracker::recordAction(int action, const MemoryStats& before, const MemoryStats& after) {
+    if (action < 0 || action >= MAX_ACTIONS) {
+        return;
+    }
+    MemoryCounters& counters = memoryActions[action];
+    counters.liveBytes.fetch_add(after.liveBytes - before.liveBytes, memory_order_relaxed);
+    counters.liveCount.fetch_add(after.liveCount - before.liveCount, memory_order_relaxed);
+    counters.allocatedBytes.fetch_add(after.allocatedBytes - before.allocatedBytes, memory_order_relaxed);
+    counters.allocationCount.fetch_add(after.allocationCount - before.allocationCount, memory_order_relaxed);
+    memoryActionRuns[action].fetch_add(1, memory_order_relaxed);
+}
+
+void MemoryTracker::setSampleRate(int everyN) {
+    memorySampleRate.store(everyN > 0 ? everyN : 0, memory_order_relaxed);
+}
+
+MemoryStats MemoryTracker::getStats(int account, int tag) {
+    return memoryAccounts[account].tags[tag].load();
+}
+
+MemoryStats MemoryTracker::getTotal(int account) {
+    MemoryStats total = MemoryStats();
+    for (int tag = 0; tag < MEMORY_TAG_COUNT; tag++) {
+        MemoryStats stats = getStats(account, tag);
+        total.liveBytes += stats.liveBytes;
+        total.liveCount += stats.liveCount;
+        total.allocatedBytes += stats.allocatedBytes;
+        total.allocationCount += stats.allocationCount;
+    }
+    return total;
+}
+
+MemoryStats MemoryTracker::getLastTurn(int account) {
+    return memoryAccounts[account].lastTurn;
+}
+
+const char* MemoryTracker::getTagName(int tag) {
+    static const char* const names[MEMORY_TAG_COUNT] = {
+        "other", "kingdom", "population", "economy", "army", "bank", "market", "politics",
+        "diplomacy", "communication", "territory", "status", "history", "save", "replay"
+    };
+    return tag >= 0 && tag < MEMORY_TAG_COUNT ? names[tag] : "unknown";
+}
+
+int MemoryTracker::copyTrace(TraceEntry* out, int max) {
+    while (memoryTraceLock.test_and_set(memory_order_acquire)) {
+    }
+    unsigned long long count = memoryTraceCount.load(memory_order_relaxed);
+    unsigned long long available = count < (unsigned long long)TRACE_SIZE ? count : TRACE_SIZE;
+    int copied = (int)(available < (unsigned long long)max ? available : max);
+    for (int i = 0; i < copied; i++) {
+        out[i] = memoryTrace[(count - copied + i) % TRACE_SIZE];
+    }
+    memoryTraceLock.clear(memory_order_release);
+    return copied;
+}
+
+void MemoryTracker::printAccount(int account) {
+    MemoryStats total = getTotal(account);
+    Visual::printInfo(VFMT("Memory of {}: {} bytes live in {} blocks, {} bytes in {} allocations"),
+        account == 0 ? "global" : memoryAccounts[account].name, total.liveBytes, total.liveCount,
+        total.allocatedBytes, total.allocationCount);
+    for (int tag = 0; tag < MEMORY_TAG_COUNT; tag++) {
+        MemoryStats stats = getStats(account, tag);
+        if (stats.allocationCount != 0) {
+            Visual::printInfo(VFMT("  {}: {} bytes live in {} blocks, {} bytes in {} allocations"),
+                getTagName(tag), stats.liveBytes, stats.liveCount, stats.allocatedBytes, stats.allocationCount);
+        }
+    }
+    MemoryStats turn = getLastTurn(account);
+    Visual::printInfo(VFMT("  Last turn: {} bytes in {} allocations, {} bytes net growth"),
+        turn.allocatedBytes, turn.allocationCount, turn.liveBytes);
+}
+
+void MemoryTracker::printSites() {
+    for (int i = 0; i < MAX_SITES; i++) {
+        const char* name = memorySites[i].name.load(memory_order_acquire);
+        MemoryStats stats = memorySites[i].counters.load();
+        if (name != nullptr && stats.allocationCount != 0) {
+            Visual::printInfo(VFMT("Site {}: {} bytes in {} allocations, {} bytes live"),
+                name, stats.allocatedBytes, stats.allocationCount, stats.liveBytes);
+        }
+    }
+}
+
+void MemoryTracker::printActions() {
+    for (int action = 0; action < ACTION_NAME_COUNT; action++) {
+        long long runs = memoryActionRuns[action].load(memory_order_relaxed);
+        if (runs == 0) {
+            continue;
+        }
+        MemoryStats stats = memoryActions[action].load();
+        Visual::printInfo(VFMT("Action {}: {} runs, {} bytes in {} allocations per run, {} bytes net growth"),
+            ACTION_NAMES[action], runs, stats.allocatedBytes / runs, stats.allocationCount / runs, stats.liveBytes);
+    }
+}
+
+void MemoryTracker::printTrace(int max) {
+    static TraceEntry entries[TRACE_SIZE];  // Too big for the stack
+    int count = copyTrace(entries, max < TRACE_SIZE ? max : TRACE_SIZE);
+    for (int i = 0; i < count; i++) {
+        Visual::printInfo(VFMT("#{} {} bytes, {} / {} at {}"), entries[i].sequence, entries[i].size,
+            entries[i].account == 0 ? "global" : memoryAccounts[entries[i].account].name,
+            getTagName(entries[i].tag), entries[i].site != nullptr ? entries[i].site : "unknown site");
+    }
+}
+
+MemoryScope::MemoryScope(int account, int tag, const char* site)
+    : previousAccount(memoryAccount), previousTag(memoryTag), previousSite(memorySite), isActive(true) {
+    memoryAccount = account >= 0 && account < MemoryTracker::MAX_ACCOUNTS ? account : 0;
+    memoryTag = tag;
+    if (site != nullptr) {
+        memorySite = MemoryTracker::findSite(site);
+    }
+}
+
+MemoryScope::MemoryScope(int tag, const char* site)
+    : previousAccount(memoryAccount), previousTag(memoryTag), previousSite(memorySite), isActive(true) {
+    memoryTag = tag;
+    if (site != nullptr) {
+        memorySite = MemoryTracker::findSite(site);
+    }
+}
+
+void MemoryScope::end() {
+    if (isActive) {
+        memoryAccount = previousAccount;
+        memoryTag = previousTag;
+        memorySite = previousSite;
+        isActive = false;
+    }
+}
+
+// Every allocation in the game goes through the tracker
+void* operator new(size_t size) {
+    void* block = MemoryTracker::allocate(size);
+    if (block == nullptr) {
+        throw bad_alloc();
+    }
+    return block;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept {
+    return MemoryTracker::allocate(size);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept {
+    return MemoryTracker::allocate(size);
+}
+
+void operator delete(void* block) noexcept {
+    MemoryTracker::release(block);
+}
+
+void operator delete[](void* block) noexcept {
+    MemoryTracker::release(block);
+}
+
+void operator delete(void* block, size_t) noexcept {
+    MemoryTracker::release(block);
+}
+
+void operator delete[](void* block, size_t) noexcept {
+    MemoryTracker::release(block);
+}
+
+void operator delete(void* block, const nothrow_t&) noexcept {
+    MemoryTracker::release(block);
+}
+
+void operator delete[](void* block, const nothrow_t&) noexcept {
+    MemoryTracker::release(block);
+}
+
+// Money implementation
+int Money::format(char* buffer) const
+{
+    // Build the digits backwards; buffer must hold at least 24 characters
+    char digits[24];
+    unsigned long long value = raw < 0 ? 0ULL - (unsigned long long)raw : (unsigned long long)raw;
+    int count = 0;
+    do
+    {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0 || count < 3);  // Always at least "0.00"
+
+    int length = 0;
+    if (raw < 0)
+    {
+        buffer[length++] = '-';
+    }
+    for (int i = count - 1; i >= 0; i--)
+    {
+        buffer[length++] = digits[i];
+        if (i == 2)
+        {
+            buffer[length++] = '.';
+        }
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+string Money::toString() const
+{
+    char buffer[24];
+    int length = format(buffer);
+    return string(buffer, length);
+}
+
+bool Money::parse(const string& text, Money& out)
+{
+    size_t i = 0;
+    bool negative = false;
+    if (i < text.size() && (text[i] == '-' || text[i] == '+'))
+    {
+        negative = text[i] == '-';
+        i++;
+    }
+
+    long long whole = 0;
+    int wholeDigits = 0;
+    while (i < text.size() && text[i] >= '0' && text[i] <= '9')
+    {
+        if (++wholeDigits > 16)
+        {
+            return false;  // Too large to hold in hundredths
+        }
+        whole = whole * 10 + (text[i] - '0');
+        i++;
+    }
 
-void King::applyPolicy()
+    long long fraction = 0;
+    int fractionDigits = 0;
+    if (i < text.size() && text[i] == '.')
+    {
+        i++;
+        while (i < text.size() && text[i] >= '0' && text[i] <= '9')
+        {
+            // Digits past hundredths are dropped
+            if (fractionDigits < 2)
+            {
+                fraction = fraction * 10 + (text[i] - '0');
+            }
+            fractionDigits++;
+            i++;
+        }
+    }
+    if (fractionDigits == 1)
+    {
+        fraction *= 10;
+    }
+
+    if (i != text.size() || wholeDigits + fractionDigits == 0)
+    {
+        return false;
+    }
+    long long value = whole * SCALE + fraction;
+    out = fromRaw(negative ? -value : value);
+    return true;
+}
+
+ostream& operator<<(ostream& out, const Money& money)
+{
+    char buffer[24];
+    out.write(buffer, money.format(buffer));
+    return out;
+}
+
+istream& operator>>(istream& in, Money& money)
 {
-    Visual::printInfo(name + " applies a new policy!");
+    string token;
+    if (in >> token && !Money::parse(token, money))
+    {
+        in.setstate(ios::failbit);
+    }
+    return in;
+}
+
+// LedgerTransaction class implementation
+LedgerTransaction& LedgerTransaction::add(int slot, long long amount) {
+    // Changes to the same slot are merged into one entry
+    for (int i = 0; i < entryCount; i++) {
+        if (entries[i].slot == slot) {
+            entries[i].amount += amount;
+            return *this;
+        }
+    }
+    if (slot < 0 || slot >= LEDGER_SLOT_COUNT || entryCount == MAX_ENTRIES) {
+        isOverflow = true;
+        return *this;
+    }
+    entries[entryCount].slot = slot;
+    entries[entryCount].amount = amount;
+    entryCount++;
+    return *this;
+}
+
+// ResourceLedger class implementation
+ResourceLedger::ResourceLedger() {
+    for (int i = 0; i < LEDGER_SLOT_COUNT; i++) {
+        quantities[i] = 0;
+        capacities[i] = LLONG_MAX;
+        revisions[i] = 0;
+    }
+    capacities[LEDGER_GOLD] = Money(1000).getRaw();  // Treasury holds 1000 gold
+}
+
+void ResourceLedger::set(int slot, long long quantity) {
+    if (quantity < 0) {
+        quantity = 0;
+    }
+    quantity = quantity > capacities[slot] ? capacities[slot] : quantity;
+    if (quantities[slot] != quantity) {
+        quantities[slot] = quantity;
+        revisions[slot]++;
+    }
+}
+
+bool ResourceLedger::apply(const LedgerTransaction& transaction) {
+    if (transaction.getIsOverflow()) {
+        return false;
+    }
+
+    // Work on a copy of the block so a failed check leaves nothing behind
+    long long result[LEDGER_SLOT_COUNT];
+    for (int i = 0; i < LEDGER_SLOT_COUNT; i++) {
+        result[i] = quantities[i];
+    }
+
+    for (int i = 0; i < transaction.getEntryCount(); i++) {
+        const LedgerEntry& entry = transaction.getEntry(i);
+        long long current = result[entry.slot];
+        if (entry.amount < 0 && current < -entry.amount) {
+            return false;  // Would go negative: roll back
+        }
+        long long room = capacities[entry.slot] - current;
+        result[entry.slot] = entry.amount > room ? capacities[entry.slot] : current + entry.amount;
+    }
 
-    popularity += 5;
+    for (int i = 0; i < LEDGER_SLOT_COUNT; i++) {
+        if (quantities[i] != result[i]) {
+            quantities[i] = result[i];
+            revisions[i]++;
+        }
+    }
+    return true;
+}
 
-    if (popularity > 100)
-        popularity = 100;
+int ResourceLedger::applyBatch(const LedgerTransaction* transactions, int count, bool* committed) {
+    int applied = 0;
+    for (int i = 0; i < count; i++) {
+        bool ok = apply(transactions[i]);
+        if (committed != nullptr) {
+            committed[i] = ok;
+        }
+        if (ok) {
+            applied++;
+        }
+    }
+    return applied;
 }
 
+// First: Implement King class methods
+
 void King::faceAssassinationAttempt()
 {
     assassinationAttempts++;
-    Visual::printError("Assassination attempt on " + name + "!");
+    Visual::printError(VFMT("Assassination attempt on {}!"), name);
     health -= 20;
     if (health <= 0)
     {
-        Visual::printError(name + " has been assassinated!");
+        Visual::printError(VFMT("{} has been assassinated!"), name);
         Visual::printError("Game Over: King has been assassinated!");
         exit(1);  // Exit the game instead of throwing
     }
 }
 
 // Second: Implement Population class methods
-Population::Population()
+Population::Population(ResourceLedger& l) : ledger(l), agents(nullptr)
 {
     totalPeople = 1000;  // Start with 1000 people
     peasants = 600;      // 60% peasants
@@ -36,18 +602,30 @@ Population::Population()
     birthRate = 5;
     deathRate = 2;
     isPlague = false;
-    foodSupply = 1000;
-    Visual::printSuccess("Population initialized with " + std::to_string(totalPeople) + " people.");
+    sick = 0;
+    revision = 0;
+    Visual::printSuccess(VFMT("Population initialized with {} people."), totalPeople);
 }
 
 Population::~Population()
 {
+    delete agents;
     Visual::printInfo("Population cleanup done.");
 }
 
 void Population::updatePeople(int change)
 {
+    if (agents != nullptr)
+    {
+        // Growth comes from the birth system, so only apply the change
+        if (change < 0) agents->removeRandom(-change);
+        else agents->addCitizens(change, CITIZEN_PEASANT);
+        syncFromAgents();
+        return;
+    }
+
     totalPeople += change;
+    revision++;
     if (totalPeople < 0)
     {
         totalPeople = 0;
@@ -58,44 +636,74 @@ void Population::updatePeople(int change)
 
 void Population::checkSocialClasses()
 {
-    if (peasants > totalPeople * 0.7)
+    if (arePeasantsUnhappy())
     {
         Visual::printWarning("Peasants are unhappy! Risk of riots!");
     }
-    if (nobility < totalPeople * 0.05)
+    if (isNobilityTooSmall())
     {
         Visual::printWarning("Nobility too small! Political unrest possible!");
     }
-    Visual::printInfo("Social classes: " + std::to_string(peasants) + " peasants, " +
-        std::to_string(merchants) + " merchants, " + std::to_string(nobility) + " nobles, " +
-        std::to_string(military) + " military.");
+    Visual::printInfo(VFMT("Social classes: {} peasants, {} merchants, {} nobles, {} military."),
+        peasants, merchants, nobility, military);
 }
 
-void Population::handlePlague()
+void Population::handlePlague(int deaths, int infected)
 {
-    if (isPlague)
+    if (sick != infected || isPlague != (infected > 0))
     {
-        int deaths = totalPeople * 0.1;  // 10% death rate
-        updatePeople(-deaths);
-        Visual::printError("Plague has killed " + std::to_string(deaths) + " people!");
+        sick = infected;
+        isPlague = infected > 0;
+        revision++;
     }
+    if (agents != nullptr)
+    {
+        // The agents carry the epidemic's counts; their own turn adds no plague deaths
+        agents->applyEpidemic(deaths, infected);
+        syncFromAgents();
+    }
+    else if (deaths > 0)
+    {
+        decreasePopulation(deaths);
+    }
+    if (deaths > 0)
+    {
+        Visual::printError(VFMT("Plague has killed {} people!"), deaths);
+    }
+}
+
+void Population::splitByClass(int people[CITIZEN_CLASS_COUNT]) const
+{
+    int classes[CITIZEN_CLASS_COUNT] = {peasants, merchants, nobility, military};
+    long long mix = (long long)peasants + merchants + nobility + military;
+    int placed = 0;
+    for (int c = CITIZEN_MERCHANT; c < CITIZEN_CLASS_COUNT; c++)
+    {
+        people[c] = mix > 0 ? (int)((long long)totalPeople * classes[c] / mix) : 0;
+        placed += people[c];
+    }
+    people[CITIZEN_PEASANT] = totalPeople - placed;  // Peasants take the remainder
 }
 
 void Population::updateFoodSupply(int amount)
 {
-    foodSupply += amount;
-    if (foodSupply < 0)
+    if (!ledger.apply(LedgerTransaction().add(LEDGER_FOOD, amount)))
     {
-        foodSupply = 0;
+        ledger.set(LEDGER_FOOD, 0);
         Visual::printError("Food supply depleted! People are starving!");
-        updatePeople(-totalPeople * 0.05);  // 5% population dies
+        updatePeople(-totalPeople / 20);  // 5% population dies
     }
 }
 
 void Population::calculateGrowth()
 {
-    int growth = (birthRate - deathRate) * totalPeople / 100;
-    if (foodSupply > totalPeople)
+    long long inputs[RULE_INPUT_COUNT] = {};
+    inputs[INPUT_BIRTH_RATE] = birthRate;
+    inputs[INPUT_DEATH_RATE] = deathRate;
+    inputs[INPUT_PEOPLE] = totalPeople;
+    inputs[INPUT_FOOD] = getFoodSupply();
+    int growth = (int)Rules::evaluate(RULE_GROWTH, inputs);
+    if (getFoodSupply() > totalPeople)
     {
         updatePeople(growth);
     }
@@ -113,22 +721,33 @@ void Population::decreasePopulation(int amount)
         return;
     }
 
+    if (agents != nullptr)
+    {
+        agents->removeRandom(amount);
+        syncFromAgents();
+        Visual::printWarning(VFMT("Population decreased by {}. New total: {}"), amount, totalPeople);
+        return;
+    }
+
+    int previous = totalPeople;
     totalPeople -= amount;
+    revision++;
     if (totalPeople < 0)
     {
         totalPeople = 0;
         Visual::printError("Warning: Population dropped to zero!");
     }
 
-    // Adjust social classes proportionally
-    double ratio = (double)totalPeople / (totalPeople + amount);
-    peasants = (int)(peasants * ratio);
-    merchants = (int)(merchants * ratio);
-    nobility = (int)(nobility * ratio);
-    military = (int)(military * ratio);
+    // Adjust social classes proportionally (integer maths keeps peers in lockstep)
+    if (previous > 0)
+    {
+        peasants = (int)((long long)peasants * totalPeople / previous);
+        merchants = (int)((long long)merchants * totalPeople / previous);
+        nobility = (int)((long long)nobility * totalPeople / previous);
+        military = (int)((long long)military * totalPeople / previous);
+    }
 
-    Visual::printWarning("Population decreased by " + std::to_string(amount) + 
-        ". New total: " + std::to_string(totalPeople));
+    Visual::printWarning(VFMT("Population decreased by {}. New total: {}"), amount, totalPeople);
 }
 
 void Population::increasePopulation(int amount)
@@ -139,121 +758,543 @@ void Population::increasePopulation(int amount)
         return;
     }
 
+    if (agents != nullptr)
+    {
+        // Newcomers follow the current class mix; the remainder are peasants
+        int added = 0;
+        for (int c = CITIZEN_MERCHANT; c < CITIZEN_CLASS_COUNT && totalPeople > 0; c++)
+        {
+            int share = (int)((long long)amount * agents->getClassTotal(c) / totalPeople);
+            agents->addCitizens(share, c);
+            added += share;
+        }
+        agents->addCitizens(amount - added, CITIZEN_PEASANT);
+        syncFromAgents();
+        Visual::printSuccess(VFMT("Population increased by {}. New total: {}"), amount, totalPeople);
+        return;
+    }
+
+    int previous = totalPeople;
     totalPeople += amount;
+    revision++;
     
-    // Adjust social classes proportionally
-    double ratio = (double)totalPeople / (totalPeople - amount);
-    peasants = (int)(peasants * ratio);
-    merchants = (int)(merchants * ratio);
-    nobility = (int)(nobility * ratio);
-    military = (int)(military * ratio);
+    // Adjust social classes proportionally (integer maths keeps peers in lockstep)
+    if (previous > 0)
+    {
+        peasants = (int)((long long)peasants * totalPeople / previous);
+        merchants = (int)((long long)merchants * totalPeople / previous);
+        nobility = (int)((long long)nobility * totalPeople / previous);
+        military = (int)((long long)military * totalPeople / previous);
+    }
 
-    Visual::printSuccess("Population increased by " + std::to_string(amount) + 
-        ". New total: " + std::to_string(totalPeople));
+    Visual::printSuccess(VFMT("Population increased by {}. New total: {}"), amount, totalPeople);
 }
 
-// Third: Implement Economy class methods
-Economy::Economy()
+void Population::enableAgents(unsigned long long seed)
 {
-    gold = new Resource<double>();  // Create gold resource
-    gold->setQuantity(500.0);      // Start with 500 gold
-    taxRate = 0.1;                 // 10% tax rate
-    inflation = 0.0;
-    isRecession = false;
-    publicServices = 50;
-    Visual::printSuccess("Economy initialized with " + std::to_string(gold->getQuantity()) + " gold.");
+    if (agents != nullptr)
+    {
+        return;
+    }
+    agents = new CitizenPool(seed);
+    agents->addCitizens(peasants, CITIZEN_PEASANT);
+    agents->addCitizens(merchants, CITIZEN_MERCHANT);
+    agents->addCitizens(nobility, CITIZEN_NOBLE);
+    agents->addCitizens(military, CITIZEN_SOLDIER);
+    syncFromAgents();
+    Visual::printInfo(VFMT("Agent-based population enabled with {} citizens."), totalPeople);
 }
 
-Economy::~Economy()
+void Population::updateAgents(int turn)
 {
-    delete gold;  // Free gold memory
-    Visual::printInfo("Economy cleanup done.");
+    if (agents == nullptr)
+    {
+        return;
+    }
+    CitizenTurnInput input;
+    input.turn = turn;
+    long long food = ledger.get(LEDGER_FOOD);
+    input.foodPercent = totalPeople > 0 ? (int)(food * 100 / totalPeople) : 100;
+    if (input.foodPercent > 200) input.foodPercent = 200;
+    input.birthRate = birthRate;
+    agents->simulateTurn(input);
+    syncFromAgents();
 }
 
-void Economy::collectTaxes(const Population& pop)
+void Population::syncFromAgents()
 {
-    double taxes = pop.getTotalPeople() * taxRate;  // Taxes based on population
-    gold->setQuantity(gold->getQuantity() + taxes);
-    Visual::printSuccess("Collected " + std::to_string(taxes) + " gold in taxes. Total gold: " +
-        std::to_string(gold->getQuantity()) + ".");
+    totalPeople = agents->getTotal();
+    peasants = agents->getClassTotal(CITIZEN_PEASANT);
+    merchants = agents->getClassTotal(CITIZEN_MERCHANT);
+    nobility = agents->getClassTotal(CITIZEN_NOBLE);
+    military = agents->getClassTotal(CITIZEN_SOLDIER);
+    revision++;
 }
 
-void Economy::spendGold(double amount)
-{
-    double newGold = gold->getQuantity() - amount;
-    if (newGold < 0)
-    {
-        Visual::printError("Error: Cannot spend gold! Insufficient funds");
-        return;
-    }
-    gold->setQuantity(newGold);
-    Visual::printInfo("Spent " + std::to_string(amount) + " gold. Remaining: " +
-        std::to_string(gold->getQuantity()) + ".");
+// CitizenPool class implementation
+// Runs body(i) for every i in [0, count) across all cores
+static void parallelFor(int count, const function<void(int)>& body) {
+    WorkerPool::shared().run(count, body);
 }
 
-void Economy::fundPublicServices(int amount)
-{
-    double newGold = gold->getQuantity() - amount;
-    if (newGold < 0)
-    {
-        Visual::printError("Failed to fund public services: Insufficient funds");
-        return;
+// SplitMix64 finaliser, used to give every chunk its own random stream
+static unsigned long long mixSeed(unsigned long long a, unsigned long long b) {
+    unsigned long long z = a + 0x9E3779B97F4A7C15ULL * (b + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+CitizenPool::CitizenPool(unsigned long long s) : total(0), firstOpenChunk(0), seed(s), random(mixSeed(s, 0)) {
+    for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+        classTotals[c] = 0;
     }
-    gold->setQuantity(newGold);
-    publicServices += amount / 10;
-    if (publicServices > 100) publicServices = 100;
-    Visual::printSuccess("Public services funding increased to " + std::to_string(publicServices));
 }
 
-void Economy::decreaseGold(double amount)
-{
-    if (amount < 0)
-    {
-        Visual::printError("Cannot decrease gold by negative amount!");
-        return;
+CitizenPool::~CitizenPool() {
+    for (CitizenChunk* chunk : chunks) {
+        delete chunk;
     }
+}
 
-    double newGold = gold->getQuantity() - amount;
-    if (newGold < 0)
-    {
-        Visual::printError("Warning: Gold dropped below zero!");
-        newGold = 0;
+unsigned char CitizenPool::jobFor(int socialClass, int age) {
+    if (age < 14 || age > 65) {
+        return JOB_NONE;
+    }
+    switch (socialClass) {
+    case CITIZEN_PEASANT: return age % 4 == 0 ? JOB_CRAFTSMAN : JOB_FARMER;
+    case CITIZEN_MERCHANT: return JOB_TRADER;
+    case CITIZEN_NOBLE: return JOB_OFFICIAL;
+    default: return JOB_SOLDIER;
     }
-    gold->setQuantity(newGold);
-    Visual::printWarning("Gold decreased by " + std::to_string(amount) + 
-        ". New total: " + std::to_string(gold->getQuantity()));
 }
 
-void Economy::increaseGold(double amount)
-{
-    if (amount < 0)
-    {
-        Visual::printError("Cannot increase gold by negative amount!");
-        return;
+void CitizenPool::addCitizen(int socialClass, int age, int health) {
+    while (firstOpenChunk < (int)chunks.size() && chunks[firstOpenChunk]->count == CitizenChunk::CAPACITY) {
+        firstOpenChunk++;
+    }
+    if (firstOpenChunk == (int)chunks.size()) {
+        chunks.push_back(new CitizenChunk());
+        results.push_back(ChunkResult());
     }
 
-    double newGold = gold->getQuantity() + amount;
-    gold->setQuantity(newGold);
-    Visual::printSuccess("Gold increased by " + std::to_string(amount) + 
-        ". New total: " + std::to_string(gold->getQuantity()));
+    CitizenChunk& chunk = *chunks[firstOpenChunk];
+    int slot = chunk.count++;
+    chunk.socialClass[slot] = (unsigned char)socialClass;
+    chunk.age[slot] = (unsigned char)age;
+    chunk.health[slot] = (unsigned char)health;
+    chunk.flags[slot] = 0;
+    chunk.job[slot] = jobFor(socialClass, age);
+    classTotals[socialClass]++;
+    total++;
 }
 
-// Fourth: Implement Army class methods
-Army::Army(int s)
-{
-    size = s;        // Start with given soldiers
-    morale = 100;    // Full morale
-    isPaid = true;   // Soldiers start paid
-    trainingLevel = 1;
-    equipment = 50;
-    casualties = 0;
-    isRebelling = false;
-    Visual::printSuccess("Army initialized with " + std::to_string(size) + " soldiers.");
+void CitizenPool::addCitizens(int count, int socialClass) {
+    for (int i = 0; i < count; i++) {
+        addCitizen(socialClass, 16 + random.nextInt(44), 80 + random.nextInt(21));
+    }
 }
 
-Army::~Army()
-{
-    Visual::printInfo("Army cleanup done.");
+void CitizenPool::removeAt(CitizenChunk& chunk, int slot) {
+    int last = --chunk.count;
+    chunk.socialClass[slot] = chunk.socialClass[last];
+    chunk.job[slot] = chunk.job[last];
+    chunk.age[slot] = chunk.age[last];
+    chunk.health[slot] = chunk.health[last];
+    chunk.flags[slot] = chunk.flags[last];
+}
+
+void CitizenPool::remove(int chunkIndex, int slot) {
+    classTotals[chunks[chunkIndex]->socialClass[slot]]--;
+    total--;
+    removeAt(*chunks[chunkIndex], slot);
+    if (chunkIndex < firstOpenChunk) {
+        firstOpenChunk = chunkIndex;
+    }
+}
+
+void CitizenPool::removeRandom(int count) {
+    if (count > total) {
+        count = total;
+    }
+    for (int n = 0; n < count; n++) {
+        int pick = random.nextInt(total);
+        int index = 0;
+        while (pick >= chunks[index]->count) {
+            pick -= chunks[index]->count;
+            index++;
+        }
+        remove(index, pick);
+    }
+}
+
+int CitizenPool::countSick() const {
+    int sick = 0;
+    for (const CitizenChunk* chunk : chunks) {
+        for (int slot = 0; slot < chunk->count; slot++) {
+            sick += chunk->flags[slot] & CitizenChunk::SICK;
+        }
+    }
+    return sick;
+}
+
+// Selection sampling (Knuth's algorithm S): each candidate is taken with
+// the chance still needed over the candidates still left
+void CitizenPool::sample(bool isSick, int available, int count, const function<void(int, int)>& pick) {
+    for (int index = (int)chunks.size() - 1; index >= 0 && count > 0; index--) {
+        for (int slot = chunks[index]->count - 1; slot >= 0 && count > 0; slot--) {
+            if (((chunks[index]->flags[slot] & CitizenChunk::SICK) != 0) != isSick) {
+                continue;
+            }
+            if (random.nextInt(available) < count) {
+                pick(index, slot);
+                count--;
+            }
+            available--;
+        }
+    }
+}
+
+void CitizenPool::applyEpidemic(int deaths, int sick) {
+    int flagged = countSick();
+    int fromSick = deaths < flagged ? deaths : flagged;
+    if (fromSick > 0) {
+        sample(true, flagged, fromSick, [this](int index, int slot) { remove(index, slot); });
+    }
+    if (deaths > fromSick) {
+        removeRandom(deaths - fromSick);  // More died than the agents had sick; the model's count wins
+    }
+
+    flagged = countSick();
+    if (sick > total) {
+        sick = total;
+    }
+    if (flagged > sick) {
+        sample(true, flagged, flagged - sick, [this](int index, int slot) {
+            chunks[index]->flags[slot] &= ~CitizenChunk::SICK;  // Recovered
+        });
+    }
+    else if (flagged < sick) {
+        sample(false, total - flagged, sick - flagged, [this](int index, int slot) {
+            chunks[index]->flags[slot] |= CitizenChunk::SICK;  // Caught it
+        });
+    }
+}
+
+int CitizenPool::reassign(int count, int fromClass, int toClass) {
+    int moved = 0;
+    for (CitizenChunk* chunk : chunks) {
+        for (int slot = 0; slot < chunk->count && moved < count; slot++) {
+            if (chunk->socialClass[slot] != fromClass || chunk->job[slot] == JOB_NONE) {
+                continue;
+            }
+            chunk->socialClass[slot] = (unsigned char)toClass;
+            chunk->job[slot] = jobFor(toClass, chunk->age[slot]);
+            moved++;
+        }
+    }
+    classTotals[fromClass] -= moved;
+    classTotals[toClass] += moved;
+    return moved;
+}
+
+// Chances below are out of 65536 per turn
+void CitizenPool::stepChunk(int index, const CitizenTurnInput& input) {
+    CitizenChunk& chunk = *chunks[index];
+    ChunkResult& result = results[index];
+    for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+        result.classChange[c] = 0;
+    }
+    result.births.clear();
+
+    GameRandom chunkRandom(mixSeed(seed, ((unsigned long long)input.turn << 32) | (unsigned)index));
+    int fed = input.foodPercent < 100 ? input.foodPercent : 100;
+    int starvation = (100 - fed) / 10;
+    unsigned birthChance = (unsigned)(input.birthRate * 65536 / 40 * fed / 100);
+
+    // Walk backwards so a death can move the last citizen into this slot
+    for (int i = chunk.count - 1; i >= 0; i--) {
+        unsigned long long bits = chunkRandom.next();
+        unsigned deathRoll = (unsigned)(bits & 0xFFFF);
+        unsigned birthRoll = (unsigned)((bits >> 32) & 0xFFFF);
+        unsigned mobilityRoll = (unsigned)(bits >> 48);
+
+        int age = chunk.age[i] < 255 ? chunk.age[i] + 1 : 255;
+        chunk.age[i] = (unsigned char)age;
+        int socialClass = chunk.socialClass[i];
+
+        // Health; plague deaths are the epidemic model's, so sickness costs none here
+        int health = chunk.health[i] + 2 - starvation;
+        if (health > 100) health = 100;
+        if (health < 0) health = 0;
+        chunk.health[i] = (unsigned char)health;
+
+        // Deaths
+        unsigned deathChance = age < 5 ? 200 : age < 50 ? 130 : age < 65 ? 1300 : 6500;
+        if (health < 30) {
+            deathChance += (30 - health) * 300;
+        }
+        if (deathRoll < deathChance) {
+            result.classChange[socialClass]--;
+            removeAt(chunk, i);
+            continue;
+        }
+
+        // Births; soldiers' children are born peasants
+        if (age >= 18 && age <= 45 && birthRoll < birthChance) {
+            result.births.push_back((unsigned char)(socialClass == CITIZEN_SOLDIER ? CITIZEN_PEASANT : socialClass));
+        }
+
+        // Class mobility
+        int newClass = socialClass;
+        if (age >= 16) {
+            if (socialClass == CITIZEN_PEASANT && mobilityRoll < 131) newClass = CITIZEN_MERCHANT;
+            else if (socialClass == CITIZEN_MERCHANT && mobilityRoll < 33) newClass = CITIZEN_NOBLE;
+            else if (socialClass == CITIZEN_NOBLE && mobilityRoll < 66) newClass = CITIZEN_MERCHANT;
+        }
+        if (newClass != socialClass) {
+            result.classChange[socialClass]--;
+            result.classChange[newClass]++;
+            chunk.socialClass[i] = (unsigned char)newClass;
+        }
+        if (newClass != socialClass || age == 14 || age == 66) {
+            chunk.job[i] = jobFor(newClass, age);
+        }
+    }
+}
+
+void CitizenPool::simulateTurn(const CitizenTurnInput& input) {
+    int chunkCount = (int)chunks.size();
+    parallelFor(chunkCount, [&](int index) { stepChunk(index, input); });
+
+    // Merge in chunk order so newborns land in the same slots on every run
+    for (int i = 0; i < chunkCount; i++) {
+        for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+            classTotals[c] += results[i].classChange[c];
+            total += results[i].classChange[c];
+        }
+    }
+    firstOpenChunk = 0;
+    for (int i = 0; i < chunkCount; i++) {
+        for (size_t b = 0; b < results[i].births.size(); b++) {
+            addCitizen(results[i].births[b], 0, 100);  // May add chunks; index, don't hold references
+        }
+    }
+}
+
+string CitizenPool::serialize() const {
+    unsigned long long state = random.getState();
+    int chunkCount = (int)chunks.size();
+    string data((const char*)&state, sizeof(state));
+    data.append((const char*)&chunkCount, sizeof(chunkCount));
+    for (const CitizenChunk* chunk : chunks) {
+        data.append((const char*)&chunk->count, sizeof(chunk->count));
+        data.append((const char*)chunk->socialClass, chunk->count);
+        data.append((const char*)chunk->job, chunk->count);
+        data.append((const char*)chunk->age, chunk->count);
+        data.append((const char*)chunk->health, chunk->count);
+        data.append((const char*)chunk->flags, chunk->count);
+    }
+    return data;
+}
+
+bool CitizenPool::deserialize(const string& data) {
+    unsigned long long state;
+    int chunkCount;
+    if (data.size() < sizeof(state) + sizeof(chunkCount)) {
+        return false;
+    }
+    const char* in = data.data();
+    const char* end = in + data.size();
+    memcpy(&state, in, sizeof(state));
+    in += sizeof(state);
+    memcpy(&chunkCount, in, sizeof(chunkCount));
+    in += sizeof(chunkCount);
+
+    // Check every chunk fits before touching the pool
+    const char* scan = in;
+    for (int i = 0; i < chunkCount; i++) {
+        int count;
+        if (end - scan < (ptrdiff_t)sizeof(count)) {
+            return false;
+        }
+        memcpy(&count, scan, sizeof(count));
+        if (count < 0 || count > CitizenChunk::CAPACITY || end - scan - (ptrdiff_t)sizeof(count) < (ptrdiff_t)count * CitizenChunk::ARRAY_COUNT) {
+            return false;
+        }
+        scan += sizeof(count) + (size_t)count * CitizenChunk::ARRAY_COUNT;
+    }
+    if (chunkCount < 0 || scan != end) {
+        return false;
+    }
+
+    while ((int)chunks.size() > chunkCount) {
+        delete chunks.back();
+        chunks.pop_back();
+    }
+    while ((int)chunks.size() < chunkCount) {
+        chunks.push_back(new CitizenChunk());
+    }
+    results.resize(chunkCount);
+
+    random.setSeed(state);
+    total = 0;
+    for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+        classTotals[c] = 0;
+    }
+    firstOpenChunk = chunkCount;
+    for (int i = 0; i < chunkCount; i++) {
+        CitizenChunk& chunk = *chunks[i];
+        memcpy(&chunk.count, in, sizeof(chunk.count));
+        in += sizeof(chunk.count);
+        memcpy(chunk.socialClass, in, chunk.count);
+        in += chunk.count;
+        memcpy(chunk.job, in, chunk.count);
+        in += chunk.count;
+        memcpy(chunk.age, in, chunk.count);
+        in += chunk.count;
+        memcpy(chunk.health, in, chunk.count);
+        in += chunk.count;
+        memcpy(chunk.flags, in, chunk.count);
+        in += chunk.count;
+        for (int slot = 0; slot < chunk.count; slot++) {
+            classTotals[chunk.socialClass[slot]]++;
+        }
+        total += chunk.count;
+        if (chunk.count < CitizenChunk::CAPACITY && firstOpenChunk == chunkCount) {
+            firstOpenChunk = i;
+        }
+    }
+    return true;
+}
+
+// Third: Implement Economy class methods
+Economy::Economy(ResourceLedger& l) : ledger(l)
+{
+    ledger.set(LEDGER_GOLD, Money(500).getRaw());  // Start with 500 gold
+    taxRate = 10;                                  // 10% tax rate
+    inflationRate = 0;
+    isRecession = false;
+    publicServices = 50;
+    worldDemand = 0;
+    worldOutput = 0;
+    shrinkingTurns = 0;
+    revision = 0;
+    Visual::printSuccess(VFMT("Economy initialized with {} gold."), getGold());
+}
+
+Economy::~Economy()
+{
+    Visual::printInfo("Economy cleanup done.");
+}
+
+void Economy::collectTaxes(const Population& pop)
+{
+    Money taxes = Money(pop.getTotalPeople()).percent(taxRate);  // Taxes based on population
+    if (isRecession)
+    {
+        taxes = taxes.scaled(3, 4);  // Hard times: a quarter goes unpaid
+        Visual::printWarning("The recession has cut tax receipts!");
+    }
+    ledger.apply(LedgerTransaction().addGold(taxes));
+    Visual::printSuccess(VFMT("Collected {} gold in taxes. Total gold: {}."), taxes, getGold());
+}
+
+void Economy::setTaxRate(int percent)
+{
+    if (percent < 0 || percent > 100)
+    {
+        Visual::printError("Tax rate must be between 0 and 100 percent!");
+        return;
+    }
+    taxRate = percent;
+}
+
+void Economy::spendGold(Money amount)
+{
+    if (!ledger.apply(LedgerTransaction().addGold(-amount)))
+    {
+        Visual::printError("Error: Cannot spend gold! Insufficient funds");
+        return;
+    }
+    Visual::printInfo(VFMT("Spent {} gold. Remaining: {}."), amount, getGold());
+}
+
+void Economy::fundPublicServices(int amount)
+{
+    if (!ledger.apply(LedgerTransaction().addGold(-Money(amount))))
+    {
+        Visual::printError("Failed to fund public services: Insufficient funds");
+        return;
+    }
+    publicServices += amount / 10;
+    if (publicServices > 100) publicServices = 100;
+    revision++;
+    Visual::printSuccess(VFMT("Public services funding increased to {}"), publicServices);
+}
+
+void Economy::decreaseGold(Money amount)
+{
+    if (amount < 0)
+    {
+        Visual::printError("Cannot decrease gold by negative amount!");
+        return;
+    }
+
+    if (!ledger.apply(LedgerTransaction().addGold(-amount)))
+    {
+        Visual::printError("Warning: Gold dropped below zero!");
+        ledger.set(LEDGER_GOLD, 0);
+    }
+    Visual::printWarning(VFMT("Gold decreased by {}. New total: {}"), amount, getGold());
+}
+
+void Economy::increaseGold(Money amount)
+{
+    if (amount < 0)
+    {
+        Visual::printError("Cannot increase gold by negative amount!");
+        return;
+    }
+
+    ledger.apply(LedgerTransaction().addGold(amount));
+    Visual::printSuccess(VFMT("Gold increased by {}. New total: {}"), amount, getGold());
+}
+
+void Economy::handleArrears(int loansInArrears)
+{
+    bool inArrears = loansInArrears > 0;
+    if (inArrears)
+    {
+        // Gold owed to the bank is gold not spent on the realm
+        publicServices -= loansInArrears * 2 < 10 ? loansInArrears * 2 : 10;
+        if (publicServices < 0) publicServices = 0;
+        revision++;
+    }
+    else if (isRecession)
+    {
+        revision++;
+    }
+    isRecession = inArrears;
+}
+
+// Fourth: Implement Army class methods
+Army::Army(int s)
+{
+    size = s;        // Start with given soldiers
+    morale = 100;    // Full morale
+    isPaid = true;   // Soldiers start paid
+    trainingLevel = 1;
+    equipment = 50;
+    casualties = 0;
+    isRebelling = false;
+    revision = 0;
+    Visual::printSuccess(VFMT("Army initialized with {} soldiers."), size);
+}
+
+Army::~Army()
+{
+    Visual::printInfo("Army cleanup done.");
 }
 
 void Army::train(int cycles)
@@ -264,10 +1305,10 @@ void Army::train(int cycles)
         return;
     }
 
-    Visual::printInfo("Training army for " + std::to_string(cycles) + " cycles...");
+    Visual::printInfo(VFMT("Training army for {} cycles..."), cycles);
     for (int i = 0; i < cycles; i++)
     {
-        Sleep(1000);  // 1 second delay
+        Visual::pause(1000);  // 1 second delay
         trainingLevel++;
         morale -= 5;
         if (morale < 0)
@@ -277,26 +1318,26 @@ void Army::train(int cycles)
         }
     }
     size += 50;
-    Visual::printSuccess("Training done. Army size: " + std::to_string(size) + 
-        ", Training Level: " + std::to_string(trainingLevel) + 
-        ", Morale: " + std::to_string(morale) + ".");
+    revision++;
+    Visual::printSuccess(VFMT("Training done. Army size: {}, Training Level: {}, Morale: {}."),
+        size, trainingLevel, morale);
 }
 
 void Army::paySoldiers(Economy& economy)
 {
-    double cost = size * 0.1;
+    Money cost = Money(size).percent(10);
     try
     {
         economy.spendGold(cost);
         isPaid = true;
         morale += 10;
         if (morale > 100) morale = 100;
-        Visual::printSuccess("Paid " + std::to_string(cost) + " gold to soldiers. Morale: " + 
-            std::to_string(morale) + ".");
+        revision++;
+        Visual::printSuccess(VFMT("Paid {} gold to soldiers. Morale: {}."), cost, morale);
     }
     catch (const exception& e)
     {
-        Visual::printError("Failed to pay soldiers: " + std::string(e.what()));
+        Visual::printError(VFMT("Failed to pay soldiers: {}"), e.what());
     }
 }
 
@@ -308,8 +1349,8 @@ void Army::updateEquipment(int quality)
         return;
     }
     equipment = quality * 10;
-    Visual::printSuccess("Army equipment updated to level " + std::to_string(quality) + 
-        " (Quality: " + std::to_string(equipment) + ")");
+    revision++;
+    Visual::printSuccess(VFMT("Army equipment updated to level {} (Quality: {})"), quality, equipment);
 }
 
 void Army::decreaseSize(int amount)
@@ -330,10 +1371,9 @@ void Army::decreaseSize(int amount)
     // Decrease morale when army size decreases
     morale -= amount / 10;
     if (morale < 0) morale = 0;
+    revision++;
 
-    Visual::printWarning("Army size decreased by " + std::to_string(amount) + 
-        ". New size: " + std::to_string(size) + 
-        ", Morale: " + std::to_string(morale));
+    Visual::printWarning(VFMT("Army size decreased by {}. New size: {}, Morale: {}"), amount, size, morale);
 }
 
 void Army::increaseSize(int amount)
@@ -349,527 +1389,7764 @@ void Army::increaseSize(int amount)
     // Increase morale when army size increases
     morale += amount / 20;
     if (morale > 100) morale = 100;
+    revision++;
 
-    Visual::printSuccess("Army size increased by " + std::to_string(amount) + 
-        ". New size: " + std::to_string(size) + 
-        ", Morale: " + std::to_string(morale));
-}
-
-// Fifth: Implement Bank class methods
-Bank::Bank()
-{
-    loanAmount = 0;
-    interestRate = 0.1;  // 10% interest
-    isCorrupt = false;
-    securityLevel = 1;
-    auditCost = 100;
-    Visual::printSuccess("Bank initialized.");
-}
-
-Bank::~Bank()
-{
-    Visual::printInfo("Bank cleanup done.");
+    Visual::printSuccess(VFMT("Army size increased by {}. New size: {}, Morale: {}"), amount, size, morale);
 }
 
-void Bank::takeLoan(double amount, Economy& economy)
+void Army::applyBattleOutcome(int losses, bool won)
 {
-    if (amount <= 0)
+    if (losses < 0)
     {
-        Visual::printError("Loan amount must be positive!");
+        Visual::printError("Battle losses cannot be negative!");
         return;
     }
-    loanAmount += amount;
-    economy.spendGold(-amount);  // Add money to economy
-    Visual::printSuccess("Loan of " + std::to_string(amount) + " gold taken. Total debt: " + 
-        std::to_string(loanAmount) + " gold.");
+    if (losses > size) losses = size;
+
+    size -= losses;
+    casualties += losses;
+    morale += won ? 10 : -15;
+    if (morale > 100) morale = 100;
+    if (morale < 0) morale = 0;
+    revision++;
 }
 
-void Bank::repayLoan(double amount, Economy& economy)
+int Army::getFightingPower(int weapons) const
 {
-    if (amount <= 0)
-    {
-        Visual::printError("Repayment amount must be positive!");
-        return;
-    }
-    if (amount > loanAmount)
+    // Training adds 10% a level, equipment and morale scale from half strength
+    long long training = 10 + trainingLevel;  // Tenths
+    long long quality = 50 + equipment;       // Hundredths
+    long long spirit = 100 + morale;          // Two-hundredths
+
+    // Each soldier needs 2 weapons; unarmed soldiers fight at half strength
+    long long armed = 1000;  // Per mille of soldiers with weapons
+    if (size > 0)
     {
-        amount = loanAmount;
+        armed = (long long)weapons * 1000 / ((long long)size * 2);
+        if (armed > 1000) armed = 1000;
+        if (armed < 0) armed = 0;
     }
-    economy.spendGold(amount);
-    loanAmount -= amount;
-    Visual::printSuccess("Repaid " + std::to_string(amount) + " gold. Remaining debt: " + 
-        std::to_string(loanAmount) + " gold.");
+    return (int)(POWER_ONE * training * quality * spirit * (1000 + armed) / (10LL * 100 * 200 * 2000));
 }
 
-// Sixth: Implement Market class methods
-Market::Market() : priceMultiplier(1.0), foodStockpile(100), weaponsStockpile(50), foodConsumptionRate(1.0) {
-    // Initialize all resources to 100
-    for (int i = 0; i < MAX_RESOURCES; i++) {
-        resourceQuantities[i] = 100;
+// LoanBook class implementation
+// (1 + rate)^turns by squaring. Only multiplications, so every platform
+// rounds the same way and stored payments match across lockstep peers.
+static double growthFactor(int rateBasisPoints, int turns) {
+    double base = 1.0 + rateBasisPoints / 10000.0;
+    double result = 1.0;
+    for (int n = turns; n > 0; n >>= 1) {
+        if (n & 1) {
+            result *= base;
+        }
+        base *= base;
     }
-    Visual::printSuccess("Market initialized with basic resources.");
+    return result;
 }
 
-Market::~Market() {
-    Visual::printInfo("Market cleanup done.");
+// Annuity payment: amount * r * g / (g - 1) with g = (1 + r)^turns
+Money LoanBook::schedulePayment(Money amount, int rateBasisPoints, int turns) {
+    if (turns <= 0) {
+        return amount;
+    }
+    double principal = (double)amount.getRaw();
+    if (rateBasisPoints == 0) {
+        return Money::fromRaw((long long)(principal / turns + 0.5));
+    }
+    double growth = growthFactor(rateBasisPoints, turns);
+    return Money::fromRaw((long long)(principal * (rateBasisPoints / 10000.0) * growth / (growth - 1.0) + 0.5));
 }
 
-int Market::findResourceIndex(const string& resource) const {
-    for (int i = 0; i < MAX_RESOURCES; i++) {
-        if (resourceNames[i] == resource) {
-            return i;
-        }
+// Balance after age payments: amount * g^age - payment * (g^age - 1) / r
+Money LoanBook::scheduledBalance(Money amount, int rateBasisPoints, int turns, int age) {
+    if (age >= turns) {
+        return 0;
     }
-    return -1; // Resource not found
+    if (age <= 0) {
+        return amount;
+    }
+    double payment = (double)schedulePayment(amount, rateBasisPoints, turns).getRaw();
+    double balance;
+    if (rateBasisPoints == 0) {
+        balance = amount.getRaw() - payment * age;
+    }
+    else {
+        double growth = growthFactor(rateBasisPoints, age);
+        balance = amount.getRaw() * growth - payment * (growth - 1.0) / (rateBasisPoints / 10000.0);
+    }
+    return Money::fromRaw(balance > 0 ? (long long)(balance + 0.5) : 0);
 }
 
-void Market::tradeResource(string resource, int amount, Economy& economy) {
-    if (!tradeRoute.getIsSecure()) {
-        Visual::printWarning("Warning: Trade route is not secure!");
-        if (rand() % 100 < tradeRoute.getAttackProbability()) {
-            Visual::printError("Trade caravan was attacked!");
-            return;
-        }
+bool LoanBook::add(Money amount, int rateBasisPoints, int turns) {
+    if (amount <= 0 || amount.getRaw() > MAX_BALANCE || rateBasisPoints < 0 || rateBasisPoints > MAX_RATE ||
+        turns < 1) {
+        return false;
     }
+    balance.push_back(amount.getRaw());
+    payment.push_back(schedulePayment(amount, rateBasisPoints, turns).getRaw());
+    principal.push_back(amount.getRaw());
+    rateScaled.push_back((((long long)rateBasisPoints << RATE_SHIFT) + 5000) / 10000);
+    rate.push_back(rateBasisPoints);
+    term.push_back(turns);
+    age.push_back(0);
+    missed.push_back(0);
+    total += amount;
+    return true;
+}
 
-    int resourceIndex = findResourceIndex(resource);
-    if (resourceIndex == -1) {
-        Visual::printError("Invalid resource type!");
-        return;
+Money LoanBook::repay(Money amount) {
+    long long left = amount.getRaw();
+    bool isClosed = false;
+    for (int i = 0; i < getCount() && left > 0; i++) {
+        long long part = balance[i] < left ? balance[i] : left;
+        balance[i] -= part;
+        left -= part;
+        isClosed = isClosed || balance[i] == 0;
+    }
+    Money used = Money::fromRaw(amount.getRaw() - left);
+    total -= used;
+    if (isClosed) {
+        removePaidOff();
     }
+    return used;
+}
 
-    double basePrice = 10.0;
-    if (resource == "wood") basePrice = 5.0;
-    else if (resource == "stone") basePrice = 8.0;
-    else if (resource == "iron") basePrice = 15.0;
-    else if (resource == "food") basePrice = 12.0;
-    else if (resource == "weapons") basePrice = 25.0;
+// Interest and this turn's payment for one chunk. No branches, so the
+// compiler can vectorize it.
+void LoanBook::accrueChunk(int chunk) {
+    int begin = chunk * CHUNK;
+    int end = begin + CHUNK < getCount() ? begin + CHUNK : getCount();
+    long long* balances = balance.data();
+    const long long* payments = payment.data();
+    const long long* rates = rateScaled.data();
+    const int* terms = term.data();
+    const int* ages = age.data();
+    long long* dues = due.data();
 
-    double totalCost = basePrice * amount * priceMultiplier;
-    
-    if (amount > 0) { // Buying
-        if (economy.getGold() < totalCost) {
-            Visual::printError("Not enough gold!");
-            return;
-        }
-        economy.decreaseGold(totalCost);
-        resourceQuantities[resourceIndex] += amount;
-        Visual::printSuccess("Successfully bought " + to_string(amount) + " " + resource);
-    }
-    else { // Selling
-        if (resourceQuantities[resourceIndex] < -amount) {
-            Visual::printError("Not enough " + resource + "!");
-            return;
-        }
-        economy.increaseGold(totalCost);
-        resourceQuantities[resourceIndex] += amount;
-        Visual::printSuccess("Successfully sold " + to_string(-amount) + " " + resource);
+    long long interestSum = 0;
+    long long dueSum = 0;
+    for (int i = begin; i < end; i++) {
+        long long interest = (balances[i] * rates[i] + (1LL << (RATE_SHIFT - 1))) >> RATE_SHIFT;
+        long long owed = balances[i] + interest;
+        owed = owed < MAX_BALANCE ? owed : MAX_BALANCE;
+        long long scheduled = ages[i] + 1 >= terms[i] ? owed : payments[i];  // The last payment clears it
+        dues[i] = scheduled < owed ? scheduled : owed;
+        balances[i] = owed;
+        interestSum += interest;
+        dueSum += dues[i];
     }
+    chunkResults[chunk].interest = Money::fromRaw(interestSum);
+    chunkResults[chunk].due = Money::fromRaw(dueSum);
 }
 
-int Market::getResource(string resource) const {
-    int resourceIndex = findResourceIndex(resource);
-    if (resourceIndex == -1) {
-        return 0;
+// Pays share/65536 of every due payment; anything short is a missed payment
+void LoanBook::settleChunk(int chunk, long long share) {
+    int begin = chunk * CHUNK;
+    int end = begin + CHUNK < getCount() ? begin + CHUNK : getCount();
+    long long* balances = balance.data();
+    const long long* dues = due.data();
+    int* ages = age.data();
+    int* misses = missed.data();
+
+    long long paidSum = 0;
+    long long remaining = 0;
+    int arrears = 0;
+    int worst = 0;
+    int closed = 0;
+    int written = 0;
+    long long lostSum = 0;
+    for (int i = begin; i < end; i++) {
+        long long paid = (dues[i] * share) >> 16;
+        int isShort = paid < dues[i];
+        balances[i] -= paid;
+        misses[i] = (misses[i] + 1) * isShort;
+        ages[i]++;
+        int isWrittenOff = misses[i] >= WRITE_OFF_MISSES;
+        lostSum += balances[i] * isWrittenOff;
+        balances[i] *= 1 - isWrittenOff;  // Closed with nothing more to pay
+        paidSum += paid;
+        remaining += balances[i];
+        arrears += isShort;
+        worst = misses[i] > worst ? misses[i] : worst;
+        closed += balances[i] == 0;
+        written += isWrittenOff;
     }
-    return resourceQuantities[resourceIndex];
+    LoanTurnResult& result = chunkResults[chunk];
+    result.paid = Money::fromRaw(paidSum);
+    result.loansInArrears = arrears;
+    result.worstMissed = worst;
+    result.paidOff = closed - written;
+    result.writtenOff = written;
+    result.lost = Money::fromRaw(lostSum);
+    chunkTotals[chunk] = remaining;
 }
 
-void Market::decreaseResource(string resource, int amount) {
-    if (amount < 0) {
-        Visual::printError("Cannot decrease resource by negative amount!");
-        return;
+LoanTurnResult LoanBook::accrue(Money available) {
+    LoanTurnResult result = LoanTurnResult();
+    int count = getCount();
+    if (count == 0) {
+        return result;
+    }
+    int chunkCount = (count + CHUNK - 1) / CHUNK;
+    due.resize(count);
+    chunkResults.assign(chunkCount, LoanTurnResult());
+    chunkTotals.assign(chunkCount, 0);
+    parallelFor(chunkCount, [this](int chunk) { accrueChunk(chunk); });
+    for (int c = 0; c < chunkCount; c++) {
+        result.interest += chunkResults[c].interest;
+        result.due += chunkResults[c].due;
     }
 
-    int resourceIndex = findResourceIndex(resource);
-    if (resourceIndex == -1) {
-        Visual::printError("Invalid resource type!");
-        return;
+    // Pay in full if the gold is there, otherwise the same fraction of every payment
+    long long share = 1 << 16;
+    if (result.due > available) {
+        share = available <= 0 ? 0 : (long long)((double)available.getRaw() * 65536.0 / (double)result.due.getRaw());
+        share = share > 0 ? share - 1 : 0;  // Rounding must never pay out more than there is
     }
+    parallelFor(chunkCount, [this, share](int chunk) { settleChunk(chunk, share); });
 
-    int newQuantity = resourceQuantities[resourceIndex] - amount;
-    if (newQuantity < 0) {
-        Visual::printError("Warning: " + resource + " dropped below zero!");
-        newQuantity = 0;
+    long long remaining = 0;
+    for (int c = 0; c < chunkCount; c++) {
+        result.paid += chunkResults[c].paid;
+        result.loansInArrears += chunkResults[c].loansInArrears;
+        result.paidOff += chunkResults[c].paidOff;
+        result.writtenOff += chunkResults[c].writtenOff;
+        result.lost += chunkResults[c].lost;
+        if (chunkResults[c].worstMissed > result.worstMissed) {
+            result.worstMissed = chunkResults[c].worstMissed;
+        }
+        remaining += chunkTotals[c];
     }
-    resourceQuantities[resourceIndex] = newQuantity;
-    
-    Visual::printWarning(resource + " decreased by " + to_string(amount) + 
-        ". New quantity: " + to_string(newQuantity));
+    total = Money::fromRaw(remaining);
+    arrearsCount = result.loansInArrears - result.writtenOff;
+    if (result.paidOff + result.writtenOff > 0) {
+        removePaidOff();
+    }
+    return result;
 }
 
-void Market::updateFoodStockpile(int population, const Weather& weather) {
-    // Calculate food production (base amount)
-    int foodProduction = 50;
-    
-    // Apply weather effects to food production
-    foodProduction = static_cast<int>(foodProduction * weather.getFoodProductionMultiplier());
-    
-    // Update food stockpile
-    foodStockpile += foodProduction;
-    
-    // Consume food based on population
-    consumeFood(population);
-    
-    // Check for food shortage
-    if (checkFoodShortage()) {
-        Visual::printWarning("Food shortage detected! Population may be affected.");
+// Closed and written off loans are squeezed out in order, so loan order stays deterministic
+void LoanBook::removePaidOff() {
+    int kept = 0;
+    for (int i = 0; i < getCount(); i++) {
+        if (balance[i] == 0) {
+            continue;
+        }
+        balance[kept] = balance[i];
+        payment[kept] = payment[i];
+        principal[kept] = principal[i];
+        rateScaled[kept] = rateScaled[i];
+        rate[kept] = rate[i];
+        term[kept] = term[i];
+        age[kept] = age[i];
+        missed[kept] = missed[i];
+        kept++;
     }
+    balance.resize(kept);
+    payment.resize(kept);
+    principal.resize(kept);
+    rateScaled.resize(kept);
+    rate.resize(kept);
+    term.resize(kept);
+    age.resize(kept);
+    missed.resize(kept);
 }
 
-void Market::consumeFood(int population) {
-    int foodNeeded = population * foodConsumptionRate;
-    if (foodStockpile >= foodNeeded) {
-        foodStockpile -= foodNeeded;
-    }
-    else {
-        foodStockpile = 0;
-        Visual::printError("Food shortage! Population is starving!");
-    }
+void LoanBook::clear() {
+    balance.clear();
+    payment.clear();
+    principal.clear();
+    rateScaled.clear();
+    rate.clear();
+    term.clear();
+    age.clear();
+    missed.clear();
+    total = 0;
+    arrearsCount = 0;
 }
 
-bool Market::checkFoodShortage() const {
-    return foodStockpile < 50; // Consider it a shortage if below 50 units
+template <typename T>
+static void appendArray(string& out, const vector<T>& values) {
+    out.append((const char*)values.data(), values.size() * sizeof(T));
 }
 
-void Market::updateWeaponsStockpile(int armySize) {
-    // Calculate weapons needed based on army size
-    int weaponsNeeded = armySize * 2; // Each soldier needs 2 weapons
-    
-    if (weaponsStockpile < weaponsNeeded) {
-        Visual::printWarning("Weapons shortage! Army effectiveness may be reduced.");
+template <typename T>
+static void readArray(const char*& in, vector<T>& values, int count) {
+    values.resize(count);
+    if (count > 0) {
+        memcpy(values.data(), in, count * sizeof(T));  // data() may be null when empty
     }
+    in += count * sizeof(T);
 }
 
-int Market::getFoodStockpile() const {
-    return foodStockpile;
+// Count, then each array in turn. Used by the undo history.
+string LoanBook::serialize() const {
+    int count = getCount();
+    string data((const char*)&count, sizeof(count));
+    appendArray(data, balance);
+    appendArray(data, payment);
+    appendArray(data, principal);
+    appendArray(data, rateScaled);
+    appendArray(data, rate);
+    appendArray(data, term);
+    appendArray(data, age);
+    appendArray(data, missed);
+    return data;
 }
 
-int Market::getWeaponsStockpile() const {
-    return weaponsStockpile;
-}
+bool LoanBook::deserialize(const string& data) {
+    int count;
+    if (data.size() < sizeof(count)) {
+        return false;
+    }
+    memcpy(&count, data.data(), sizeof(count));
+    if (count < 0 || data.size() != sizeof(count) + (size_t)count * (4 * sizeof(long long) + 4 * sizeof(int))) {
+        return false;
+    }
+    const char* in = data.data() + sizeof(count);
+    readArray(in, balance, count);
+    readArray(in, payment, count);
+    readArray(in, principal, count);
+    readArray(in, rateScaled, count);
+    readArray(in, rate, count);
+    readArray(in, term, count);
+    readArray(in, age, count);
+    readArray(in, missed, count);
 
-TradeRoute& Market::getTradeRoute() {
-    return tradeRoute;
+    long long sum = 0;
+    arrearsCount = 0;
+    for (int i = 0; i < count; i++) {
+        sum += balance[i];
+        arrearsCount += missed[i] > 0;
+    }
+    total = Money::fromRaw(sum);
+    return true;
 }
 
-double Market::getPriceMultiplier() const {
-    return priceMultiplier;
+// Fifth: Implement Bank class methods
+// Basis points as a percentage, e.g. 126 -> "1.26" and -5 -> "-0.05"
+static string formatRate(int basisPoints) {
+    char buffer[16];
+    int magnitude = basisPoints < 0 ? -basisPoints : basisPoints;
+    snprintf(buffer, sizeof(buffer), "%s%d.%02d", basisPoints < 0 ? "-" : "", magnitude / 100, magnitude % 100);
+    return buffer;
 }
 
-// Seventh: Implement Politics class methods
-Politics::Politics()
+Bank::Bank()
 {
-    currentKing = new King("No King", 50);
-    electionTimer = 0;
-    stability = 50;
-    isCoup = false;
-    corruptionLevel = 0;
-    Visual::printSuccess("Politics initialized.");
+    interestRate = BASE_RATE;
+    isCorrupt = false;
+    securityLevel = 1;
+    auditCost = 100;
+    revision = 0;
+    Visual::printSuccess("Bank initialized.");
 }
 
-Politics::~Politics()
+Bank::~Bank()
 {
-    delete currentKing;
-    Visual::printInfo("Politics cleanup done.");
+    Visual::printInfo("Bank cleanup done.");
 }
 
-void Politics::holdElection()
+void Bank::takeLoan(Money amount, int turns, Economy& economy)
 {
-    if (electionTimer > 0)
+    if (amount <= 0 || amount > Money(MAX_LOAN))
     {
-        Visual::printError("Cannot hold election yet! Wait " + std::to_string(electionTimer) + " more turns.");
+        Visual::printError(VFMT("Loan amount must be between 0 and {} gold!"), MAX_LOAN);
         return;
     }
-    
-    delete currentKing;
-    currentKing = new King("New King", rand() % 50 + 50);  // Random skill 50-100
-    electionTimer = 10;  // 10 turns until next election
-    stability += 10;
-    if (stability > 100) stability = 100;
-    
-    Visual::printSuccess("New king elected: " + currentKing->getName() + 
-        " (Skill: " + std::to_string(currentKing->getSkill()) + ")");
+    if (turns < MIN_TERM || turns > MAX_TERM)
+    {
+        Visual::printError(VFMT("Loan term must be between {} and {} turns!"), MIN_TERM, MAX_TERM);
+        return;
+    }
+    if (loans.getArrearsCount() > 0)
+    {
+        Visual::printError("Lenders will not lend while loan payments are in arrears!");
+        return;
+    }
+    if (loans.getCount() >= MAX_LOANS || loans.getTotal() + amount > Money(MAX_DEBT))
+    {
+        Visual::printError(VFMT("Lenders will not lend past {} loans or {} gold of debt!"), MAX_LOANS, MAX_DEBT);
+        return;
+    }
+    int rate = quoteRate(turns);
+    if (rate > LoanBook::MAX_RATE) rate = LoanBook::MAX_RATE;
+    loans.add(amount, rate, turns);
+    revision++;
+    economy.spendGold(-amount);  // Add money to economy
+    Visual::printSuccess(VFMT("Loan of {} gold taken over {} turns at {}% per turn. Total debt: {} gold."),
+        amount, turns, formatRate(rate), loans.getTotal());
+    Visual::printInfo(VFMT("Payments of {} gold are taken each turn."), LoanBook::schedulePayment(amount, rate, turns));
 }
 
-void Politics::decreaseStability(int amount)
+void Bank::repayLoan(Money amount, Economy& economy)
 {
-    if (amount < 0)
+    if (amount <= 0)
     {
-        Visual::printError("Cannot decrease stability by negative amount!");
+        Visual::printError("Repayment amount must be positive!");
         return;
     }
-
-    stability -= amount;
-    if (stability < 0)
+    if (loans.getCount() == 0)
     {
-        stability = 0;
-        Visual::printError("Warning: Kingdom stability dropped to zero!");
-        isCoup = true;  // Trigger coup if stability reaches zero
+        Visual::printError("There is no debt to repay!");
+        return;
     }
-    else if (stability < 20)
+    if (amount > economy.getGold())
     {
-        Visual::printWarning("Warning: Kingdom stability critically low! Risk of rebellion!");
+        Visual::printError("Not enough gold to repay that much!");
+        return;
     }
-
-    Visual::printWarning("Kingdom stability decreased by " + std::to_string(amount) + 
-        ". New stability: " + std::to_string(stability));
+    Money repaid = loans.repay(amount);  // Oldest loans first
+    economy.spendGold(repaid);
+    revision++;
+    Visual::printSuccess(VFMT("Repaid {} gold. Remaining debt: {} gold."), repaid, loans.getTotal());
 }
 
-string Politics::getKingName() const
+void Bank::restoreDebt(const string& book, Money amount)
 {
-    return currentKing->getName();
+    if (book.empty() || !loans.deserialize(book))
+    {
+        loans.clear();
+        if (amount > 0)
+        {
+            loans.add(amount, quoteRate(DEFAULT_TERM), DEFAULT_TERM);
+        }
+    }
+    revision++;
 }
 
-// Eighth: Implement Diplomacy class methods
-Diplomacy::Diplomacy()
-{
-    treaty = "No active treaty";
-    relations = 50;
-    isAlliance = false;
-    tradeSanctions = 0;
-    Visual::printSuccess("Diplomacy initialized.");
-}
+void Bank::accrueInterest(Kingdom* const* kingdoms, int count) {
+    for (int k = 0; k < count; k++) {
+        Kingdom& kingdom = *kingdoms[k];
+        Bank& bank = kingdom.getBank();
+        if (bank.loans.getCount() == 0 && bank.interestRate == BASE_RATE) {
+            continue;  // Nothing owed and nothing to forgive
+        }
+        MemoryScope scope(kingdom.getMemoryAccount(), MEMORY_BANK, "Bank::accrueInterest");
+        LoanTurnResult result = bank.loans.accrue(kingdom.getLedger().getGold());
+        kingdom.getLedger().apply(LedgerTransaction().addGold(-result.paid));
+        bank.revision++;
 
-Diplomacy::~Diplomacy()
-{
-    Visual::printInfo("Diplomacy cleanup done.");
+        if (result.loansInArrears > 0) {
+            // Lenders charge more, the treasury cuts back and the court loses faith
+            bank.interestRate += ARREARS_PREMIUM * result.loansInArrears;
+            if (bank.interestRate > LoanBook::MAX_RATE) bank.interestRate = LoanBook::MAX_RATE;
+            kingdom.getEconomy().handleArrears(result.loansInArrears);
+            kingdom.getPolitics().decreaseStability(result.worstMissed * 2 < 10 ? result.worstMissed * 2 : 10);
+            Visual::printWarning(VFMT("Missed {} gold of loan payments on {} loans!"), result.due - result.paid,
+                result.loansInArrears);
+        }
+        else {
+            // Good standing slowly brings the rate back down
+            bank.interestRate -= bank.interestRate - BASE_RATE < 5 ? bank.interestRate - BASE_RATE : 5;
+            kingdom.getEconomy().handleArrears(0);
+        }
+        if (result.writtenOff > 0) {
+            // A default is not forgotten: lenders price it in and the court is shaken
+            bank.interestRate += ARREARS_PREMIUM * LoanBook::WRITE_OFF_MISSES * result.writtenOff;
+            if (bank.interestRate > LoanBook::MAX_RATE) bank.interestRate = LoanBook::MAX_RATE;
+            kingdom.getPolitics().decreaseStability(10);
+            Visual::printWarning(VFMT("Lenders wrote off {} loans still owing {} gold!"), result.writtenOff, result.lost);
+        }
+        if (result.paidOff > 0) {
+            Visual::printSuccess(VFMT("{} loans paid off."), result.paidOff);
+        }
+    }
 }
 
-void Diplomacy::makeTreaty(string t)
-{
-    treaty = t;
-    relations += 10;
-    if (relations > 100) relations = 100;
-    isAlliance = true;
-    Visual::printSuccess("Treaty established: " + treaty);
-}
+// Sixth: Implement Market class methods
+// Neighbouring kingdoms; each also runs a market beyond the east border
+static const char* const NEIGHBOUR_NAMES[Diplomacy::NEIGHBOUR_COUNT] = {"Eastland", "Highvale", "Saltport", "Ironhold"};
 
-void Diplomacy::breakTreaty()
-{
-    if (treaty == "No active treaty")
-    {
-        Visual::printError("No active treaty to break!");
-        return;
+// Roads from the trading post (id 0) to the neighbours' markets (id 1 on)
+static const int TRADING_POST = 0;
+static const int ROAD_COUNT = 6;
+static const int ROADS[ROAD_COUNT][2] = {{0, 1}, {0, 2}, {1, 3}, {2, 3}, {2, 4}, {3, 4}};
+static const int RESOURCE_MARKET[] = {2, 1, 4, 3, 4};  // Where wood, stone, iron, food and weapons trade
+
+Market::Market(ResourceLedger& l, GameRandom& r)
+    : ledger(l), random(r), priceLevel(10000), foodConsumptionRate(100), revision(0) {
+    // Initialize all resources to 100
+    for (int i = 0; i < MAX_RESOURCES; i++) {
+        ledger.set(LEDGER_WOOD + i, 100);
+    }
+    ledger.set(LEDGER_FOOD, 1000);  // Market food is also the granary, which starts with 1000
+    roads.addKingdom("Trading Post");
+    for (int i = 0; i < Diplomacy::NEIGHBOUR_COUNT; i++) {
+        roads.addKingdom(NEIGHBOUR_NAMES[i]);
     }
-    treaty = "No active treaty";
-    relations -= 20;
-    if (relations < 0) relations = 0;
-    isAlliance = false;
-    Visual::printWarning("Treaty broken! Relations decreased.");
+    for (int i = 0; i < ROAD_COUNT; i++) {
+        roads.connect(ROADS[i][0], ROADS[i][1], 0.0, 0);
+    }
+    Visual::printSuccess("Market initialized with basic resources.");
 }
 
-// Ninth: Implement Communication class methods
-Communication::Communication()
-{
-    messageCount = 0;  // Start with no messages
-    for (int i = 0; i < 5; i++)
-    {
-        messages[i] = "";  // Clear message array
-    }
-    cout << "Communication initialized with no messages." << endl;
+Market::~Market() {
+    Visual::printInfo("Market cleanup done.");
 }
 
-Communication::~Communication()
-{
-    // No dynamic memory to free
-    cout << "Communication cleanup done." << endl;
+int Market::findResourceIndex(const string& resource) const {
+    for (int i = 0; i < MAX_RESOURCES; i++) {
+        if (resourceNames[i] == resource) {
+            return LEDGER_WOOD + i;
+        }
+    }
+    return -1; // Resource not found
 }
 
-void Communication::sendMessage(const string& msg)
-{
-    if (messageCount < 5)
-    {
-        messages[messageCount] = msg;
-        messageCount++;
-        cout << "Sent message: " << msg << "." << endl;
+void Market::tradeResource(string resource, int amount, Economy& economy, const Diplomacy& diplomacy,
+    const CaravanRoute& route) {
+    if (!route.isFound) {
+        Visual::printError("No caravan route to the trading post!");
+        return;
     }
-    else
-    {
-        cout << "Error: Message limit reached!" << endl;
+    int slot = findResourceIndex(resource);
+    if (slot == -1) {
+        Visual::printError("Invalid resource type!");
+        return;
     }
-}
 
-void Communication::showMessages() const
-{
-    if (messageCount == 0)
-    {
-        cout << "No messages." << endl;
+    int partner = RESOURCE_MARKET[slot - LEDGER_WOOD];
+    if (diplomacy.isSanctionedBy(partner)) {
+        Visual::printError(VFMT("{} refuses to trade with us while its sanctions last!"), roads.getKingdomName(partner));
         return;
     }
-    cout << "Messages:" << endl;
-    for (int i = 0; i < messageCount; i++)
-    {
-        cout << "- " << messages[i] << endl;
+
+    // Risk builds up over every tile to the border, then every road abroad
+    int roadChance = roads.getRouteAttackProbability(TRADING_POST, partner);
+    if (roadChance >= 50) {
+        Visual::printWarning(VFMT("Warning: The roads to {} are not secure!"), roads.getKingdomName(partner));
+    }
+    int tileChance = route.getAttackProbability(roadChance);
+    int attackChance = 100 - (100 - tileChance) * (100 - roadChance) / 100;
+    Visual::printInfo(VFMT("Caravan travels {} tiles and {} roads to {} with a {}% chance of attack"),
+        route.length, (int)roads.getRoute(TRADING_POST, partner).size() - 1, roads.getKingdomName(partner),
+        attackChance);
+    if (random.nextInt(100) < attackChance) {
+        Visual::printError("Trade caravan was attacked!");
+        return;
     }
-}
 
-string Communication::getMessage(int index) const
-{
-    if (index >= 0 && index < messageCount)
-    {
-        return messages[index];
+    long long inputs[RULE_INPUT_COUNT] = {};
+    inputs[INPUT_RESOURCE] = slot - LEDGER_WOOD;
+    int basePrice = (int)Rules::evaluate(RULE_BASE_PRICE, inputs);
+
+    int units = amount > 0 ? amount : -amount;
+    Money totalCost = (Money(basePrice) * units).scaled(priceLevel, 10000);
+    
+    // Gold and goods change together or not at all
+    LedgerTransaction trade;
+    trade.add(slot, amount);
+    trade.addGold(amount > 0 ? -totalCost : totalCost);
+
+    if (!economy.getLedger().apply(trade)) {
+        if (amount > 0) {
+            Visual::printError("Not enough gold!");
+        }
+        else {
+            Visual::printError(VFMT("Not enough {}!"), resource);
+        }
+        return;
+    }
+    tradeVolume += totalCost;
+    if (amount > 0) { // Buying
+        Visual::printSuccess(VFMT("Successfully bought {} {} for {} gold"), amount, resource, totalCost);
+    }
+    else { // Selling
+        Visual::printSuccess(VFMT("Successfully sold {} {} for {} gold"), -amount, resource, totalCost);
     }
-    return "Invalid message index";
 }
 
-// Update Kingdom constructor
-Kingdom::Kingdom(string n)
-{
-    name = n;
-    people = new Population();
-    economy = new Economy();
-    army = new Army(100);
-    bank = new Bank();
-    market = new Market();
-    politics = new Politics();
-    diplomacy = new Diplomacy();
-    communication = new Communication();
-    turn = 1;
-    isGameOver = false;
-    turnsSinceLastWeatherUpdate = 0;
-    Visual::printSuccess("Kingdom " + name + " initialized!");
+int Market::getResource(string resource) const {
+    int slot = findResourceIndex(resource);
+    if (slot == -1) {
+        return 0;
+    }
+    return (int)ledger.get(slot);
 }
 
-// Update Kingdom destructor
-Kingdom::~Kingdom()
-{
-    delete people;
-    delete economy;
-    delete army;
-    delete bank;
-    delete market;
-    delete politics;
-    delete diplomacy;
-    delete communication;  // Clean up communication
-    Visual::printInfo("Kingdom cleanup done.");
-}
+void Market::decreaseResource(string resource, int amount) {
+    if (amount < 0) {
+        Visual::printError("Cannot decrease resource by negative amount!");
+        return;
+    }
 
-void Kingdom::saveGame() const
-{
-    ofstream file("score.txt");
-    if (!file.is_open())
-    {
-        Visual::printError("Error: Cannot open score.txt for saving!");
+    int slot = findResourceIndex(resource);
+    if (slot == -1) {
+        Visual::printError("Invalid resource type!");
         return;
     }
-    file << name << endl;
-    file << people->getTotalPeople() << endl;
-    file << economy->getGold() << endl;
-    file << army->getSize() << endl;
-    file << army->getMorale() << endl;
-    file << bank->getLoanAmount() << endl;
-    file << communication->getMessageCount() << endl;
-    for (int i = 0; i < communication->getMessageCount(); i++)
-    {
-        file << communication->getMessage(i) << endl;
+
+    if (!ledger.apply(LedgerTransaction().add(slot, -amount))) {
+        Visual::printError(VFMT("Warning: {} dropped below zero!"), resource);
+        ledger.set(slot, 0);
     }
-    file.close();
-    Visual::printSuccess("Game saved to score.txt.");
+    
+    Visual::printWarning(VFMT("{} decreased by {}. New quantity: {}"), resource, amount, ledger.get(slot));
 }
 
-void Kingdom::loadGame()
-{
-    ifstream file("score.txt");
-    if (!file.is_open())
-    {
-        Visual::printError("Error: Cannot open score.txt for loading!");
-        return;
+void Market::updateFoodStockpile(int population, long long foodProduced) {
+    // The harvest comes in, then the people eat, in one pass over the ledger
+    LedgerTransaction turn[2];
+    turn[0].add(LEDGER_FOOD, foodProduced);
+    turn[1].add(LEDGER_FOOD, -(long long)population * foodConsumptionRate / 100);
+    bool committed[2];
+    ledger.applyBatch(turn, 2, committed);
+    if (!committed[1]) {
+        ledger.set(LEDGER_FOOD, 0);
+        Visual::printError("Food shortage! Population is starving!");
     }
-    getline(file, name);
-    int pop;
-    double gold;
-    int armySize, armyMorale;
-    double loan;
-    file >> pop >> gold >> armySize >> armyMorale >> loan;
-    people->updatePeople(pop - people->getTotalPeople());
-    economy->spendGold(gold - economy->getGold());
-    delete army;
-    army = new Army(armySize);
-    army->train(0);
-    army->paySoldiers(*economy);
-    bank->takeLoan(loan - bank->getLoanAmount(), *economy);
     
-    int msgCount;
-    file >> msgCount;
-    string msg;
-    getline(file, msg);
-    for (int i = 0; i < msgCount; i++)
-    {
-        getline(file, msg);
-        communication->sendMessage(msg);
+    // Check for food shortage
+    if (checkFoodShortage()) {
+        Visual::printWarning("Food shortage detected! Population may be affected.");
     }
-    
-    file.close();
-    Visual::printSuccess("Game loaded from score.txt.");
 }
 
-// Add Kingdom weather update method
-void Kingdom::updateWeather() {
-    weather.updateWeather();
-    if (weather.isHarshWeather()) {
-        Visual::printWarning("Weather Alert: " + weather.getCurrentCondition());
-        Visual::printInfo("Food production will be affected for " + 
-                        to_string(weather.getDuration()) + " turns.");
-    }
+void Market::addProduction(const TileMap& territory) {
+    LedgerTransaction goods;
+    goods.add(LEDGER_WOOD, territory.getProduction(BUILDING_LUMBER_MILL));
+    goods.add(LEDGER_STONE, territory.getProduction(BUILDING_QUARRY));
+    goods.add(LEDGER_IRON, territory.getProduction(BUILDING_MINE));
+    goods.add(LEDGER_WEAPONS, territory.getProduction(BUILDING_SMITHY));
+    ledger.apply(goods);
 }
 
-// Weather class implementation
-void Weather::updateWeather() {
-    srand(time(0));
-    int weatherChange = rand() % 100;
+bool Market::checkFoodShortage() const {
+    return ledger.get(LEDGER_FOOD) < 50; // Consider it a shortage if below 50 units
+}
+
+void Market::updateWeaponsStockpile(int armySize) {
+    // Calculate weapons needed based on army size
+    int weaponsNeeded = armySize * 2; // Each soldier needs 2 weapons
     
-    if (weatherChange < 60) { // 60% chance of normal weather
-        currentCondition = "Normal";
-        foodProductionMultiplier = 1.0;
-        isHarsh = false;
-        duration = 0;
+    if (ledger.get(LEDGER_WEAPONS) < weaponsNeeded) {
+        Visual::printWarning("Weapons shortage! Army effectiveness may be reduced.");
     }
-    else if (weatherChange < 75) { // 15% chance of drought
-        currentCondition = "Drought";
-        foodProductionMultiplier = 0.5;
-        isHarsh = true;
-        duration = rand() % 3 + 1;
+}
+
+int Market::getFoodStockpile() const {
+    return (int)ledger.get(LEDGER_FOOD);
+}
+
+int Market::getWeaponsStockpile() const {
+    return (int)ledger.get(LEDGER_WEAPONS);
+}
+
+void Market::updateRoadSecurity() {
+    int road = random.nextInt(ROAD_COUNT);
+    TradeRoute report;
+    report.updateSecurity(random);
+    roads.updateSecurity(ROADS[road][0], ROADS[road][1], report);
+}
+
+double Market::getPriceMultiplier() const {
+    return priceLevel / 10000.0;
+}
+
+int Market::getPriceLevel() const {
+    return priceLevel;
+}
+
+// WorldEconomy class implementation
+WorldTotals& WorldTotals::operator+=(const WorldTotals& other) {
+    money += other.money;
+    output += other.output;
+    trade += other.trade;
+    people += other.people;
+    return *this;
+}
+
+WorldTotals WorldEconomy::sumLeaf(Kingdom* const* kingdoms, int count) {
+    WorldTotals totals;
+    for (int i = 0; i < count; i++) {
+        Kingdom& kingdom = *kingdoms[i];
+        const TileMap& territory = kingdom.getTerritory();
+        totals.money += kingdom.getLedger().get(LEDGER_GOLD);
+        totals.output += kingdom.weather.getFoodProduction(territory) +
+            territory.getProduction(BUILDING_LUMBER_MILL) + territory.getProduction(BUILDING_QUARRY) +
+            territory.getProduction(BUILDING_MINE) + territory.getProduction(BUILDING_SMITHY);
+        totals.trade += kingdom.getMarket().tradeVolume.getRaw();
+        totals.people += kingdom.getPeople().getTotalPeople();
     }
-    else if (weatherChange < 90) { // 15% chance of harsh winter
-        currentCondition = "Harsh Winter";
-        foodProductionMultiplier = 0.3;
-        isHarsh = true;
-        duration = rand() % 2 + 1;
+    return totals;
+}
+
+WorldTotals WorldEconomy::aggregate(Kingdom* const* kingdoms, int count) {
+    int leafCount = (count + LEAF - 1) / LEAF;
+    if (leafCount <= 0) {
+        return WorldTotals();
     }
-    else { // 10% chance of good weather
-        currentCondition = "Good Weather";
-        foodProductionMultiplier = 1.5;
-        isHarsh = false;
-        duration = rand() % 2 + 1;
+    vector<WorldTotals> partial(leafCount);
+    parallelFor(leafCount, [&](int leaf) {
+        int begin = leaf * LEAF;
+        partial[leaf] = sumLeaf(kingdoms + begin, count - begin < LEAF ? count - begin : LEAF);
+    });
+
+    // Merge neighbours, then neighbours two apart, and so on up to the root
+    for (int stride = 1; stride < leafCount; stride *= 2) {
+        int pairs = (leafCount + 2 * stride - 1) / (2 * stride);
+        parallelFor(pairs, [&](int pair) {
+            int left = pair * 2 * stride;
+            if (left + stride < leafCount) {
+                partial[left] += partial[left + stride];
+            }
+        });
     }
+    return partial[0];
 }
 
-// TradeRoute class implementation
-void TradeRoute::updateSecurity() {
-    srand(time(0));
-    int securityCheck = rand() % 100;
-    
-    if (securityCheck < 70) { // 70% chance of secure route
-        isSecure = true;
-        riskLevel = 0.0;
-        attackProbability = 0;
+// change / base in basis points. Large world sums are halved until the
+// products fit in 64 bits; growth past MAX_GROWTH saturates.
+static long long growthBasisPoints(long long change, long long base) {
+    const long long MAX_GROWTH = 1000000;  // 100 times over
+    while (base > LLONG_MAX / 20000) {
+        base /= 2;
+        change /= 2;
     }
-    else if (securityCheck < 85) { // 15% chance of moderate risk
-        isSecure = true;
-        riskLevel = 0.3;
-        attackProbability = 20;
+    long long whole = change / base;
+    if (whole >= MAX_GROWTH / 10000 || whole <= -MAX_GROWTH / 10000) {
+        return whole > 0 ? MAX_GROWTH : -MAX_GROWTH;
     }
-    else { // 15% chance of high risk
-        isSecure = false;
-        riskLevel = 0.7;
-        attackProbability = 50;
+    return whole * 10000 + change % base * 10000 / base;
+}
+
+// Inflation is demand growth minus output growth, smoothed because prices
+// are sticky. A few turns of falling output make a recession, as do loans
+// in arrears at home. All integer, so lockstep peers and replays agree.
+void WorldEconomy::applyLeaf(Kingdom* const* kingdoms, int count, const WorldTotals& world) {
+    long long demand = world.money + world.trade;
+    for (int i = 0; i < count; i++) {
+        Kingdom& kingdom = *kingdoms[i];
+        Economy& economy = kingdom.getEconomy();
+        Market& market = kingdom.getMarket();
+
+        int rate = economy.inflationRate;
+        if (economy.worldDemand > 0 && economy.worldOutput > 0) {
+            // Coin in people's pockets steadies the base when treasuries run dry
+            long long demandGrowth = growthBasisPoints(demand - economy.worldDemand,
+                economy.worldDemand + world.people * Money::SCALE);
+            long long outputGrowth = growthBasisPoints(world.output - economy.worldOutput, economy.worldOutput);
+            long long pressure = demandGrowth - outputGrowth;
+            pressure = pressure < -MAX_INFLATION ? -MAX_INFLATION : (pressure > MAX_INFLATION ? MAX_INFLATION : pressure);
+            rate = (rate * 3 + (int)pressure) / 4;
+        }
+        economy.shrinkingTurns = world.output < economy.worldOutput ? economy.shrinkingTurns + 1 : 0;
+        bool isRecession = economy.shrinkingTurns >= RECESSION_TURNS || kingdom.getBank().getLoans().getArrearsCount() > 0;
+        if (rate != economy.inflationRate || isRecession != economy.isRecession) {
+            economy.revision++;
+        }
+        economy.inflationRate = rate;
+        economy.isRecession = isRecession;
+        economy.worldDemand = demand;
+        economy.worldOutput = world.output;
+
+        long long price = (long long)market.priceLevel * (10000 + rate) / 10000;
+        price = price < MIN_PRICE_LEVEL ? MIN_PRICE_LEVEL : (price > MAX_PRICE_LEVEL ? MAX_PRICE_LEVEL : price);
+        if (price != market.priceLevel) {
+            market.priceLevel = (int)price;
+            market.revision++;
+        }
+        market.tradeVolume = 0;
     }
 }
 
-// Global function implementations
-void handleRandomEvent(Kingdom& kingdom);
+void WorldEconomy::update(Kingdom* const* kingdoms, int count) {
+    if (count <= 0) {
+        return;
+    }
+    WorldTotals world = aggregate(kingdoms, count);
+    int leafCount = (count + LEAF - 1) / LEAF;
+    parallelFor(leafCount, [&](int leaf) {
+        int begin = leaf * LEAF;
+        applyLeaf(kingdoms + begin, count - begin < LEAF ? count - begin : LEAF, world);
+    });
+}
 
-void updateGameState(Kingdom& kingdom) {
-    kingdom.getMarket().updateFoodStockpile(kingdom.getPeople().getTotalPeople(), kingdom.weather);
+// Seventh: Implement Politics class methods
+Politics::Politics(GameRandom& r) : random(r)
+{
+    currentKing = new King("No King", 50);
+    electionTimer = 0;
+    stability = 50;
+    isCoup = false;
+    corruptionLevel = 0;
+    policies = 0;
+    revision = 0;
+    Visual::printSuccess("Politics initialized.");
+}
+
+Politics::~Politics()
+{
+    delete currentKing;
+    Visual::printInfo("Politics cleanup done.");
+}
+
+void Politics::holdElection(const Population& people, int system)
+{
+    MemoryScope scope(MEMORY_POLITICS, "Politics::holdElection");
+    if (electionTimer > 0)
+    {
+        Visual::printError(VFMT("Cannot hold election yet! Wait {} more turns."), electionTimer);
+        return;
+    }
+    if (system < 0 || system >= ELECTION_SYSTEM_COUNT)
+    {
+        Visual::printError("Unknown electoral system!");
+        return;
+    }
+
+    // Every citizen votes in their estate
+    election.generateCandidates(random, 4);
+    long long voters[ESTATE_COUNT] = {people.getPeasants(), people.getMerchants(), people.getNobility(), people.getMilitary()};
+    ElectionResult result = election.hold(voters, system, corruptionLevel, random);
+    Visual::printInfo(VFMT("Election by {}: {} ballots cast"), ElectionEngine::getSystemName(system), result.ballots);
+    for (int c = 0; c < election.getCandidateCount(); c++)
+    {
+        const Candidate& candidate = election.getCandidate(c);
+        Visual::printInfo(VFMT("{} (skill {}, popularity {}): {} first preferences"),
+            candidate.name, candidate.skill, candidate.popularity, result.firstPreferences[c]);
+    }
+    if (system == ELECTION_RANKED_CHOICE)
+    {
+        Visual::printInfo(VFMT("Decided after {} rounds of counting"), result.rounds);
+    }
+
+    // Reuse the king rather than reallocating him
+    const Candidate& winner = election.getCandidate(result.winner);
+    *currentKing = King(winner.name, winner.skill);
+    currentKing->setPopularity(winner.popularity);
+    currentKing->setCorruption(winner.corruption > 60);
+    electionTimer = 10;  // 10 turns until next election
+    stability += 10;
+    if (stability > 100) stability = 100;
+    revision++;
+    
+    Visual::printSuccess(VFMT("New king elected: {} (Skill: {})"),
+        currentKing->getName(), currentKing->getSkill());
+}
+
+void Politics::decreaseStability(int amount)
+{
+    if (amount < 0)
+    {
+        Visual::printError("Cannot decrease stability by negative amount!");
+        return;
+    }
+
+    stability -= amount;
+    revision++;
+    if (stability < 0)
+    {
+        stability = 0;
+        Visual::printError("Warning: Kingdom stability dropped to zero!");
+        isCoup = true;  // Trigger coup if stability reaches zero
+    }
+    else if (stability < 20)
+    {
+        Visual::printWarning("Warning: Kingdom stability critically low! Risk of rebellion!");
+    }
+
+    Visual::printWarning(VFMT("Kingdom stability decreased by {}. New stability: {}"), amount, stability);
+}
+
+void Politics::togglePolicy(int policy)
+{
+    if (policy < 0 || policy >= POLICY_COUNT)
+    {
+        Visual::printError("Unknown policy!");
+        return;
+    }
+
+    if (hasPolicy(policy))
+    {
+        policies &= ~(1u << policy);
+        revision++;
+        Visual::printInfo(VFMT("{} has been repealed."), getPolicyName(policy));
+        return;
+    }
+
+    int inForce = 0;
+    for (int p = 0; p < POLICY_COUNT; p++)
+    {
+        inForce += hasPolicy(p) ? 1 : 0;
+    }
+    if (inForce >= MAX_POLICIES)
+    {
+        Visual::printError(VFMT("At most {} policies can be in force! Repeal one first."), MAX_POLICIES);
+        return;
+    }
+
+    policies |= 1u << policy;
+    revision++;
+    Visual::printSuccess(VFMT("{} enacted by {}."), getPolicyName(policy), currentKing->getName());
+}
+
+string Politics::getKingName() const
+{
+    return currentKing->getName();
+}
+
+const char* Politics::getPolicyName(int policy)
+{
+    static const char* const names[POLICY_COUNT] = {
+        "Tax reform", "Conscription", "Rationing", "Public works", "Festivals"
+    };
+    return policy >= 0 && policy < POLICY_COUNT ? names[policy] : "Unknown policy";
+}
+
+// ElectionEngine class implementation
+ElectionEngine::ElectionEngine() : codeCount(0) {
+    static const int defaults[ESTATE_COUNT] = {250, 250, 300, 200};
+    setEstateWeights(defaults);
+}
+
+const char* ElectionEngine::getSystemName(int system) {
+    static const char* const names[ELECTION_SYSTEM_COUNT] = {"plurality", "ranked choice", "weighted estates"};
+    return system >= 0 && system < ELECTION_SYSTEM_COUNT ? names[system] : "unknown";
+}
+
+bool ElectionEngine::setEstateWeights(const int* weights) {
+    int sum = 0;
+    for (int e = 0; e < ESTATE_COUNT; e++) {
+        if (weights[e] < 0) {
+            return false;
+        }
+        sum += weights[e];
+    }
+    if (sum != 1000) {
+        return false;
+    }
+    memcpy(estateWeights, weights, sizeof(estateWeights));
+    return true;
+}
+
+void ElectionEngine::generateCandidates(GameRandom& random, int count) {
+    static const char* const titles[] = {"Lord", "Lady", "Sir", "Duke", "Baroness"};
+    static const char* const names[] = {"Aldric", "Beatrice", "Cedric", "Edmund", "Matilda", "Godfrey", "Isolde", "Roland"};
+    if (count < 2) count = 2;
+    if (count > ElectionResult::MAX_CANDIDATES) count = ElectionResult::MAX_CANDIDATES;
+
+    candidates.resize(count);
+    for (Candidate& candidate : candidates) {
+        candidate.name = string(titles[random.nextInt(5)]) + " " + names[random.nextInt(8)];
+        candidate.skill = random.nextInt(51) + 50;
+        candidate.popularity = random.nextInt(101);
+        candidate.corruption = random.nextInt(101);
+        for (int e = 0; e < ESTATE_COUNT; e++) {
+            candidate.appeal[e] = random.nextInt(41) - 20;
+        }
+    }
+}
+
+// Ranking code: the sum of rank(c) * K^c, with rank 0 the favourite.
+// Voters get 0-63 of noise per candidate from four xorshift32 lanes,
+// each lane giving two 16-bit values; the scalar path reads them in the
+// same order, so both paths count exactly the same ballots.
+void ElectionEngine::castBallots(long long* counts, long long voters, const short* preference, unsigned* lanes) const {
+    const int k = (int)candidates.size();
+    short place[ElectionResult::MAX_CANDIDATES];
+    place[0] = 1;
+    for (int c = 1; c < k; c++) {
+        place[c] = (short)(place[c - 1] * k);
+    }
+#ifdef USE_SSE2
+    __m128i state = _mm_loadu_si128((const __m128i*)lanes);
+    const __m128i noiseMask = _mm_set1_epi16(63);
+    alignas(16) short codes[8];
+    for (long long v = 0; v < voters; v += 8) {
+        __m128i utility[ElectionResult::MAX_CANDIDATES];
+        for (int c = 0; c < k; c++) {
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+            state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+            utility[c] = _mm_add_epi16(_mm_set1_epi16(preference[c]), _mm_and_si128(state, noiseMask));
+        }
+        // Candidates ahead of c: higher utility, or equal utility and a lower index.
+        // Comparison masks are -1, so they are added or subtracted as counts.
+        __m128i code = _mm_setzero_si128();
+        for (int c = 0; c < k; c++) {
+            __m128i rank = _mm_set1_epi16((short)c);
+            for (int d = 0; d < c; d++) {
+                rank = _mm_add_epi16(rank, _mm_cmpgt_epi16(utility[c], utility[d]));
+            }
+            for (int d = c + 1; d < k; d++) {
+                rank = _mm_sub_epi16(rank, _mm_cmpgt_epi16(utility[d], utility[c]));
+            }
+            code = _mm_add_epi16(code, _mm_mullo_epi16(rank, _mm_set1_epi16(place[c])));
+        }
+        _mm_store_si128((__m128i*)codes, code);
+        int used = voters - v < 8 ? (int)(voters - v) : 8;
+        for (int j = 0; j < used; j++) {
+            counts[codes[j]]++;
+        }
+    }
+    _mm_storeu_si128((__m128i*)lanes, state);
+#else
+    for (long long v = 0; v < voters; v += 8) {
+        int utility[ElectionResult::MAX_CANDIDATES][8];
+        for (int c = 0; c < k; c++) {
+            for (int lane = 0; lane < 4; lane++) {
+                lanes[lane] ^= lanes[lane] << 13;
+                lanes[lane] ^= lanes[lane] >> 17;
+                lanes[lane] ^= lanes[lane] << 5;
+            }
+            for (int j = 0; j < 8; j++) {
+                utility[c][j] = preference[c] + (int)((lanes[j >> 1] >> ((j & 1) * 16)) & 63);
+            }
+        }
+        int used = voters - v < 8 ? (int)(voters - v) : 8;
+        for (int j = 0; j < used; j++) {
+            // Each pair once; ties go to the lower index
+            int rank[ElectionResult::MAX_CANDIDATES] = {0};
+            for (int c = 1; c < k; c++) {
+                for (int d = 0; d < c; d++) {
+                    if (utility[c][j] > utility[d][j]) rank[d]++;
+                    else rank[c]++;
+                }
+            }
+            int code = 0;
+            for (int c = 0; c < k; c++) {
+                code += rank[c] * place[c];
+            }
+            counts[code]++;
+        }
+    }
+#endif
+}
+
+void ElectionEngine::decodeRanking(int code, int* order) const {
+    int k = (int)candidates.size();
+    for (int c = 0; c < k; c++) {
+        order[code % k] = c;
+        code /= k;
+    }
+}
+
+// Instant runoff: drop the weakest candidate until one holds a majority
+int ElectionEngine::runRankedChoice(ElectionResult& result) const {
+    int k = (int)candidates.size();
+    vector<long long> totals(codeCount, 0);
+    for (int e = 0; e < ESTATE_COUNT; e++) {
+        for (int code = 0; code < codeCount; code++) {
+            totals[code] += rankings[e * codeCount + code];
+        }
+    }
+
+    bool isEliminated[ElectionResult::MAX_CANDIDATES] = {false};
+    for (int round = 1; ; round++) {
+        long long votes[ElectionResult::MAX_CANDIDATES] = {0};
+        for (int code = 0; code < codeCount; code++) {
+            if (totals[code] == 0) {
+                continue;
+            }
+            int order[ElectionResult::MAX_CANDIDATES];
+            decodeRanking(code, order);
+            for (int r = 0; r < k; r++) {
+                if (!isEliminated[order[r]]) {
+                    votes[order[r]] += totals[code];
+                    break;
+                }
+            }
+        }
+
+        int best = -1;
+        int worst = -1;
+        int remaining = 0;
+        for (int c = 0; c < k; c++) {
+            if (isEliminated[c]) {
+                continue;
+            }
+            remaining++;
+            if (best < 0 || votes[c] > votes[best]) best = c;
+            if (worst < 0 || votes[c] < votes[worst]) worst = c;
+        }
+        if (votes[best] * 2 > result.ballots || remaining <= 2) {
+            memcpy(result.finalVotes, votes, sizeof(votes));
+            result.rounds = round;
+            return best;
+        }
+        isEliminated[worst] = true;
+    }
+}
+
+ElectionResult ElectionEngine::hold(const long long* voters, int system, int corruptionLevel, GameRandom& random) {
+    ElectionResult result;
+    memset(&result, 0, sizeof(result));
+    int k = (int)candidates.size();
+    codeCount = 1;
+    for (int c = 0; c < k; c++) {
+        codeCount *= k;
+    }
+    rankings.assign((size_t)ESTATE_COUNT * codeCount, 0);
+
+    for (int e = 0; e < ESTATE_COUNT; e++) {
+        // Estate preference; bribes sway nobles at a corrupt court and anger peasants
+        short preference[ElectionResult::MAX_CANDIDATES];
+        for (int c = 0; c < k; c++) {
+            const Candidate& candidate = candidates[c];
+            int value = candidate.popularity / 2 + candidate.skill / 5 + candidate.appeal[e];
+            if (e == ESTATE_NOBILITY) value += candidate.corruption * corruptionLevel / 100;
+            if (e == ESTATE_PEASANTS) value -= candidate.corruption / 5;
+            preference[c] = (short)value;
+        }
+        unsigned long long seedLow = random.next();
+        unsigned long long seedHigh = random.next();
+        unsigned lanes[4] = {(unsigned)seedLow | 1, (unsigned)(seedLow >> 32) | 1,
+                             (unsigned)seedHigh | 1, (unsigned)(seedHigh >> 32) | 1};
+        castBallots(&rankings[(size_t)e * codeCount], voters[e] > 0 ? voters[e] : 0, preference, lanes);
+    }
+
+    // First preferences per estate
+    for (int e = 0; e < ESTATE_COUNT; e++) {
+        for (int code = 0; code < codeCount; code++) {
+            long long count = rankings[(size_t)e * codeCount + code];
+            if (count != 0) {
+                int order[ElectionResult::MAX_CANDIDATES];
+                decodeRanking(code, order);
+                result.estateVotes[e][order[0]] += count;
+                result.firstPreferences[order[0]] += count;
+                result.ballots += count;
+            }
+        }
+    }
+
+    result.rounds = 1;
+    if (system == ELECTION_RANKED_CHOICE && result.ballots > 0) {
+        result.winner = runRankedChoice(result);
+        return result;
+    }
+    if (system == ELECTION_WEIGHTED_ESTATES) {
+        // Score in per mille: each estate's vote share scaled by its weight
+        for (int e = 0; e < ESTATE_COUNT; e++) {
+            long long estateBallots = 0;
+            for (int c = 0; c < k; c++) {
+                estateBallots += result.estateVotes[e][c];
+            }
+            for (int c = 0; c < k && estateBallots > 0; c++) {
+                result.finalVotes[c] += result.estateVotes[e][c] * estateWeights[e] / estateBallots;
+            }
+        }
+    }
+    else {
+        memcpy(result.finalVotes, result.firstPreferences, sizeof(result.finalVotes));
+    }
+    for (int c = 1; c < k; c++) {
+        if (result.finalVotes[c] > result.finalVotes[result.winner]) {
+            result.winner = c;
+        }
+    }
+    return result;
+}
+
+// PolicyBatch class implementation
+// What one policy in force does each turn
+struct PolicyEffect {
+    int goldPerHundred;   // Money raw value per 100 people
+    int upkeep;           // Money raw value
+    int foodPerHundred;   // Food per 100 people
+    int draftPerMille;    // Peasants drafted into the army
+    int publicServices;
+    int stability;
+    int popularity;
+};
+
+static const PolicyEffect POLICY_EFFECTS[POLICY_COUNT] = {
+    // gold, upkeep, food, draft, services, stability, popularity
+    {200, 0, 0, 0, 0, -1, -1},       // Tax reform
+    {0, 500, 0, 10, 0, -1, -2},      // Conscription
+    {0, 0, 3, 0, 0, -1, -1},         // Rationing
+    {0, 1500, 0, 0, 1, 1, 0},        // Public works
+    {0, 2000, -2, 0, 0, 1, 3}        // Festivals
+};
+
+void PolicyBatch::apply(Kingdom* const* kingdoms, int count) {
+    Block block;
+    for (int start = 0; start < count; start += BLOCK) {
+        block.count = count - start < BLOCK ? count - start : BLOCK;
+        gather(kingdoms + start, block);
+        applyEffects(block);
+        scatter(kingdoms + start, block);
+    }
+}
+
+void PolicyBatch::gather(Kingdom* const* kingdoms, Block& block) {
+    for (int i = 0; i < block.count; i++) {
+        Kingdom& kingdom = *kingdoms[i];
+        block.policies[i] = kingdom.getPolitics().policies;
+        block.people[i] = kingdom.getPeople().totalPeople;
+        block.peasants[i] = kingdom.getPeople().peasants;
+        block.drafted[i] = 0;
+        block.gold[i] = kingdom.getLedger().get(LEDGER_GOLD);
+        block.food[i] = kingdom.getLedger().get(LEDGER_FOOD);
+        block.services[i] = kingdom.getEconomy().publicServices;
+        block.stability[i] = kingdom.getPolitics().stability;
+        block.popularity[i] = kingdom.getPolitics().currentKing->getPopularity();
+    }
+}
+
+// One pass per table row; kingdoms without the policy get a zero mask
+void PolicyBatch::applyEffects(Block& block) {
+    for (int p = 0; p < POLICY_COUNT; p++) {
+        const PolicyEffect& effect = POLICY_EFFECTS[p];
+        for (int i = 0; i < block.count; i++) {
+            int on = (block.policies[i] >> p) & 1;
+            long long drafted = on * (block.peasants[i] * effect.draftPerMille / 1000);
+            block.gold[i] += on * (block.people[i] * effect.goldPerHundred / 100 - effect.upkeep);
+            block.food[i] += on * (block.people[i] * effect.foodPerHundred / 100);
+            block.peasants[i] -= drafted;
+            block.drafted[i] += drafted;
+            block.services[i] += on * effect.publicServices;
+            block.stability[i] += on * effect.stability;
+            block.popularity[i] += on * effect.popularity;
+        }
+    }
+
+    // Gold and food are clamped by the ledger on the way back
+    for (int i = 0; i < block.count; i++) {
+        int stability = block.stability[i];
+        int popularity = block.popularity[i];
+        block.stability[i] = stability < 0 ? 0 : (stability > 100 ? 100 : stability);
+        block.popularity[i] = popularity < 0 ? 0 : (popularity > 100 ? 100 : popularity);
+        block.services[i] = block.services[i] < 0 ? 0 : block.services[i];
+    }
+}
+
+void PolicyBatch::scatter(Kingdom* const* kingdoms, const Block& block) {
+    for (int i = 0; i < block.count; i++) {
+        if (block.policies[i] == 0) {
+            continue;  // Nothing changed
+        }
+        Kingdom& kingdom = *kingdoms[i];
+        kingdom.getLedger().set(LEDGER_GOLD, block.gold[i]);
+        kingdom.getLedger().set(LEDGER_FOOD, block.food[i]);
+
+        Economy& economy = kingdom.getEconomy();
+        if (economy.publicServices != block.services[i]) {
+            economy.publicServices = block.services[i];
+            economy.revision++;
+        }
+
+        Politics& politics = kingdom.getPolitics();
+        if (politics.stability != block.stability[i] || politics.currentKing->getPopularity() != block.popularity[i]) {
+            politics.stability = block.stability[i];
+            politics.currentKing->setPopularity(block.popularity[i]);
+            if (politics.stability == 0) {
+                politics.isCoup = true;  // Same rule as decreaseStability
+            }
+            politics.revision++;
+        }
+
+        long long drafted = block.drafted[i];
+        if (drafted > 0) {
+            Population& people = kingdom.getPeople();
+            if (people.agents != nullptr) {
+                drafted = people.agents->reassign((int)drafted, CITIZEN_PEASANT, CITIZEN_SOLDIER);
+                people.syncFromAgents();
+            }
+            else {
+                people.peasants -= (int)drafted;
+                people.military += (int)drafted;
+                people.revision++;
+            }
+            Army& army = kingdom.getArmy();
+            army.size += (int)drafted;
+            army.revision++;
+        }
+    }
+}
+
+// Eighth: Implement Diplomacy class methods
+static const int WAR_RELATIONS = 30;       // Relations lost when a neighbour attacks
+static const int SANCTION_RELATIONS = 20;  // Neighbours below this refuse our trade
+static const int LIFT_RELATIONS = 30;      // ...until relations climb back to this
+
+Diplomacy::Diplomacy()
+{
+    network.addKingdom("Home");
+    for (int i = 0; i < NEIGHBOUR_COUNT; i++)
+    {
+        network.addKingdom(NEIGHBOUR_NAMES[i]);
+    }
+    revision = 0;
+    Visual::printSuccess("Diplomacy initialized.");
+}
+
+Diplomacy::~Diplomacy()
+{
+    Visual::printInfo("Diplomacy cleanup done.");
+}
+
+int Diplomacy::findNeighbour(const string& treaty) const
+{
+    for (int neighbour = 1; neighbour <= NEIGHBOUR_COUNT; neighbour++)
+    {
+        if (treaty.find(network.getKingdomName(neighbour)) != string::npos)
+        {
+            return neighbour;
+        }
+    }
+    return 1;
+}
+
+void Diplomacy::makeTreaty(string t)
+{
+    int neighbour = findNeighbour(t);
+    network.makeTreaty(HOME, neighbour, t);
+    revision++;
+    Visual::printSuccess(VFMT("Treaty established with {}: {}"), network.getKingdomName(neighbour), t);
+}
+
+void Diplomacy::breakTreaty()
+{
+    // Treaties are broken in neighbour order so every peer breaks the same one
+    for (int neighbour = 1; neighbour <= NEIGHBOUR_COUNT; neighbour++)
+    {
+        if (network.getIsAlliance(HOME, neighbour))
+        {
+            network.breakTreaty(HOME, neighbour);
+            revision++;
+            Visual::printWarning(VFMT("Treaty with {} broken! Relations decreased."), network.getKingdomName(neighbour));
+            return;
+        }
+    }
+    Visual::printError("No active treaty to break!");
+}
+
+int Diplomacy::declareWar(GameRandom& random)
+{
+    int neighbour = 1 + random.nextInt(NEIGHBOUR_COUNT);
+    if (network.getIsAlliance(HOME, neighbour))
+    {
+        network.breakTreaty(HOME, neighbour);  // War ends any treaty
+    }
+    network.changeRelations(HOME, neighbour, -WAR_RELATIONS);
+    revision++;
+    return neighbour;
+}
+
+void Diplomacy::simulateTurn()
+{
+    int before = getRelations();
+    network.simulateTurn();
+
+    bool changed = false;
+    for (int neighbour = 1; neighbour <= NEIGHBOUR_COUNT; neighbour++)
+    {
+        int relations = network.getRelations(HOME, neighbour);
+        if (!isSanctionedBy(neighbour) && relations < SANCTION_RELATIONS)
+        {
+            network.imposeSanctions(neighbour, HOME, 1);
+            Visual::printWarning(VFMT("{} has placed trade sanctions on the kingdom!"), network.getKingdomName(neighbour));
+            changed = true;
+        }
+        else if (isSanctionedBy(neighbour) && relations >= LIFT_RELATIONS)
+        {
+            network.liftSanctions(neighbour, HOME);
+            Visual::printInfo(VFMT("{} has lifted its trade sanctions."), network.getKingdomName(neighbour));
+            changed = true;
+        }
+    }
+    if (changed || getRelations() != before)
+    {
+        revision++;
+    }
+}
+
+string Diplomacy::getTreaty() const
+{
+    for (int neighbour = 1; neighbour <= NEIGHBOUR_COUNT; neighbour++)
+    {
+        if (network.getIsAlliance(HOME, neighbour))
+        {
+            return network.getTreaty(HOME, neighbour);
+        }
+    }
+    return network.getTreaty(HOME, 1);
+}
+
+int Diplomacy::getRelations() const
+{
+    int total = 0;
+    for (int neighbour = 1; neighbour <= NEIGHBOUR_COUNT; neighbour++)
+    {
+        total += network.getRelations(HOME, neighbour);
+    }
+    return total / NEIGHBOUR_COUNT;
+}
+
+bool Diplomacy::getIsAlliance() const
+{
+    return !network.getAllies(HOME).empty();
+}
+
+int Diplomacy::getTradeSanctions() const
+{
+    int count = 0;
+    for (int neighbour = 1; neighbour <= NEIGHBOUR_COUNT; neighbour++)
+    {
+        count += isSanctionedBy(neighbour);
+    }
+    return count;
+}
+
+bool Diplomacy::isSanctionedBy(int neighbour) const
+{
+    return network.getTradeSanctions(neighbour, HOME) > 0;
+}
+
+// KingdomSet class implementation
+bool KingdomSet::insert(int id)
+{
+    if (positions.count(id) > 0)
+    {
+        return false;
+    }
+    positions[id] = (int)items.size();
+    items.push_back(id);
+    return true;
+}
+
+bool KingdomSet::erase(int id)
+{
+    auto found = positions.find(id);
+    if (found == positions.end())
+    {
+        return false;
+    }
+    // Swap the last item into the hole to keep removal O(1)
+    int index = found->second;
+    int last = items.back();
+    items[index] = last;
+    positions[last] = index;
+    items.pop_back();
+    positions.erase(id);
+    return true;
+}
+
+// TreatyRegistry class implementation
+TreatyRegistry::TreatyRegistry()
+{
+    intern("No active treaty");  // Always id 0
+}
+
+int TreatyRegistry::intern(const string& treaty)
+{
+    auto found = ids.find(treaty);
+    if (found != ids.end())
+    {
+        return found->second;
+    }
+    int id = (int)names.size();
+    names.push_back(treaty);
+    ids[treaty] = id;
+    return id;
+}
+
+const string& TreatyRegistry::getName(int id) const
+{
+    if (id < 0 || id >= (int)names.size())
+    {
+        return names[NO_TREATY];
+    }
+    return names[id];
+}
+
+// DiplomacyNetwork class implementation
+unsigned long long DiplomacyNetwork::pairKey(int a, int b)
+{
+    unsigned long long low = a < b ? a : b;
+    unsigned long long high = a < b ? b : a;
+    return (low << 32) | high;
+}
+
+bool DiplomacyNetwork::isValidPair(int a, int b) const
+{
+    int count = (int)kingdomNames.size();
+    return a >= 0 && a < count && b >= 0 && b < count && a != b;
+}
+
+DiplomaticTie& DiplomacyNetwork::getTie(int a, int b)
+{
+    auto found = ties.find(pairKey(a, b));
+    if (found != ties.end())
+    {
+        return found->second;
+    }
+    DiplomaticTie tie = {DEFAULT_RELATIONS, TreatyRegistry::NO_TREATY, false, 0, 0};
+    return ties.emplace(pairKey(a, b), tie).first->second;
+}
+
+const DiplomaticTie* DiplomacyNetwork::findTie(int a, int b) const
+{
+    auto found = ties.find(pairKey(a, b));
+    if (found == ties.end())
+    {
+        return nullptr;
+    }
+    return &found->second;
+}
+
+void DiplomacyNetwork::updateStanding(int a, int b, const DiplomaticTie& tie)
+{
+    if (tie.isAlliance)
+    {
+        allies[a].insert(b);
+        allies[b].insert(a);
+    }
+    else
+    {
+        allies[a].erase(b);
+        allies[b].erase(a);
+    }
+
+    if (tie.relations < ENEMY_THRESHOLD)
+    {
+        enemies[a].insert(b);
+        enemies[b].insert(a);
+    }
+    else
+    {
+        enemies[a].erase(b);
+        enemies[b].erase(a);
+    }
+}
+
+int DiplomacyNetwork::addKingdom(const string& name)
+{
+    int id = (int)kingdomNames.size();
+    kingdomNames.push_back(name);
+    allies.push_back(KingdomSet());
+    enemies.push_back(KingdomSet());
+    sanctioned.push_back(KingdomSet());
+    return id;
+}
+
+void DiplomacyNetwork::makeTreaty(int a, int b, const string& treaty)
+{
+    if (!isValidPair(a, b))
+    {
+        Visual::printError("Invalid kingdoms for treaty!");
+        return;
+    }
+    DiplomaticTie& tie = getTie(a, b);
+    tie.treatyId = treaties.intern(treaty);
+    tie.relations += 10;
+    if (tie.relations > 100) tie.relations = 100;
+    tie.isAlliance = true;
+    updateStanding(a, b, tie);
+}
+
+void DiplomacyNetwork::breakTreaty(int a, int b)
+{
+    if (!isValidPair(a, b))
+    {
+        Visual::printError("Invalid kingdoms for treaty!");
+        return;
+    }
+    const DiplomaticTie* existing = findTie(a, b);
+    if (existing == nullptr || existing->treatyId == TreatyRegistry::NO_TREATY)
+    {
+        Visual::printError("No active treaty to break!");
+        return;
+    }
+    DiplomaticTie& tie = getTie(a, b);
+    tie.treatyId = TreatyRegistry::NO_TREATY;
+    tie.relations -= 20;
+    if (tie.relations < 0) tie.relations = 0;
+    tie.isAlliance = false;
+    updateStanding(a, b, tie);
+}
+
+void DiplomacyNetwork::changeRelations(int a, int b, int amount)
+{
+    if (!isValidPair(a, b))
+    {
+        Visual::printError("Invalid kingdoms for relations!");
+        return;
+    }
+    DiplomaticTie& tie = getTie(a, b);
+    tie.relations += amount;
+    if (tie.relations > 100) tie.relations = 100;
+    if (tie.relations < 0) tie.relations = 0;
+    updateStanding(a, b, tie);
+}
+
+void DiplomacyNetwork::imposeSanctions(int from, int to, int level)
+{
+    if (!isValidPair(from, to) || level <= 0)
+    {
+        Visual::printError("Invalid trade sanctions!");
+        return;
+    }
+    DiplomaticTie& tie = getTie(from, to);
+    if (from < to) tie.sanctionsAtoB = level;
+    else tie.sanctionsBtoA = level;
+    sanctioned[from].insert(to);
+}
+
+void DiplomacyNetwork::liftSanctions(int from, int to)
+{
+    if (!isValidPair(from, to))
+    {
+        Visual::printError("Invalid trade sanctions!");
+        return;
+    }
+    if (findTie(from, to) == nullptr)
+    {
+        return;  // Never met, so there is nothing to lift
+    }
+    DiplomaticTie& tie = getTie(from, to);
+    if (from < to) tie.sanctionsAtoB = 0;
+    else tie.sanctionsBtoA = 0;
+    sanctioned[from].erase(to);
+}
+
+void DiplomacyNetwork::simulateTurn()
+{
+    for (auto& entry : ties)
+    {
+        DiplomaticTie& tie = entry.second;
+        int before = tie.relations;
+
+        if (tie.isAlliance)
+        {
+            tie.relations++;  // Allies slowly grow closer
+        }
+        else if (tie.relations < DEFAULT_RELATIONS)
+        {
+            tie.relations++;  // Old grudges fade
+        }
+        else if (tie.relations > DEFAULT_RELATIONS)
+        {
+            tie.relations--;  // Goodwill fades without a treaty
+        }
+        if (tie.sanctionsAtoB > 0) tie.relations--;
+        if (tie.sanctionsBtoA > 0) tie.relations--;
+
+        if (tie.relations > 100) tie.relations = 100;
+        if (tie.relations < 0) tie.relations = 0;
+
+        // Only touch the ally and enemy sets when the standing changes
+        if ((before < ENEMY_THRESHOLD) != (tie.relations < ENEMY_THRESHOLD))
+        {
+            updateStanding((int)(entry.first >> 32), (int)(entry.first & 0xffffffffULL), tie);
+        }
+    }
+}
+
+int DiplomacyNetwork::getRelations(int a, int b) const
+{
+    const DiplomaticTie* tie = findTie(a, b);
+    return tie != nullptr ? tie->relations : DEFAULT_RELATIONS;
+}
+
+string DiplomacyNetwork::getTreaty(int a, int b) const
+{
+    const DiplomaticTie* tie = findTie(a, b);
+    return treaties.getName(tie != nullptr ? tie->treatyId : TreatyRegistry::NO_TREATY);
+}
+
+bool DiplomacyNetwork::getIsAlliance(int a, int b) const
+{
+    const DiplomaticTie* tie = findTie(a, b);
+    return tie != nullptr && tie->isAlliance;
+}
+
+const vector<int>& DiplomacyNetwork::getAllies(int id) const
+{
+    static const vector<int> none;
+    if (id < 0 || id >= (int)allies.size())
+    {
+        return none;
+    }
+    return allies[id].getItems();
+}
+
+const vector<int>& DiplomacyNetwork::getEnemies(int id) const
+{
+    static const vector<int> none;
+    if (id < 0 || id >= (int)enemies.size())
+    {
+        return none;
+    }
+    return enemies[id].getItems();
+}
+
+string DiplomacyNetwork::getKingdomName(int id) const
+{
+    if (id < 0 || id >= (int)kingdomNames.size())
+    {
+        return "Unknown";
+    }
+    return kingdomNames[id];
+}
+
+int DiplomacyNetwork::getTradeSanctions(int from, int to) const
+{
+    const DiplomaticTie* tie = findTie(from, to);
+    if (tie == nullptr)
+    {
+        return 0;
+    }
+    return from < to ? tie->sanctionsAtoB : tie->sanctionsBtoA;
+}
+
+vector<int> DiplomacyNetwork::getSanctionChain(int from, int to) const
+{
+    vector<int> chain;
+    if (!isValidPair(from, to))
+    {
+        return chain;
+    }
+
+    // Breadth-first search over sanctions, touching only reached kingdoms
+    unordered_map<int, int> previous;
+    vector<int> frontier;
+    previous[from] = -1;
+    frontier.push_back(from);
+    for (size_t i = 0; i < frontier.size() && previous.count(to) == 0; i++)
+    {
+        for (int next : sanctioned[frontier[i]].getItems())
+        {
+            if (previous.count(next) == 0)
+            {
+                previous[next] = frontier[i];
+                frontier.push_back(next);
+            }
+        }
+    }
+
+    if (previous.count(to) == 0)
+    {
+        return chain;
+    }
+    for (int current = to; current != -1; current = previous[current])
+    {
+        chain.push_back(current);
+    }
+    return vector<int>(chain.rbegin(), chain.rend());
+}
+
+// Count, pair keys, then five numbers per tie. Used by the undo history;
+// treaty ids stay valid because the registry only ever grows.
+string DiplomacyNetwork::serialize() const
+{
+    vector<unsigned long long> keys;
+    vector<int> values;
+    for (const auto& entry : ties)
+    {
+        const DiplomaticTie& tie = entry.second;
+        keys.push_back(entry.first);
+        values.push_back(tie.relations);
+        values.push_back(tie.treatyId);
+        values.push_back(tie.isAlliance);
+        values.push_back(tie.sanctionsAtoB);
+        values.push_back(tie.sanctionsBtoA);
+    }
+    int count = (int)keys.size();
+    string data((const char*)&count, sizeof(count));
+    appendArray(data, keys);
+    appendArray(data, values);
+    return data;
+}
+
+bool DiplomacyNetwork::deserialize(const string& data)
+{
+    int count;
+    if (data.size() < sizeof(count))
+    {
+        return false;
+    }
+    memcpy(&count, data.data(), sizeof(count));
+    if (count < 0 || data.size() != sizeof(count) + (size_t)count * (sizeof(unsigned long long) + 5 * sizeof(int)))
+    {
+        return false;
+    }
+    vector<unsigned long long> keys;
+    vector<int> values;
+    const char* in = data.data() + sizeof(count);
+    readArray(in, keys, count);
+    readArray(in, values, count * 5);
+
+    ties.clear();
+    for (int id = 0; id < (int)kingdomNames.size(); id++)
+    {
+        allies[id] = KingdomSet();
+        enemies[id] = KingdomSet();
+        sanctioned[id] = KingdomSet();
+    }
+    for (int i = 0; i < count; i++)
+    {
+        const int* v = &values[i * 5];
+        DiplomaticTie tie = {v[0], v[1], v[2] != 0, v[3], v[4]};
+        int low = (int)(keys[i] >> 32);
+        int high = (int)(keys[i] & 0xffffffffULL);
+        ties[keys[i]] = tie;
+        updateStanding(low, high, tie);
+        if (tie.sanctionsAtoB > 0) sanctioned[low].insert(high);
+        if (tie.sanctionsBtoA > 0) sanctioned[high].insert(low);
+    }
+    return true;
+}
+
+// Ninth: Implement Communication class methods
+Communication::Communication()
+{
+    messageCount = 0;  // Start with no messages
+    for (int i = 0; i < 5; i++)
+    {
+        messages[i] = "";  // Clear message array
+    }
+    Visual::printMessage("Communication initialized with no messages.");
+}
+
+Communication::~Communication()
+{
+    // No dynamic memory to free
+    Visual::printMessage("Communication cleanup done.");
+}
+
+void Communication::sendMessage(const string& msg)
+{
+    MemoryScope scope(MEMORY_COMMUNICATION, "Communication::sendMessage");
+    if (messageCount < 5)
+    {
+        messages[messageCount] = msg;
+        messageCount++;
+        Visual::printMessage(VFMT("Sent message: {}."), msg);
+    }
+    else
+    {
+        Visual::printMessage("Error: Message limit reached!");
+    }
+}
+
+void Communication::showMessages() const
+{
+    if (messageCount == 0)
+    {
+        Visual::printMessage("No messages.");
+        return;
+    }
+    Visual::printMessage("Messages:");
+    for (int i = 0; i < messageCount; i++)
+    {
+        Visual::printMessage(VFMT("- {}"), messages[i]);
+    }
+}
+
+string Communication::getMessage(int index) const
+{
+    if (index >= 0 && index < messageCount)
+    {
+        return messages[index];
+    }
+    return "Invalid message index";
+}
+
+// TileMap class implementation
+// Output per turn of each building on each terrain; 0 means it cannot be built there
+const unsigned char TileMap::YIELDS[BUILDING_COUNT][TERRAIN_COUNT] = {
+    // Plains, forest, hills, mountains, water
+    {0, 0, 0, 0, 0},  // None
+    {5, 2, 3, 0, 0},  // Farm
+    {1, 5, 2, 1, 0},  // Lumber mill
+    {0, 0, 4, 5, 0},  // Quarry
+    {0, 0, 2, 5, 0},  // Mine
+    {2, 2, 2, 2, 0}   // Smithy
+};
+
+TileMap::TileMap(int w, int h) {
+    MemoryScope scope(MEMORY_TERRITORY, "TileMap::TileMap");
+    // Round up to whole chunks
+    chunksX = (w + MapChunk::SIZE - 1) / MapChunk::SIZE;
+    chunksY = (h + MapChunk::SIZE - 1) / MapChunk::SIZE;
+    width = chunksX * MapChunk::SIZE;
+    height = chunksY * MapChunk::SIZE;
+    chunks.resize((size_t)chunksX * chunksY);
+    for (MapChunk& chunk : chunks) {
+        memset(chunk.terrain, TERRAIN_PLAINS, sizeof(chunk.terrain));
+        memset(chunk.building, BUILDING_NONE, sizeof(chunk.building));
+        memset(chunk.yield, 0, sizeof(chunk.yield));
+        memset(chunk.production, 0, sizeof(chunk.production));
+        chunk.revision = 0;
+        chunk.isDirty = false;
+    }
+    memset(production, 0, sizeof(production));
+    revision = 0;
+}
+
+void TileMap::markDirty(MapChunk& chunk) {
+    if (!chunk.isDirty) {
+        chunk.isDirty = true;
+        dirtyChunks.push_back((int)(&chunk - chunks.data()));
+    }
+}
+
+void TileMap::generate(unsigned long long seed) {
+    GameRandom mapRandom(seed ^ 0x6D61705F73656564ULL);
+
+    // Terrain comes in 8x8 patches
+    static const int PATCH = 8;
+    for (int py = 0; py < height; py += PATCH) {
+        for (int px = 0; px < width; px += PATCH) {
+            int roll = mapRandom.nextInt(100);
+            int terrain = roll < 45 ? TERRAIN_PLAINS : roll < 70 ? TERRAIN_FOREST :
+                roll < 85 ? TERRAIN_HILLS : roll < 93 ? TERRAIN_MOUNTAINS : TERRAIN_WATER;
+            for (int y = py; y < py + PATCH && y < height; y++) {
+                for (int x = px; x < px + PATCH && x < width; x++) {
+                    setTerrain(x, y, terrain);
+                }
+            }
+        }
+    }
+
+    // Starting buildings: farms for 50 food, then one of each other kind
+    static const int STARTING[][2] = {
+        {BUILDING_FARM, 50}, {BUILDING_LUMBER_MILL, 5}, {BUILDING_QUARRY, 4},
+        {BUILDING_MINE, 2}, {BUILDING_SMITHY, 2}
+    };
+    for (const int* start : STARTING) {
+        int produced = 0;
+        for (int tries = 0; produced < start[1] && tries < 4096; tries++) {
+            int x = mapRandom.nextInt(width);
+            int y = mapRandom.nextInt(height);
+            if (getBuilding(x, y) == BUILDING_NONE && build(x, y, start[0])) {
+                produced += getYield(start[0], getTerrain(x, y));
+            }
+        }
+    }
+    updateProduction();
+}
+
+bool TileMap::setTerrain(int x, int y, int terrain) {
+    if (!isInside(x, y) || terrain < 0 || terrain >= TERRAIN_COUNT) {
+        return false;
+    }
+    MapChunk& chunk = chunkAt(x, y);
+    int i = tileIndex(x, y);
+    chunk.terrain[i] = (unsigned char)terrain;
+    chunk.yield[i] = YIELDS[chunk.building[i]][terrain];
+    chunk.revision++;
+    revision++;
+    markDirty(chunk);
+    return true;
+}
+
+bool TileMap::build(int x, int y, int building) {
+    if (!isInside(x, y) || building < 0 || building >= BUILDING_COUNT) {
+        return false;
+    }
+    MapChunk& chunk = chunkAt(x, y);
+    int i = tileIndex(x, y);
+    if (building != BUILDING_NONE && YIELDS[building][chunk.terrain[i]] == 0) {
+        return false;  // Would produce nothing on this terrain
+    }
+    chunk.building[i] = (unsigned char)building;
+    chunk.yield[i] = YIELDS[building][chunk.terrain[i]];
+    chunk.revision++;
+    revision++;
+    markDirty(chunk);
+    return true;
+}
+
+// Sums yield per building over one chunk
+void TileMap::sumChunk(MapChunk& chunk) {
+    memset(chunk.production, 0, sizeof(chunk.production));
+    int i = 0;
+#ifdef USE_SSE2
+    // 16 tiles at a time: compare building ids, mask the yields, widen and add
+    __m128i sums[BUILDING_COUNT];
+    __m128i ids[BUILDING_COUNT];
+    for (int b = 1; b < BUILDING_COUNT; b++) {
+        sums[b] = _mm_setzero_si128();
+        ids[b] = _mm_set1_epi8((char)b);
+    }
+    const __m128i ones = _mm_set1_epi16(1);
+    for (; i + 16 <= MapChunk::TILES; i += 16) {
+        __m128i buildings = _mm_load_si128((const __m128i*)(chunk.building + i));
+        __m128i yieldLow = _mm_load_si128((const __m128i*)(chunk.yield + i));
+        __m128i yieldHigh = _mm_load_si128((const __m128i*)(chunk.yield + i + 8));
+        for (int b = 1; b < BUILDING_COUNT; b++) {
+            __m128i match = _mm_cmpeq_epi8(buildings, ids[b]);
+            __m128i low = _mm_and_si128(_mm_unpacklo_epi8(match, match), yieldLow);
+            __m128i high = _mm_and_si128(_mm_unpackhi_epi8(match, match), yieldHigh);
+            sums[b] = _mm_add_epi32(sums[b], _mm_madd_epi16(_mm_add_epi16(low, high), ones));
+        }
+    }
+    for (int b = 1; b < BUILDING_COUNT; b++) {
+        int lanes[4];
+        _mm_storeu_si128((__m128i*)lanes, sums[b]);
+        chunk.production[b] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+    for (; i < MapChunk::TILES; i++) {
+        chunk.production[chunk.building[i]] += chunk.yield[i];
+    }
+    chunk.production[BUILDING_NONE] = 0;
+}
+
+void TileMap::updateProduction() {
+    for (int index : dirtyChunks) {
+        MapChunk& chunk = chunks[index];
+        for (int b = 0; b < BUILDING_COUNT; b++) {
+            production[b] -= chunk.production[b];
+        }
+        sumChunk(chunk);
+        for (int b = 0; b < BUILDING_COUNT; b++) {
+            production[b] += chunk.production[b];
+        }
+        chunk.isDirty = false;
+    }
+    dirtyChunks.clear();
+}
+
+// CaravanRouter class implementation
+int CaravanRoute::getAttackProbability(int securityPercent) const {
+    if (!isFound) {
+        return 100;
+    }
+    // Insecure routes scale the danger up: 20% -> 3x, 50% -> 6x
+    long long risk = (long long)danger * (10 + securityPercent) / 10;
+    return (int)(risk * 100 / (risk + 10000));
+}
+
+CaravanRouter::CaravanRouter(const TileMap& m) : map(m) {
+    MemoryScope scope(MEMORY_TERRITORY, "CaravanRouter::CaravanRouter");
+    mapRevision = map.getRevision();
+    clusters.resize((size_t)map.getChunksX() * map.getChunksY());
+    clusterRoutes.resize(clusters.size());
+    for (int c = 0; c < (int)clusters.size(); c++) {
+        buildPortals(c);
+    }
+    tileCost.resize(MapChunk::TILES);
+    tileDanger.resize(MapChunk::TILES);
+    tileLength.resize(MapChunk::TILES);
+    size_t nodes = clusters.size() * MAX_PORTALS + 1;  // Plus the goal
+    nodeCost.resize(nodes);
+    nodeDanger.resize(nodes);
+    nodeLength.resize(nodes);
+    nodeParent.resize(nodes);
+    nodeStamp.assign(nodes, 0);
+    stamp = 0;
+    searchedNodes = 0;
+}
+
+int CaravanRouter::stepCost(int terrain, int building) {
+    if (terrain == TERRAIN_WATER) {
+        return 0;
+    }
+    if (building != BUILDING_NONE) {
+        return 1;  // Roads through settled land
+    }
+    static const int COSTS[TERRAIN_COUNT] = {2, 3, 4, 8, 0};
+    return COSTS[terrain];
+}
+
+int CaravanRouter::stepDanger(int terrain, int building) {
+    if (building != BUILDING_NONE) {
+        return 0;
+    }
+    static const int DANGERS[TERRAIN_COUNT] = {5, 20, 12, 30, 0};
+    return DANGERS[terrain];
+}
+
+int CaravanRouter::clusterOf(int x, int y) const {
+    return (y / MapChunk::SIZE) * map.getChunksX() + x / MapChunk::SIZE;
+}
+
+int CaravanRouter::portalNode(int cluster, int side, int sideIndex) const {
+    return cluster * MAX_PORTALS + clusters[cluster].sideStart[side] + sideIndex;
+}
+
+// Places one portal in the middle of every open stretch of each border.
+// Both clusters scan a shared border the same way, so their portals pair up.
+void CaravanRouter::buildPortals(int cluster) {
+    Cluster& cl = clusters[cluster];
+    int cx = cluster % map.getChunksX();
+    int cy = cluster / map.getChunksX();
+    int ox = cx * MapChunk::SIZE;
+    int oy = cy * MapChunk::SIZE;
+    const int last = MapChunk::SIZE - 1;
+    const bool hasNeighbour[4] = {cx + 1 < map.getChunksX(), cx > 0, cy + 1 < map.getChunksY(), cy > 0};
+    const int insideX[4] = {ox + last, ox, ox, ox};
+    const int insideY[4] = {oy, oy, oy + last, oy};
+    const int stepX[4] = {0, 0, 1, 1};  // Direction along the border
+    const int stepY[4] = {1, 1, 0, 0};
+    const int outX[4] = {1, -1, 0, 0};  // Direction into the neighbour
+    const int outY[4] = {0, 0, 1, -1};
+
+    cl.portals.clear();
+    for (int side = 0; side < 4; side++) {
+        cl.sideStart[side] = (int)cl.portals.size();
+        if (!hasNeighbour[side]) {
+            continue;
+        }
+        int runStart = -1;
+        for (int i = 0; i <= MapChunk::SIZE; i++) {
+            bool isOpen = false;
+            if (i < MapChunk::SIZE) {
+                int x = insideX[side] + stepX[side] * i;
+                int y = insideY[side] + stepY[side] * i;
+                isOpen = stepCost(map.getTerrain(x, y), map.getBuilding(x, y)) > 0 &&
+                    stepCost(map.getTerrain(x + outX[side], y + outY[side]),
+                             map.getBuilding(x + outX[side], y + outY[side])) > 0;
+            }
+            if (isOpen && runStart < 0) {
+                runStart = i;
+            }
+            else if (!isOpen && runStart >= 0) {
+                int middle = (runStart + i - 1) / 2;
+                Portal portal;
+                portal.x = (short)(insideX[side] + stepX[side] * middle);
+                portal.y = (short)(insideY[side] + stepY[side] * middle);
+                portal.side = side;
+                portal.sideIndex = (int)cl.portals.size() - cl.sideStart[side];
+                cl.portals.push_back(portal);
+                runStart = -1;
+            }
+        }
+    }
+    cl.sideStart[4] = (int)cl.portals.size();
+    cl.cost.clear();
+    cl.danger.clear();
+    cl.length.clear();
+    cl.revision = map.getChunkRevision(cluster);
+    cl.hasEdges = false;
+}
+
+// Paths between every pair of portals that stay inside the cluster
+void CaravanRouter::buildEdges(int cluster) {
+    Cluster& cl = clusters[cluster];
+    int count = (int)cl.portals.size();
+    cl.cost.assign(count * count, -1);
+    cl.danger.assign(count * count, 0);
+    cl.length.assign(count * count, 0);
+    for (int i = 0; i < count; i++) {
+        searchCluster(cluster, cl.portals[i].x, cl.portals[i].y);
+        for (int j = 0; j < count; j++) {
+            int t = tileIndexOf(cl.portals[j].x, cl.portals[j].y);
+            cl.cost[i * count + j] = tileCost[t];
+            cl.danger[i * count + j] = tileDanger[t];
+            cl.length[i * count + j] = tileLength[t];
+        }
+    }
+    cl.hasEdges = true;
+}
+
+// Dijkstra from one tile over the tiles of its cluster
+void CaravanRouter::searchCluster(int cluster, int x, int y) {
+    int ox = (cluster % map.getChunksX()) * MapChunk::SIZE;
+    int oy = (cluster / map.getChunksX()) * MapChunk::SIZE;
+    static const int DX[4] = {1, -1, 0, 0};
+    static const int DY[4] = {0, 0, 1, -1};
+
+    tileCost.assign(MapChunk::TILES, -1);
+    int start = tileIndexOf(x, y);
+    tileCost[start] = 0;
+    tileDanger[start] = 0;
+    tileLength[start] = 0;
+    SearchQueue queue;
+    queue.push(make_pair(0, start));
+    while (!queue.empty()) {
+        int cost = queue.top().first;
+        int tile = queue.top().second;
+        queue.pop();
+        if (cost > tileCost[tile]) {
+            continue;  // Stale entry
+        }
+        int tx = tile % MapChunk::SIZE;
+        int ty = tile / MapChunk::SIZE;
+        for (int d = 0; d < 4; d++) {
+            int nx = tx + DX[d];
+            int ny = ty + DY[d];
+            if (nx < 0 || ny < 0 || nx >= MapChunk::SIZE || ny >= MapChunk::SIZE) {
+                continue;
+            }
+            int terrain = map.getTerrain(ox + nx, oy + ny);
+            int building = map.getBuilding(ox + nx, oy + ny);
+            int step = stepCost(terrain, building);
+            if (step == 0) {
+                continue;
+            }
+            int next = ny * MapChunk::SIZE + nx;
+            if (tileCost[next] < 0 || cost + step < tileCost[next]) {
+                tileCost[next] = cost + step;
+                tileDanger[next] = tileDanger[tile] + stepDanger(terrain, building);
+                tileLength[next] = tileLength[tile] + 1;
+                queue.push(make_pair(cost + step, next));
+            }
+        }
+    }
+}
+
+// Rebuilds the clusters whose chunks were edited since the last query
+void CaravanRouter::syncMap() {
+    if (map.getRevision() == mapRevision) {
+        return;
+    }
+    mapRevision = map.getRevision();
+    vector<int> changed;
+    for (int c = 0; c < (int)clusters.size(); c++) {
+        if (clusters[c].revision != map.getChunkRevision(c)) {
+            changed.push_back(c);
+        }
+    }
+    for (int c : changed) {
+        invalidateCluster(c);
+    }
+}
+
+// A changed chunk also changes the borders of its neighbours
+void CaravanRouter::invalidateCluster(int cluster) {
+    int chunksX = map.getChunksX();
+    int cx = cluster % chunksX;
+    int cy = cluster / chunksX;
+    int affected[5] = {
+        cluster,
+        cx + 1 < chunksX ? cluster + 1 : -1,
+        cx > 0 ? cluster - 1 : -1,
+        cy + 1 < map.getChunksY() ? cluster + chunksX : -1,
+        cy > 0 ? cluster - chunksX : -1
+    };
+    for (int c : affected) {
+        if (c < 0) {
+            continue;
+        }
+        buildPortals(c);
+        for (unsigned long long key : clusterRoutes[c]) {
+            auto found = cache.find(key);
+            if (found != cache.end()) {
+                cacheOrder.erase(found->second);
+                cache.erase(found);
+            }
+        }
+        clusterRoutes[c].clear();
+    }
+}
+
+CaravanRoute CaravanRouter::search(int startX, int startY, int goalX, int goalY) {
+    CaravanRoute route;
+    int startCluster = clusterOf(startX, startY);
+    int goalCluster = clusterOf(goalX, goalY);
+    searchedNodes = 0;
+
+    if (startCluster == goalCluster) {
+        searchCluster(startCluster, startX, startY);
+        int t = tileIndexOf(goalX, goalY);
+        if (tileCost[t] >= 0) {
+            route.isFound = true;
+            route.cost = tileCost[t];
+            route.danger = tileDanger[t];
+            route.length = tileLength[t];
+            route.waypoints.push_back(make_pair((short)startX, (short)startY));
+            route.waypoints.push_back(make_pair((short)goalX, (short)goalY));
+            return route;
+        }
+    }
+
+    // Portal to goal costs, taken from a search outward from the goal.
+    // Entering the goal replaces entering the portal.
+    int toGoalCost[MAX_PORTALS];
+    int toGoalDanger[MAX_PORTALS];
+    int toGoalLength[MAX_PORTALS];
+    const Cluster& last = clusters[goalCluster];
+    int goalStep = stepCost(map.getTerrain(goalX, goalY), map.getBuilding(goalX, goalY));
+    int goalDanger = stepDanger(map.getTerrain(goalX, goalY), map.getBuilding(goalX, goalY));
+    searchCluster(goalCluster, goalX, goalY);
+    for (int j = 0; j < (int)last.portals.size(); j++) {
+        int px = last.portals[j].x;
+        int py = last.portals[j].y;
+        int t = tileIndexOf(px, py);
+        toGoalCost[j] = tileCost[t] < 0 ? -1 :
+            tileCost[t] - stepCost(map.getTerrain(px, py), map.getBuilding(px, py)) + goalStep;
+        toGoalDanger[j] = tileDanger[t] - stepDanger(map.getTerrain(px, py), map.getBuilding(px, py)) + goalDanger;
+        toGoalLength[j] = tileLength[t];
+    }
+
+    stamp++;
+    const int goalNode = (int)clusters.size() * MAX_PORTALS;
+    SearchQueue open;
+    // Manhattan distance is a lower bound since no step costs less than 1
+    auto estimate = [&](int node) {
+        if (node == goalNode) {
+            return 0;
+        }
+        const Portal& p = clusters[node / MAX_PORTALS].portals[node % MAX_PORTALS];
+        return abs(p.x - goalX) + abs(p.y - goalY);
+    };
+    auto relax = [&](int node, int cost, int danger, int length, int parent) {
+        if (nodeStamp[node] == stamp && nodeCost[node] <= cost) {
+            return;
+        }
+        nodeStamp[node] = stamp;
+        nodeCost[node] = cost;
+        nodeDanger[node] = danger;
+        nodeLength[node] = length;
+        nodeParent[node] = parent;
+        open.push(make_pair(cost + estimate(node), node));
+    };
+
+    searchCluster(startCluster, startX, startY);
+    const Cluster& first = clusters[startCluster];
+    for (int i = 0; i < (int)first.portals.size(); i++) {
+        int t = tileIndexOf(first.portals[i].x, first.portals[i].y);
+        if (tileCost[t] >= 0) {
+            relax(startCluster * MAX_PORTALS + i, tileCost[t], tileDanger[t], tileLength[t], -1);
+        }
+    }
+
+    while (!open.empty()) {
+        int node = open.top().second;
+        int priority = open.top().first;
+        open.pop();
+        if (priority != nodeCost[node] + estimate(node)) {
+            continue;  // Stale entry
+        }
+        if (node == goalNode) {
+            break;
+        }
+        searchedNodes++;
+
+        int c = node / MAX_PORTALS;
+        int i = node % MAX_PORTALS;
+        int cost = nodeCost[node];
+        int danger = nodeDanger[node];
+        int length = nodeLength[node];
+        if (c == goalCluster && toGoalCost[i] >= 0) {
+            relax(goalNode, cost + toGoalCost[i], danger + toGoalDanger[i], length + toGoalLength[i], node);
+        }
+
+        // Step across the border
+        const Portal portal = clusters[c].portals[i];
+        static const int NEIGHBOUR_DX[4] = {1, -1, 0, 0};
+        static const int NEIGHBOUR_DY[4] = {0, 0, 1, -1};
+        int neighbour = c + NEIGHBOUR_DX[portal.side] + NEIGHBOUR_DY[portal.side] * map.getChunksX();
+        int partner = portalNode(neighbour, portal.side ^ 1, portal.sideIndex);
+        const Portal& across = clusters[neighbour].portals[partner % MAX_PORTALS];
+        int terrain = map.getTerrain(across.x, across.y);
+        int building = map.getBuilding(across.x, across.y);
+        relax(partner, cost + stepCost(terrain, building), danger + stepDanger(terrain, building), length + 1, node);
+
+        // Move to the other portals of this cluster
+        if (!clusters[c].hasEdges) {
+            buildEdges(c);
+        }
+        const Cluster& cl = clusters[c];
+        int count = (int)cl.portals.size();
+        for (int j = 0; j < count; j++) {
+            int edge = i * count + j;
+            if (j != i && cl.cost[edge] >= 0) {
+                relax(c * MAX_PORTALS + j, cost + cl.cost[edge], danger + cl.danger[edge], length + cl.length[edge], node);
+            }
+        }
+    }
+
+    if (nodeStamp[goalNode] != stamp) {
+        return route;  // Not reachable
+    }
+    route.isFound = true;
+    route.cost = nodeCost[goalNode];
+    route.danger = nodeDanger[goalNode];
+    route.length = nodeLength[goalNode];
+    route.waypoints.push_back(make_pair((short)goalX, (short)goalY));
+    for (int node = nodeParent[goalNode]; node != -1; node = nodeParent[node]) {
+        const Portal& p = clusters[node / MAX_PORTALS].portals[node % MAX_PORTALS];
+        route.waypoints.push_back(make_pair(p.x, p.y));
+    }
+    route.waypoints.push_back(make_pair((short)startX, (short)startY));
+    reverse(route.waypoints.begin(), route.waypoints.end());
+    return route;
+}
+
+CaravanRoute CaravanRouter::findRoute(int startX, int startY, int goalX, int goalY) {
+    if (!map.isInside(startX, startY) || !map.isInside(goalX, goalY) ||
+        stepCost(map.getTerrain(startX, startY), map.getBuilding(startX, startY)) == 0 ||
+        stepCost(map.getTerrain(goalX, goalY), map.getBuilding(goalX, goalY)) == 0) {
+        return CaravanRoute();
+    }
+    MemoryScope scope(MEMORY_TERRITORY, "CaravanRouter::findRoute");
+    syncMap();
+
+    unsigned long long key = ((unsigned long long)startX << 48) | ((unsigned long long)startY << 32) |
+        ((unsigned long long)goalX << 16) | (unsigned long long)goalY;
+    auto found = cache.find(key);
+    if (found != cache.end()) {
+        cacheOrder.splice(cacheOrder.begin(), cacheOrder, found->second);
+        searchedNodes = 0;
+        return found->second->second;
+    }
+
+    CaravanRoute route = search(startX, startY, goalX, goalY);
+    if (!route.isFound) {
+        return route;  // Not cached, since any edit could open a way
+    }
+    if ((int)cache.size() >= MAX_CACHED_ROUTES) {
+        cache.erase(cacheOrder.back().first);
+        cacheOrder.pop_back();
+    }
+    cacheOrder.push_front(CachedRoute(key, route));
+    cache[key] = cacheOrder.begin();
+    for (const pair<short, short>& point : route.waypoints) {
+        vector<unsigned long long>& keys = clusterRoutes[clusterOf(point.first, point.second)];
+        keys.push_back(key);
+        if ((int)keys.size() > 2 * MAX_CACHED_ROUTES) {
+            // Forget keys of routes that were already evicted
+            vector<unsigned long long> live;
+            for (unsigned long long k : keys) {
+                if (cache.count(k)) {
+                    live.push_back(k);
+                }
+            }
+            keys.swap(live);
+        }
+    }
+    return route;
+}
+
+// Closest passable tile, searching outward ring by ring
+bool CaravanRouter::nearestPassable(int& x, int& y) const {
+    int limit = map.getWidth() > map.getHeight() ? map.getWidth() : map.getHeight();
+    for (int radius = 0; radius < limit; radius++) {
+        for (int dy = -radius; dy <= radius; dy++) {
+            for (int dx = -radius; dx <= radius; dx++) {
+                if (abs(dx) != radius && abs(dy) != radius) {
+                    continue;  // Inside the ring
+                }
+                int nx = x + dx;
+                int ny = y + dy;
+                if (map.isInside(nx, ny) && stepCost(map.getTerrain(nx, ny), map.getBuilding(nx, ny)) > 0) {
+                    x = nx;
+                    y = ny;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+CaravanRoute CaravanRouter::findTradeRoute() {
+    int capitalX = map.getWidth() / 2;
+    int capitalY = map.getHeight() / 2;
+    int postX = map.getWidth() - 1;
+    int postY = map.getHeight() / 2;
+    if (!nearestPassable(capitalX, capitalY) || !nearestPassable(postX, postY)) {
+        return CaravanRoute();
+    }
+    return findRoute(capitalX, capitalY, postX, postY);
+}
+
+// KingdomStatus class implementation
+KingdomStatus::KingdomStatus() : snapshot() {
+    for (int i = 0; i < SOURCE_COUNT; i++) {
+        seen[i] = 0;
+    }
+    markAllDirty();
+}
+
+void KingdomStatus::markAllDirty() {
+    for (int i = 0; i < STATUS_SECTION_COUNT; i++) {
+        dirty[i] = true;
+    }
+}
+
+const char* KingdomStatus::getSectionTitle(int section) {
+    static const char* titles[STATUS_SECTION_COUNT] = {
+        "Basic Information", "Social Classes", "Economy & Military",
+        "Resources", "Politics & Diplomacy"
+    };
+    return titles[section];
+}
+
+int KingdomStatus::refresh(Kingdom& kingdom) {
+    MemoryScope scope(kingdom.getMemoryAccount(), MEMORY_STATUS, "KingdomStatus::refresh");
+    // Sections each source feeds, as bit masks over StatusSection
+    static const unsigned feeds[SOURCE_COUNT] = {
+        (1u << STATUS_BASIC) | (1u << STATUS_SOCIAL),      // SOURCE_PEOPLE
+        1u << STATUS_ECONOMY,                              // SOURCE_ECONOMY
+        1u << STATUS_ECONOMY,                              // SOURCE_ARMY
+        1u << STATUS_ECONOMY,                              // SOURCE_BANK
+        1u << STATUS_RESOURCES,                            // SOURCE_MARKET
+        1u << STATUS_POLITICS,                             // SOURCE_POLITICS
+        1u << STATUS_POLITICS,                             // SOURCE_DIPLOMACY
+        1u << STATUS_BASIC,                                // SOURCE_TURN
+        1u << STATUS_ECONOMY,                              // SOURCE_GOLD
+        1u << STATUS_RESOURCES,                            // SOURCE_WOOD
+        1u << STATUS_RESOURCES,                            // SOURCE_STONE
+        1u << STATUS_RESOURCES,                            // SOURCE_IRON
+        (1u << STATUS_SOCIAL) | (1u << STATUS_RESOURCES)   // SOURCE_FOOD
+    };
+
+    const ResourceLedger& ledger = kingdom.getLedger();
+    int current[SOURCE_COUNT] = {
+        kingdom.getPeople().getRevision(),
+        kingdom.getEconomy().getRevision(),
+        kingdom.getArmy().getRevision(),
+        kingdom.getBank().getRevision(),
+        kingdom.getMarket().getRevision(),
+        kingdom.getPolitics().getRevision(),
+        kingdom.getDiplomacy().getRevision(),
+        kingdom.getTurn(),
+        ledger.getRevision(LEDGER_GOLD),
+        ledger.getRevision(LEDGER_WOOD),
+        ledger.getRevision(LEDGER_STONE),
+        ledger.getRevision(LEDGER_IRON),
+        ledger.getRevision(LEDGER_FOOD)
+    };
+
+    unsigned changed = 0;
+    for (int i = 0; i < SOURCE_COUNT; i++) {
+        if (current[i] != seen[i]) {
+            changed |= feeds[i];
+            seen[i] = current[i];
+        }
+    }
+
+    int rebuilt = 0;
+    for (int i = 0; i < STATUS_SECTION_COUNT; i++) {
+        if (dirty[i] || (changed & (1u << i))) {
+            readSection(kingdom, i);
+            formatSection(i);
+            dirty[i] = false;
+            rebuilt++;
+        }
+    }
+    return rebuilt;
+}
+
+void KingdomStatus::readSection(Kingdom& kingdom, int section) {
+    StatusSnapshot& s = snapshot;
+    const ResourceLedger& ledger = kingdom.getLedger();
+    switch (section) {
+    case STATUS_BASIC:
+        s.name = kingdom.getName();
+        s.turn = kingdom.getTurn();
+        s.totalPeople = kingdom.getPeople().getTotalPeople();
+        break;
+    case STATUS_SOCIAL: {
+        const Population& people = kingdom.getPeople();
+        s.peasants = people.getPeasants();
+        s.merchants = people.getMerchants();
+        s.nobility = people.getNobility();
+        s.military = people.getMilitary();
+        s.foodSupply = people.getFoodSupply();
+        s.sick = people.getSick();
+        s.peasantsUnhappy = people.arePeasantsUnhappy();
+        s.nobilityTooSmall = people.isNobilityTooSmall();
+        break;
+    }
+    case STATUS_ECONOMY: {
+        const Economy& economy = kingdom.getEconomy();
+        const Army& army = kingdom.getArmy();
+        s.gold = economy.getGold();
+        s.inflationRate = economy.getInflationRate();
+        s.isRecession = economy.getIsRecession();
+        s.publicServices = economy.getPublicServices();
+        s.armySize = army.getSize();
+        s.armyMorale = army.getMorale();
+        s.trainingLevel = army.getTrainingLevel();
+        s.equipment = army.getEquipment();
+        s.soldiersPaid = army.getIsPaid();
+        s.debt = kingdom.getBank().getLoanAmount();
+        s.loanCount = kingdom.getBank().getLoans().getCount();
+        s.loansInArrears = kingdom.getBank().getLoans().getArrearsCount();
+        break;
+    }
+    case STATUS_RESOURCES:
+        s.wood = (int)ledger.get(LEDGER_WOOD);
+        s.stone = (int)ledger.get(LEDGER_STONE);
+        s.iron = (int)ledger.get(LEDGER_IRON);
+        s.food = (int)ledger.get(LEDGER_FOOD);
+        s.priceMultiplier = kingdom.getMarket().getPriceMultiplier();
+        break;
+    case STATUS_POLITICS:
+        s.kingName = kingdom.getPolitics().getKingName();
+        s.stability = kingdom.getPolitics().getStability();
+        s.corruptionLevel = kingdom.getPolitics().getCorruptionLevel();
+        s.policies.clear();
+        for (int p = 0; p < POLICY_COUNT; p++) {
+            if (kingdom.getPolitics().hasPolicy(p)) {
+                s.policies += (s.policies.empty() ? "" : ", ") + string(Politics::getPolicyName(p));
+            }
+        }
+        s.treaty = kingdom.getDiplomacy().getTreaty();
+        s.relations = kingdom.getDiplomacy().getRelations();
+        break;
+    }
+}
+
+// Formats doubles the way cout does by default
+static string formatDouble(double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%g", value);
+    return buffer;
+}
+
+void KingdomStatus::formatSection(int section) {
+    const StatusSnapshot& s = snapshot;
+    string& text = sectionText[section];
+    switch (section) {
+    case STATUS_BASIC:
+        text = "Name: " + s.name +
+            "\nTurn: " + to_string(s.turn) +
+            "\nPopulation: " + to_string(s.totalPeople);
+        break;
+    case STATUS_SOCIAL:
+        text = "- Peasants: " + to_string(s.peasants) +
+            "\n- Merchants: " + to_string(s.merchants) +
+            "\n- Nobility: " + to_string(s.nobility) +
+            "\n- Military: " + to_string(s.military) +
+            "\n- Food Supply: " + to_string(s.foodSupply) +
+            (s.sick > 0 ? "\n- Sick: " + to_string(s.sick) : "");
+        break;
+    case STATUS_ECONOMY:
+        text = "Gold: " + s.gold.toString() +
+            "\nInflation: " + formatRate(s.inflationRate) + "%" + (s.isRecession ? " (recession)" : "") +
+            "\nPublic Services: " + to_string(s.publicServices) +
+            "\nArmy Size: " + to_string(s.armySize) +
+            "\nArmy Morale: " + to_string(s.armyMorale) +
+            "\nTraining Level: " + to_string(s.trainingLevel) +
+            "\nEquipment Quality: " + to_string(s.equipment) +
+            "\nSoldiers Paid: " + (s.soldiersPaid ? "Yes" : "No") +
+            "\nDebt: " + s.debt.toString();
+        if (s.loanCount > 0) {
+            text += " (" + to_string(s.loanCount) + " loans, " + to_string(s.loansInArrears) + " in arrears)";
+        }
+        break;
+    case STATUS_RESOURCES:
+        text = "- Wood: " + to_string(s.wood) +
+            "\n- Stone: " + to_string(s.stone) +
+            "\n- Iron: " + to_string(s.iron) +
+            "\n- Food: " + to_string(s.food) +
+            "\n- Price Multiplier: " + formatDouble(s.priceMultiplier);
+        break;
+    case STATUS_POLITICS:
+        text = "King: " + s.kingName +
+            "\nStability: " + to_string(s.stability) +
+            "\nCorruption Level: " + to_string(s.corruptionLevel) +
+            "\nPolicies: " + (s.policies.empty() ? "None" : s.policies) +
+            "\nTreaty: " + s.treaty +
+            "\nRelations: " + to_string(s.relations);
+        break;
+    }
+}
+
+void KingdomStatus::render() const {
+    for (int i = 0; i < STATUS_SECTION_COUNT; i++) {
+        Visual::printSection(getSectionTitle(i));
+        Visual::printMessage(sectionText[i]);
+    }
+}
+
+// Update Kingdom constructor
+Kingdom::Kingdom(string n) : Kingdom(n, (unsigned long long)time(0))
+{
+}
+
+Kingdom::Kingdom(string n, unsigned long long seed)
+    : memoryAccount(MemoryTracker::openAccount(n.c_str())),
+      constructionScope(memoryAccount, MEMORY_KINGDOM, "Kingdom::Kingdom"),
+      random(seed), territory(64, 64), caravans(territory)
+{
+    name = n;
+    {
+        MemoryScope subsystem(MEMORY_POPULATION);
+        people = new Population(ledger);
+    }
+    {
+        MemoryScope subsystem(MEMORY_ECONOMY);
+        economy = new Economy(ledger);
+    }
+    {
+        MemoryScope subsystem(MEMORY_ARMY);
+        army = new Army(100);
+    }
+    {
+        MemoryScope subsystem(MEMORY_BANK);
+        bank = new Bank();
+    }
+    {
+        MemoryScope subsystem(MEMORY_MARKET);
+        market = new Market(ledger, random);
+    }
+    {
+        MemoryScope subsystem(MEMORY_POLITICS);
+        politics = new Politics(random);
+    }
+    {
+        MemoryScope subsystem(MEMORY_DIPLOMACY);
+        diplomacy = new Diplomacy();
+    }
+    {
+        MemoryScope subsystem(MEMORY_COMMUNICATION);
+        communication = new Communication();
+    }
+    turn = 1;
+    isGameOver = false;
+    {
+        MemoryScope subsystem(MEMORY_TERRITORY);
+        territory.generate(seed);
+        weather.reset(territory.getChunksX() * territory.getChunksY(), seed);  // One climate region per chunk
+    }
+    {
+        MemoryScope subsystem(MEMORY_POPULATION);
+        epidemic.resetForTerritory(territory, seed);
+    }
+    Visual::printSuccess(VFMT("Kingdom {} initialized!"), name);
+    MemoryTracker::endTurn(memoryAccount);  // Construction is not part of the first turn
+    constructionScope.end();
+}
+
+// Update Kingdom destructor
+Kingdom::~Kingdom()
+{
+    delete people;
+    delete economy;
+    delete army;
+    delete bank;
+    delete market;
+    delete politics;
+    delete diplomacy;
+    delete communication;  // Clean up communication
+    MemoryTracker::closeAccount(memoryAccount);  // Reused once everything charged to it is freed
+    Visual::printInfo("Kingdom cleanup done.");
+}
+
+void Kingdom::nextTurn()
+{
+    turn++;
+    MemoryTracker::endTurn(memoryAccount);
+}
+
+void Kingdom::saveGame() const
+{
+    if (!writeSave(captureSaveState(), "score.txt"))
+    {
+        Visual::printError("Error: Cannot write score.txt!");
+        return;
+    }
+    Visual::printSuccess("Game saved to score.txt.");
+}
+
+SaveState Kingdom::captureSaveState() const
+{
+    SaveState state;
+    state.name = name;
+    state.turn = turn;
+    state.totalPeople = people->getTotalPeople();
+    state.gold = economy->getGold();
+    state.armySize = army->getSize();
+    state.armyMorale = army->getMorale();
+    state.loan = bank->getLoanAmount();
+    state.loans = bank->getLoans().serialize();
+    state.messageCount = communication->getMessageCount();
+    for (int i = 0; i < state.messageCount; i++)
+    {
+        state.messages[i] = communication->getMessage(i);
+    }
+    return state;
+}
+
+// Binary fields are stored as hex so the save stays a text file
+static string encodeHex(const string& bytes)
+{
+    static const char DIGITS[] = "0123456789abcdef";
+    string text;
+    text.reserve(bytes.size() * 2);
+    for (unsigned char byte : bytes)
+    {
+        text += DIGITS[byte >> 4];
+        text += DIGITS[byte & 15];
+    }
+    return text;
+}
+
+static int hexDigit(char digit)
+{
+    if (digit >= '0' && digit <= '9') return digit - '0';
+    if (digit >= 'a' && digit <= 'f') return digit - 'a' + 10;
+    return -1;
+}
+
+static bool decodeHex(const string& text, string& bytes)
+{
+    if (text.size() % 2 != 0)
+    {
+        return false;
+    }
+    bytes.resize(text.size() / 2);
+    for (size_t i = 0; i < bytes.size(); i++)
+    {
+        int high = hexDigit(text[i * 2]);
+        int low = hexDigit(text[i * 2 + 1]);
+        if (high < 0 || low < 0)
+        {
+            return false;
+        }
+        bytes[i] = (char)(high << 4 | low);
+    }
+    return true;
+}
+
+// Writes to path + ".tmp" first and renames it over the save only once the
+// data is on disk, so a crash leaves either the old save or the new one.
+string Kingdom::formatSave(const SaveState& state)
+{
+    string text = state.name + "\n" +
+        to_string(state.totalPeople) + "\n" +
+        state.gold.toString() + "\n" +
+        to_string(state.armySize) + "\n" +
+        to_string(state.armyMorale) + "\n" +
+        state.loan.toString() + "\n" +
+        to_string(state.messageCount) + "\n";
+    for (int i = 0; i < state.messageCount; i++)
+    {
+        text += state.messages[i] + "\n";
+    }
+    text += to_string(state.turn) + "\n";  // Newer fields go last so older saves still load
+    text += encodeHex(state.loans) + "\n";
+    return text;
+}
+
+// Flushes a file and waits until the data is on disk
+static bool syncFile(FILE* file)
+{
+    if (fflush(file) != 0)
+    {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// 64-bit file positions, so pack files past 2 GB work where long is 32 bits
+static long long tellFile(FILE* file)
+{
+#ifdef _WIN32
+    return _ftelli64(file);
+#else
+    return (long long)ftello(file);
+#endif
+}
+
+static bool seekFile(FILE* file, long long offset, int origin)
+{
+#ifdef _WIN32
+    return _fseeki64(file, offset, origin) == 0;
+#else
+    return fseeko(file, (off_t)offset, origin) == 0;
+#endif
+}
+
+bool Kingdom::writeSave(const SaveState& state, const string& path)
+{
+    string text = formatSave(state);
+    string temp = path + ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    bool ok = fwrite(text.data(), 1, text.size(), file) == text.size() && syncFile(file);
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+    {
+        remove(temp.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    return MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(temp.c_str(), path.c_str()) == 0;
+#endif
+}
+
+void Kingdom::loadGame(const string& path)
+{
+    ifstream file(path);
+    if (!file.is_open())
+    {
+        Visual::printError(VFMT("Error: Cannot open {} for loading!"), path);
+        return;
+    }
+    SaveState state;
+    if (!readSave(file, state))
+    {
+        Visual::printError(VFMT("Error: {} is damaged!"), path);
+        return;
+    }
+    file.close();
+    applySaveState(state);
+    Visual::printSuccess(VFMT("Game loaded from {}."), path);
+}
+
+void Kingdom::applySaveState(const SaveState& state)
+{
+    name = state.name;
+    turn = state.turn;
+    people->updatePeople(state.totalPeople - people->getTotalPeople());
+    economy->spendGold(state.gold - economy->getGold());
+    delete army;
+    army = new Army(state.armySize);
+    army->train(0);
+    army->paySoldiers(*economy);
+    bank->restoreDebt(state.loans, state.loan);
+    for (int i = 0; i < state.messageCount; i++)
+    {
+        communication->sendMessage(state.messages[i]);
+    }
+    status.markAllDirty();  // Subsystems were replaced wholesale
+}
+
+bool Kingdom::readSave(istream& in, SaveState& state)
+{
+    getline(in, state.name);
+    in >> state.totalPeople >> state.gold >> state.armySize >> state.armyMorale >> state.loan;
+    in >> state.messageCount;
+    if (!in || state.messageCount < 0 || state.messageCount > 5)
+    {
+        return false;
+    }
+    string line;
+    getline(in, line);
+    for (int i = 0; i < state.messageCount; i++)
+    {
+        getline(in, state.messages[i]);
+    }
+    if (!(in >> state.turn) || state.turn < 1)
+    {
+        state.turn = 1;  // Saved before the turn was kept
+        return true;
+    }
+    string loans;
+    LoanBook book;
+    if (in >> loans && (!decodeHex(loans, state.loans) || !book.deserialize(state.loans)))
+    {
+        return false;
+    }
+    return true;
+}
+
+// Add Kingdom weather update method
+void Kingdom::updateWeather() {
+    bool wasHarsh = weather.isHarshWeather();
+    weather.updateWeather(turn, territory);
+    if (weather.isHarshWeather() && !wasHarsh) {
+        Visual::printWarning(VFMT("Weather Alert: {}"), weather.getCurrentCondition());
+        Visual::printInfo(VFMT("Food production will be affected for {} turns."), weather.getDuration());
+    }
+}
+
+// Add Kingdom epidemic methods
+void Kingdom::updateEpidemic() {
+    EpidemicTurnInput input;
+    input.turn = turn;
+    people->splitByClass(input.people);
+    input.publicServices = economy->getPublicServices();
+    long long food = ledger.get(LEDGER_FOOD);
+    int total = people->getTotalPeople();
+    input.foodPercent = total > 0 && food < total ? (int)(food * 100 / total) : 100;
+    long long traded = market->getTradeVolume().getRaw();
+    long long fullTrade = Money(EpidemicModel::FULL_TRADE).getRaw();
+    input.tradeLevel = traded >= fullTrade ? 256 : (int)(traded * 256 / fullTrade);
+
+    EpidemicTurnResult result = epidemic.step(input);
+    people->handlePlague(result.totalDeaths, (int)result.infected);
+}
+
+int Kingdom::startPlague() {
+    int region = random.nextInt(epidemic.getRegionCount());
+    return epidemic.seedOutbreak(region, CITIZEN_PEASANT, 1 + people->getTotalPeople() / 200);
+}
+
+// ClimateModel class implementation
+const short ClimateModel::TRANSITIONS[SEASON_COUNT][CLIMATE_COUNT][CLIMATE_COUNT] = {
+    // To normal, drought, harsh winter, good
+    { {700, 100, 50, 150}, {500, 350, 0, 150}, {600, 0, 250, 150}, {400, 50, 0, 550} },    // Spring
+    { {650, 250, 0, 100}, {350, 600, 0, 50}, {900, 100, 0, 0}, {450, 150, 0, 400} },       // Summer
+    { {700, 100, 100, 100}, {550, 350, 50, 50}, {500, 0, 450, 50}, {500, 50, 50, 400} },  // Autumn
+    { {550, 0, 400, 50}, {600, 200, 200, 0}, {300, 0, 700, 0}, {550, 0, 200, 250} }        // Winter
+};
+const short ClimateModel::SHORT_SPELL[MAX_DURATION] = {400, 300, 150, 100, 50, 0};
+const short ClimateModel::LONG_SPELL[MAX_DURATION] = {100, 150, 250, 250, 150, 100};
+const int ClimateModel::FOOD_PERCENT[CLIMATE_COUNT] = {100, 50, 30, 150};
+
+ClimateModel::Tables::Tables() {
+    for (int s = 0; s < SEASON_COUNT; s++) {
+        for (int from = 0; from < CLIMATE_COUNT; from++) {
+            int sum = 0;
+            for (int to = 0; to < CLIMATE_COUNT; to++) {
+                sum += TRANSITIONS[s][from][to];
+                transition[s][from][to] = (unsigned)((long long)sum * TABLE_ONE / 1000);
+            }
+
+            // Normal spells are long, and so are droughts in summer and harsh winters in winter
+            bool isLong = from == CLIMATE_NORMAL || (from == CLIMATE_DROUGHT && s == SEASON_SUMMER) ||
+                (from == CLIMATE_HARSH_WINTER && s == SEASON_WINTER);
+            const short* spell = isLong ? LONG_SPELL : SHORT_SPELL;
+            sum = 0;
+            for (int d = 0; d < MAX_DURATION; d++) {
+                sum += spell[d];
+                duration[s][from][d] = (unsigned)((long long)sum * TABLE_ONE / 1000);
+            }
+        }
+    }
+}
+
+const ClimateModel::Tables& ClimateModel::tables() {
+    static const Tables built;
+    return built;
+}
+
+// Low-bias 32-bit integer hash. Only 32-bit operations, so the region loop vectorizes.
+static inline unsigned hashRegion(unsigned key, unsigned region) {
+    unsigned h = key ^ (region * 0x9E3779B9u);
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return h;
+}
+
+void ClimateModel::reset(int regionCount, unsigned long long s) {
+    seed = s;
+    condition.assign(regionCount, CLIMATE_NORMAL);
+    remaining.resize(regionCount);
+    unsigned key = (unsigned)mixSeed(seed, 0);  // Turn 0 is never stepped
+    for (int i = 0; i < regionCount; i++) {
+        remaining[i] = (unsigned char)(1 + hashRegion(key, (unsigned)i) % 3);
+    }
+}
+
+void ClimateModel::step(int turn) {
+    const Tables& table = tables();
+    int season = getSeason(turn);
+    const unsigned* transition = table.transition[season][0];
+    const unsigned* duration = table.duration[season][0];
+    unsigned key = (unsigned)mixSeed(seed, (unsigned long long)turn);
+    unsigned char* conditions = condition.data();
+    unsigned char* turnsLeft = remaining.data();
+    int count = getRegionCount();
+
+    unsigned draws[STEP_BLOCK];
+    for (int begin = 0; begin < count; begin += STEP_BLOCK) {
+        // The hashes are plain 32-bit arithmetic over a fixed-size block and vectorize
+        for (int j = 0; j < STEP_BLOCK; j++) {
+            draws[j] = hashRegion(key, (unsigned)(begin + j));
+        }
+
+        // Count the cumulative thresholds each draw passes, without branches
+        int end = count - begin < STEP_BLOCK ? count - begin : STEP_BLOCK;
+        for (int j = 0; j < end; j++) {
+            unsigned from = conditions[begin + j];
+            const unsigned* row = transition + from * CLIMATE_COUNT;
+            unsigned transitionDraw = draws[j] & (TABLE_ONE - 1);
+            unsigned next = (transitionDraw >= row[0]) + (transitionDraw >= row[1]) + (transitionDraw >= row[2]);
+
+            const unsigned* spell = duration + next * MAX_DURATION;
+            unsigned durationDraw = draws[j] >> 16;
+            unsigned length = 1 + (durationDraw >= spell[0]) + (durationDraw >= spell[1]) +
+                (durationDraw >= spell[2]) + (durationDraw >= spell[3]) + (durationDraw >= spell[4]);
+
+            // Masks rather than selects, so the compiler cannot turn the choice into a branch
+            unsigned left = turnsLeft[begin + j];
+            unsigned expired = 0u - (left <= 1);
+            conditions[begin + j] = (unsigned char)((next & expired) | (from & ~expired));
+            turnsLeft[begin + j] = (unsigned char)((length & expired) | ((left - 1) & ~expired));
+        }
+    }
+}
+
+// Count, then each array in turn. Used by the undo history.
+string ClimateModel::serialize() const {
+    int count = getRegionCount();
+    string data((const char*)&count, sizeof(count));
+    appendArray(data, condition);
+    appendArray(data, remaining);
+    return data;
+}
+
+bool ClimateModel::deserialize(const string& data) {
+    int count;
+    if (data.size() < sizeof(count)) {
+        return false;
+    }
+    memcpy(&count, data.data(), sizeof(count));
+    if (count < 0 || data.size() != sizeof(count) + (size_t)count * 2) {
+        return false;
+    }
+    const char* in = data.data() + sizeof(count);
+    readArray(in, condition, count);
+    readArray(in, remaining, count);
+    return true;
+}
+
+const char* ClimateModel::getClimateName(int climate) {
+    static const char* const NAMES[CLIMATE_COUNT] = {"Normal", "Drought", "Harsh Winter", "Good Weather"};
+    return NAMES[climate];
+}
+
+const char* ClimateModel::getSeasonName(int season) {
+    static const char* const NAMES[SEASON_COUNT] = {"Spring", "Summer", "Autumn", "Winter"};
+    return NAMES[season];
+}
+
+// Weather class implementation
+void Weather::updateWeather(int turn, const TileMap& territory) {
+    regions.step(turn);
+
+    // Summarize with the most common condition and its longest remaining spell
+    int counts[CLIMATE_COUNT] = {};
+    int longest[CLIMATE_COUNT] = {};
+    for (int region = 0; region < regions.getRegionCount(); region++) {
+        int climate = regions.getCondition(region);
+        counts[climate]++;
+        if (regions.getRemaining(region) > longest[climate]) {
+            longest[climate] = regions.getRemaining(region);
+        }
+    }
+    int common = CLIMATE_NORMAL;
+    for (int c = 0; c < CLIMATE_COUNT; c++) {
+        if (counts[c] > counts[common]) {
+            common = c;
+        }
+    }
+    currentCondition = ClimateModel::getClimateName(common);
+    duration = longest[common];
+    isHarsh = ClimateModel::isHarshClimate(common);
+
+    long long farms = territory.getProduction(BUILDING_FARM);
+    foodProductionPercent = farms > 0 ? (int)(getFoodProduction(territory) * 100 / farms) :
+        ClimateModel::getFoodPercent(common);
+}
+
+long long Weather::getFoodProduction(const TileMap& territory) const {
+    long long food = 0;
+    for (int region = 0; region < regions.getRegionCount(); region++) {
+        food += (long long)territory.getChunkProduction(region, BUILDING_FARM) *
+            ClimateModel::getFoodPercent(regions.getCondition(region));
+    }
+    return food / 100;
+}
+
+// EpidemicModel class implementation
+const int EpidemicModel::CLASS_CONTACT[CITIZEN_CLASS_COUNT][CITIZEN_CLASS_COUNT] = {
+    // With peasants, merchants, nobles, soldiers
+    {100, 40, 10, 30},  // Peasants
+    {40, 100, 30, 20},  // Merchants travel and meet everyone
+    {10, 30, 60, 10},   // Nobles keep to themselves
+    {30, 20, 10, 120}   // Soldiers share barracks
+};
+
+// Scaled is in 1/65536ths; its fraction rounds up with its own probability
+static inline int roundByDraw(long long scaled, unsigned draw) {
+    return (int)(scaled >> 16) + ((unsigned)(scaled & 0xFFFF) > draw);
+}
+
+void EpidemicModel::reset(const vector<int>& regionShares, const vector<ContactLink>& links, unsigned long long s) {
+    seed = s;
+    regionCount = (int)regionShares.size();
+    share = regionShares;
+    shareTotal = 0;
+    largestRegion = 0;
+    for (int r = 0; r < regionCount; r++) {
+        shareTotal += share[r];
+        if (share[r] > share[largestRegion]) {
+            largestRegion = r;
+        }
+    }
+
+    // Rows hold a self link plus both directions of every link. Links given
+    // twice simply add up.
+    rowStart.assign(regionCount + 1, 0);
+    for (int r = 0; r < regionCount; r++) {
+        rowStart[r + 1]++;
+    }
+    for (const ContactLink& link : links) {
+        rowStart[link.from + 1]++;
+        rowStart[link.to + 1]++;
+    }
+    for (int r = 0; r < regionCount; r++) {
+        rowStart[r + 1] += rowStart[r];
+    }
+    column.resize(rowStart[regionCount]);
+    proximity.resize(rowStart[regionCount]);
+    trade.resize(rowStart[regionCount]);
+    vector<int> next(rowStart.begin(), rowStart.end() - 1);
+    for (int r = 0; r < regionCount; r++) {
+        int e = next[r]++;
+        column[e] = r;
+        proximity[e] = SELF_WEIGHT;
+        trade[e] = 0;
+    }
+    for (const ContactLink& link : links) {
+        int e = next[link.from]++;
+        column[e] = link.to;
+        proximity[e] = (unsigned short)link.proximity;
+        trade[e] = (unsigned short)link.trade;
+        e = next[link.to]++;
+        column[e] = link.from;
+        proximity[e] = (unsigned short)link.proximity;
+        trade[e] = (unsigned short)link.trade;
+    }
+
+    int cells = regionCount * CITIZEN_CLASS_COUNT;
+    susceptible.assign(cells, 0);
+    infected.assign(cells, 0);
+    recovered.assign(cells, 0);
+    contacts.assign(cells * 2, 0);
+    exposedInfected.assign(cells, 0);
+    exposedPeople.assign(cells, 0);
+    blockResults.resize((regionCount + ROW_BLOCK - 1) / ROW_BLOCK);
+}
+
+// One region per chunk, sized by its habitable land. Neighbouring chunks are
+// in contact, and every chunk trades with the largest, its market town.
+void EpidemicModel::resetForTerritory(const TileMap& territory, unsigned long long s) {
+    int chunksX = territory.getChunksX();
+    int chunksY = territory.getChunksY();
+    vector<int> shares(chunksX * chunksY, 0);
+    for (int y = 0; y < territory.getHeight(); y++) {
+        for (int x = 0; x < territory.getWidth(); x++) {
+            int terrain = territory.getTerrain(x, y);
+            if (terrain != TERRAIN_WATER && terrain != TERRAIN_MOUNTAINS) {
+                shares[(y / MapChunk::SIZE) * chunksX + x / MapChunk::SIZE]++;
+            }
+        }
+    }
+    int town = 0;
+    for (int r = 0; r < (int)shares.size(); r++) {
+        if (shares[r] > shares[town]) {
+            town = r;
+        }
+    }
+
+    vector<ContactLink> links;
+    for (int cy = 0; cy < chunksY; cy++) {
+        for (int cx = 0; cx < chunksX; cx++) {
+            int r = cy * chunksX + cx;
+            if (cx + 1 < chunksX) {
+                links.push_back({r, r + 1, PROXIMITY_WEIGHT, 0});
+            }
+            if (cy + 1 < chunksY) {
+                links.push_back({r, r + chunksX, PROXIMITY_WEIGHT, 0});
+            }
+            if (r != town) {
+                links.push_back({r, town, 0, TRADE_WEIGHT});
+            }
+        }
+    }
+    reset(shares, links, s);
+}
+
+int EpidemicModel::seedOutbreak(int region, int socialClass, int count) {
+    if (region < 0 || region >= regionCount || socialClass < 0 || socialClass >= CITIZEN_CLASS_COUNT || count <= 0) {
+        return 0;
+    }
+    int cell = region * CITIZEN_CLASS_COUNT + socialClass;
+    int fallen = count < susceptible[cell] ? count : susceptible[cell];
+    susceptible[cell] -= fallen;
+    infected[cell] += fallen;
+    return fallen;
+}
+
+void EpidemicModel::spreadPeople(const int* people) {
+    for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+        long long current = 0;
+        long long sick = 0;
+        for (int r = 0; r < regionCount; r++) {
+            int cell = r * CITIZEN_CLASS_COUNT + c;
+            current += (long long)susceptible[cell] + infected[cell] + recovered[cell];
+            sick += infected[cell];
+        }
+        long long target = people[c] > 0 ? people[c] : 0;
+        if (current == target) {
+            continue;
+        }
+
+        // Deaths from outside the epidemic fall on the healthy first
+        if (target < current) {
+            long long healthy = current - sick;
+            long long keep = healthy - (current - target);
+            current = 0;
+            for (int r = 0; r < regionCount; r++) {
+                int cell = r * CITIZEN_CLASS_COUNT + c;
+                if (keep >= 0) {
+                    susceptible[cell] = (int)(susceptible[cell] * keep / healthy);
+                    recovered[cell] = (int)(recovered[cell] * keep / healthy);
+                }
+                else {
+                    susceptible[cell] = 0;
+                    recovered[cell] = 0;
+                    infected[cell] = (int)(infected[cell] * target / sick);
+                }
+                current += (long long)susceptible[cell] + infected[cell] + recovered[cell];
+            }
+        }
+
+        // Newcomers, and what rounding left over, settle by share as susceptible
+        long long newcomers = target - current;
+        long long placed = 0;
+        for (int r = 0; r < regionCount && shareTotal > 0; r++) {
+            int settled = (int)(newcomers * share[r] / shareTotal);
+            susceptible[r * CITIZEN_CLASS_COUNT + c] += settled;
+            placed += settled;
+        }
+        if (regionCount > 0) {
+            susceptible[largestRegion * CITIZEN_CLASS_COUNT + c] += (int)(newcomers - placed);
+        }
+    }
+}
+
+// Each link of the product then reads one region's eight counts from one place
+void EpidemicModel::packBlock(int block) {
+    int begin = block * ROW_BLOCK * CITIZEN_CLASS_COUNT;
+    int end = regionCount * CITIZEN_CLASS_COUNT - begin < ROW_BLOCK * CITIZEN_CLASS_COUNT ?
+        regionCount * CITIZEN_CLASS_COUNT : begin + ROW_BLOCK * CITIZEN_CLASS_COUNT;
+    for (int cell = begin; cell < end; cell++) {
+        int region = cell / CITIZEN_CLASS_COUNT;
+        int c = cell % CITIZEN_CLASS_COUNT;
+        contacts[region * 2 * CITIZEN_CLASS_COUNT + c] = infected[cell];
+        contacts[(region * 2 + 1) * CITIZEN_CLASS_COUNT + c] = susceptible[cell] + infected[cell] + recovered[cell];
+    }
+}
+
+// One row block of the sparse product: contact-weighted infected and people around each region
+void EpidemicModel::exposeBlock(int block, int tradeLevel) {
+    const int COUNTS = 2 * CITIZEN_CLASS_COUNT;
+    int begin = block * ROW_BLOCK;
+    int end = regionCount - begin < ROW_BLOCK ? regionCount : begin + ROW_BLOCK;
+    for (int r = begin; r < end; r++) {
+        long long sums[COUNTS] = {};
+        for (int e = rowStart[r]; e < rowStart[r + 1]; e++) {
+            long long weight = proximity[e] + (trade[e] * tradeLevel >> 8);
+            const int* counts = &contacts[column[e] * COUNTS];
+            for (int k = 0; k < COUNTS; k++) {
+                sums[k] += weight * counts[k];
+            }
+        }
+        for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+            exposedInfected[r * CITIZEN_CLASS_COUNT + c] = sums[c];
+            exposedPeople[r * CITIZEN_CLASS_COUNT + c] = sums[CITIZEN_CLASS_COUNT + c];
+        }
+    }
+}
+
+void EpidemicModel::stepBlock(int block, const EpidemicTurnInput& input, unsigned key) {
+    // Public services slow the spread and speed recovery; hunger does the opposite
+    int services = input.publicServices < 0 ? 0 : input.publicServices > 100 ? 100 : input.publicServices;
+    int fed = input.foodPercent < 0 ? 0 : input.foodPercent > 100 ? 100 : input.foodPercent;
+    long long transmission = (long long)BASE_TRANSMISSION * (100 - services * 3 / 5) / 100 * (150 - fed / 2) / 100;
+    long long recovery = (long long)BASE_RECOVERY * (50 + services / 2) / 100 * (75 + fed / 4) / 100;
+    long long mortality = (long long)BASE_MORTALITY * (150 - services) / 100 * (150 - fed / 2) / 100;
+
+    BlockResult& result = blockResults[block];
+    result = BlockResult();
+    int begin = block * ROW_BLOCK;
+    int end = regionCount - begin < ROW_BLOCK ? regionCount : begin + ROW_BLOCK;
+    for (int r = begin; r < end; r++) {
+        long long prevalence[CITIZEN_CLASS_COUNT];  // In 1/65536ths
+        for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+            long long people = exposedPeople[r * CITIZEN_CLASS_COUNT + c];
+            prevalence[c] = people > 0 ? exposedInfected[r * CITIZEN_CLASS_COUNT + c] * 65536 / people : 0;
+        }
+
+        for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+            int cell = r * CITIZEN_CLASS_COUNT + c;
+            long long mix = 0;
+            for (int other = 0; other < CITIZEN_CLASS_COUNT; other++) {
+                mix += CLASS_CONTACT[c][other] * prevalence[other];
+            }
+            long long force = transmission * (mix / 100) >> 16;
+            if (force > 65536) force = 65536;
+
+            unsigned draw = hashRegion(key, (unsigned)cell * 2);
+            unsigned secondDraw = hashRegion(key, (unsigned)cell * 2 + 1);
+            int infections = roundByDraw(susceptible[cell] * force, draw & 0xFFFF);
+            int recoveries = roundByDraw(infected[cell] * recovery, draw >> 16);
+            int deaths = roundByDraw(infected[cell] * mortality, secondDraw & 0xFFFF);
+            if (deaths > infected[cell]) deaths = infected[cell];
+            if (recoveries > infected[cell] - deaths) recoveries = infected[cell] - deaths;
+
+            susceptible[cell] -= infections;
+            infected[cell] += infections - recoveries - deaths;
+            recovered[cell] += recoveries;
+            result.infections += infections;
+            result.recoveries += recoveries;
+            result.deaths[c] += deaths;
+            result.infected += infected[cell];
+        }
+    }
+}
+
+EpidemicTurnResult EpidemicModel::step(const EpidemicTurnInput& input) {
+    spreadPeople(input.people);
+    int tradeLevel = input.tradeLevel < 0 ? 0 : input.tradeLevel > 256 ? 256 : input.tradeLevel;
+    unsigned key = (unsigned)(mixSeed(seed, (unsigned long long)input.turn) >> 32);  // The climate uses the low half
+    int blocks = (int)blockResults.size();
+
+    // Every block must see the infected before any block moves them
+    parallelFor(blocks, [&](int block) { packBlock(block); });
+    parallelFor(blocks, [&](int block) { exposeBlock(block, tradeLevel); });
+    parallelFor(blocks, [&](int block) { stepBlock(block, input, key); });
+
+    EpidemicTurnResult total = {};
+    for (const BlockResult& result : blockResults) {
+        total.infections += result.infections;
+        total.recoveries += result.recoveries;
+        for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+            total.deaths[c] += result.deaths[c];
+            total.totalDeaths += result.deaths[c];
+        }
+        total.infected += result.infected;
+    }
+    return total;
+}
+
+// Count, then each compartment in turn. Used by the undo history.
+string EpidemicModel::serialize() const {
+    string data((const char*)&regionCount, sizeof(regionCount));
+    appendArray(data, susceptible);
+    appendArray(data, infected);
+    appendArray(data, recovered);
+    return data;
+}
+
+bool EpidemicModel::deserialize(const string& data) {
+    int count;
+    if (data.size() < sizeof(count)) {
+        return false;
+    }
+    memcpy(&count, data.data(), sizeof(count));
+    int cells = count * CITIZEN_CLASS_COUNT;
+    if (count != regionCount || data.size() != sizeof(count) + (size_t)cells * 3 * sizeof(int)) {
+        return false;
+    }
+    const char* in = data.data() + sizeof(count);
+    readArray(in, susceptible, cells);
+    readArray(in, infected, cells);
+    readArray(in, recovered, cells);
+    return true;
+}
+
+// TradeRoute class implementation
+void TradeRoute::updateSecurity(GameRandom& random) {
+    int securityCheck = random.nextInt(100);
+    
+    if (securityCheck < 70) { // 70% chance of secure route
+        isSecure = true;
+        riskLevel = 0.0;
+        attackProbability = 0;
+    }
+    else if (securityCheck < 85) { // 15% chance of moderate risk
+        isSecure = true;
+        riskLevel = 0.3;
+        attackProbability = 20;
+    }
+    else { // 15% chance of high risk
+        isSecure = false;
+        riskLevel = 0.7;
+        attackProbability = 50;
+    }
+}
+
+// TradeNetwork class implementation
+double TradeNetwork::edgeCost(double riskLevel, int attackProbability) {
+    // Small per-hop cost so that equally safe routes prefer fewer stops
+    return 0.01 + riskLevel + attackProbability / 100.0;
+}
+
+bool TradeNetwork::isValidKingdom(int id) const {
+    return id >= 0 && id < (int)kingdomNames.size();
+}
+
+TradeEdge* TradeNetwork::findEdge(int from, int to) {
+    for (TradeEdge& edge : adjacency[from]) {
+        if (edge.to == to) {
+            return &edge;
+        }
+    }
+    return nullptr;
+}
+
+int TradeNetwork::addKingdom(const string& name) {
+    int id = (int)kingdomNames.size();
+    kingdomNames.push_back(name);
+    adjacency.push_back(vector<TradeEdge>());
+    affectedMark.push_back(0);
+
+    // A new kingdom has no roads yet, so cached trees only need to grow
+    for (auto& entry : routeTrees) {
+        entry.second.risk.push_back(numeric_limits<double>::infinity());
+        entry.second.parent.push_back(-1);
+    }
+    return id;
+}
+
+void TradeNetwork::connect(int a, int b, double riskLevel, int attackProbability) {
+    if (!isValidKingdom(a) || !isValidKingdom(b) || a == b) {
+        Visual::printError("Invalid trade connection!");
+        return;
+    }
+    if (findEdge(a, b) != nullptr) {
+        updateSecurity(a, b, riskLevel, attackProbability);
+        return;
+    }
+
+    double cost = edgeCost(riskLevel, attackProbability);
+    adjacency[a].push_back({b, riskLevel, attackProbability, cost});
+    adjacency[b].push_back({a, riskLevel, attackProbability, cost});
+
+    // A new road behaves like a road whose cost dropped from infinity
+    double oldCost = numeric_limits<double>::infinity();
+    for (auto& entry : routeTrees) {
+        applyCostChange(entry.second, a, b, oldCost, cost);
+        applyCostChange(entry.second, b, a, oldCost, cost);
+    }
+}
+
+void TradeNetwork::updateSecurity(int a, int b, double riskLevel, int attackProbability) {
+    if (!isValidKingdom(a) || !isValidKingdom(b)) {
+        Visual::printError("Invalid trade connection!");
+        return;
+    }
+    TradeEdge* forward = findEdge(a, b);
+    TradeEdge* backward = findEdge(b, a);
+    if (forward == nullptr || backward == nullptr) {
+        Visual::printError("No trade road between these kingdoms!");
+        return;
+    }
+
+    double oldCost = forward->cost;
+    double newCost = edgeCost(riskLevel, attackProbability);
+    forward->riskLevel = backward->riskLevel = riskLevel;
+    forward->attackProbability = backward->attackProbability = attackProbability;
+    forward->cost = backward->cost = newCost;
+
+    if (newCost == oldCost) {
+        return;
+    }
+    for (auto& entry : routeTrees) {
+        applyCostChange(entry.second, a, b, oldCost, newCost);
+        applyCostChange(entry.second, b, a, oldCost, newCost);
+    }
+}
+
+void TradeNetwork::updateSecurity(int a, int b, const TradeRoute& route) {
+    updateSecurity(a, b, route.getRiskLevel(), route.getAttackProbability());
+}
+
+TradeNetwork::RouteTree& TradeNetwork::getRouteTree(int source) {
+    auto found = routeTrees.find(source);
+    if (found != routeTrees.end()) {
+        // Move the source to the front of the usage list
+        for (auto it = treeOrder.begin(); it != treeOrder.end(); ++it) {
+            if (*it == source) {
+                treeOrder.splice(treeOrder.begin(), treeOrder, it);
+                break;
+            }
+        }
+        return found->second;
+    }
+
+    if ((int)routeTrees.size() >= MAX_CACHED_TREES) {
+        routeTrees.erase(treeOrder.back());
+        treeOrder.pop_back();
+    }
+    treeOrder.push_front(source);
+    RouteTree& tree = routeTrees[source];
+    buildRouteTree(source, tree);
+    return tree;
+}
+
+void TradeNetwork::buildRouteTree(int source, RouteTree& tree) {
+    tree.risk.assign(kingdomNames.size(), numeric_limits<double>::infinity());
+    tree.parent.assign(kingdomNames.size(), -1);
+    tree.risk[source] = 0.0;
+
+    RouteQueue queue;
+    queue.push(make_pair(0.0, source));
+    relaxFrom(tree, queue);
+}
+
+void TradeNetwork::relaxFrom(RouteTree& tree, RouteQueue& queue) {
+    while (!queue.empty()) {
+        pair<double, int> top = queue.top();
+        queue.pop();
+        if (top.first > tree.risk[top.second]) {
+            continue;  // Stale queue entry
+        }
+        for (const TradeEdge& edge : adjacency[top.second]) {
+            double risk = top.first + edge.cost;
+            if (risk < tree.risk[edge.to]) {
+                tree.risk[edge.to] = risk;
+                tree.parent[edge.to] = top.second;
+                queue.push(make_pair(risk, edge.to));
+            }
+        }
+    }
+}
+
+void TradeNetwork::applyCostChange(RouteTree& tree, int from, int to, double oldCost, double newCost) {
+    RouteQueue queue;
+
+    if (newCost < oldCost) {
+        // Cheaper road: only kingdoms reachable through it can improve
+        double risk = tree.risk[from] + newCost;
+        if (risk < tree.risk[to]) {
+            tree.risk[to] = risk;
+            tree.parent[to] = from;
+            queue.push(make_pair(risk, to));
+            relaxFrom(tree, queue);
+        }
+        return;
+    }
+
+    if (tree.parent[to] != from) {
+        return;  // Road is not on any cached route
+    }
+
+    // Costlier road: every kingdom routed through it must be re-attached
+    vector<int> affected;
+    affected.push_back(to);
+    affectedMark[to] = 1;
+    for (size_t i = 0; i < affected.size(); i++) {
+        int current = affected[i];
+        for (const TradeEdge& edge : adjacency[current]) {
+            if (!affectedMark[edge.to] && tree.parent[edge.to] == current) {
+                affectedMark[edge.to] = 1;
+                affected.push_back(edge.to);
+            }
+        }
+    }
+
+    for (int id : affected) {
+        tree.risk[id] = numeric_limits<double>::infinity();
+        tree.parent[id] = -1;
+    }
+
+    // Seed each affected kingdom from its best unaffected neighbour
+    for (int id : affected) {
+        for (const TradeEdge& edge : adjacency[id]) {
+            if (affectedMark[edge.to]) {
+                continue;
+            }
+            double risk = tree.risk[edge.to] + edge.cost;
+            if (risk < tree.risk[id]) {
+                tree.risk[id] = risk;
+                tree.parent[id] = edge.to;
+            }
+        }
+        if (tree.parent[id] != -1) {
+            queue.push(make_pair(tree.risk[id], id));
+        }
+    }
+
+    for (int id : affected) {
+        affectedMark[id] = 0;
+    }
+    relaxFrom(tree, queue);
+}
+
+vector<int> TradeNetwork::getRoute(int from, int to) {
+    vector<int> route;
+    if (!isValidKingdom(from) || !isValidKingdom(to)) {
+        Visual::printError("Invalid kingdom for trade route!");
+        return route;
+    }
+
+    RouteTree& tree = getRouteTree(from);
+    if (tree.risk[to] == numeric_limits<double>::infinity()) {
+        return route;  // No route exists
+    }
+    for (int current = to; current != -1; current = tree.parent[current]) {
+        route.push_back(current);
+    }
+    return vector<int>(route.rbegin(), route.rend());
+}
+
+double TradeNetwork::getRouteRisk(int from, int to) {
+    if (!isValidKingdom(from) || !isValidKingdom(to)) {
+        Visual::printError("Invalid kingdom for trade route!");
+        return numeric_limits<double>::infinity();
+    }
+    return getRouteTree(from).risk[to];
+}
+
+int TradeNetwork::getRouteAttackProbability(int from, int to) {
+    vector<int> route = getRoute(from, to);
+    if (route.empty()) {
+        return 100;  // Goods cannot get through at all
+    }
+
+    // Chance that the caravan survives every road along the way
+    double survival = 1.0;
+    for (size_t i = 1; i < route.size(); i++) {
+        TradeEdge* edge = findEdge(route[i - 1], route[i]);
+        survival *= 1.0 - edge->attackProbability / 100.0;
+    }
+    return (int)((1.0 - survival) * 100.0 + 0.5);
+}
+
+string TradeNetwork::getKingdomName(int id) const {
+    if (!isValidKingdom(id)) {
+        return "Unknown";
+    }
+    return kingdomNames[id];
+}
+
+// Risk and attack chance of every road end in adjacency order. Used by the
+// undo history; roads are only added at setup, so the order never changes.
+string TradeNetwork::serialize() const {
+    string data;
+    for (const vector<TradeEdge>& edges : adjacency) {
+        for (const TradeEdge& edge : edges) {
+            data.append((const char*)&edge.riskLevel, sizeof(edge.riskLevel));
+            data.append((const char*)&edge.attackProbability, sizeof(edge.attackProbability));
+        }
+    }
+    return data;
+}
+
+bool TradeNetwork::deserialize(const string& data) {
+    size_t ends = 0;
+    for (const vector<TradeEdge>& edges : adjacency) {
+        ends += edges.size();
+    }
+    if (data.size() != ends * (sizeof(double) + sizeof(int))) {
+        return false;
+    }
+    const char* in = data.data();
+    for (vector<TradeEdge>& edges : adjacency) {
+        for (TradeEdge& edge : edges) {
+            memcpy(&edge.riskLevel, in, sizeof(edge.riskLevel));
+            in += sizeof(edge.riskLevel);
+            memcpy(&edge.attackProbability, in, sizeof(edge.attackProbability));
+            in += sizeof(edge.attackProbability);
+            edge.cost = edgeCost(edge.riskLevel, edge.attackProbability);
+        }
+    }
+    // Many roads may have changed at once, so rebuild routes on demand
+    routeTrees.clear();
+    treeOrder.clear();
+    return true;
+}
+
+// BattleEngine class implementation
+int BattleEngine::addBattle() {
+    attackerSize.push_back(0);
+    attackerPower.push_back(0);
+    defenderSize.push_back(0);
+    defenderPower.push_back(0);
+    results.push_back({0, 0, false});
+    return (int)attackerSize.size() - 1;
+}
+
+void BattleEngine::addForceTotals(int battle, int size, int power, bool attacker) {
+    // Power is summed as firepower here and turned into a per-soldier value in resolveAll
+    if (attacker) {
+        attackerSize[battle] += (long long)size * SIZE_ONE;
+        attackerPower[battle] += (long long)size * power;
+    }
+    else {
+        defenderSize[battle] += (long long)size * SIZE_ONE;
+        defenderPower[battle] += (long long)size * power;
+    }
+}
+
+void BattleEngine::addArmy(int battle, Army& army, int weapons, bool attacker) {
+    if (battle < 0 || battle >= getBattleCount()) {
+        Visual::printError("Invalid battle!");
+        return;
+    }
+    addForceTotals(battle, army.getSize(), army.getFightingPower(weapons), attacker);
+    armies.push_back(&army);
+    armyBattle.push_back(battle);
+    armyIsAttacker.push_back(attacker);
+    armySize.push_back(army.getSize());
+}
+
+void BattleEngine::addForce(int battle, int size, int power, bool attacker) {
+    if (battle < 0 || battle >= getBattleCount() || size < 0) {
+        Visual::printError("Invalid battle force!");
+        return;
+    }
+    addForceTotals(battle, size, power, attacker);
+}
+
+void BattleEngine::runAttrition(long long* aSize, const long long* aPower, long long* dSize, const long long* dPower,
+    int count) {
+    // Lanchester square law: each side loses in proportion to the enemy's firepower
+    const long long scale = 1000LL * Army::POWER_ONE;
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < count; i++) {
+            long long a = aSize[i];
+            long long d = dSize[i];
+            long long newA = a - ROUND_LENGTH * dPower[i] * d / scale;
+            long long newD = d - ROUND_LENGTH * aPower[i] * a / scale;
+            aSize[i] = newA > 0 ? newA : 0;
+            dSize[i] = newD > 0 ? newD : 0;
+        }
+    }
+}
+
+void BattleEngine::resolveAll() {
+    int count = getBattleCount();
+    if (count == 0) {
+        return;
+    }
+
+    vector<long long> startAttackers(attackerSize);
+    vector<long long> startDefenders(defenderSize);
+    for (int i = 0; i < count; i++) {
+        attackerPower[i] = attackerSize[i] > 0 ? attackerPower[i] * SIZE_ONE / attackerSize[i] : 0;
+        defenderPower[i] = defenderSize[i] > 0 ? defenderPower[i] * SIZE_ONE / defenderSize[i] : 0;
+    }
+
+    runAttrition(attackerSize.data(), attackerPower.data(), defenderSize.data(), defenderPower.data(), count);
+
+    for (int i = 0; i < count; i++) {
+        results[i].attackerLosses = (int)((startAttackers[i] - attackerSize[i] + SIZE_ONE / 2) / SIZE_ONE);
+        results[i].defenderLosses = (int)((startDefenders[i] - defenderSize[i] + SIZE_ONE / 2) / SIZE_ONE);
+        results[i].attackerWon = attackerSize[i] * attackerPower[i] > defenderSize[i] * defenderPower[i];
+    }
+
+    // Share each side's losses between its armies by size
+    for (size_t i = 0; i < armies.size(); i++) {
+        int battle = armyBattle[i];
+        bool attacker = armyIsAttacker[i];
+        long long sideSize = (attacker ? startAttackers[battle] : startDefenders[battle]) / SIZE_ONE;
+        int sideLosses = attacker ? results[battle].attackerLosses : results[battle].defenderLosses;
+        int losses = sideSize > 0 ? (int)((sideLosses * (long long)armySize[i] + sideSize / 2) / sideSize) : 0;
+        bool won = attacker == results[battle].attackerWon;
+        armies[i]->applyBattleOutcome(losses, won);
+    }
+}
+
+void BattleEngine::clear() {
+    attackerSize.clear();
+    attackerPower.clear();
+    defenderSize.clear();
+    defenderPower.clear();
+    results.clear();
+    armies.clear();
+    armyBattle.clear();
+    armyIsAttacker.clear();
+    armySize.clear();
+}
+
+// ActionHistory class implementation
+long long ActionHistory::readField(const Kingdom& kingdom, int field) {
+    const King* king = kingdom.politics->currentKing;
+    switch (field) {
+    case FIELD_TURN: return kingdom.turn;
+    case FIELD_GAME_OVER: return kingdom.isGameOver;
+    case FIELD_RANDOM: return (long long)kingdom.random.getState();
+    case FIELD_GOLD: return kingdom.ledger.get(LEDGER_GOLD);
+    case FIELD_WOOD: return kingdom.ledger.get(LEDGER_WOOD);
+    case FIELD_STONE: return kingdom.ledger.get(LEDGER_STONE);
+    case FIELD_IRON: return kingdom.ledger.get(LEDGER_IRON);
+    case FIELD_FOOD: return kingdom.ledger.get(LEDGER_FOOD);
+    case FIELD_WEAPONS: return kingdom.ledger.get(LEDGER_WEAPONS);
+    case FIELD_PEOPLE: return kingdom.people->totalPeople;
+    case FIELD_PEASANTS: return kingdom.people->peasants;
+    case FIELD_MERCHANTS: return kingdom.people->merchants;
+    case FIELD_NOBILITY: return kingdom.people->nobility;
+    case FIELD_MILITARY: return kingdom.people->military;
+    case FIELD_BIRTH_RATE: return kingdom.people->birthRate;
+    case FIELD_DEATH_RATE: return kingdom.people->deathRate;
+    case FIELD_PLAGUE: return kingdom.people->isPlague;
+    case FIELD_SICK: return kingdom.people->sick;
+    case FIELD_TAX_RATE: return kingdom.economy->taxRate;
+    case FIELD_INFLATION: return kingdom.economy->inflationRate;
+    case FIELD_RECESSION: return kingdom.economy->isRecession;
+    case FIELD_PUBLIC_SERVICES: return kingdom.economy->publicServices;
+    case FIELD_WORLD_DEMAND: return kingdom.economy->worldDemand;
+    case FIELD_WORLD_OUTPUT: return kingdom.economy->worldOutput;
+    case FIELD_SHRINKING: return kingdom.economy->shrinkingTurns;
+    case FIELD_ARMY_SIZE: return kingdom.army->size;
+    case FIELD_MORALE: return kingdom.army->morale;
+    case FIELD_PAID: return kingdom.army->isPaid;
+    case FIELD_TRAINING: return kingdom.army->trainingLevel;
+    case FIELD_EQUIPMENT: return kingdom.army->equipment;
+    case FIELD_CASUALTIES: return kingdom.army->casualties;
+    case FIELD_REBELLING: return kingdom.army->isRebelling;
+    case FIELD_INTEREST: return kingdom.bank->interestRate;
+    case FIELD_BANK_CORRUPT: return kingdom.bank->isCorrupt;
+    case FIELD_SECURITY: return kingdom.bank->securityLevel;
+    case FIELD_AUDIT_COST: return kingdom.bank->auditCost;
+    case FIELD_PRICE_LEVEL: return kingdom.market->priceLevel;
+    case FIELD_FOOD_RATE: return kingdom.market->foodConsumptionRate;
+    case FIELD_ELECTION_TIMER: return kingdom.politics->electionTimer;
+    case FIELD_STABILITY: return kingdom.politics->stability;
+    case FIELD_COUP: return kingdom.politics->isCoup;
+    case FIELD_CORRUPTION: return kingdom.politics->corruptionLevel;
+    case FIELD_POLICIES: return kingdom.politics->policies;
+    case FIELD_KING_SKILL: return king->skill;
+    case FIELD_KING_POPULARITY: return king->popularity;
+    case FIELD_KING_CORRUPT: return king->isCorrupt;
+    case FIELD_KING_HEALTH: return king->health;
+    case FIELD_KING_REIGN: return king->reignLength;
+    case FIELD_KING_ATTEMPTS: return king->assassinationAttempts;
+    case FIELD_MESSAGE_COUNT: return kingdom.communication->messageCount;
+    case FIELD_WEATHER_DURATION: return kingdom.weather.duration;
+    case FIELD_WEATHER_PERCENT: return kingdom.weather.foodProductionPercent;
+    case FIELD_WEATHER_HARSH: return kingdom.weather.isHarsh;
+    default: return 0;
+    }
+}
+
+void ActionHistory::writeField(Kingdom& kingdom, int field, long long value) {
+    King* king = kingdom.politics->currentKing;
+    int number = (int)value;
+    bool flag = value != 0;
+    switch (field) {
+    case FIELD_TURN: kingdom.turn = number; break;
+    case FIELD_GAME_OVER: kingdom.isGameOver = flag; break;
+    case FIELD_RANDOM: kingdom.random.setSeed((unsigned long long)value); break;
+    case FIELD_GOLD: kingdom.ledger.set(LEDGER_GOLD, value); break;
+    case FIELD_WOOD: kingdom.ledger.set(LEDGER_WOOD, value); break;
+    case FIELD_STONE: kingdom.ledger.set(LEDGER_STONE, value); break;
+    case FIELD_IRON: kingdom.ledger.set(LEDGER_IRON, value); break;
+    case FIELD_FOOD: kingdom.ledger.set(LEDGER_FOOD, value); break;
+    case FIELD_WEAPONS: kingdom.ledger.set(LEDGER_WEAPONS, value); break;
+    case FIELD_PEOPLE: kingdom.people->totalPeople = number; break;
+    case FIELD_PEASANTS: kingdom.people->peasants = number; break;
+    case FIELD_MERCHANTS: kingdom.people->merchants = number; break;
+    case FIELD_NOBILITY: kingdom.people->nobility = number; break;
+    case FIELD_MILITARY: kingdom.people->military = number; break;
+    case FIELD_BIRTH_RATE: kingdom.people->birthRate = number; break;
+    case FIELD_DEATH_RATE: kingdom.people->deathRate = number; break;
+    case FIELD_PLAGUE: kingdom.people->isPlague = flag; break;
+    case FIELD_SICK: kingdom.people->sick = number; break;
+    case FIELD_TAX_RATE: kingdom.economy->taxRate = number; break;
+    case FIELD_INFLATION: kingdom.economy->inflationRate = number; break;
+    case FIELD_RECESSION: kingdom.economy->isRecession = flag; break;
+    case FIELD_PUBLIC_SERVICES: kingdom.economy->publicServices = number; break;
+    case FIELD_WORLD_DEMAND: kingdom.economy->worldDemand = value; break;
+    case FIELD_WORLD_OUTPUT: kingdom.economy->worldOutput = value; break;
+    case FIELD_SHRINKING: kingdom.economy->shrinkingTurns = number; break;
+    case FIELD_ARMY_SIZE: kingdom.army->size = number; break;
+    case FIELD_MORALE: kingdom.army->morale = number; break;
+    case FIELD_PAID: kingdom.army->isPaid = flag; break;
+    case FIELD_TRAINING: kingdom.army->trainingLevel = number; break;
+    case FIELD_EQUIPMENT: kingdom.army->equipment = number; break;
+    case FIELD_CASUALTIES: kingdom.army->casualties = number; break;
+    case FIELD_REBELLING: kingdom.army->isRebelling = flag; break;
+    case FIELD_INTEREST: kingdom.bank->interestRate = number; break;
+    case FIELD_BANK_CORRUPT: kingdom.bank->isCorrupt = flag; break;
+    case FIELD_SECURITY: kingdom.bank->securityLevel = number; break;
+    case FIELD_AUDIT_COST: kingdom.bank->auditCost = number; break;
+    case FIELD_PRICE_LEVEL: kingdom.market->priceLevel = number; break;
+    case FIELD_FOOD_RATE: kingdom.market->foodConsumptionRate = number; break;
+    case FIELD_ELECTION_TIMER: kingdom.politics->electionTimer = number; break;
+    case FIELD_STABILITY: kingdom.politics->stability = number; break;
+    case FIELD_COUP: kingdom.politics->isCoup = flag; break;
+    case FIELD_CORRUPTION: kingdom.politics->corruptionLevel = number; break;
+    case FIELD_POLICIES: kingdom.politics->policies = (unsigned)value; break;
+    case FIELD_KING_SKILL: king->skill = number; break;
+    case FIELD_KING_POPULARITY: king->popularity = number; break;
+    case FIELD_KING_CORRUPT: king->isCorrupt = flag; break;
+    case FIELD_KING_HEALTH: king->health = number; break;
+    case FIELD_KING_REIGN: king->reignLength = number; break;
+    case FIELD_KING_ATTEMPTS: king->assassinationAttempts = number; break;
+    case FIELD_MESSAGE_COUNT: kingdom.communication->messageCount = number; break;
+    case FIELD_WEATHER_DURATION: kingdom.weather.duration = number; break;
+    case FIELD_WEATHER_PERCENT: kingdom.weather.foodProductionPercent = number; break;
+    case FIELD_WEATHER_HARSH: kingdom.weather.isHarsh = flag; break;
+    default: break;
+    }
+}
+
+string ActionHistory::readText(const Kingdom& kingdom, int field) {
+    switch (field) {
+    case TEXT_NAME: return kingdom.name;
+    case TEXT_DIPLOMACY: return kingdom.diplomacy->network.serialize();
+    case TEXT_WEATHER: return kingdom.weather.currentCondition;
+    case TEXT_CLIMATE: return kingdom.weather.regions.serialize();
+    case TEXT_EPIDEMIC: return kingdom.epidemic.serialize();
+    case TEXT_KING: return kingdom.politics->currentKing->name;
+    case TEXT_LOANS: return kingdom.bank->loans.serialize();
+    case TEXT_ROADS: return kingdom.market->roads.serialize();
+    case TEXT_AGENTS: return kingdom.people->agents != nullptr ? kingdom.people->agents->serialize() : string();
+    default: return kingdom.communication->messages[field - TEXT_MESSAGE];
+    }
+}
+
+void ActionHistory::writeText(Kingdom& kingdom, int field, const string& value) {
+    switch (field) {
+    case TEXT_NAME: kingdom.name = value; break;
+    case TEXT_DIPLOMACY: kingdom.diplomacy->network.deserialize(value); break;
+    case TEXT_WEATHER: kingdom.weather.currentCondition = value; break;
+    case TEXT_CLIMATE: kingdom.weather.regions.deserialize(value); break;
+    case TEXT_EPIDEMIC: kingdom.epidemic.deserialize(value); break;
+    case TEXT_KING: kingdom.politics->currentKing->name = value; break;
+    case TEXT_LOANS: kingdom.bank->loans.deserialize(value); break;
+    case TEXT_ROADS: kingdom.market->roads.deserialize(value); break;
+    case TEXT_AGENTS:
+        if (kingdom.people->agents != nullptr && !value.empty()) {
+            kingdom.people->agents->deserialize(value);
+        }
+        break;
+    default: kingdom.communication->messages[field - TEXT_MESSAGE] = value; break;
+    }
+}
+
+void ActionHistory::putVarint(vector<unsigned char>& out, unsigned long long value) {
+    while (value >= 0x80) {
+        out.push_back((unsigned char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((unsigned char)value);
+}
+
+unsigned long long ActionHistory::getVarint(const unsigned char*& in) {
+    unsigned long long value = 0;
+    for (int shift = 0; ; shift += 7) {
+        unsigned char byte = *in++;
+        value |= (unsigned long long)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+}
+
+// Start of each chunk in a serialized CitizenPool, at its count
+static vector<size_t> findAgentChunks(const string& pool) {
+    int chunkCount;
+    memcpy(&chunkCount, pool.data() + sizeof(unsigned long long), sizeof(chunkCount));
+    vector<size_t> starts(chunkCount);
+    size_t offset = sizeof(unsigned long long) + sizeof(chunkCount);
+    for (int i = 0; i < chunkCount; i++) {
+        int count;
+        memcpy(&count, pool.data() + offset, sizeof(count));
+        starts[i] = offset;
+        offset += sizeof(count) + (size_t)count * CitizenChunk::ARRAY_COUNT;
+    }
+    return starts;
+}
+
+static int agentCount(const string& pool, const vector<size_t>& starts, int chunk) {
+    int count = 0;
+    if (chunk < (int)starts.size()) {
+        memcpy(&count, pool.data() + starts[chunk], sizeof(count));
+    }
+    return count;
+}
+
+// The pool is megabytes but a turn changes it in a regular way: every
+// citizen ages by one, health mostly sits at its cap. So each chunk array
+// keeps only the byte differences, as the most common one plus the slots
+// that differ otherwise; added they give the new pool, subtracted the old.
+// Slots past a chunk's count read as 0. Layout: random state XOR, chunk
+// counts before and after, then per chunk its counts before and after and
+// for each array the common difference, the exception count and each
+// exception's gap from the last one and difference.
+void ActionHistory::putAgentsDelta(vector<unsigned char>& out, const string& before, const string& after) {
+    unsigned long long beforeState, afterState;
+    memcpy(&beforeState, before.data(), sizeof(beforeState));
+    memcpy(&afterState, after.data(), sizeof(afterState));
+    putVarint(out, beforeState ^ afterState);
+
+    vector<size_t> beforeChunks = findAgentChunks(before);
+    vector<size_t> afterChunks = findAgentChunks(after);
+    putVarint(out, beforeChunks.size());
+    putVarint(out, afterChunks.size());
+    int chunkCount = (int)(beforeChunks.size() > afterChunks.size() ? beforeChunks.size() : afterChunks.size());
+    unsigned char differences[CitizenChunk::CAPACITY];
+    for (int c = 0; c < chunkCount; c++) {
+        int oldCount = agentCount(before, beforeChunks, c);
+        int newCount = agentCount(after, afterChunks, c);
+        putVarint(out, oldCount);
+        putVarint(out, newCount);
+        int length = oldCount > newCount ? oldCount : newCount;
+        for (int array = 0; array < CitizenChunk::ARRAY_COUNT; array++) {
+            const unsigned char* oldBytes = oldCount == 0 ? nullptr :
+                (const unsigned char*)before.data() + beforeChunks[c] + sizeof(int) + (size_t)array * oldCount;
+            const unsigned char* newBytes = newCount == 0 ? nullptr :
+                (const unsigned char*)after.data() + afterChunks[c] + sizeof(int) + (size_t)array * newCount;
+            int histogram[256] = {};
+            for (int i = 0; i < length; i++) {
+                differences[i] = (unsigned char)((i < newCount ? newBytes[i] : 0) - (i < oldCount ? oldBytes[i] : 0));
+                histogram[differences[i]]++;
+            }
+            int common = 0;
+            for (int value = 1; value < 256; value++) {
+                common = histogram[value] > histogram[common] ? value : common;
+            }
+            out.push_back((unsigned char)common);
+            putVarint(out, length - histogram[common]);
+            int last = -1;
+            for (int i = 0; i < length; i++) {
+                if (differences[i] != common) {
+                    putVarint(out, i - last - 1);
+                    out.push_back(differences[i]);
+                    last = i;
+                }
+            }
+        }
+    }
+}
+
+// Rebuilds the pool on the other side of a delta from the one it is on now
+string ActionHistory::applyAgentsDelta(const string& current, const unsigned char*& in, bool undo) {
+    unsigned long long state;
+    memcpy(&state, current.data(), sizeof(state));
+    state ^= getVarint(in);
+    int oldChunkCount = (int)getVarint(in);
+    int newChunkCount = (int)getVarint(in);
+    int targetChunkCount = undo ? oldChunkCount : newChunkCount;
+
+    string result((const char*)&state, sizeof(state));
+    result.append((const char*)&targetChunkCount, sizeof(targetChunkCount));
+    vector<size_t> currentChunks = findAgentChunks(current);
+    unsigned char differences[CitizenChunk::CAPACITY];
+    unsigned char bytes[CitizenChunk::CAPACITY];
+    int chunkCount = oldChunkCount > newChunkCount ? oldChunkCount : newChunkCount;
+    for (int c = 0; c < chunkCount; c++) {
+        int oldCount = (int)getVarint(in);
+        int newCount = (int)getVarint(in);
+        int currentCount = undo ? newCount : oldCount;
+        int targetCount = undo ? oldCount : newCount;
+        int length = oldCount > newCount ? oldCount : newCount;
+        if (c < targetChunkCount) {
+            result.append((const char*)&targetCount, sizeof(targetCount));
+        }
+        for (int array = 0; array < CitizenChunk::ARRAY_COUNT; array++) {
+            const unsigned char* currentBytes = currentCount == 0 ? nullptr :
+                (const unsigned char*)current.data() + currentChunks[c] + sizeof(int) + (size_t)array * currentCount;
+            unsigned char common = *in++;
+            int exceptions = (int)getVarint(in);
+            for (int i = 0; i < length; i++) {
+                differences[i] = common;
+            }
+            for (int e = 0, i = -1; e < exceptions; e++) {
+                i += (int)getVarint(in) + 1;
+                differences[i] = *in++;
+            }
+            for (int i = 0; i < targetCount; i++) {
+                unsigned char value = i < currentCount ? currentBytes[i] : 0;
+                bytes[i] = (unsigned char)(undo ? value - differences[i] : value + differences[i]);
+            }
+            result.append((const char*)bytes, targetCount);
+        }
+    }
+    return result;
+}
+
+void ActionHistory::begin(const Kingdom& kingdom) {
+    MemoryScope scope(kingdom.getMemoryAccount(), MEMORY_HISTORY, "ActionHistory::begin");
+    for (int field = 0; field < FIELD_COUNT; field++) {
+        before[field] = readField(kingdom, field);
+    }
+    for (int field = 0; field < TEXT_COUNT; field++) {
+        beforeText[field] = readText(kingdom, field);
+    }
+    isRecording = true;
+}
+
+void ActionHistory::commit(const Kingdom& kingdom) {
+    MemoryScope scope(kingdom.getMemoryAccount(), MEMORY_HISTORY, "ActionHistory::commit");
+    if (!isRecording) {
+        Visual::printError("No action is being recorded!");
+        return;
+    }
+    isRecording = false;
+
+    // A new action throws away anything that could have been redone
+    if (cursor < offsets.size()) {
+        data.resize(offsets[cursor]);
+        offsets.resize(cursor);
+    }
+    offsets.push_back(data.size());
+
+    // Diff layout: field id then XOR varint, or 0x80|text id then old and new text; 0xFF ends it.
+    // Agents on both sides are kept as a delta instead, flagged by a 1 after the id.
+    for (int field = 0; field < FIELD_COUNT; field++) {
+        unsigned long long change = (unsigned long long)(before[field] ^ readField(kingdom, field));
+        if (change != 0) {
+            data.push_back((unsigned char)field);
+            putVarint(data, change);
+        }
+    }
+    for (int field = 0; field < TEXT_COUNT; field++) {
+        string after = readText(kingdom, field);
+        if (after == beforeText[field]) {
+            continue;
+        }
+        data.push_back((unsigned char)(0x80 | field));
+        if (field == TEXT_AGENTS) {
+            bool isDelta = !after.empty() && !beforeText[field].empty();
+            data.push_back((unsigned char)isDelta);
+            if (isDelta) {
+                putAgentsDelta(data, beforeText[field], after);
+                continue;
+            }
+        }
+        putVarint(data, beforeText[field].size());
+        data.insert(data.end(), beforeText[field].begin(), beforeText[field].end());
+        putVarint(data, after.size());
+        data.insert(data.end(), after.begin(), after.end());
+    }
+    data.push_back(0xFF);
+    cursor = offsets.size();
+
+    if (data.size() > MAX_BYTES) {
+        dropOldest();
+    }
+}
+
+void ActionHistory::applyDiff(Kingdom& kingdom, size_t index, bool undo) {
+    const unsigned char* in = data.data() + offsets[index];
+    while (*in != 0xFF) {
+        unsigned char tag = *in++;
+        if ((tag & 0x80) == 0) {
+            long long change = (long long)getVarint(in);
+            writeField(kingdom, tag, readField(kingdom, tag) ^ change);
+        }
+        else if ((tag & 0x7F) == TEXT_AGENTS && *in++ == 1) {
+            writeText(kingdom, TEXT_AGENTS, applyAgentsDelta(readText(kingdom, TEXT_AGENTS), in, undo));
+        }
+        else {
+            size_t oldLength = (size_t)getVarint(in);
+            string oldText((const char*)in, oldLength);
+            in += oldLength;
+            size_t newLength = (size_t)getVarint(in);
+            string newText((const char*)in, newLength);
+            in += newLength;
+            writeText(kingdom, tag & 0x7F, undo ? oldText : newText);
+        }
+    }
+    kingdom.status.markAllDirty();  // Fields were written behind the subsystems' backs
+}
+
+void ActionHistory::dropOldest() {
+    // Drop the older half of the undo history in one move
+    size_t count = offsets.size() / 2;
+    if (count > cursor) count = cursor;
+    if (count == 0) {
+        return;
+    }
+    size_t shift = offsets[count];
+    data.erase(data.begin(), data.begin() + shift);
+    offsets.erase(offsets.begin(), offsets.begin() + count);
+    for (size_t& offset : offsets) {
+        offset -= shift;
+    }
+    cursor -= count;
+}
+
+bool ActionHistory::undo(Kingdom& kingdom) {
+    if (!canUndo()) {
+        Visual::printError("Nothing to undo!");
+        return false;
+    }
+    cursor--;
+    applyDiff(kingdom, cursor, true);
+    Visual::printSuccess(VFMT("Undid turn {}."), kingdom.getTurn());
+    return true;
+}
+
+bool ActionHistory::redo(Kingdom& kingdom) {
+    if (!canRedo()) {
+        Visual::printError("Nothing to redo!");
+        return false;
+    }
+    applyDiff(kingdom, cursor, false);
+    cursor++;
+    Visual::printSuccess(VFMT("Redid turn {}."), kingdom.getTurn() - 1);
+    return true;
+}
+
+void ActionHistory::clear() {
+    data.clear();
+    offsets.clear();
+    cursor = 0;
+    isRecording = false;
+}
+
+// AutosaveService class implementation
+AutosaveService::AutosaveService(const string& p)
+    : path(p), hasPending(false), isWriting(false), isStopping(false), savedCount(0), failedCount(0)
+{
+    worker = thread(&AutosaveService::run, this);
+}
+
+AutosaveService::~AutosaveService()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        isStopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+}
+
+void AutosaveService::submit(const Kingdom& kingdom)
+{
+    MemoryScope scope(kingdom.getMemoryAccount(), MEMORY_SAVE, "AutosaveService::submit");
+    SaveState state = kingdom.captureSaveState();  // Only this runs on the game thread
+    {
+        lock_guard<mutex> guard(lock);
+        pending = std::move(state);
+        hasPending = true;
+    }
+    wake.notify_one();
+}
+
+void AutosaveService::flush()
+{
+    unique_lock<mutex> guard(lock);
+    idle.wait(guard, [this] { return !hasPending && !isWriting; });
+}
+
+int AutosaveService::getSavedCount()
+{
+    lock_guard<mutex> guard(lock);
+    return savedCount;
+}
+
+int AutosaveService::getFailedCount()
+{
+    lock_guard<mutex> guard(lock);
+    return failedCount;
+}
+
+void AutosaveService::run()
+{
+    unique_lock<mutex> guard(lock);
+    while (true)
+    {
+        wake.wait(guard, [this] { return hasPending || isStopping; });
+        if (!hasPending)
+        {
+            break;  // Stopping with nothing left to write
+        }
+
+        SaveState state = std::move(pending);
+        hasPending = false;
+        isWriting = true;
+        guard.unlock();
+
+        bool ok = Kingdom::writeSave(state, path);
+
+        guard.lock();
+        isWriting = false;
+        if (ok) savedCount++;
+        else failedCount++;
+        idle.notify_all();
+    }
+}
+
+// SaveStore class implementation
+// Catalog file: 64-byte header ("SHSC", version, record count) followed by
+// SaveCatalogEntry records. Pack file: compressed saves back to back.
+static_assert(sizeof(SaveCatalogEntry) == 128, "Catalog records must stay 128 bytes");
+
+static const unsigned CATALOG_VERSION = 1;
+
+// FNV-1a over a byte range
+static unsigned long long hashBytes(const void* data, size_t length)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    unsigned long long hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Copies a name into a zero-padded fixed field, truncating if needed
+static void copyName(char* field, const string& name)
+{
+    memset(field, 0, 32);
+    memcpy(field, name.data(), name.size() < 31 ? name.size() : 31);
+}
+
+SaveStore::SaveStore(const string& baseName)
+    : catalogPath(baseName + ".cat"), packPath(baseName + ".pack"),
+      mapped(nullptr), mappedSize(0), isHashIndexBuilt(false)
+{
+#ifdef _WIN32
+    fileHandle = INVALID_HANDLE_VALUE;
+    mappingHandle = NULL;
+#endif
+    mapCatalog();
+}
+
+SaveStore::~SaveStore()
+{
+    unmapCatalog();
+}
+
+bool SaveStore::mapCatalog()
+{
+    unmapCatalog();
+#ifdef _WIN32
+    fileHandle = CreateFileA(catalogPath.c_str(), GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (fileHandle == INVALID_HANDLE_VALUE || !GetFileSizeEx(fileHandle, &size) || size.QuadPart < HEADER_SIZE)
+    {
+        unmapCatalog();
+        return false;
+    }
+    mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mappingHandle != NULL)
+    {
+        mapped = (const unsigned char*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (mapped == nullptr)
+    {
+        unmapCatalog();
+        return false;
+    }
+    mappedSize = (size_t)size.QuadPart;
+#else
+    int descriptor = open(catalogPath.c_str(), O_RDONLY);
+    if (descriptor < 0)
+    {
+        return false;
+    }
+    struct stat info;
+    if (fstat(descriptor, &info) != 0 || info.st_size < HEADER_SIZE)
+    {
+        close(descriptor);
+        return false;
+    }
+    void* view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, descriptor, 0);
+    close(descriptor);  // The mapping keeps the file open
+    if (view == MAP_FAILED)
+    {
+        return false;
+    }
+    mapped = (const unsigned char*)view;
+    mappedSize = (size_t)info.st_size;
+#endif
+
+    if (memcmp(mapped, "SHSC", 4) != 0)
+    {
+        unmapCatalog();
+        return false;
+    }
+    indexSlots();
+    return true;
+}
+
+// One pass over the records; later records of a slot replace earlier ones
+void SaveStore::indexSlots()
+{
+    latestBySlot.clear();
+    int count = getSlotCount();
+    for (int i = 0; i < count; i++)
+    {
+        const SaveCatalogEntry* entry = getEntry(i);
+        if (entry != nullptr)
+        {
+            latestBySlot[string(entry->slot, sizeof(entry->slot))] = i;
+        }
+    }
+}
+
+void SaveStore::unmapCatalog()
+{
+#ifdef _WIN32
+    if (mapped != nullptr) UnmapViewOfFile(mapped);
+    if (mappingHandle != NULL) CloseHandle(mappingHandle);
+    if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+    mappingHandle = NULL;
+    fileHandle = INVALID_HANDLE_VALUE;
+#else
+    if (mapped != nullptr) munmap((void*)mapped, mappedSize);
+#endif
+    mapped = nullptr;
+    mappedSize = 0;
+    latestBySlot.clear();
+}
+
+int SaveStore::getSlotCount() const
+{
+    if (mapped == nullptr)
+    {
+        return 0;
+    }
+    unsigned count;
+    memcpy(&count, mapped + 8, sizeof(count));
+    size_t fits = (mappedSize - HEADER_SIZE) / sizeof(SaveCatalogEntry);
+    return count > fits ? (int)fits : (int)count;
+}
+
+const SaveCatalogEntry* SaveStore::getEntry(int index) const
+{
+    if (index < 0 || index >= getSlotCount())
+    {
+        return nullptr;
+    }
+    const SaveCatalogEntry* entry =
+        (const SaveCatalogEntry*)(mapped + HEADER_SIZE + (size_t)index * sizeof(SaveCatalogEntry));
+    return entry->checksum == recordChecksum(*entry) ? entry : nullptr;
+}
+
+unsigned long long SaveStore::recordChecksum(const SaveCatalogEntry& entry)
+{
+    return hashBytes(&entry, offsetof(SaveCatalogEntry, checksum));
+}
+
+int SaveStore::findSlot(const string& slot) const
+{
+    char name[32];
+    copyName(name, slot);
+    unordered_map<string, int>::const_iterator found = latestBySlot.find(string(name, sizeof(name)));
+    return found != latestBySlot.end() ? found->second : -1;
+}
+
+// Byte-oriented LZ77. A control byte below 0x80 is followed by that many
+// plus one literal bytes; from 0x80 up it is a match of (byte & 0x7F) + 3
+// bytes starting the next two bytes (little endian) back in the output.
+void SaveStore::compress(const string& in, string& out)
+{
+    const size_t WINDOW = 65535;
+    vector<int> head(4096, -1);  // Last position of each 3-byte hash
+    size_t n = in.size();
+    size_t literalStart = 0;
+    size_t i = 0;
+    out.clear();
+
+    auto flushLiterals = [&](size_t end) {
+        while (literalStart < end)
+        {
+            size_t run = end - literalStart > 128 ? 128 : end - literalStart;
+            out += (char)(run - 1);
+            out.append(in, literalStart, run);
+            literalStart += run;
+        }
+    };
+
+    while (i + 3 <= n)
+    {
+        const unsigned char* p = (const unsigned char*)in.data() + i;
+        unsigned key = ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> 20;
+        int candidate = head[key];
+        head[key] = (int)i;
+        if (candidate >= 0 && i - candidate <= WINDOW && memcmp(in.data() + candidate, p, 3) == 0)
+        {
+            size_t length = 3;
+            while (i + length < n && length < 130 && in[candidate + length] == in[i + length])
+            {
+                length++;
+            }
+            flushLiterals(i);
+            size_t distance = i - candidate;
+            out += (char)(0x80 | (length - 3));
+            out += (char)(distance & 0xFF);
+            out += (char)(distance >> 8);
+            i += length;
+            literalStart = i;
+        }
+        else
+        {
+            i++;
+        }
+    }
+    flushLiterals(n);
+}
+
+bool SaveStore::decompress(const unsigned char* in, size_t length, size_t rawSize, string& out)
+{
+    out.clear();
+    out.reserve(rawSize);
+    size_t pos = 0;
+    while (pos < length)
+    {
+        unsigned char control = in[pos++];
+        if (control < 0x80)
+        {
+            size_t run = (size_t)control + 1;
+            if (pos + run > length || out.size() + run > rawSize)
+            {
+                return false;
+            }
+            out.append((const char*)in + pos, run);
+            pos += run;
+        }
+        else
+        {
+            size_t count = (size_t)(control & 0x7F) + 3;
+            if (pos + 2 > length)
+            {
+                return false;
+            }
+            size_t distance = in[pos] | (size_t)in[pos + 1] << 8;
+            pos += 2;
+            if (distance == 0 || distance > out.size() || out.size() + count > rawSize)
+            {
+                return false;
+            }
+            size_t from = out.size() - distance;
+            for (size_t k = 0; k < count; k++)
+            {
+                out += out[from + k];  // Byte by byte: matches may overlap
+            }
+        }
+    }
+    return out.size() == rawSize;
+}
+
+bool SaveStore::save(const string& slot, const Kingdom& kingdom)
+{
+    MemoryScope scope(kingdom.getMemoryAccount(), MEMORY_SAVE, "SaveStore::save");
+    if (slot.empty())
+    {
+        Visual::printError("Slot name cannot be empty!");
+        return false;
+    }
+
+    SaveState state = kingdom.captureSaveState();
+    string text = Kingdom::formatSave(state);
+    unsigned long long hash = hashBytes(text.data(), text.size());
+
+    if (!isHashIndexBuilt)
+    {
+        int count = getSlotCount();
+        for (int i = 0; i < count; i++)
+        {
+            const SaveCatalogEntry* entry = getEntry(i);
+            if (entry != nullptr)
+            {
+                blobsByHash[entry->contentHash] = i;
+            }
+        }
+        isHashIndexBuilt = true;
+    }
+
+    SaveCatalogEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    copyName(entry.slot, slot);
+    copyName(entry.kingdom, kingdom.getName());
+    entry.turn = state.turn;
+    entry.population = state.totalPeople;
+    entry.goldRaw = state.gold.getRaw();
+    entry.contentHash = hash;
+    entry.rawSize = (unsigned)text.size();
+
+    // Reuse the blob of an identical save if there is one
+    unordered_map<unsigned long long, int>::const_iterator found = blobsByHash.find(hash);
+    const SaveCatalogEntry* same = found != blobsByHash.end() ? getEntry(found->second) : nullptr;
+    if (same != nullptr && same->contentHash == hash && same->rawSize == entry.rawSize)
+    {
+        entry.blobOffset = same->blobOffset;
+        entry.blobSize = same->blobSize;
+    }
+    else
+    {
+        string packed;
+        compress(text, packed);
+        FILE* pack = fopen(packPath.c_str(), "ab");
+        if (pack == nullptr)
+        {
+            Visual::printError(VFMT("Cannot open {}!"), packPath);
+            return false;
+        }
+        seekFile(pack, 0, SEEK_END);
+        entry.blobOffset = (unsigned long long)tellFile(pack);
+        entry.blobSize = (unsigned)packed.size();
+        bool written = fwrite(packed.data(), 1, packed.size(), pack) == packed.size() && syncFile(pack);
+        if (fclose(pack) != 0 || !written)
+        {
+            Visual::printError(VFMT("Cannot write {}!"), packPath);
+            return false;
+        }
+    }
+    entry.checksum = recordChecksum(entry);
+
+    // The blob is on disk before the record that points to it, and the
+    // record before the count that makes it visible. An existing slot is
+    // never written in place: its new record goes at the end like any other.
+    int count = getSlotCount();
+    bool isNewCatalog = mapped == nullptr;
+    unmapCatalog();
+    FILE* catalog = fopen(catalogPath.c_str(), isNewCatalog ? "w+b" : "r+b");
+    if (catalog == nullptr)
+    {
+        Visual::printError(VFMT("Cannot open {}!"), catalogPath);
+        mapCatalog();
+        return false;
+    }
+    int index = count++;
+    unsigned char header[HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, "SHSC", 4);
+    memcpy(header + 4, &CATALOG_VERSION, sizeof(CATALOG_VERSION));
+    unsigned recordCount = (unsigned)count;
+    memcpy(header + 8, &recordCount, sizeof(recordCount));
+
+    bool ok = seekFile(catalog, HEADER_SIZE + (long long)index * (long long)sizeof(entry), SEEK_SET) &&
+        fwrite(&entry, sizeof(entry), 1, catalog) == 1 && syncFile(catalog) &&
+        seekFile(catalog, 0, SEEK_SET) &&
+        fwrite(header, sizeof(header), 1, catalog) == 1 && syncFile(catalog);
+    ok = fclose(catalog) == 0 && ok;
+    mapCatalog();
+    if (!ok)
+    {
+        Visual::printError(VFMT("Cannot write {}!"), catalogPath);
+        return false;
+    }
+
+    blobsByHash[hash] = index;
+    Visual::printSuccess(VFMT("Game saved to slot {}."), entry.slot);
+    return true;
+}
+
+bool SaveStore::load(const string& slot, Kingdom& kingdom)
+{
+    int index = findSlot(slot);
+    if (index < 0)
+    {
+        Visual::printError(VFMT("No save in slot {}!"), slot);
+        return false;
+    }
+    const SaveCatalogEntry* entry = getEntry(index);
+    if (entry->blobSize > (unsigned)MAX_BLOB || entry->rawSize > (unsigned)MAX_BLOB)
+    {
+        Visual::printError(VFMT("Save in slot {} is damaged!"), slot);
+        return false;
+    }
+
+    vector<unsigned char> packed(entry->blobSize);
+    FILE* pack = fopen(packPath.c_str(), "rb");
+    bool ok = pack != nullptr && seekFile(pack, (long long)entry->blobOffset, SEEK_SET) &&
+        fread(packed.data(), 1, packed.size(), pack) == packed.size();
+    if (pack != nullptr)
+    {
+        fclose(pack);
+    }
+
+    string text;
+    SaveState state;
+    ok = ok && decompress(packed.data(), packed.size(), entry->rawSize, text) &&
+        hashBytes(text.data(), text.size()) == entry->contentHash;
+    if (ok)
+    {
+        istringstream in(text);
+        ok = Kingdom::readSave(in, state);
+    }
+    if (!ok)
+    {
+        Visual::printError(VFMT("Save in slot {} is damaged!"), slot);
+        return false;
+    }
+
+    kingdom.applySaveState(state);
+    Visual::printSuccess(VFMT("Game loaded from slot {}."), slot);
+    return true;
+}
+
+void SaveStore::listSlots() const
+{
+    int count = getSlotCount();
+    if (count == 0)
+    {
+        Visual::printInfo("No saved slots.");
+        return;
+    }
+    int shown = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const SaveCatalogEntry* entry = getEntry(i);
+        if (entry == nullptr)
+        {
+            shown++;
+            Visual::printWarning(VFMT("{}. (damaged record)"), shown);  // Damaged records are still listed
+            continue;
+        }
+        unordered_map<string, int>::const_iterator latest = latestBySlot.find(string(entry->slot, sizeof(entry->slot)));
+        if (latest == latestBySlot.end() || latest->second != i)
+        {
+            continue;  // Replaced by a later save to the same slot
+        }
+        shown++;
+        Visual::printMessage(VFMT("{}. {} - {}, turn {}, {} gold, {} people"), shown, entry->slot,
+            entry->kingdom, entry->turn, Money::fromRaw(entry->goldRaw), entry->population);
+    }
+}
+
+// Global function implementations
+void applyRandomEvent(Kingdom& kingdom) {
+    MemoryScope scope(kingdom.getMemoryAccount(), MEMORY_KINGDOM, "applyRandomEvent");
+    GameRandom& random = kingdom.getRandom();
+    long long inputs[RULE_INPUT_COUNT] = {};
+    inputs[INPUT_ROLL] = random.nextInt(100);
+    int event = (int)Rules::evaluate(RULE_EVENT, inputs);  // Odds come from the rules
+
+    // Update the security of one trade road
+    kingdom.getMarket().updateRoadSecurity();
+
+    if (event == EVENT_PLAGUE)
+    {
+        inputs[INPUT_PEOPLE] = kingdom.getPeople().getTotalPeople();
+        inputs[INPUT_SHORTAGE] = kingdom.getMarket().checkFoodShortage();
+        int populationLoss = (int)Rules::evaluate(RULE_PLAGUE_LOSS, inputs);  // Starvation kills more
+        if (inputs[INPUT_SHORTAGE]) {
+            kingdom.getPeople().decreasePopulation(populationLoss);
+            Visual::printWarning("Food shortage has led to starvation!");
+            Visual::printError(VFMT("Population decreased by {} people."), populationLoss);
+        }
+        else {
+            int fallen = kingdom.startPlague();  // The epidemic decides how many die
+            Visual::printWarning("A deadly plague has struck the kingdom!");
+            Visual::printError(VFMT("{} people have fallen ill."), fallen);
+        }
+    }
+    else if (event == EVENT_WAR)
+    {
+        int invader = kingdom.getDiplomacy().declareWar(random);
+        Visual::printWarning(VFMT("{} has declared war!"), kingdom.getDiplomacy().getNeighbourName(invader));
+
+        // Enemy army is 80-120% of our size with average fighting power, and
+        // never so small that a kingdom without soldiers could hold it off
+        static const int MIN_ENEMY_SIZE = 50;
+        BattleEngine battles;
+        int battle = battles.addBattle();
+        int enemySize = kingdom.getArmy().getSize() * (80 + random.nextInt(41)) / 100;
+        if (enemySize < MIN_ENEMY_SIZE) enemySize = MIN_ENEMY_SIZE;
+        battles.addForce(battle, enemySize, Army::POWER_ONE, true);
+        battles.addArmy(battle, kingdom.getArmy(), kingdom.getMarket().getWeaponsStockpile(), false);
+        battles.resolveAll();
+
+        const BattleResult& result = battles.getResult(battle);
+        int resourceLoss = (int)Rules::evaluate(RULE_WAR_RESOURCE_LOSS, inputs);
+        kingdom.getMarket().decreaseResource("weapons", resourceLoss);
+        kingdom.getMarket().decreaseResource("food", resourceLoss);
+
+        if (result.attackerWon)
+        {
+            Money goldLoss = kingdom.getEconomy().getGold().percent((int)Rules::evaluate(RULE_WAR_GOLD_PERCENT, inputs));
+            kingdom.getEconomy().decreaseGold(goldLoss);
+            Visual::printError(VFMT("Our army was defeated! Lost {} gold, {} soldiers, and resources."),
+                goldLoss, result.defenderLosses);
+        }
+        else
+        {
+            Visual::printSuccess(VFMT("The invaders were repelled! Enemy lost {} soldiers."),
+                result.attackerLosses);
+            Visual::printWarning(VFMT("Lost {} soldiers and resources."), result.defenderLosses);
+        }
+    }
+    else if (event == EVENT_DISASTER)
+    {
+        int resourceLoss = (int)Rules::evaluate(RULE_DISASTER_LOSS, inputs);
+        kingdom.getMarket().decreaseResource("food", resourceLoss);
+        kingdom.getMarket().decreaseResource("wood", resourceLoss);
+        Visual::printWarning("A natural disaster has struck!");
+        Visual::printError(VFMT("Lost {} units of food and wood."), resourceLoss);
+    }
+    else if (event == EVENT_ASSASSINATION)
+    {
+        if (random.nextInt(2) == 0) // 50% chance of success
+        {
+            int stabilityLoss = (int)Rules::evaluate(RULE_ASSASSINATION_STABILITY, inputs);
+            kingdom.getPolitics().decreaseStability(stabilityLoss);
+            Visual::printWarning("An assassination attempt on the king has failed!");
+            Visual::printError(VFMT("Kingdom stability decreased by {}%."), stabilityLoss);
+        }
+        else
+        {
+            kingdom.getPolitics().holdElection(kingdom.getPeople(), ELECTION_PLURALITY); // Force new election
+            Visual::printWarning("The king has been assassinated!");
+            Visual::printInfo("A new election must be held.");
+        }
+    }
+    else if (event == EVENT_REVOLT)
+    {
+        Money goldLoss = kingdom.getEconomy().getGold().percent((int)Rules::evaluate(RULE_REVOLT_GOLD_PERCENT, inputs));
+        int stabilityLoss = (int)Rules::evaluate(RULE_REVOLT_STABILITY, inputs);
+        kingdom.getEconomy().decreaseGold(goldLoss);
+        kingdom.getPolitics().decreaseStability(stabilityLoss);
+        Visual::printWarning("The peasants are revolting!");
+        Visual::printError(VFMT("Lost {} gold and stability decreased by {}%."), goldLoss, stabilityLoss);
+    }
+    else if (event == EVENT_WINDFALL)
+    {
+        Money goldGain = kingdom.getEconomy().getGold().percent((int)Rules::evaluate(RULE_WINDFALL_PERCENT, inputs));
+        kingdom.getEconomy().increaseGold(goldGain);
+        Visual::printSuccess("A wealthy merchant has donated to the kingdom!");
+        Visual::printInfo(VFMT("Gained {} gold."), goldGain);
+    }
+    // Any other result: nothing happens
+}
+
+void executeCommand(Kingdom& kingdom, const TurnCommand& command) {
+    // Subsystem charged for each menu action
+    static const int ACTION_TAGS[ACTION_NAME_COUNT] = {
+        MEMORY_KINGDOM, MEMORY_STATUS, MEMORY_ECONOMY, MEMORY_ARMY, MEMORY_ARMY, MEMORY_BANK,
+        MEMORY_BANK, MEMORY_MARKET, MEMORY_POLITICS, MEMORY_DIPLOMACY, MEMORY_DIPLOMACY, MEMORY_SAVE,
+        MEMORY_SAVE, MEMORY_ECONOMY, MEMORY_ARMY, MEMORY_COMMUNICATION, MEMORY_COMMUNICATION, MEMORY_POLITICS
+    };
+    bool isKnown = command.action >= 0 && command.action < ACTION_NAME_COUNT;
+    MemoryScope scope(kingdom.getMemoryAccount(), isKnown ? ACTION_TAGS[command.action] : MEMORY_KINGDOM,
+        isKnown ? ACTION_NAMES[command.action] : "unknown action");
+    MemoryStats before = MemoryTracker::getTotal(kingdom.getMemoryAccount());
+
+    switch (command.action) {
+    case 2: // Collect Taxes
+        kingdom.getEconomy().collectTaxes(kingdom.getPeople());
+        break;
+    case 3: // Train Army
+        kingdom.getArmy().train((int)command.value);
+        break;
+    case 4: // Pay Soldiers
+        kingdom.getArmy().paySoldiers(kingdom.getEconomy());
+        break;
+    case 5: // Take Loan
+        kingdom.getBank().takeLoan(Money::fromRaw(command.value),
+            command.text.empty() ? Bank::DEFAULT_TERM : atoi(command.text.c_str()), kingdom.getEconomy());
+        break;
+    case 6: // Repay Loan
+        kingdom.getBank().repayLoan(Money::fromRaw(command.value), kingdom.getEconomy());
+        break;
+    case 7: // Trade Resources
+        kingdom.getMarket().tradeResource(command.text, (int)command.value, kingdom.getEconomy(),
+            kingdom.getDiplomacy(), kingdom.getCaravans().findTradeRoute());
+        break;
+    case 8: // Hold Election
+        kingdom.getPolitics().holdElection(kingdom.getPeople(), (int)command.value);
+        break;
+    case 9: // Make Treaty
+        kingdom.getDiplomacy().makeTreaty(command.text);
+        break;
+    case 10: // Break Treaty
+        kingdom.getDiplomacy().breakTreaty();
+        break;
+    case 13: // Fund Public Services
+        kingdom.getEconomy().fundPublicServices((int)command.value);
+        break;
+    case 14: // Update Army Equipment
+        kingdom.getArmy().updateEquipment((int)command.value);
+        break;
+    case 15: // Send Message
+        kingdom.getCommunication().sendMessage(command.text);
+        break;
+    case 17: // Set Policy
+        kingdom.getPolitics().togglePolicy((int)command.value);
+        break;
+    default: // Viewing, saving and loading do not change the shared world
+        break;
+    }
+    MemoryTracker::recordAction(command.action, before, MemoryTracker::getTotal(kingdom.getMemoryAccount()));
+}
+
+// Stability lost to a food shortage this turn
+static int shortagePenalty(Kingdom& kingdom) {
+    long long inputs[RULE_INPUT_COUNT] = {};
+    inputs[INPUT_FOOD] = kingdom.getMarket().getFoodStockpile();
+    inputs[INPUT_STABILITY] = kingdom.getPolitics().getStability();
+    return (int)Rules::evaluate(RULE_SHORTAGE_PENALTY, inputs);
+}
+
+// The standard stages, run one after another on the calling thread
+static const TurnPipeline& standardTurn() {
+    static TurnPipeline pipeline(1);  // No workers
+    static bool isBuilt = (pipeline.addStandardStages(), true);
+    (void)isBuilt;
+    return pipeline;
+}
+
+void updateGameState(Kingdom& kingdom) {
+    MemoryScope scope(kingdom.getMemoryAccount(), MEMORY_KINGDOM, "updateGameState");
+    standardTurn().runSequential(kingdom, TurnCommand(), TurnPipeline::UPDATE_STAGE);
+}
+
+void runWorldTurn(Kingdom* const* kingdoms, const TurnCommand* commands, int count) {
+    for (int i = 0; i < count; i++) {
+        standardTurn().runSequential(*kingdoms[i], commands[i]);
+    }
+    WorldEconomy::update(kingdoms, count);  // The world economy moves once every kingdom is done
+}
+
+void runTurn(Kingdom& kingdom, const TurnCommand& command) {
+    Kingdom* self = &kingdom;
+    runWorldTurn(&self, &command, 1);  // A kingdom on its own is its whole world
+}
+
+// Kingdom state hash for lockstep checks (FNV-1a over the simulated fields)
+static void hashValue(unsigned long long& hash, long long value) {
+    for (int i = 0; i < 8; i++) {
+        hash ^= (unsigned long long)(value >> (i * 8)) & 0xFF;
+        hash *= 0x100000001B3ULL;
+    }
+}
+
+unsigned long long Kingdom::computeStateHash() const {
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    hashValue(hash, turn);
+    for (int i = 0; i < LEDGER_SLOT_COUNT; i++) {
+        hashValue(hash, ledger.get(i));
+    }
+    hashValue(hash, people->getTotalPeople());
+    hashValue(hash, people->getSick());
+    hashValue(hash, people->getPeasants());
+    hashValue(hash, people->getMerchants());
+    hashValue(hash, people->getNobility());
+    hashValue(hash, people->getMilitary());
+    const CitizenPool* agents = people->getAgents();
+    if (agents != nullptr) {
+        for (int i = 0; i < agents->getChunkCount(); i++) {
+            const CitizenChunk& chunk = agents->getChunk(i);
+            hashValue(hash, chunk.count);
+            for (int slot = 0; slot < chunk.count; slot++) {
+                hashValue(hash, ((long long)chunk.socialClass[slot] << 32) | (chunk.job[slot] << 24) |
+                    (chunk.age[slot] << 16) | (chunk.health[slot] << 8) | chunk.flags[slot]);
+            }
+        }
+        hashValue(hash, (long long)agents->getRandomState());
+    }
+    hashValue(hash, army->getSize());
+    hashValue(hash, army->getMorale());
+    hashValue(hash, army->getTrainingLevel());
+    hashValue(hash, army->getEquipment());
+    hashValue(hash, army->getCasualties());
+    hashValue(hash, bank->getLoanAmount().getRaw());
+    hashValue(hash, bank->getLoans().getCount());
+    hashValue(hash, bank->getInterestRate());
+    hashValue(hash, economy->getPublicServices());
+    hashValue(hash, economy->getInflationRate());
+    hashValue(hash, economy->getIsRecession());
+    hashValue(hash, market->getPriceLevel());
+    const TradeNetwork& roads = market->getRoads();
+    for (int id = 0; id < roads.getKingdomCount(); id++) {
+        for (const TradeEdge& edge : roads.getRoads(id)) {
+            hashValue(hash, edge.attackProbability * 1000 + llround(edge.riskLevel * 100));
+        }
+    }
+    hashValue(hash, politics->getStability());
+    hashValue(hash, politics->getKingSkill());
+    hashValue(hash, politics->getPolicies());
+    const DiplomacyNetwork& ties = diplomacy->getNetwork();
+    for (int neighbour = 1; neighbour <= Diplomacy::NEIGHBOUR_COUNT; neighbour++) {
+        hashValue(hash, ties.getRelations(Diplomacy::HOME, neighbour));
+        hashValue(hash, ties.getIsAlliance(Diplomacy::HOME, neighbour));
+        hashValue(hash, ties.getTradeSanctions(neighbour, Diplomacy::HOME));
+    }
+    hashValue(hash, communication->getMessageCount());
+    hashValue(hash, weather.getFoodProductionPercent());
+    hashValue(hash, weather.getDuration());
+    const ClimateModel& climate = weather.getRegions();
+    for (int region = 0; region < climate.getRegionCount(); region++) {
+        hashValue(hash, climate.getCondition(region) * 256 + climate.getRemaining(region));
+    }
+    for (int region = 0; region < epidemic.getRegionCount(); region++) {
+        for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+            hashValue(hash, epidemic.getSusceptible(region, c));
+            hashValue(hash, epidemic.getInfected(region, c));
+            hashValue(hash, epidemic.getRecovered(region, c));
+        }
+    }
+    hashValue(hash, (long long)random.getState());
+    return hash;
+}
+
+// TurnCommand encoding: action, zigzag varint value, text length, text
+int TurnCommand::encode(unsigned char* buffer) const {
+    int length = 0;
+    buffer[length++] = (unsigned char)action;
+
+    unsigned long long zigzag = ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+    do {
+        unsigned char byte = zigzag & 0x7F;
+        zigzag >>= 7;
+        buffer[length++] = zigzag != 0 ? (byte | 0x80) : byte;
+    } while (zigzag != 0);
+
+    int textLength = text.size() > 100 ? 100 : (int)text.size();
+    buffer[length++] = (unsigned char)textLength;
+    for (int i = 0; i < textLength; i++) {
+        buffer[length++] = (unsigned char)text[i];
+    }
+    return length;
+}
+
+int TurnCommand::decode(const unsigned char* buffer, int length) {
+    int position = 0;
+    if (length < 3) {
+        return 0;
+    }
+    action = buffer[position++];
+
+    unsigned long long zigzag = 0;
+    for (int shift = 0; ; shift += 7) {
+        if (position >= length || shift > 63) {
+            return 0;
+        }
+        unsigned char byte = buffer[position++];
+        zigzag |= (unsigned long long)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    value = (long long)(zigzag >> 1) ^ -(long long)(zigzag & 1);
+
+    if (position >= length) {
+        return 0;
+    }
+    int textLength = buffer[position++];
+    if (position + textLength > length) {
+        return 0;
+    }
+    text.assign((const char*)buffer + position, textLength);
+    return position + textLength;
+}
+
+// LockstepSession class implementation
+// Packet layout: 'S', turn (4 bytes), player (1 byte), hash (8 bytes), rules hash (8 bytes), command
+static const int LOCKSTEP_HEADER = 22;
+
+LockstepSession::LockstepSession(int id, int count, int port, unsigned long long seed)
+    : playerId(id), playerCount(count), basePort(port), socketHandle(-1),
+      lastPacketSize(0), previousPacketSize(0), lastHash(0), turn(1), isDesynced(false), isRulesMismatch(false),
+      bytesSent(0) {
+    for (int i = 0; i < playerCount; i++) {
+        // Every peer builds the same kingdoms from the same seeds
+        kingdoms.push_back(new Kingdom("Player " + to_string(i + 1), seed + 0x9E3779B97F4A7C15ULL * (i + 1)));
+    }
+    commands.resize(playerCount);
+    received.assign(playerCount, false);
+
+    lastHash = 0xCBF29CE484222325ULL;
+    for (Kingdom* kingdom : kingdoms) {
+        hashValue(lastHash, (long long)kingdom->computeStateHash());
+    }
+}
+
+LockstepSession::~LockstepSession() {
+    for (Kingdom* kingdom : kingdoms) {
+        delete kingdom;
+    }
+    if (socketHandle != -1) {
+#ifdef _WIN32
+        closesocket((SOCKET)socketHandle);
+        WSACleanup();
+#else
+        close((int)socketHandle);
+#endif
+    }
+}
+
+bool LockstepSession::open() {
+#ifdef _WIN32
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+        Visual::printError("Cannot start networking!");
+        return false;
+    }
+    SOCKET handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (handle == INVALID_SOCKET) {
+        WSACleanup();
+        Visual::printError("Cannot create lockstep socket!");
+        return false;
+    }
+#else
+    int handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (handle < 0) {
+        Visual::printError("Cannot create lockstep socket!");
+        return false;
+    }
+#endif
+    socketHandle = (long long)handle;
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((unsigned short)(basePort + playerId));
+    if (::bind(handle, (sockaddr*)&address, sizeof(address)) != 0) {
+        Visual::printError(VFMT("Cannot bind lockstep port {}!"), basePort + playerId);
+        return false;
+    }
+    return true;
+}
+
+void LockstepSession::sendPacket(const unsigned char* packet, int size) {
+    for (int player = 0; player < playerCount; player++) {
+        if (player == playerId) {
+            continue;
+        }
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons((unsigned short)(basePort + player));
+#ifdef _WIN32
+        sendto((SOCKET)socketHandle, (const char*)packet, size, 0, (sockaddr*)&address, sizeof(address));
+#else
+        sendto((int)socketHandle, packet, size, 0, (sockaddr*)&address, sizeof(address));
+#endif
+        bytesSent += size;
+    }
+}
+
+void LockstepSession::sendCommand(const TurnCommand& command) {
+    commands[playerId] = command;
+    received[playerId] = true;
+
+    unsigned char* packet = lastPacket;
+    packet[0] = 'S';
+    for (int i = 0; i < 4; i++) {
+        packet[1 + i] = (unsigned char)(turn >> (i * 8));
+    }
+    packet[5] = (unsigned char)playerId;
+    unsigned long long rulesHash = Rules::get().getHash();
+    for (int i = 0; i < 8; i++) {
+        packet[6 + i] = (unsigned char)(lastHash >> (i * 8));
+        packet[14 + i] = (unsigned char)(rulesHash >> (i * 8));
+    }
+    lastPacketSize = LOCKSTEP_HEADER + command.encode(packet + LOCKSTEP_HEADER);
+    sendPacket(lastPacket, lastPacketSize);
+}
+
+void LockstepSession::acceptPacket(const PendingPacket& packet) {
+    int player = packet.player;
+    if (player < 0 || player >= playerCount || player == playerId) {
+        return;
+    }
+    if (packet.turn > turn) {
+        future.push_back(packet);
+        return;
+    }
+    if (packet.turn < turn) {
+        // The sender is still waiting on our previous turn; send it again
+        if (packet.turn == turn - 1 && previousPacketSize > 0) {
+            sendPacket(previousPacket, previousPacketSize);
+        }
+        return;
+    }
+    if (received[player]) {
+        return;  // Duplicate
+    }
+    if (packet.rulesHash != Rules::get().getHash()) {
+        if (!isRulesMismatch) {
+            Visual::printError(VFMT("Player {} runs different rules; refusing turn {}!"), player + 1, turn);
+        }
+        isRulesMismatch = true;
+        return;
+    }
+    if (packet.hash != lastHash && !isDesynced) {
+        isDesynced = true;
+        Visual::printError(VFMT("Desync with player {} before turn {}!"), player + 1, turn);
+    }
+    commands[player] = packet.command;
+    received[player] = true;
+}
+
+bool LockstepSession::receiveCommands(int timeoutMs) {
+    // Packets that arrived early for this turn
+    for (size_t i = 0; i < future.size(); ) {
+        if (future[i].turn == turn) {
+            PendingPacket pending = future[i];
+            future.erase(future.begin() + i);
+            acceptPacket(pending);
+        }
+        else {
+            i++;
+        }
+    }
+
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+    while (!isRulesMismatch) {
+        bool complete = true;
+        for (int player = 0; player < playerCount; player++) {
+            complete = complete && received[player];
+        }
+        if (complete) {
+            return true;
+        }
+        if (chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+
+        fd_set readable;
+        FD_ZERO(&readable);
+#ifdef _WIN32
+        FD_SET((SOCKET)socketHandle, &readable);
+#else
+        FD_SET((int)socketHandle, &readable);
+#endif
+        timeval wait = {0, 50000};
+        if (select((int)socketHandle + 1, &readable, nullptr, nullptr, &wait) <= 0) {
+            // Nothing arrived; our packet may have been lost, so send it again
+            if (lastPacketSize > 0) {
+                sendPacket(lastPacket, lastPacketSize);
+            }
+            continue;
+        }
+
+        unsigned char packet[MAX_PACKET];
+#ifdef _WIN32
+        int size = recvfrom((SOCKET)socketHandle, (char*)packet, MAX_PACKET, 0, nullptr, nullptr);
+#else
+        int size = (int)recvfrom((int)socketHandle, packet, MAX_PACKET, 0, nullptr, nullptr);
+#endif
+        if (size < LOCKSTEP_HEADER || packet[0] != 'S') {
+            continue;
+        }
+        PendingPacket incoming = {0, packet[5], 0, 0, TurnCommand()};
+        for (int i = 0; i < 4; i++) {
+            incoming.turn |= packet[1 + i] << (i * 8);
+        }
+        for (int i = 0; i < 8; i++) {
+            incoming.hash |= (unsigned long long)packet[6 + i] << (i * 8);
+            incoming.rulesHash |= (unsigned long long)packet[14 + i] << (i * 8);
+        }
+        if (incoming.command.decode(packet + LOCKSTEP_HEADER, size - LOCKSTEP_HEADER) == 0) {
+            continue;
+        }
+        acceptPacket(incoming);
+    }
+    return false;
+}
+
+void LockstepSession::advance() {
+    // Commands are applied in player order so every peer runs the same steps
+    lastHash = 0xCBF29CE484222325ULL;
+    runWorldTurn(kingdoms.data(), commands.data(), playerCount);  // The players share one world economy
+    for (int player = 0; player < playerCount; player++) {
+        hashValue(lastHash, (long long)kingdoms[player]->computeStateHash());
+    }
+
+    for (int i = 0; i < lastPacketSize; i++) {
+        previousPacket[i] = lastPacket[i];
+    }
+    previousPacketSize = lastPacketSize;
+    lastPacketSize = 0;
+    received.assign(playerCount, false);
+    turn++;
+}
+
+// Scripted command for the loopback check
+static TurnCommand scriptedCommand(GameRandom& script) {
+    static const char* resources[] = {"wood", "stone", "iron", "food", "weapons"};
+    switch (script.nextInt(13)) {
+    case 0: return TurnCommand(2);
+    case 1: return TurnCommand(3, script.nextInt(5) + 1);
+    case 2: return TurnCommand(4);
+    case 3: return TurnCommand(5, Money(script.nextInt(200) + 1).getRaw(), to_string(4 + script.nextInt(21)));
+    case 4: return TurnCommand(6, Money(script.nextInt(100) + 1).getRaw());
+    case 5: return TurnCommand(7, script.nextInt(41) - 20, resources[script.nextInt(5)]);
+    case 6: return TurnCommand(8, script.nextInt(ELECTION_SYSTEM_COUNT));
+    case 7: return TurnCommand(9, 0, "Peace with Eastland");
+    case 8: return TurnCommand(10);
+    case 9: return TurnCommand(13, script.nextInt(100));
+    case 10: return TurnCommand(14, script.nextInt(10) + 1);
+    case 11: return TurnCommand(17, script.nextInt(POLICY_COUNT));
+    default: return TurnCommand(0);
+    }
+}
+
+bool runLockstepLoopback(int playerCount, int turns, unsigned long long seed) {
+    if (playerCount < 2 || playerCount > 16 || turns < 1) {
+        Visual::printError("Lockstep check needs 2-16 players and at least one turn!");
+        return false;
+    }
+
+    bool wasQuiet = Visual::quietMode();
+    Visual::setQuiet(true);
+
+    vector<LockstepSession*> peers;
+    bool ok = true;
+    string failure;
+    for (int i = 0; i < playerCount && ok; i++) {
+        peers.push_back(new LockstepSession(i, playerCount, 47000, seed));
+        if (!peers.back()->open()) {
+            ok = false;
+            failure = "could not open loopback socket";
+        }
+    }
+
+    GameRandom script(seed ^ 0x5DEECE66DULL);
+    for (int t = 0; t < turns && ok; t++) {
+        for (LockstepSession* peer : peers) {
+            peer->sendCommand(scriptedCommand(script));
+        }
+        for (LockstepSession* peer : peers) {
+            if (!peer->receiveCommands(2000)) {
+                ok = false;
+                failure = peer->getIsRulesMismatch() ? "peers run different rules" :
+                    "timed out waiting for commands on turn " + to_string(peer->getTurn());
+                break;
+            }
+        }
+        if (!ok) {
+            break;
+        }
+        for (LockstepSession* peer : peers) {
+            peer->advance();
+        }
+        for (LockstepSession* peer : peers) {
+            if (peer->getIsDesynced() || peer->getStateHash() != peers[0]->getStateHash()) {
+                ok = false;
+                failure = "peers diverged on turn " + to_string(peer->getTurn() - 1);
+                break;
+            }
+        }
+    }
+
+    long long bytes = peers.empty() ? 0 : peers[0]->getBytesSent();
+    for (LockstepSession* peer : peers) {
+        delete peer;
+    }
+    Visual::setQuiet(wasQuiet);
+
+    if (!ok) {
+        Visual::printError(VFMT("Lockstep check failed: {}"), failure);
+        return false;
+    }
+    Visual::printSuccess(VFMT("Lockstep check passed: {} players, {} turns, {} bytes sent per peer per turn."),
+        playerCount, turns, bytes / turns);
+    return true;
+}
+
+// WorkerPool class implementation
+WorkerPool::WorkerPool(int threadCount)
+    : body(nullptr), count(0), next(0), busyWorkers(0), generation(0), isStopping(false) {
+    // The calling thread also works, so start one fewer worker
+    for (int i = 1; i < threadCount; i++) {
+        workers.push_back(thread(&WorkerPool::workerLoop, this));
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        lock_guard<mutex> guard(lock);
+        isStopping = true;
+    }
+    wake.notify_all();
+    for (thread& worker : workers) {
+        worker.join();
+    }
+}
+
+WorkerPool& WorkerPool::shared() {
+    static WorkerPool pool((int)thread::hardware_concurrency());
+    return pool;
+}
+
+void WorkerPool::run(int count, const function<void(int)>& body) {
+    unique_lock<mutex> job(jobLock, try_to_lock);
+    if (count <= 1 || workers.empty() || !job.owns_lock()) {
+        for (int i = 0; i < count; i++) {
+            body(i);
+        }
+        return;
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        this->body = &body;
+        this->count = count;
+        next = 0;
+        busyWorkers = (int)workers.size();
+        generation++;
+    }
+    wake.notify_all();
+    work();
+    unique_lock<mutex> guard(lock);
+    finished.wait(guard, [this] { return busyWorkers == 0; });
+    this->body = nullptr;
+}
+
+void WorkerPool::work() {
+    for (int i = next++; i < count; i = next++) {
+        (*body)(i);
+    }
+}
+
+void WorkerPool::workerLoop() {
+    unsigned long long joined = 0;
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        wake.wait(guard, [this, joined] { return isStopping || generation != joined; });
+        if (isStopping) {
+            return;
+        }
+        joined = generation;
+        guard.unlock();
+        work();
+        guard.lock();
+        if (--busyWorkers == 0) {
+            finished.notify_one();
+        }
+    }
+}
+
+// TurnPipeline class implementation
+TurnPipeline::TurnPipeline(int threadCount)
+    : batchKingdoms(nullptr), batchCommands(nullptr), unfinishedTasks(0), isStopping(false) {
+    // The calling thread also runs tasks, so start one fewer worker
+    for (int i = 1; i < threadCount; i++) {
+        workers.push_back(thread(&TurnPipeline::workerLoop, this));
+    }
+}
+
+TurnPipeline::~TurnPipeline() {
+    {
+        lock_guard<mutex> guard(lock);
+        isStopping = true;
+    }
+    wake.notify_all();
+    for (thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void TurnPipeline::addStage(const char* name, unsigned reads, unsigned writes, StageFunction run) {
+    Stage stage;
+    stage.name = name;
+    stage.reads = reads;
+    stage.writes = writes;
+    stage.run = run;
+    stage.dependencyCount = 0;
+
+    // Wait for every earlier stage that writes what we touch or reads what we write
+    int index = (int)stages.size();
+    for (int i = 0; i < index; i++) {
+        const Stage& earlier = stages[i];
+        if ((earlier.writes & (reads | writes)) != 0 || (earlier.reads & writes) != 0) {
+            stages[i].dependents.push_back(index);
+            stage.dependencyCount++;
+        }
+    }
+    stages.push_back(stage);
+}
+
+static void commandStage(Kingdom& kingdom, const TurnCommand& command) {
+    executeCommand(kingdom, command);
+}
+
+static void randomEventStage(Kingdom& kingdom, const TurnCommand&) {
+    if (kingdom.getTurn() % 4 == 0) {
+        applyRandomEvent(kingdom);  // Random event every 4 turns
+    }
+}
+
+static void populationStage(Kingdom& kingdom, const TurnCommand&) {
+    kingdom.getPeople().updateAgents(kingdom.getTurn());
+}
+
+static void productionStage(Kingdom& kingdom, const TurnCommand&) {
+    kingdom.getTerritory().updateProduction();
+    kingdom.getMarket().addProduction(kingdom.getTerritory());
+}
+
+static void weatherStage(Kingdom& kingdom, const TurnCommand&) {
+    kingdom.updateWeather();
+}
+
+static void foodStage(Kingdom& kingdom, const TurnCommand&) {
+    kingdom.getMarket().updateFoodStockpile(kingdom.getPeople().getTotalPeople(),
+        kingdom.weather.getFoodProduction(kingdom.getTerritory()));
+}
+
+static void epidemicStage(Kingdom& kingdom, const TurnCommand&) {
+    kingdom.updateEpidemic();
+}
+
+static void weaponsStage(Kingdom& kingdom, const TurnCommand&) {
+    kingdom.getMarket().updateWeaponsStockpile(kingdom.getArmy().getSize());
+}
+
+static void shortageStage(Kingdom& kingdom, const TurnCommand&) {
+    if (kingdom.getMarket().checkFoodShortage()) {
+        kingdom.getPolitics().decreaseStability(shortagePenalty(kingdom));
+        Visual::printWarning("Food shortage is causing unrest among the population!");
+    }
+}
+
+static void diplomacyStage(Kingdom& kingdom, const TurnCommand&) {
+    kingdom.getDiplomacy().simulateTurn();
+}
+
+static void advanceStage(Kingdom& kingdom, const TurnCommand&) {
+    kingdom.nextTurn();
+}
+
+void TurnPipeline::addStandardStages() {
+    addStage("command", DATA_ALL, DATA_ALL, commandStage);
+    addStage("random event", DATA_ALL, DATA_ALL & ~DATA_TURN, randomEventStage);
+    addStage("population", DATA_PEOPLE | DATA_FOOD | DATA_TURN, DATA_PEOPLE, populationStage);
+    addStage("production", DATA_TERRITORY | DATA_GOODS | DATA_WEAPONS, DATA_TERRITORY | DATA_GOODS | DATA_WEAPONS,
+        productionStage);
+    addStage("weather", DATA_WEATHER | DATA_TERRITORY | DATA_TURN, DATA_WEATHER, weatherStage);
+    addStage("food", DATA_PEOPLE | DATA_WEATHER | DATA_FOOD | DATA_TERRITORY, DATA_FOOD, foodStage);
+    addStage("epidemic", DATA_PEOPLE | DATA_FOOD | DATA_ECONOMY | DATA_GOODS | DATA_TURN, DATA_PEOPLE, epidemicStage);
+    addStage("weapons", DATA_ARMY | DATA_WEAPONS, 0, weaponsStage);
+    addStage("shortage", DATA_FOOD | DATA_POLITICS, DATA_POLITICS, shortageStage);
+    addStage("diplomacy", DATA_DIPLOMACY, DATA_DIPLOMACY, diplomacyStage);
+    addStage("advance", DATA_TURN, DATA_TURN, advanceStage);
+}
+
+void TurnPipeline::runSequential(Kingdom& kingdom, const TurnCommand& command, int firstStage) const {
+    if (firstStage == 0) {
+        Kingdom* self = &kingdom;
+        PolicyBatch::apply(&self, 1);  // Policies in force and loans act at the start of the turn
+        Bank::accrueInterest(&self, 1);
+    }
+    for (int i = firstStage; i < (int)stages.size(); i++) {
+        MemoryScope scope(kingdom.getMemoryAccount(), MEMORY_KINGDOM, stages[i].name);
+        stages[i].run(kingdom, command);
+    }
+}
+
+void TurnPipeline::runParallel(Kingdom* const* kingdoms, const TurnCommand* commands, int count) {
+    int stageCount = (int)stages.size();
+    if (count <= 0 || stageCount == 0) {
+        return;
+    }
+    PolicyBatch::apply(kingdoms, count);  // One pass over the whole batch, before any stage
+    Bank::accrueInterest(kingdoms, count);
+
+    unique_lock<mutex> guard(lock);
+    batchKingdoms = kingdoms;
+    batchCommands = commands;
+    waitingOn.resize((size_t)count * stageCount);
+    readyTasks.clear();
+    for (int k = 0; k < count; k++) {
+        for (int s = 0; s < stageCount; s++) {
+            waitingOn[k * stageCount + s] = stages[s].dependencyCount;
+            if (stages[s].dependencyCount == 0) {
+                readyTasks.push_back(k * stageCount + s);
+            }
+        }
+    }
+    unfinishedTasks = count * stageCount;
+    wake.notify_all();
+
+    // Help out until the batch is done
+    while (unfinishedTasks > 0) {
+        if (readyTasks.empty()) {
+            finished.wait(guard);
+            continue;
+        }
+        int task = readyTasks.back();
+        readyTasks.pop_back();
+        guard.unlock();
+        runTask(task);
+        guard.lock();
+    }
+    guard.unlock();
+    WorldEconomy::update(kingdoms, count);  // The batch is one world; it moves once every kingdom is done
+}
+
+// Runs one task, then releases the stages waiting on it. Called unlocked.
+void TurnPipeline::runTask(int task) {
+    int stageCount = (int)stages.size();
+    int kingdom = task / stageCount;
+    const Stage& stage = stages[task % stageCount];
+    MemoryScope scope(batchKingdoms[kingdom]->getMemoryAccount(), MEMORY_KINGDOM, stage.name);
+    stage.run(*batchKingdoms[kingdom], batchCommands[kingdom]);
+
+    lock_guard<mutex> guard(lock);
+    int released = 0;
+    for (int dependent : stage.dependents) {
+        if (--waitingOn[kingdom * stageCount + dependent] == 0) {
+            readyTasks.push_back(kingdom * stageCount + dependent);
+            released++;
+        }
+    }
+    unfinishedTasks--;
+    if (released > 0) {
+        wake.notify_all();
+    }
+    finished.notify_all();  // The caller is either done or may have new work
+}
+
+void TurnPipeline::workerLoop() {
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        wake.wait(guard, [this] { return isStopping || !readyTasks.empty(); });
+        if (isStopping) {
+            return;
+        }
+        int task = readyTasks.back();
+        readyTasks.pop_back();
+        guard.unlock();
+        runTask(task);
+        guard.lock();
+    }
+}
+
+bool runPipelineCheck(int kingdomCount, int turns, unsigned long long seed) {
+    if (kingdomCount < 1 || turns < 1) {
+        Visual::printError("Pipeline check needs at least one kingdom and one turn!");
+        return false;
+    }
+
+    bool wasQuiet = Visual::quietMode();
+    Visual::setQuiet(true);
+
+    // Two identical sets of kingdoms: one runs runTurn, one the parallel pipeline
+    vector<Kingdom*> sequential;
+    vector<Kingdom*> parallel;
+    for (int i = 0; i < kingdomCount; i++) {
+        sequential.push_back(new Kingdom("Kingdom " + to_string(i + 1), seed + i));
+        parallel.push_back(new Kingdom("Kingdom " + to_string(i + 1), seed + i));
+    }
+
+    int threads = (int)thread::hardware_concurrency();
+    TurnPipeline pipeline(threads > 0 ? threads : 2);
+    pipeline.addStandardStages();
+
+    GameRandom script(seed ^ 0x5DEECE66DULL);
+    vector<TurnCommand> commands(kingdomCount);
+    int divergedTurn = -1;
+    for (int t = 0; t < turns && divergedTurn < 0; t++) {
+        for (int i = 0; i < kingdomCount; i++) {
+            commands[i] = scriptedCommand(script);
+        }
+        runWorldTurn(sequential.data(), commands.data(), kingdomCount);
+        pipeline.runParallel(parallel.data(), commands.data(), kingdomCount);
+        for (int i = 0; i < kingdomCount; i++) {
+            if (sequential[i]->computeStateHash() != parallel[i]->computeStateHash()) {
+                divergedTurn = t + 1;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < kingdomCount; i++) {
+        delete sequential[i];
+        delete parallel[i];
+    }
+    Visual::setQuiet(wasQuiet);
+
+    if (divergedTurn >= 0) {
+        Visual::printError(VFMT("Pipeline check failed: parallel turn {} differs from the sequential one."), divergedTurn);
+        return false;
+    }
+    Visual::printSuccess(VFMT("Pipeline check passed: {} kingdoms, {} turns."), kingdomCount, turns);
+    return true;
+}
+
+// Replay class implementation
+// File layout: "SHRP", version, seed, agent seed, name, turn count, flags,
+// encoded commands, rule changes (count, then turn, length and text of
+// each), optional turn hashes, FNV checksum of all of it
+Replay::Replay(const string& name, unsigned long long s, unsigned long long agents)
+    : kingdomName(name), seed(s), agentSeed(agents), length(0), isRecording(true) {}
+
+unsigned long long Replay::chainHash(unsigned long long previous, unsigned long long stateHash) {
+    hashValue(previous, (long long)stateHash);
+    return previous;
+}
+
+void Replay::record(const TurnCommand& command, const Kingdom& kingdom) {
+    MemoryScope scope(0, MEMORY_REPLAY, "Replay::record");  // The replay outlives the kingdom
+    if (!isRecording) {
+        return;
+    }
+    // A new turn after an undo replaces the undone ones
+    commands.resize(length);
+    turnHashes.resize(length);
+    while (!ruleChanges.empty() && ruleChanges.back().turn >= length) {
+        ruleChanges.pop_back();
+    }
+    const RuleSet& rules = Rules::get();  // What this turn ran with; rules reload only between turns
+    if (ruleChanges.empty() || ruleChanges.back().hash != rules.getHash()) {
+        RuleChange change = {length, rules.getHash(), rules.getSource()};
+        ruleChanges.push_back(change);
+    }
+    unsigned long long previous = length > 0 ? turnHashes[length - 1] : 0xCBF29CE484222325ULL;
+    commands.push_back(command);
+    turnHashes.push_back(chainHash(previous, kingdom.computeStateHash()));
+    length++;
+}
+
+void Replay::seek(int turns) {
+    if (turns >= 0 && turns <= (int)commands.size()) {
+        length = turns;
+    }
+}
+
+vector<unsigned long long> Replay::getTurnHashes() const {
+    if (!hasTurnHashes()) {
+        return vector<unsigned long long>();
+    }
+    return vector<unsigned long long>(turnHashes.begin(), turnHashes.begin() + length);
+}
+
+bool Replay::save(const string& path) const {
+    string data("SHRP", 4);
+    unsigned version = VERSION;
+    unsigned turnCount = (unsigned)length;
+    unsigned char nameLength = (unsigned char)(kingdomName.size() > 255 ? 255 : kingdomName.size());
+    unsigned char flags = hasTurnHashes() ? 1 : 0;
+    data.append((const char*)&version, sizeof(version));
+    data.append((const char*)&seed, sizeof(seed));
+    data.append((const char*)&agentSeed, sizeof(agentSeed));
+    data.append((const char*)&nameLength, 1);
+    data.append(kingdomName.data(), nameLength);
+    data.append((const char*)&turnCount, sizeof(turnCount));
+    data.append((const char*)&flags, 1);
+
+    unsigned char buffer[128];
+    for (int i = 0; i < length; i++) {
+        data.append((const char*)buffer, commands[i].encode(buffer));
+    }
+    unsigned changeCount = (unsigned)ruleChanges.size();
+    data.append((const char*)&changeCount, sizeof(changeCount));
+    for (const RuleChange& change : ruleChanges) {
+        unsigned changeTurn = (unsigned)change.turn;
+        unsigned sourceLength = (unsigned)change.source.size();
+        data.append((const char*)&changeTurn, sizeof(changeTurn));
+        data.append((const char*)&sourceLength, sizeof(sourceLength));
+        data.append(change.source);
+    }
+    if (flags & 1) {
+        data.append((const char*)turnHashes.data(), length * sizeof(unsigned long long));
+    }
+    unsigned long long checksum = 0xCBF29CE484222325ULL;
+    for (unsigned char byte : data) {
+        checksum = (checksum ^ byte) * 0x100000001B3ULL;
+    }
+    data.append((const char*)&checksum, sizeof(checksum));
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        Visual::printError(VFMT("Cannot open {}!"), path);
+        return false;
+    }
+    bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+    if (fclose(file) != 0 || !written) {
+        Visual::printError(VFMT("Cannot write {}!"), path);
+        return false;
+    }
+    return true;
+}
+
+bool Replay::load(const string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        Visual::printError(VFMT("Cannot open {}!"), path);
+        return false;
+    }
+    string data;
+    char chunk[65536];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        data.append(chunk, got);
+    }
+    fclose(file);
+
+    const size_t fixedSize = 4 + sizeof(unsigned) + 2 * sizeof(unsigned long long) + 1;
+    if (data.size() < fixedSize + sizeof(unsigned long long) || data.compare(0, 4, "SHRP") != 0) {
+        Visual::printError(VFMT("{} is not a replay file!"), path);
+        return false;
+    }
+    size_t end = data.size() - sizeof(unsigned long long);
+    unsigned long long checksum = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < end; i++) {
+        checksum = (checksum ^ (unsigned char)data[i]) * 0x100000001B3ULL;
+    }
+    unsigned long long stored;
+    memcpy(&stored, data.data() + end, sizeof(stored));
+    unsigned version;
+    memcpy(&version, data.data() + 4, sizeof(version));
+    if (stored != checksum || version < 1 || version > VERSION) {
+        Visual::printError(VFMT("Replay {} is damaged or from another version!"), path);
+        return false;
+    }
+
+    const unsigned char* bytes = (const unsigned char*)data.data();
+    size_t position = 4 + sizeof(version);
+    memcpy(&seed, bytes + position, sizeof(seed));
+    position += sizeof(seed);
+    memcpy(&agentSeed, bytes + position, sizeof(agentSeed));
+    position += sizeof(agentSeed);
+    int nameLength = bytes[position++];
+    if (position + nameLength + sizeof(unsigned) + 1 > end) {
+        Visual::printError(VFMT("Replay {} is truncated!"), path);
+        return false;
+    }
+    kingdomName.assign(data, position, nameLength);
+    position += nameLength;
+    unsigned turnCount;
+    memcpy(&turnCount, bytes + position, sizeof(turnCount));
+    position += sizeof(turnCount);
+    unsigned char flags = bytes[position++];
+
+    commands.assign(turnCount, TurnCommand());
+    for (unsigned i = 0; i < turnCount; i++) {
+        int used = commands[i].decode(bytes + position, (int)(end - position));
+        if (used == 0) {
+            Visual::printError(VFMT("Replay {} is truncated!"), path);
+            return false;
+        }
+        position += used;
+    }
+    ruleChanges.clear();
+    unsigned changeCount = 0;
+    if (version >= 2) {
+        if (end - position < sizeof(changeCount)) {
+            Visual::printError(VFMT("Replay {} is truncated!"), path);
+            return false;
+        }
+        memcpy(&changeCount, bytes + position, sizeof(changeCount));
+        position += sizeof(changeCount);
+    }
+    for (unsigned i = 0; i < changeCount; i++) {
+        unsigned changeTurn;
+        unsigned sourceLength;
+        if (end - position < sizeof(changeTurn) + sizeof(sourceLength)) {
+            Visual::printError(VFMT("Replay {} is truncated!"), path);
+            return false;
+        }
+        memcpy(&changeTurn, bytes + position, sizeof(changeTurn));
+        position += sizeof(changeTurn);
+        memcpy(&sourceLength, bytes + position, sizeof(sourceLength));
+        position += sizeof(sourceLength);
+        if (end - position < sourceLength) {
+            Visual::printError(VFMT("Replay {} is truncated!"), path);
+            return false;
+        }
+        string source((const char*)bytes + position, sourceLength);
+        RuleChange change = {(int)changeTurn, RuleSet::hashSource(source), source};
+        ruleChanges.push_back(change);
+        position += sourceLength;
+    }
+    turnHashes.clear();
+    if (flags & 1) {
+        if (end - position != turnCount * sizeof(unsigned long long)) {
+            Visual::printError(VFMT("Replay {} is truncated!"), path);
+            return false;
+        }
+        turnHashes.resize(turnCount);
+        memcpy(turnHashes.data(), bytes + position, turnCount * sizeof(unsigned long long));
+    }
+    length = (int)turnCount;
+    isRecording = false;
+    return true;
+}
+
+vector<unsigned long long> Replay::run() const {
+    bool wasQuiet = Visual::quietMode();
+    Visual::setQuiet(true);
+
+    // Re-run with the rules the game ran with, then put the current ones back
+    string currentRules = Rules::get().getSource();
+    if (ruleChanges.empty()) {
+        Rules::reset();
+    }
+    vector<unsigned long long> hashes;
+    hashes.reserve(length);
+    {
+        Kingdom kingdom(kingdomName, seed);
+        if (agentSeed != 0) {
+            kingdom.getPeople().enableAgents(agentSeed);
+        }
+        unsigned long long chain = 0xCBF29CE484222325ULL;
+        size_t change = 0;
+        bool isRunnable = true;
+        for (int i = 0; i < length && isRunnable; i++) {
+            while (isRunnable && change < ruleChanges.size() && ruleChanges[change].turn <= i) {
+                isRunnable = Rules::loadSource(ruleChanges[change].source, "the replay");
+                change++;
+            }
+            if (!isRunnable) {
+                Visual::setQuiet(wasQuiet);
+                Visual::printError(VFMT("The rules recorded for turn {} do not compile in this build!"), i + 1);
+                Visual::setQuiet(true);
+                hashes.clear();
+                break;
+            }
+            runTurn(kingdom, commands[i]);
+            chain = chainHash(chain, kingdom.computeStateHash());
+            hashes.push_back(chain);
+        }
+    }
+    Rules::loadSource(currentRules, "before the replay");
+    Visual::setQuiet(wasQuiet);
+    return hashes;
+}
+
+int Replay::findDivergence(const vector<unsigned long long>& a, const vector<unsigned long long>& b) {
+    size_t common = a.size() < b.size() ? a.size() : b.size();
+    for (size_t i = 0; i < common; i++) {
+        if (a[i] != b[i]) {
+            return (int)i;
+        }
+    }
+    return a.size() == b.size() ? -1 : (int)common;
+}
+
+bool recordScriptedReplay(const string& path, int turns, unsigned long long seed) {
+    if (turns < 1) {
+        Visual::printError("Replay needs at least one turn!");
+        return false;
+    }
+    bool wasQuiet = Visual::quietMode();
+    Visual::setQuiet(true);
+    Replay replay("Westland", seed);
+    {
+        Kingdom kingdom("Westland", seed);
+        GameRandom script(seed ^ 0x5DEECE66DULL);
+        for (int t = 0; t < turns; t++) {
+            TurnCommand command = scriptedCommand(script);
+            runTurn(kingdom, command);
+            replay.record(command, kingdom);
+        }
+    }
+    Visual::setQuiet(wasQuiet);
+
+    if (!replay.save(path)) {
+        return false;
+    }
+    Visual::printSuccess(VFMT("Recorded {} turns to {}."), turns, path);
+    return true;
+}
+
+// Re-runs a replay and compares it with the hashes it was recorded with.
+// Replays without hashes are run twice and the two runs compared.
+bool verifyReplay(const string& path) {
+    Replay replay;
+    if (!replay.load(path)) {
+        return false;
+    }
+    auto start = chrono::steady_clock::now();
+    vector<unsigned long long> hashes = replay.run();
+    long long elapsed = (long long)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    if ((int)hashes.size() != replay.getTurnCount()) {
+        return false;  // run() said why
+    }
+
+    bool hasRecording = replay.hasTurnHashes();
+    vector<unsigned long long> expected = hasRecording ? replay.getTurnHashes() : replay.run();
+    int diverged = Replay::findDivergence(expected, hashes);
+    if (diverged >= 0) {
+        // Turn numbers count from 1, as in the game
+        Visual::printError(VFMT("Replay diverges from {} at turn {}: hash {} instead of {}."),
+            hasRecording ? "the recording" : "a second run", diverged + 1, hashes[diverged], expected[diverged]);
+        return false;
+    }
+    Visual::printSuccess(VFMT("Replay verified: {} turns in {} ms, final hash {}."), replay.getTurnCount(), elapsed,
+        hashes.empty() ? 0ULL : hashes.back());
+    return true;
+}
+
+// Runs scripted turns on one kingdom and prints where its memory went
+bool runMemoryReport(int turns, unsigned long long seed) {
+    if (turns < 1) {
+        Visual::printError("Memory report needs at least one turn!");
+        return false;
+    }
+    bool wasQuiet = Visual::quietMode();
+    Visual::setQuiet(true);
+    MemoryTracker::setSampleRate(64);
+
+    Kingdom* kingdom = new Kingdom("Westland", seed);
+    MemoryStats built = MemoryTracker::getTotal(kingdom->getMemoryAccount());
+    GameRandom script(seed ^ 0x5DEECE66DULL);
+    MemoryStats peak = MemoryStats();
+    for (int t = 0; t < turns; t++) {
+        runTurn(*kingdom, scriptedCommand(script));
+        MemoryStats turn = MemoryTracker::getLastTurn(kingdom->getMemoryAccount());
+        if (turn.allocatedBytes > peak.allocatedBytes) {
+            peak = turn;
+        }
+    }
+    MemoryStats total = MemoryTracker::getTotal(kingdom->getMemoryAccount());
+
+    Visual::setQuiet(wasQuiet);
+    Visual::printInfo(VFMT("New kingdom: {} bytes in {} blocks"), built.liveBytes, built.liveCount);
+    MemoryTracker::printAccount(kingdom->getMemoryAccount());
+    Visual::printInfo(VFMT("Per turn over {} turns: {} bytes in {} allocations on average, peak {} bytes"), turns,
+        (total.allocatedBytes - built.allocatedBytes) / turns, (total.allocationCount - built.allocationCount) / turns,
+        peak.allocatedBytes);
+    MemoryTracker::printActions();
+    MemoryTracker::printSites();
+    Visual::printInfo("Sampled allocations (1 in 64), newest last:");
+    MemoryTracker::printTrace(16);
+
+    Visual::setQuiet(true);
+    delete kingdom;
+    Visual::setQuiet(wasQuiet);
+    MemoryTracker::setSampleRate(0);
+    return true;
+}
+
+// RuleProgram class implementation
+enum RuleOp {
+    RULE_OP_INPUT, RULE_OP_CONST, RULE_OP_NEG, RULE_OP_NOT, RULE_OP_SELECT,
+    RULE_OP_ADD, RULE_OP_SUB, RULE_OP_MUL, RULE_OP_DIV, RULE_OP_MOD,
+    RULE_OP_LT, RULE_OP_LE, RULE_OP_GT, RULE_OP_GE, RULE_OP_EQ, RULE_OP_NE,
+    RULE_OP_AND, RULE_OP_OR, RULE_OP_MIN, RULE_OP_MAX
+};
+
+// Where a node finds an operand
+enum RuleOperand {
+    OPERAND_INPUT, OPERAND_CONST, OPERAND_NODE
+};
+
+// Used for constant folding and by the nodes. Division by zero gives zero.
+static long long ruleBinary(int op, long long a, long long b) {
+    switch (op) {
+    case RULE_OP_ADD: return a + b;
+    case RULE_OP_SUB: return a - b;
+    case RULE_OP_MUL: return a * b;
+    case RULE_OP_DIV: return b != 0 ? a / b : 0;
+    case RULE_OP_MOD: return b != 0 ? a % b : 0;
+    case RULE_OP_LT: return a < b;
+    case RULE_OP_LE: return a <= b;
+    case RULE_OP_GT: return a > b;
+    case RULE_OP_GE: return a >= b;
+    case RULE_OP_EQ: return a == b;
+    case RULE_OP_NE: return a != b;
+    case RULE_OP_AND: return a != 0 && b != 0;
+    case RULE_OP_OR: return a != 0 || b != 0;
+    case RULE_OP_MIN: return a < b ? a : b;
+    default: return a > b ? a : b;  // RULE_OP_MAX
+    }
+}
+
+// Table layout for a scan: arm count, default, then (key, value) per arm
+static long long scanTable(const long long* table, long long x, int op) {
+    long long count = table[0];
+    const long long* arm = table + 2;
+    for (long long i = 0; i < count; i++, arm += 2) {
+        bool isHit = op == RULE_OP_LT ? x < arm[0] : (op == RULE_OP_GT ? x > arm[0] : x == arm[0]);
+        if (isHit) {
+            return arm[1];
+        }
+    }
+    return table[1];
+}
+
+// Table layout for a lookup: lowest key, size, default, then a value per key
+static long long lookupTable(const long long* table, long long x) {
+    unsigned long long index = (unsigned long long)x - (unsigned long long)table[0];
+    return index < (unsigned long long)table[1] ? table[3 + index] : table[2];
+}
+
+// High 64 bits of the 128-bit signed product
+static long long multiplyHigh(long long a, long long b) {
+#ifdef _MSC_VER
+    return __mulh(a, b);
+#else
+    return (long long)(((__int128)a * b) >> 64);
+#endif
+}
+
+// n / divisor, rounded towards zero, from the node's magic numbers
+static long long divideByMagic(const RuleProgram::Node& node, long long n) {
+    long long q = multiplyHigh(node.magic, n);
+    if (node.correction == 1) q += n;
+    else if (node.correction == 2) q -= n;
+    q >>= node.shift;
+    return q + (long long)((unsigned long long)q >> 63);
+}
+
+// The evaluate functions, one per operator and operand kinds. KIND is
+// known when the function is made, so fetching an operand has no branch.
+template <int KIND>
+static long long fetchOperand(const RuleProgram& program, const RuleProgram::Node& node, int slot,
+    const long long* inputs) {
+    if (KIND == OPERAND_INPUT) return inputs[node.operand[slot]];
+    if (KIND == OPERAND_CONST) return node.constant[slot];
+    return program.evaluateNode(node.operand[slot], inputs);
+}
+
+static long long evaluateInput(const RuleProgram&, const RuleProgram::Node& node, const long long* inputs) {
+    return inputs[node.operand[0]];
+}
+
+template <int OP, int KIND>
+static long long evaluateUnary(const RuleProgram& program, const RuleProgram::Node& node, const long long* inputs) {
+    long long x = fetchOperand<KIND>(program, node, 0, inputs);
+    return OP == RULE_OP_NEG ? -x : x == 0;
+}
+
+template <int OP, int LEFT, int RIGHT>
+static long long evaluateBinary(const RuleProgram& program, const RuleProgram::Node& node, const long long* inputs) {
+    return ruleBinary(OP, fetchOperand<LEFT>(program, node, 0, inputs), fetchOperand<RIGHT>(program, node, 1, inputs));
+}
+
+// Only the arm the condition picks is evaluated
+template <int CONDITION, int WHEN_TRUE, int WHEN_FALSE>
+static long long evaluateSelect(const RuleProgram& program, const RuleProgram::Node& node, const long long* inputs) {
+    return fetchOperand<CONDITION>(program, node, 0, inputs) != 0 ? fetchOperand<WHEN_TRUE>(program, node, 1, inputs) :
+        fetchOperand<WHEN_FALSE>(program, node, 2, inputs);
+}
+
+template <int LEFT>
+static long long evaluateDivide(const RuleProgram& program, const RuleProgram::Node& node, const long long* inputs) {
+    return divideByMagic(node, fetchOperand<LEFT>(program, node, 0, inputs));
+}
+
+// a * b / constant, the usual percentage, as one node
+template <int LEFT, int RIGHT>
+static long long evaluateScale(const RuleProgram& program, const RuleProgram::Node& node, const long long* inputs) {
+    return divideByMagic(node, fetchOperand<LEFT>(program, node, 0, inputs) * fetchOperand<RIGHT>(program, node, 1, inputs));
+}
+
+// A select between two scaled inputs, the usual shape of a loss rule. The
+// condition picks an arm's node without a branch and that node is read in
+// place, so a condition with no pattern costs no mispredictions.
+template <int CONDITION>
+static long long evaluatePickScaled(const RuleProgram& program, const RuleProgram::Node& node,
+    const long long* inputs) {
+    int mask = -(int)(fetchOperand<CONDITION>(program, node, 0, inputs) != 0);
+    const RuleProgram::Node& arm = program.getNode((node.operand[1] & mask) | (node.operand[2] & ~mask));
+    return divideByMagic(arm, inputs[arm.operand[0]] * arm.constant[1]);
+}
+
+template <int OP>
+static long long evaluateScan(const RuleProgram& program, const RuleProgram::Node& node, const long long* inputs) {
+    return scanTable(program.getTable(node.constant[1]), inputs[node.operand[0]], OP);
+}
+
+static long long evaluateLookup(const RuleProgram& program, const RuleProgram::Node& node, const long long* inputs) {
+    return lookupTable(program.getTable(node.constant[1]), inputs[node.operand[0]]);
+}
+
+// Picking the function for operand kinds only known while compiling
+template <int OP>
+static RuleProgram::Evaluate unaryEvaluator(int kind) {
+    return kind == OPERAND_INPUT ? evaluateUnary<OP, OPERAND_INPUT> : evaluateUnary<OP, OPERAND_NODE>;
+}
+
+template <int OP, int LEFT>
+static RuleProgram::Evaluate binaryEvaluator(int right) {
+    return right == OPERAND_INPUT ? evaluateBinary<OP, LEFT, OPERAND_INPUT> :
+        right == OPERAND_CONST ? evaluateBinary<OP, LEFT, OPERAND_CONST> : evaluateBinary<OP, LEFT, OPERAND_NODE>;
+}
+
+template <int OP>
+static RuleProgram::Evaluate binaryEvaluator(int left, int right) {
+    return left == OPERAND_INPUT ? binaryEvaluator<OP, OPERAND_INPUT>(right) :
+        left == OPERAND_CONST ? binaryEvaluator<OP, OPERAND_CONST>(right) : binaryEvaluator<OP, OPERAND_NODE>(right);
+}
+
+static RuleProgram::Evaluate binaryEvaluator(int op, int left, int right) {
+    switch (op) {
+    case RULE_OP_ADD: return binaryEvaluator<RULE_OP_ADD>(left, right);
+    case RULE_OP_SUB: return binaryEvaluator<RULE_OP_SUB>(left, right);
+    case RULE_OP_MUL: return binaryEvaluator<RULE_OP_MUL>(left, right);
+    case RULE_OP_DIV: return binaryEvaluator<RULE_OP_DIV>(left, right);
+    case RULE_OP_MOD: return binaryEvaluator<RULE_OP_MOD>(left, right);
+    case RULE_OP_LT: return binaryEvaluator<RULE_OP_LT>(left, right);
+    case RULE_OP_LE: return binaryEvaluator<RULE_OP_LE>(left, right);
+    case RULE_OP_GT: return binaryEvaluator<RULE_OP_GT>(left, right);
+    case RULE_OP_GE: return binaryEvaluator<RULE_OP_GE>(left, right);
+    case RULE_OP_EQ: return binaryEvaluator<RULE_OP_EQ>(left, right);
+    case RULE_OP_NE: return binaryEvaluator<RULE_OP_NE>(left, right);
+    case RULE_OP_AND: return binaryEvaluator<RULE_OP_AND>(left, right);
+    case RULE_OP_OR: return binaryEvaluator<RULE_OP_OR>(left, right);
+    case RULE_OP_MIN: return binaryEvaluator<RULE_OP_MIN>(left, right);
+    default: return binaryEvaluator<RULE_OP_MAX>(left, right);
+    }
+}
+
+template <int CONDITION, int WHEN_TRUE>
+static RuleProgram::Evaluate selectEvaluator(int whenFalse) {
+    return whenFalse == OPERAND_INPUT ? evaluateSelect<CONDITION, WHEN_TRUE, OPERAND_INPUT> :
+        whenFalse == OPERAND_CONST ? evaluateSelect<CONDITION, WHEN_TRUE, OPERAND_CONST> :
+        evaluateSelect<CONDITION, WHEN_TRUE, OPERAND_NODE>;
+}
+
+template <int CONDITION>
+static RuleProgram::Evaluate selectEvaluator(int whenTrue, int whenFalse) {
+    return whenTrue == OPERAND_INPUT ? selectEvaluator<CONDITION, OPERAND_INPUT>(whenFalse) :
+        whenTrue == OPERAND_CONST ? selectEvaluator<CONDITION, OPERAND_CONST>(whenFalse) :
+        selectEvaluator<CONDITION, OPERAND_NODE>(whenFalse);
+}
+
+static RuleProgram::Evaluate selectEvaluator(int condition, int whenTrue, int whenFalse) {
+    // A constant condition was folded away by the parser
+    return condition == OPERAND_INPUT ? selectEvaluator<OPERAND_INPUT>(whenTrue, whenFalse) :
+        selectEvaluator<OPERAND_NODE>(whenTrue, whenFalse);
+}
+
+static RuleProgram::Evaluate divideEvaluator(int left) {
+    return left == OPERAND_INPUT ? evaluateDivide<OPERAND_INPUT> : evaluateDivide<OPERAND_NODE>;
+}
+
+template <int LEFT>
+static RuleProgram::Evaluate scaleEvaluator(int right) {
+    return right == OPERAND_INPUT ? evaluateScale<LEFT, OPERAND_INPUT> :
+        right == OPERAND_CONST ? evaluateScale<LEFT, OPERAND_CONST> : evaluateScale<LEFT, OPERAND_NODE>;
+}
+
+static RuleProgram::Evaluate scaleEvaluator(int left, int right) {
+    return left == OPERAND_INPUT ? scaleEvaluator<OPERAND_INPUT>(right) : scaleEvaluator<OPERAND_NODE>(right);
+}
+
+static const char* const RULE_INPUT_NAMES[RULE_INPUT_COUNT] = {
+    "roll", "people", "shortage", "resource", "birth", "death", "food", "stability"
+};
+
+// Compiles one expression into a RuleProgram. The expression is parsed
+// into a small tree, folding constants as it goes, then turned into program
+// nodes; inputs and constants are read in place and never get a node.
+// Chains like "x < 15 ? 0 : x < 30 ? 1 : 2" become a single table scan.
+class RuleCompiler {
+    struct Token {
+        char kind;  // 'n' number, 'i' name, 's' symbol, 'e' end
+        string text;
+        long long value;
+    };
+
+    struct Node {
+        int op;           // RULE_OP_CONST, RULE_OP_INPUT, unary, RULE_OP_SELECT or a binary operator
+        long long value;  // Constant value or input index
+        int a, b, c;      // Child nodes
+    };
+
+    struct Operand {
+        int kind;         // RuleOperand
+        int index;        // Input or program node
+        long long value;  // When constant
+    };
+
+    static const int MIN_SCAN_ARMS = 3;
+    static const int MAX_LOOKUP_SIZE = 64;  // Equality scans over keys this close become lookups
+
+    RuleProgram& program;
+    unsigned allowedInputs;
+    vector<Token> tokens;
+    size_t position;
+    vector<Node> nodes;
+    string error;
+
+    bool fail(const string& message) {
+        if (error.empty()) {
+            error = message;
+        }
+        return false;
+    }
+
+    const Token& peek() const { return tokens[position]; }
+    bool isSymbol(const char* symbol) const { return peek().kind == 's' && peek().text == symbol; }
+
+    bool expect(const char* symbol) {
+        if (!isSymbol(symbol)) {
+            return fail(string("Expected '") + symbol + "' but found '" + peek().text + "'");
+        }
+        position++;
+        return true;
+    }
+
+    bool tokenize(const string& text) {
+        static const char* const pairs[] = {"<=", ">=", "==", "!=", "&&", "||"};
+        size_t i = 0;
+        while (i < text.size()) {
+            char c = text[i];
+            Token token = {'s', "", 0};
+            if (c == ' ' || c == '\t' || c == '\r') {
+                i++;
+                continue;
+            }
+            if (isdigit((unsigned char)c)) {
+                token.kind = 'n';
+                while (i < text.size() && isdigit((unsigned char)text[i])) {
+                    if (token.value > (LLONG_MAX - (text[i] - '0')) / 10) {
+                        return fail("Number is too large");
+                    }
+                    token.value = token.value * 10 + (text[i] - '0');
+                    token.text += text[i++];
+                }
+            }
+            else if (isalpha((unsigned char)c) || c == '_') {
+                token.kind = 'i';
+                while (i < text.size() && (isalnum((unsigned char)text[i]) || text[i] == '_')) {
+                    token.text += text[i++];
+                }
+            }
+            else {
+                for (const char* pair : pairs) {
+                    if (text.compare(i, 2, pair) == 0) {
+                        token.text = pair;
+                    }
+                }
+                if (token.text.empty()) {
+                    if (strchr("+-*/%()?:,<>!", c) == nullptr) {
+                        return fail(string("Unexpected character '") + c + "'");
+                    }
+                    token.text = string(1, c);
+                }
+                i += token.text.size();
+            }
+            tokens.push_back(token);
+        }
+        Token end = {'e', "end of line", 0};
+        tokens.push_back(end);
+        return true;
+    }
+
+    int addNode(int op, long long value, int a, int b, int c) {
+        Node node = {op, value, a, b, c};
+        nodes.push_back(node);
+        return (int)nodes.size() - 1;
+    }
+
+    bool isConstantNode(int node) const { return nodes[node].op == RULE_OP_CONST; }
+
+    // Folds constants, puts a constant operand on the right where the
+    // operator allows it, and turns <= and >= against a constant into < and >
+    bool makeBinary(int op, int left, int right, int& out) {
+        if ((op == RULE_OP_DIV || op == RULE_OP_MOD) && isConstantNode(right) && nodes[right].value == 0) {
+            return fail("Division by zero");
+        }
+        if (isConstantNode(left) && isConstantNode(right)) {
+            out = addNode(RULE_OP_CONST, ruleBinary(op, nodes[left].value, nodes[right].value), 0, 0, 0);
+            return true;
+        }
+        if (isConstantNode(left)) {
+            int swapped = op;
+            switch (op) {
+            case RULE_OP_LT: swapped = RULE_OP_GT; break;
+            case RULE_OP_LE: swapped = RULE_OP_GE; break;
+            case RULE_OP_GT: swapped = RULE_OP_LT; break;
+            case RULE_OP_GE: swapped = RULE_OP_LE; break;
+            case RULE_OP_SUB: case RULE_OP_DIV: case RULE_OP_MOD: swapped = -1; break;
+            }
+            if (swapped >= 0) {
+                int constant = left;
+                left = right;
+                right = constant;
+                op = swapped;
+            }
+        }
+        if (isConstantNode(right)) {
+            long long k = nodes[right].value;
+            if (op == RULE_OP_LE && k < LLONG_MAX) {
+                op = RULE_OP_LT;
+                right = addNode(RULE_OP_CONST, k + 1, 0, 0, 0);
+            }
+            else if (op == RULE_OP_GE && k > LLONG_MIN) {
+                op = RULE_OP_GT;
+                right = addNode(RULE_OP_CONST, k - 1, 0, 0, 0);
+            }
+        }
+        out = addNode(op, 0, left, right, 0);
+        return true;
+    }
+
+    // Precedence from loosest to tightest: ?:, ||, &&, == !=, < <= > >=, + -, * / %, unary
+    bool parseExpression(int& out) {
+        int condition;
+        if (!parseBinary(0, condition)) {
+            return false;
+        }
+        if (!isSymbol("?")) {
+            out = condition;
+            return true;
+        }
+        position++;
+        int whenTrue, whenFalse;
+        if (!parseExpression(whenTrue) || !expect(":") || !parseExpression(whenFalse)) {
+            return false;
+        }
+        if (isConstantNode(condition)) {
+            out = nodes[condition].value != 0 ? whenTrue : whenFalse;
+        }
+        else {
+            out = addNode(RULE_OP_SELECT, 0, condition, whenTrue, whenFalse);
+        }
+        return true;
+    }
+
+    bool parseBinary(int level, int& out) {
+        static const char* const symbols[6][4] = {
+            {"||"}, {"&&"}, {"==", "!="}, {"<", "<=", ">", ">="}, {"+", "-"}, {"*", "/", "%"}
+        };
+        static const int ops[6][4] = {
+            {RULE_OP_OR}, {RULE_OP_AND}, {RULE_OP_EQ, RULE_OP_NE},
+            {RULE_OP_LT, RULE_OP_LE, RULE_OP_GT, RULE_OP_GE}, {RULE_OP_ADD, RULE_OP_SUB},
+            {RULE_OP_MUL, RULE_OP_DIV, RULE_OP_MOD}
+        };
+        if (level == 6) {
+            return parseUnary(out);
+        }
+        int left;
+        if (!parseBinary(level + 1, left)) {
+            return false;
+        }
+        while (true) {
+            int op = -1;
+            for (int i = 0; i < 4 && symbols[level][i] != nullptr; i++) {
+                if (isSymbol(symbols[level][i])) {
+                    op = ops[level][i];
+                }
+            }
+            if (op < 0) {
+                out = left;
+                return true;
+            }
+            position++;
+            int right;
+            if (!parseBinary(level + 1, right) || !makeBinary(op, left, right, left)) {
+                return false;
+            }
+        }
+    }
+
+    bool parseUnary(int& out) {
+        if (isSymbol("-") || isSymbol("!")) {
+            int op = isSymbol("-") ? RULE_OP_NEG : RULE_OP_NOT;
+            position++;
+            int operand;
+            if (!parseUnary(operand)) {
+                return false;
+            }
+            if (isConstantNode(operand)) {
+                long long value = nodes[operand].value;
+                out = addNode(RULE_OP_CONST, op == RULE_OP_NEG ? -value : value == 0, 0, 0, 0);
+            }
+            else {
+                out = addNode(op, 0, operand, 0, 0);
+            }
+            return true;
+        }
+        return parsePrimary(out);
+    }
+
+    bool parsePrimary(int& out) {
+        Token token = peek();
+        if (token.kind == 'n') {
+            position++;
+            out = addNode(RULE_OP_CONST, token.value, 0, 0, 0);
+            return true;
+        }
+        if (isSymbol("(")) {
+            position++;
+            return parseExpression(out) && expect(")");
+        }
+        if (token.kind != 'i') {
+            return fail("Expected a value but found '" + token.text + "'");
+        }
+        position++;
+
+        if (token.text == "min" || token.text == "max") {
+            int first, second;
+            if (!expect("(") || !parseExpression(first) || !expect(",") || !parseExpression(second) || !expect(")")) {
+                return false;
+            }
+            return makeBinary(token.text == "min" ? RULE_OP_MIN : RULE_OP_MAX, first, second, out);
+        }
+
+        for (int i = 0; i < RULE_INPUT_COUNT; i++) {
+            if (token.text == RULE_INPUT_NAMES[i]) {
+                if ((allowedInputs & (1u << i)) == 0) {
+                    return fail("This rule cannot use '" + token.text + "'");
+                }
+                out = addNode(RULE_OP_INPUT, i, 0, 0, 0);
+                return true;
+            }
+        }
+        return fail("Unknown name '" + token.text + "'");
+    }
+
+    // Divisor as a multiplier and shifts (Hacker's Delight, chapter 10);
+    // the divisor is not 0, 1 or -1
+    static void setMagic(RuleProgram::Node& node, long long divisor) {
+        unsigned long long absolute = divisor < 0 ? 0 - (unsigned long long)divisor : (unsigned long long)divisor;
+        const unsigned long long TWO_63 = 1ULL << 63;
+        unsigned long long t = TWO_63 + ((unsigned long long)divisor >> 63);
+        unsigned long long limit = t - 1 - t % absolute;  // Largest value whose remainder is absolute - 1
+        unsigned long long q1 = TWO_63 / limit;
+        unsigned long long r1 = TWO_63 - q1 * limit;
+        unsigned long long q2 = TWO_63 / absolute;
+        unsigned long long r2 = TWO_63 - q2 * absolute;
+        unsigned long long delta;
+        int power = 63;
+        do {
+            power++;
+            q1 *= 2;
+            r1 *= 2;
+            if (r1 >= limit) {
+                q1++;
+                r1 -= limit;
+            }
+            q2 *= 2;
+            r2 *= 2;
+            if (r2 >= absolute) {
+                q2++;
+                r2 -= absolute;
+            }
+            delta = absolute - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+
+        node.magic = divisor < 0 ? (long long)(0 - (q2 + 1)) : (long long)(q2 + 1);
+        node.shift = power - 64;
+        node.correction = divisor > 0 && node.magic < 0 ? 1 : (divisor < 0 && node.magic > 0 ? 2 : 0);
+    }
+
+    int addProgramNode(RuleProgram::Evaluate evaluate) {
+        RuleProgram::Node node = {};
+        node.evaluate = evaluate;
+        program.nodes.push_back(node);
+        return (int)program.nodes.size() - 1;
+    }
+
+    // Fills one operand slot of a program node
+    void setOperand(int target, int slot, const Operand& operand) {
+        program.nodes[target].operand[slot] = operand.index;
+        program.nodes[target].constant[slot] = operand.value;
+    }
+
+    // x < k1 ? v1 : x < k2 ? v2 : ... : default over one input and constants
+    bool buildScan(int node, Operand& out, bool& isScan) {
+        isScan = false;
+        int input = -1;
+        int test = -1;
+        vector<long long> arms;
+        while (nodes[node].op == RULE_OP_SELECT) {
+            const Node& condition = nodes[nodes[node].a];
+            const Node& value = nodes[nodes[node].b];
+            if ((condition.op != RULE_OP_LT && condition.op != RULE_OP_GT && condition.op != RULE_OP_EQ) ||
+                nodes[condition.a].op != RULE_OP_INPUT || !isConstantNode(condition.b) || !isConstantNode(nodes[node].b) ||
+                (input >= 0 && (nodes[condition.a].value != input || condition.op != test))) {
+                break;
+            }
+            input = (int)nodes[condition.a].value;
+            test = condition.op;
+            arms.push_back(nodes[condition.b].value);
+            arms.push_back(value.value);
+            node = nodes[node].c;
+        }
+        if (!isConstantNode(node) || (int)arms.size() < MIN_SCAN_ARMS * 2) {
+            return true;
+        }
+
+        isScan = true;
+        long long offset = (long long)program.tables.size();
+        long long lowest = arms[0];
+        long long highest = arms[0];
+        for (size_t i = 2; i < arms.size(); i += 2) {
+            if (arms[i] < lowest) lowest = arms[i];
+            if (arms[i] > highest) highest = arms[i];
+        }
+        RuleProgram::Evaluate evaluate;
+        if (test == RULE_OP_EQ && (unsigned long long)highest - (unsigned long long)lowest < MAX_LOOKUP_SIZE) {
+            long long size = highest - lowest + 1;
+            program.tables.push_back(lowest);
+            program.tables.push_back(size);
+            program.tables.push_back(nodes[node].value);
+            program.tables.resize(program.tables.size() + (size_t)size, nodes[node].value);
+            for (size_t i = arms.size(); i > 0; i -= 2) {  // Backwards, so the first arm for a key wins
+                program.tables[(size_t)(offset + 3 + arms[i - 2] - lowest)] = arms[i - 1];
+            }
+            evaluate = evaluateLookup;
+        }
+        else {
+            program.tables.push_back((long long)arms.size() / 2);
+            program.tables.push_back(nodes[node].value);
+            program.tables.insert(program.tables.end(), arms.begin(), arms.end());
+            evaluate = test == RULE_OP_LT ? evaluateScan<RULE_OP_LT> :
+                (test == RULE_OP_GT ? evaluateScan<RULE_OP_GT> : evaluateScan<RULE_OP_EQ>);
+        }
+        int target = addProgramNode(evaluate);
+        program.nodes[target].operand[0] = input;
+        program.nodes[target].constant[1] = offset;
+        Operand result = {OPERAND_NODE, target, 0};
+        out = result;
+        return true;
+    }
+
+    // An input divided by a constant, or times one and divided by another
+    bool isScaledInput(const Operand& operand) const {
+        if (operand.kind != OPERAND_NODE) {
+            return false;
+        }
+        RuleProgram::Evaluate evaluate = program.nodes[operand.index].evaluate;
+        return evaluate == evaluateDivide<OPERAND_INPUT> || evaluate == evaluateScale<OPERAND_INPUT, OPERAND_CONST>;
+    }
+
+    bool build(int node, int depth, Operand& out) {
+        const Node current = nodes[node];
+        if (current.op == RULE_OP_CONST || current.op == RULE_OP_INPUT) {
+            Operand operand = {current.op == RULE_OP_CONST ? OPERAND_CONST : OPERAND_INPUT,
+                current.op == RULE_OP_CONST ? 0 : (int)current.value, current.value};
+            out = operand;
+            return true;
+        }
+        if (depth >= RuleProgram::MAX_DEPTH) {
+            return fail("Expression is too deep");
+        }
+
+        if (current.op == RULE_OP_NEG || current.op == RULE_OP_NOT) {
+            Operand operand;
+            if (!build(current.a, depth + 1, operand)) {
+                return false;
+            }
+            int target = addProgramNode(current.op == RULE_OP_NEG ? unaryEvaluator<RULE_OP_NEG>(operand.kind) :
+                unaryEvaluator<RULE_OP_NOT>(operand.kind));
+            setOperand(target, 0, operand);
+            Operand result = {OPERAND_NODE, target, 0};
+            out = result;
+            return true;
+        }
+
+        if (current.op == RULE_OP_SELECT) {
+            bool isScan;
+            if (!buildScan(node, out, isScan)) {
+                return false;
+            }
+            if (isScan) {
+                return true;
+            }
+            Operand operands[3];
+            if (!build(current.a, depth + 1, operands[0]) || !build(current.b, depth + 1, operands[1]) ||
+                !build(current.c, depth + 1, operands[2])) {
+                return false;
+            }
+            int target;
+            if (isScaledInput(operands[1]) && isScaledInput(operands[2])) {
+                // The arms' nodes stay in the program but are only read, so a divide gets its multiplier of 1
+                for (int slot = 1; slot < 3; slot++) {
+                    if (program.nodes[operands[slot].index].evaluate == evaluateDivide<OPERAND_INPUT>) {
+                        program.nodes[operands[slot].index].constant[1] = 1;
+                    }
+                }
+                target = addProgramNode(operands[0].kind == OPERAND_INPUT ? evaluatePickScaled<OPERAND_INPUT> :
+                    evaluatePickScaled<OPERAND_NODE>);
+            }
+            else {
+                target = addProgramNode(selectEvaluator(operands[0].kind, operands[1].kind, operands[2].kind));
+            }
+            for (int slot = 0; slot < 3; slot++) {
+                setOperand(target, slot, operands[slot]);
+            }
+            Operand result = {OPERAND_NODE, target, 0};
+            out = result;
+            return true;
+        }
+
+        // Division by a constant multiplies instead; a product divided by one is a single node
+        if (current.op == RULE_OP_DIV && isConstantNode(current.b)) {
+            long long divisor = nodes[current.b].value;
+            if (divisor == 1) {
+                return build(current.a, depth, out);
+            }
+            if (divisor != -1) {
+                const Node& dividend = nodes[current.a];
+                Operand operands[2];
+                int target;
+                if (dividend.op == RULE_OP_MUL) {
+                    if (!build(dividend.a, depth + 1, operands[0]) || !build(dividend.b, depth + 1, operands[1])) {
+                        return false;
+                    }
+                    target = addProgramNode(scaleEvaluator(operands[0].kind, operands[1].kind));
+                    setOperand(target, 1, operands[1]);
+                }
+                else {
+                    if (!build(current.a, depth + 1, operands[0])) {
+                        return false;
+                    }
+                    target = addProgramNode(divideEvaluator(operands[0].kind));
+                }
+                setOperand(target, 0, operands[0]);
+                setMagic(program.nodes[target], divisor);
+                Operand result = {OPERAND_NODE, target, 0};
+                out = result;
+                return true;
+            }
+        }
+
+        // Binary; makeBinary left any constant on the right unless the operator forbids it
+        Operand left, right;
+        if (!build(current.a, depth + 1, left) || !build(current.b, depth + 1, right)) {
+            return false;
+        }
+        int target = addProgramNode(binaryEvaluator(current.op, left.kind, right.kind));
+        setOperand(target, 0, left);
+        setOperand(target, 1, right);
+        Operand result = {OPERAND_NODE, target, 0};
+        out = result;
+        return true;
+    }
+
+public:
+    RuleCompiler(RuleProgram& p, unsigned allowed) : program(p), allowedInputs(allowed), position(0) {}
+
+    bool compile(const string& text) {
+        program = RuleProgram();
+        int root;
+        if (!tokenize(text) || !parseExpression(root)) {
+            return false;
+        }
+        if (peek().kind != 'e') {
+            return fail("Unexpected '" + peek().text + "'");
+        }
+
+        Operand result;
+        if (!build(root, 0, result)) {
+            return false;
+        }
+        program.isConstant = result.kind == OPERAND_CONST;
+        program.constant = result.value;
+        if (result.kind == OPERAND_INPUT) {
+            program.root = addProgramNode(evaluateInput);  // The rule is just an input
+            setOperand(program.root, 0, result);
+        }
+        else {
+            program.root = result.index;
+        }
+        if (program.isConstant) {
+            program.nodes.clear();
+            program.tables.clear();
+        }
+        return true;
+    }
+
+    const string& getError() const { return error; }
+};
+
+// RuleSet class implementation
+struct RuleSpec {
+    const char* name;
+    unsigned inputs;  // Bit per RuleInput the rule may read
+};
+
+static const RuleSpec RULE_SPECS[RULE_COUNT] = {
+    {"event", 1u << INPUT_ROLL},
+    {"plague_loss", (1u << INPUT_PEOPLE) | (1u << INPUT_SHORTAGE)},
+    {"war_resource_loss", 0},
+    {"war_gold_percent", 0},
+    {"disaster_loss", 0},
+    {"assassination_stability", 0},
+    {"revolt_gold_percent", 0},
+    {"revolt_stability", 0},
+    {"windfall_percent", 0},
+    {"base_price", 1u << INPUT_RESOURCE},
+    {"growth", (1u << INPUT_BIRTH_RATE) | (1u << INPUT_DEATH_RATE) | (1u << INPUT_PEOPLE) | (1u << INPUT_FOOD)},
+    {"shortage_penalty", (1u << INPUT_FOOD) | (1u << INPUT_STABILITY)}
+};
+
+const char* RuleSet::getRuleName(int rule) {
+    return rule >= 0 && rule < RULE_COUNT ? RULE_SPECS[rule].name : "unknown";
+}
+
+const char* RuleSet::getDefaultSource() {
+    return
+        "# Random event for a 0-99 roll: 0 plague, 1 war, 2 disaster, 3 assassination,\n"
+        "# 4 revolt, 5 windfall, anything else nothing\n"
+        "event = roll < 15 ? 0 : roll < 30 ? 1 : roll < 45 ? 2 : roll < 60 ? 3 : roll < 75 ? 4 : roll < 90 ? 5 : 6\n"
+        "plague_loss = shortage ? people * 15 / 100 : people / 10\n"
+        "war_resource_loss = 30\n"
+        "war_gold_percent = 20\n"
+        "disaster_loss = 20\n"
+        "assassination_stability = 20\n"
+        "revolt_gold_percent = 10\n"
+        "revolt_stability = 15\n"
+        "windfall_percent = 10\n"
+        "# Gold per unit: 0 wood, 1 stone, 2 iron, 3 food, 4 weapons\n"
+        "base_price = resource == 0 ? 5 : resource == 1 ? 8 : resource == 2 ? 15 : resource == 3 ? 12 : resource == 4 ? 25 : 10\n"
+        "growth = (birth - death) * people / 100\n"
+        "shortage_penalty = 5\n";
+}
+
+bool RuleSet::compile(const string& text, const string& fileName) {
+    bool isDefined[RULE_COUNT] = {};
+    bool ok = true;
+    istringstream lines(text);
+    string line;
+    for (int number = 1; getline(lines, line); number++) {
+        size_t comment = line.find('#');
+        if (comment != string::npos) {
+            line.erase(comment);
+        }
+        if (line.find_first_not_of(" \t\r") == string::npos) {
+            continue;
+        }
+
+        size_t equals = line.find('=');
+        size_t nameStart = line.find_first_not_of(" \t");
+        size_t nameEnd = equals == string::npos ? string::npos : line.find_last_not_of(" \t", equals - 1);
+        if (equals == string::npos || line.compare(equals, 2, "==") == 0 || nameEnd == string::npos ||
+            nameStart > nameEnd) {
+            Visual::printError(VFMT("{} line {}: Expected name = expression"), fileName, number);
+            ok = false;
+            continue;
+        }
+        string name = line.substr(nameStart, nameEnd - nameStart + 1);
+        int rule = 0;
+        while (rule < RULE_COUNT && name != RULE_SPECS[rule].name) {
+            rule++;
+        }
+        if (rule == RULE_COUNT) {
+            Visual::printError(VFMT("{} line {}: Unknown rule '{}'"), fileName, number, name);
+            ok = false;
+            continue;
+        }
+        if (isDefined[rule]) {
+            Visual::printError(VFMT("{} line {}: Rule {} is defined twice"), fileName, number, name);
+            ok = false;
+            continue;
+        }
+        isDefined[rule] = true;
+
+        RuleProgram program;
+        RuleCompiler compiler(program, RULE_SPECS[rule].inputs);
+        if (!compiler.compile(line.substr(equals + 1))) {
+            Visual::printError(VFMT("{} line {}: {}"), fileName, number, compiler.getError());
+            ok = false;
+            continue;
+        }
+        programs[rule] = program;
+    }
+    if (ok) {
+        source = text;
+        hash = hashSource(text);
+    }
+    return ok;
+}
+
+unsigned long long RuleSet::hashSource(const string& text) {
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    for (unsigned char byte : text) {
+        hash = (hash ^ byte) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Rules class implementation
+atomic<const RuleSet*> Rules::current(nullptr);
+vector<const RuleSet*> Rules::retired;
+
+const RuleSet& Rules::getDefaults() {
+    static const RuleSet defaults = [] {
+        RuleSet rules;
+        rules.compile(RuleSet::getDefaultSource(), "built-in rules");
+        return rules;
+    }();
+    return defaults;
+}
+
+const RuleSet& Rules::get() {
+    const RuleSet* rules = current.load(memory_order_acquire);
+    return rules != nullptr ? *rules : getDefaults();
+}
+
+bool Rules::load(const string& path) {
+    MemoryScope scope(MEMORY_OTHER, "Rules::load");
+    ifstream file(path, ios::binary);
+    if (!file) {
+        Visual::printError(VFMT("Cannot open rule file {}!"), path);
+        return false;
+    }
+    stringstream text;
+    text << file.rdbuf();
+    return loadSource(text.str(), path);
+}
+
+bool Rules::loadSource(const string& source, const string& name) {
+    // Rules the text leaves out keep their built-in definitions
+    RuleSet* rules = new RuleSet(getDefaults());
+    if (!rules->compile(source, name)) {
+        delete rules;
+        Visual::printWarning("Rule file has errors; keeping the current rules.");
+        return false;
+    }
+    const RuleSet* previous = current.exchange(rules, memory_order_acq_rel);
+    if (previous != nullptr) {
+        retired.push_back(previous);
+    }
+    Visual::printSuccess(VFMT("Loaded rules from {}."), name);
+    return true;
+}
+
+void Rules::reset() {
+    const RuleSet* previous = current.exchange(nullptr, memory_order_acq_rel);
+    if (previous != nullptr) {
+        retired.push_back(previous);
+    }
+}
+
+// FileWatcher class implementation
+#ifdef _WIN32
+FileWatcher::FileWatcher() : change(INVALID_HANDLE_VALUE) {
+    lastWrite.dwLowDateTime = 0;
+    lastWrite.dwHighDateTime = 0;
+}
+
+FileWatcher::~FileWatcher() {
+    if (change != INVALID_HANDLE_VALUE) {
+        FindCloseChangeNotification(change);
+    }
+}
+#else
+FileWatcher::FileWatcher() : descriptor(-1) {}
+
+FileWatcher::~FileWatcher() {
+    if (descriptor >= 0) {
+        close(descriptor);
+    }
+}
+#endif
+
+bool FileWatcher::open(const string& path) {
+    size_t slash = path.find_last_of("/\\");
+    directory = slash == string::npos ? "." : path.substr(0, slash);
+    fileName = slash == string::npos ? path : path.substr(slash + 1);
+
+    // Watch the directory: editors often save by renaming a new file over the old one
+#ifdef _WIN32
+    if (change != INVALID_HANDLE_VALUE) {
+        FindCloseChangeNotification(change);
+    }
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes)) {
+        lastWrite = attributes.ftLastWriteTime;
+    }
+    change = FindFirstChangeNotificationA(directory.c_str(), FALSE,
+        FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    return change != INVALID_HANDLE_VALUE;
+#else
+    if (descriptor >= 0) {
+        close(descriptor);
+    }
+    descriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (descriptor < 0) {
+        return false;
+    }
+    if (inotify_add_watch(descriptor, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(descriptor);
+        descriptor = -1;
+        return false;
+    }
+    return true;
+#endif
+}
+
+bool FileWatcher::poll() {
+    bool isChanged = false;
+#ifdef _WIN32
+    // Windows only says that something in the directory changed
+    while (change != INVALID_HANDLE_VALUE && WaitForSingleObject(change, 0) == WAIT_OBJECT_0) {
+        FindNextChangeNotification(change);
+        WIN32_FILE_ATTRIBUTE_DATA attributes;
+        string path = directory + "\\" + fileName;
+        if (GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes) &&
+            CompareFileTime(&attributes.ftLastWriteTime, &lastWrite) != 0) {
+            lastWrite = attributes.ftLastWriteTime;
+            isChanged = true;
+        }
+    }
+#else
+    alignas(inotify_event) char buffer[4096];
+    while (descriptor >= 0) {
+        ssize_t length = read(descriptor, buffer, sizeof(buffer));
+        if (length <= 0) {
+            break;  // EAGAIN: nothing more queued
+        }
+        for (ssize_t offset = 0; offset < length; ) {
+            const inotify_event* event = (const inotify_event*)(buffer + offset);
+            if (event->len > 0 && fileName == event->name) {
+                isChanged = true;
+            }
+            offset += sizeof(inotify_event) + event->len;
+        }
+    }
+#endif
+    return isChanged;
+}
+
+// The built-in rules written out in C++, for runRulesCheck
+static long long handWrittenRule(int rule, const long long* in) {
+    switch (rule) {
+    case RULE_EVENT: {
+        long long roll = in[INPUT_ROLL];
+        return roll < 15 ? EVENT_PLAGUE : roll < 30 ? EVENT_WAR : roll < 45 ? EVENT_DISASTER :
+            roll < 60 ? EVENT_ASSASSINATION : roll < 75 ? EVENT_REVOLT : roll < 90 ? EVENT_WINDFALL : EVENT_NONE;
+    }
+    case RULE_PLAGUE_LOSS:
+        return in[INPUT_SHORTAGE] ? in[INPUT_PEOPLE] * 15 / 100 : in[INPUT_PEOPLE] / 10;
+    case RULE_WAR_RESOURCE_LOSS: return 30;
+    case RULE_WAR_GOLD_PERCENT: return 20;
+    case RULE_DISASTER_LOSS: return 20;
+    case RULE_ASSASSINATION_STABILITY: return 20;
+    case RULE_REVOLT_GOLD_PERCENT: return 10;
+    case RULE_REVOLT_STABILITY: return 15;
+    case RULE_WINDFALL_PERCENT: return 10;
+    case RULE_BASE_PRICE: {
+        static const int prices[5] = {5, 8, 15, 12, 25};
+        long long resource = in[INPUT_RESOURCE];
+        return resource >= 0 && resource < 5 ? prices[resource] : 10;
+    }
+    case RULE_GROWTH:
+        return (in[INPUT_BIRTH_RATE] - in[INPUT_DEATH_RATE]) * in[INPUT_PEOPLE] / 100;
+    default: return 5;  // RULE_SHORTAGE_PENALTY
+    }
+}
+
+// Checks the current rules against the hand-written ones and times both.
+// With a path, only checks that the file compiles and times it.
+bool runRulesCheck(const string& path, int evaluations) {
+    if (evaluations < 1) {
+        Visual::printError("Rules check needs at least one evaluation!");
+        return false;
+    }
+    if (!path.empty() && !Rules::load(path)) {
+        return false;
+    }
+
+    static constexpr int TIMING_RUNS = 20;
+    static constexpr int MAX_SLOWDOWN = 2;  // Compiled rules must stay within this of hand-written C++
+
+    // A fixed table of inputs, reused round-robin
+    const int SAMPLES = 1024;
+    vector<long long> samples((size_t)SAMPLES * RULE_INPUT_COUNT);
+    GameRandom random(0x5EED);
+    for (int s = 0; s < SAMPLES; s++) {
+        long long* in = &samples[(size_t)s * RULE_INPUT_COUNT];
+        in[INPUT_ROLL] = random.nextInt(100);
+        in[INPUT_PEOPLE] = random.nextInt(100000);
+        in[INPUT_SHORTAGE] = random.nextInt(2);
+        in[INPUT_RESOURCE] = random.nextInt(6);
+        in[INPUT_BIRTH_RATE] = random.nextInt(10);
+        in[INPUT_DEATH_RATE] = random.nextInt(10);
+        in[INPUT_FOOD] = random.nextInt(100000);
+        in[INPUT_STABILITY] = random.nextInt(101);
+    }
+
+    const RuleSet& rules = Rules::get();
+    bool ok = true;
+    long long compiledTotal = 0;
+    long long handTotal = 0;
+    for (int rule = 0; rule < RULE_COUNT; rule++) {
+        if (path.empty()) {
+            for (int s = 0; s < SAMPLES; s++) {
+                const long long* in = &samples[(size_t)s * RULE_INPUT_COUNT];
+                if (rules.run(rule, in) != handWrittenRule(rule, in)) {
+                    Visual::printError(VFMT("Rule {} gives {} instead of {} for sample {}"), RuleSet::getRuleName(rule),
+                        rules.run(rule, in), handWrittenRule(rule, in), s);
+                    ok = false;
+                    break;
+                }
+            }
+        }
+
+        // The evaluations are split into short runs and the best run counts,
+        // scaled back up, so bursts of other work on the machine do not decide the limit
+        int perRun = evaluations / TIMING_RUNS > 0 ? evaluations / TIMING_RUNS : 1;
+        long long compiledSum = 0;
+        long long handSum = 0;
+        long long compiled = LLONG_MAX;
+        long long hand = LLONG_MAX;
+        for (int run = 0; run < TIMING_RUNS; run++) {
+            auto start = chrono::steady_clock::now();
+            for (int n = 0; n < perRun; n++) {
+                compiledSum += rules.run(rule, &samples[(size_t)(n % SAMPLES) * RULE_INPUT_COUNT]);
+            }
+            auto middle = chrono::steady_clock::now();
+            for (int n = 0; n < perRun; n++) {
+                handSum += handWrittenRule(rule, &samples[(size_t)(n % SAMPLES) * RULE_INPUT_COUNT]);
+            }
+            auto end = chrono::steady_clock::now();
+
+            long long compiledRun = (long long)chrono::duration_cast<chrono::nanoseconds>(middle - start).count();
+            long long handRun = (long long)chrono::duration_cast<chrono::nanoseconds>(end - middle).count();
+            if (compiledRun < compiled) compiled = compiledRun;
+            if (handRun < hand) hand = handRun;
+        }
+        compiled = compiled * TIMING_RUNS / 1000;  // In microseconds, for all the evaluations
+        hand = hand * TIMING_RUNS / 1000;
+        compiledTotal += compiled;
+        handTotal += hand;
+        Visual::printInfo(VFMT("{}: {} nodes, {} us compiled, {} us hand-written (checksums {} and {})"),
+            RuleSet::getRuleName(rule), rules.getProgram(rule).getSize(), compiled, hand, compiledSum, handSum);
+
+        // Only the built-in rules have a hand-written twin; a constant rule costs nothing either way
+        if (path.empty() && rules.getProgram(rule).getSize() > 0 && compiled > hand * MAX_SLOWDOWN) {
+            Visual::printError(VFMT("Rule {} is more than {}x slower than hand-written C++!"),
+                RuleSet::getRuleName(rule), MAX_SLOWDOWN);
+            ok = false;
+        }
+    }
+    if (ok) {
+        Visual::printSuccess(VFMT("Rules check passed: {} evaluations per rule, {} us compiled, {} us hand-written."),
+            evaluations, compiledTotal, handTotal);
+    }
+    return ok;
+}
+
+// RawInput class implementation
+#ifdef _WIN32
+bool RawInput::open() {
+    console = GetStdHandle(STD_INPUT_HANDLE);
+    if (console == INVALID_HANDLE_VALUE || !GetConsoleMode(console, &savedMode)) {
+        return false;
+    }
+    SetConsoleMode(console, savedMode & ~(ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT));
+
+    // The real-time screen is drawn with escape codes
+    HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD outputMode;
+    if (GetConsoleMode(output, &outputMode)) {
+        SetConsoleMode(output, outputMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+    }
+    isRaw = true;
+    return true;
+}
+
+void RawInput::close() {
+    if (isRaw) {
+        SetConsoleMode(console, savedMode);
+        isRaw = false;
+    }
+}
+
+int RawInput::readKey() {
+    if (!_kbhit()) {
+        return -1;
+    }
+    int key = _getch();
+    if (key == 0 || key == 224) {
+        _getch();  // Arrow and function keys are a prefix and a scan code
+        return KEY_SPECIAL;
+    }
+    return key;
+}
+
+bool RawInput::waitForKey(int milliseconds) {
+    // Also wakes for mouse and focus events; readKey() then finds nothing
+    return WaitForSingleObject(console, (DWORD)milliseconds) == WAIT_OBJECT_0 && _kbhit();
+}
+#else
+bool RawInput::open() {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) != 0) {
+        return false;
+    }
+    struct termios raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0) {
+        return false;
+    }
+    isRaw = true;
+    return true;
+}
+
+void RawInput::close() {
+    if (isRaw) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+        isRaw = false;
+    }
+}
+
+// Next byte of input if one arrives within milliseconds, otherwise -1
+static int readByte(int milliseconds) {
+    struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+    unsigned char key;
+    if (::poll(&input, 1, milliseconds) <= 0 || read(STDIN_FILENO, &key, 1) != 1) {
+        return -1;
+    }
+    return key;
+}
+
+int RawInput::readKey() {
+    int key = readByte(0);
+    if (key != KEY_ESCAPE) {
+        return key;
+    }
+    // A lone Escape has nothing after it; a key's sequence follows at once
+    int next = readByte(ESCAPE_WAIT_MILLISECONDS);
+    if (next < 0) {
+        return KEY_ESCAPE;
+    }
+    if (next == '[' || next == 'O') {
+        // SS3 (ESC O) has one more byte; CSI (ESC [) runs to a byte from '@' to '~'
+        int byte = readByte(ESCAPE_WAIT_MILLISECONDS);
+        while (next == '[' && byte >= 0 && (byte < '@' || byte > '~')) {
+            byte = readByte(ESCAPE_WAIT_MILLISECONDS);
+        }
+    }
+    return KEY_SPECIAL;  // Alt with a key sends Escape and that key
+}
+
+bool RawInput::waitForKey(int milliseconds) {
+    struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+    return ::poll(&input, 1, milliseconds) > 0;
+}
+#endif
+
+// FixedTimestep class implementation
+FixedTimestep::FixedTimestep(int periodMilliseconds)
+    : period(chrono::milliseconds(periodMilliseconds)), tickCount(0), skippedCount(0), totalLateness(0),
+      maxLateness(0) {
+    memset(histogram, 0, sizeof(histogram));
+    restart();
+}
+
+void FixedTimestep::restart() {
+    origin = chrono::steady_clock::now();
+    gridTicks = 0;
+}
+
+int FixedTimestep::collectDueTicks(int maxTicks) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    int due = 0;
+    while (due < maxTicks && getNextTick() <= now) {
+        long long lateness = (long long)chrono::duration_cast<chrono::microseconds>(now - getNextTick()).count();
+        int bucket = (int)(lateness / BUCKET_MICROSECONDS);
+        histogram[bucket < BUCKETS ? bucket : BUCKETS - 1]++;
+        totalLateness += lateness;
+        maxLateness = lateness > maxLateness ? lateness : maxLateness;
+        tickCount++;
+        gridTicks++;
+        due++;
+    }
+
+    // Still behind: drop the backlog rather than fall further behind catching up
+    if (getNextTick() <= now) {
+        long long behind = (long long)((now - getNextTick()) / period) + 1;
+        skippedCount += behind;
+        gridTicks += behind;
+    }
+    return due;
+}
+
+long long FixedTimestep::getLatenessPercentile(int percent) const {
+    long long wanted = (tickCount * percent + 99) / 100;
+    long long seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen >= wanted) {
+            return i < BUCKETS - 1 ? (long long)(i + 1) * BUCKET_MICROSECONDS : maxLateness;
+        }
+    }
+    return maxLateness;
+}
+
+// Runs scripted turns on a fixed timestep with no terminal and reports how
+// late the ticks started. Fails if a tick was skipped or started more than
+// a quarter period late.
+bool runRealTimeCheck(int ticks, int periodMilliseconds, unsigned long long seed) {
+    if (ticks < 1 || periodMilliseconds < 1) {
+        Visual::printError("Real-time check needs at least one tick of at least 1 ms!");
+        return false;
+    }
+    bool wasQuiet = Visual::quietMode();
+    Visual::setQuiet(true);
+
+    Kingdom* kingdom = new Kingdom("Westland", seed);
+    GameRandom script(seed ^ 0x5DEECE66DULL);
+    FixedTimestep clock(periodMilliseconds);
+    long long longestTurn = 0;
+    while (clock.getTickCount() + clock.getSkippedCount() < ticks) {
+        int due = clock.collectDueTicks(4);
+        for (int i = 0; i < due; i++) {
+            auto start = chrono::steady_clock::now();
+            runTurn(*kingdom, scriptedCommand(script));
+            long long elapsed = (long long)chrono::duration_cast<chrono::microseconds>(
+                chrono::steady_clock::now() - start).count();
+            longestTurn = elapsed > longestTurn ? elapsed : longestTurn;
+        }
+        this_thread::sleep_until(clock.getNextTick());
+    }
+    delete kingdom;
+    Visual::setQuiet(wasQuiet);
+
+    Visual::printInfo(VFMT("{} ticks of {} ms: started late by {} us on average, under {} us for 99%, {} us at most"),
+        clock.getTickCount(), periodMilliseconds, clock.getMeanLateness(), clock.getLatenessPercentile(99),
+        clock.getMaxLateness());
+    Visual::printInfo(VFMT("Longest turn took {} us; {} ticks skipped"), longestTurn, clock.getSkippedCount());
+    if (clock.getSkippedCount() > 0 || clock.getMaxLateness() * 4 > periodMilliseconds * 1000LL) {
+        Visual::printError("Real-time check failed: ticks ran late.");
+        return false;
+    }
+    Visual::printSuccess("Real-time check passed.");
+    return true;
+}
+
+// Fills a book with random loans and pays them all in full, checking a
+// sample against the closed-form schedule each turn and that every loan
+// closes on its last turn. Then checks that a kingdom without gold falls
+// into arrears, feels it, is refused new credit and has its loans written
+// off once it misses enough payments. Reports the accrual cost per loan
+// and turn.
+bool runLoanCheck(int loanCount, int turns, unsigned long long seed) {
+    if (loanCount < 1 || turns < 1) {
+        Visual::printError("Loan check needs at least one loan and one turn!");
+        return false;
+    }
+    bool wasQuiet = Visual::quietMode();
+    Visual::setQuiet(true);
+
+    GameRandom random(seed);
+    LoanBook book;
+    vector<int> closingTurns(Bank::MAX_TERM + 1, 0);
+    for (int i = 0; i < loanCount; i++) {
+        int term = Bank::MIN_TERM + random.nextInt(Bank::MAX_TERM - Bank::MIN_TERM + 1);
+        book.add(Money(100 + random.nextInt(Bank::MAX_LOAN - 99)), 50 + random.nextInt(350), term);
+        closingTurns[term]++;
+    }
+
+    const int SAMPLE = 97;  // Every 97th loan is checked against the schedule
+    int open = loanCount;
+    int badTurn = -1;
+    long long accrueNanoseconds = 0;
+    for (int t = 1; t <= turns && badTurn < 0; t++) {
+        auto start = chrono::steady_clock::now();
+        book.accrue(Money::fromRaw(LLONG_MAX));
+        accrueNanoseconds += (long long)chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - start).count();
+
+        open -= t <= Bank::MAX_TERM ? closingTurns[t] : 0;
+        if (book.getCount() != open || book.getArrearsCount() != 0) {
+            badTurn = t;
+        }
+        for (int i = 0; i < book.getCount() && badTurn < 0; i += SAMPLE) {
+            long long drift = book.getBalance(i).getRaw() - book.getScheduledBalance(i).getRaw();
+            long long tolerance = book.getPrincipal(i).getRaw() / 1000 + book.getAge(i);  // Rounding per turn
+            if (drift > tolerance || -drift > tolerance) {
+                badTurn = t;
+            }
+        }
+    }
+
+    // Arrears: an empty treasury misses every payment and the kingdom pays for it
+    Kingdom* kingdom = new Kingdom("Westland", seed);
+    Kingdom* self = kingdom;
+    kingdom->getBank().takeLoan(Money(1000), Bank::DEFAULT_TERM, kingdom->getEconomy());
+    kingdom->getBank().takeLoan(Money(500), Bank::MIN_TERM, kingdom->getEconomy());
+    kingdom->getLedger().set(LEDGER_GOLD, 0);
+    int stabilityBefore = kingdom->getPolitics().getStability();
+    for (int t = 0; t < 3; t++) {
+        Bank::accrueInterest(&self, 1);
+    }
+    bool arrearsFelt = kingdom->getBank().getLoans().getArrearsCount() == 2 &&
+        kingdom->getBank().getLoans().getMissed(0) == 3 &&
+        kingdom->getBank().getInterestRate() > Bank::BASE_RATE &&
+        kingdom->getEconomy().getIsRecession() &&
+        kingdom->getPolitics().getStability() < stabilityBefore;
+    kingdom->getBank().takeLoan(Money(100), Bank::DEFAULT_TERM, kingdom->getEconomy());  // Refused
+    arrearsFelt = arrearsFelt && kingdom->getBank().getLoans().getCount() == 2;
+    kingdom->getLedger().set(LEDGER_GOLD, Money(100000).getRaw());
+    Bank::accrueInterest(&self, 1);
+    bool arrearsCleared = kingdom->getBank().getLoans().getArrearsCount() == 0 &&
+        !kingdom->getEconomy().getIsRecession();
+
+    // Left unpaid long enough, what is still open is written off
+    kingdom->getLedger().set(LEDGER_GOLD, 0);
+    for (int t = 0; t < LoanBook::WRITE_OFF_MISSES; t++) {
+        Bank::accrueInterest(&self, 1);
+    }
+    bool writtenOff = kingdom->getBank().getLoans().getCount() == 0 &&
+        kingdom->getBank().getLoanAmount() == 0 && kingdom->getBank().getLoans().getArrearsCount() == 0;
+    delete kingdom;
+    Visual::setQuiet(wasQuiet);
+
+    long long loanTurns = (long long)loanCount * turns;
+    Visual::printInfo(VFMT("{} loans over {} turns: {} ns per loan and turn, {} loans still open"), loanCount, turns,
+        accrueNanoseconds / (loanTurns > 0 ? loanTurns : 1), book.getCount());
+    if (badTurn >= 0) {
+        Visual::printError(VFMT("Loan check failed: turn {} strays from the closed-form schedule."), badTurn);
+        return false;
+    }
+    if (!arrearsFelt || !arrearsCleared) {
+        Visual::printError("Loan check failed: arrears did not reach the economy and politics.");
+        return false;
+    }
+    if (!writtenOff) {
+        Visual::printError("Loan check failed: a defaulted loan was never written off.");
+        return false;
+    }
+    Visual::printSuccess("Loan check passed.");
+    return true;
+}
+
+// The world aggregate one leaf at a time on this thread alone
+static WorldTotals aggregateSerially(Kingdom* const* kingdoms, int count) {
+    WorldTotals totals;
+    for (int begin = 0; begin < count; begin += WorldEconomy::LEAF) {
+        totals += WorldEconomy::aggregate(kingdoms + begin,
+            count - begin < WorldEconomy::LEAF ? count - begin : WorldEconomy::LEAF);
+    }
+    return totals;
+}
+
+// Runs world turns for many kingdoms and checks the parallel aggregate
+// against a plain serial sum every turn, then times both. The parallel one
+// should take about the serial time divided by the core count.
+bool runWorldCheck(int kingdomCount, int turns, unsigned long long seed) {
+    if (kingdomCount < 1 || turns < 1) {
+        Visual::printError("World check needs at least one kingdom and one turn!");
+        return false;
+    }
+    bool wasQuiet = Visual::quietMode();
+    Visual::setQuiet(true);
+
+    vector<Kingdom*> kingdoms;
+    for (int i = 0; i < kingdomCount; i++) {
+        kingdoms.push_back(new Kingdom("Kingdom " + to_string(i + 1), seed + i));
+    }
+    GameRandom script(seed ^ 0x5DEECE66DULL);
+    vector<TurnCommand> commands(kingdomCount);
+    int badTurn = -1;
+    int recessions = 0;
+    for (int t = 0; t < turns && badTurn < 0; t++) {
+        for (int i = 0; i < kingdomCount; i++) {
+            commands[i] = scriptedCommand(script);
+        }
+        runWorldTurn(kingdoms.data(), commands.data(), kingdomCount);
+
+        // Every kingdom must have seen the same world
+        long long output = kingdoms[0]->getEconomy().getWorldOutput();
+        for (int i = 0; i < kingdomCount; i++) {
+            if (kingdoms[i]->getEconomy().getWorldOutput() != output) {
+                badTurn = t + 1;
+            }
+        }
+        recessions += kingdoms[0]->getEconomy().getIsRecession();
+
+        WorldTotals serial = aggregateSerially(kingdoms.data(), kingdomCount);
+        WorldTotals parallel = WorldEconomy::aggregate(kingdoms.data(), kingdomCount);
+        if (serial.money != parallel.money || serial.output != parallel.output || serial.trade != parallel.trade ||
+            serial.people != parallel.people) {
+            badTurn = t + 1;
+        }
+    }
+
+    const int ROUNDS = 50;
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < ROUNDS; r++) {
+        aggregateSerially(kingdoms.data(), kingdomCount);
+    }
+    auto middle = chrono::steady_clock::now();
+    for (int r = 0; r < ROUNDS; r++) {
+        WorldEconomy::aggregate(kingdoms.data(), kingdomCount);
+    }
+    auto end = chrono::steady_clock::now();
+
+    int inflation = kingdoms[0]->getEconomy().getInflationRate();
+    int priceLevel = kingdoms[0]->getMarket().getPriceLevel();
+    for (Kingdom* kingdom : kingdoms) {
+        delete kingdom;
+    }
+    Visual::setQuiet(wasQuiet);
+
+    long long serialMicroseconds = (long long)chrono::duration_cast<chrono::microseconds>(middle - start).count() / ROUNDS;
+    long long parallelMicroseconds = (long long)chrono::duration_cast<chrono::microseconds>(end - middle).count() / ROUNDS;
+    Visual::printInfo(VFMT("{} kingdoms, {} turns: inflation {}% per turn, price level {}, {} turns of recession"),
+        kingdomCount, turns, formatRate(inflation), priceLevel, recessions);
+    Visual::printInfo(VFMT("Aggregation: {} us serial, {} us parallel on {} threads"), serialMicroseconds,
+        parallelMicroseconds, (int)thread::hardware_concurrency());
+    if (badTurn >= 0) {
+        Visual::printError(VFMT("World check failed: turn {} aggregates disagree."), badTurn);
+        return false;
+    }
+    Visual::printSuccess("World check passed.");
+    return true;
+}
+
+// Steps many climate regions, checks that spells count down and that the
+// transitions drawn match the seasonal tables, then times the step.
+bool runClimateCheck(int regionCount, int turns, unsigned long long seed) {
+    if (regionCount < 1 || turns < 1) {
+        Visual::printError("Climate check needs at least one region and one turn!");
+        return false;
+    }
+    ClimateModel model;
+    ClimateModel twin;  // Same seed, must stay identical
+    model.reset(regionCount, seed);
+    twin.reset(regionCount, seed);
+
+    vector<long long> counts(SEASON_COUNT * CLIMATE_COUNT * CLIMATE_COUNT, 0);
+    vector<unsigned char> before(regionCount);
+    vector<unsigned char> left(regionCount);
+    int badTurn = -1;
+    long long stepNanoseconds = 0;
+    for (int t = 1; t <= turns && badTurn < 0; t++) {
+        for (int i = 0; i < regionCount; i++) {
+            before[i] = (unsigned char)model.getCondition(i);
+            left[i] = (unsigned char)model.getRemaining(i);
+        }
+        auto start = chrono::steady_clock::now();
+        model.step(t);
+        stepNanoseconds += (long long)chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - start).count();
+        twin.step(t);
+
+        int season = ClimateModel::getSeason(t);
+        for (int i = 0; i < regionCount; i++) {
+            int remaining = model.getRemaining(i);
+            if (left[i] > 1) {
+                if (model.getCondition(i) != before[i] || remaining != left[i] - 1) {
+                    badTurn = t;
+                }
+                continue;
+            }
+            if (remaining < 1 || remaining > ClimateModel::MAX_DURATION) {
+                badTurn = t;
+            }
+            counts[(season * CLIMATE_COUNT + before[i]) * CLIMATE_COUNT + model.getCondition(i)]++;
+        }
+    }
+
+    ClimateModel restored;
+    bool isRepeatable = model.serialize() == twin.serialize() &&
+        restored.deserialize(model.serialize()) && restored.serialize() == model.serialize();
+
+    // Every drawn row against its table, within four standard deviations
+    double worst = 0;
+    bool isFaithful = true;
+    for (int s = 0; s < SEASON_COUNT; s++) {
+        for (int from = 0; from < CLIMATE_COUNT; from++) {
+            long long total = 0;
+            for (int to = 0; to < CLIMATE_COUNT; to++) {
+                total += counts[(s * CLIMATE_COUNT + from) * CLIMATE_COUNT + to];
+            }
+            for (int to = 0; to < CLIMATE_COUNT && total >= 100; to++) {
+                double expected = ClimateModel::getTransitionProbability(s, from, to);
+                double observed = (double)counts[(s * CLIMATE_COUNT + from) * CLIMATE_COUNT + to] / total;
+                double deviation = observed > expected ? observed - expected : expected - observed;
+                worst = deviation > worst ? deviation : worst;
+                if (deviation > 4 * sqrt(expected * (1 - expected) / total) + 0.002) {
+                    isFaithful = false;
+                }
+            }
+        }
+    }
+
+    Visual::printInfo(VFMT("{} regions over {} turns: {} us per step, worst transition error {}%"), regionCount,
+        turns, stepNanoseconds / turns / 1000.0, worst * 100);
+    if (badTurn >= 0) {
+        Visual::printError(VFMT("Climate check failed: turn {} broke a spell's countdown."), badTurn);
+        return false;
+    }
+    if (!isRepeatable) {
+        Visual::printError("Climate check failed: the same seed gave different weather.");
+        return false;
+    }
+    if (!isFaithful) {
+        Visual::printError("Climate check failed: transitions stray from the seasonal tables.");
+        return false;
+    }
+    Visual::printSuccess("Climate check passed.");
+    return true;
+}
+
+// Spreads an outbreak over a grid of regions, each trading with a market
+// town, and checks that everyone stays accounted for, that the same seed
+// repeats and that better public services slow the plague. Then times a step.
+bool runEpidemicCheck(int regionCount, int turns, unsigned long long seed) {
+    if (regionCount < 1 || turns < 1) {
+        Visual::printError("Epidemic check needs at least one region and one turn!");
+        return false;
+    }
+    const int TOWN_SPACING = 97;
+    GameRandom random(seed);
+    int width = (int)sqrt((double)regionCount);
+    vector<int> shares(regionCount);
+    vector<ContactLink> links;
+    for (int r = 0; r < regionCount; r++) {
+        shares[r] = 50 + random.nextInt(101);
+        if ((r + 1) % width != 0 && r + 1 < regionCount) {
+            links.push_back({r, r + 1, EpidemicModel::PROXIMITY_WEIGHT, 0});
+        }
+        if (r + width < regionCount) {
+            links.push_back({r, r + width, EpidemicModel::PROXIMITY_WEIGHT, 0});
+        }
+        int town = random.nextInt((regionCount + TOWN_SPACING - 1) / TOWN_SPACING) * TOWN_SPACING;
+        if (town != r) {
+            links.push_back({r, town, 0, EpidemicModel::TRADE_WEIGHT});
+        }
+    }
+
+    const int CLASS_MIX[CITIZEN_CLASS_COUNT] = {60, 20, 10, 10};  // People per region
+    EpidemicTurnInput input;
+    input.turn = 0;
+    for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+        input.people[c] = regionCount * CLASS_MIX[c];
+    }
+    input.publicServices = 50;
+    input.foodPercent = 100;
+    input.tradeLevel = 256;
+    EpidemicTurnInput careful = input;  // Fully funded public services
+    careful.publicServices = 100;
+
+    EpidemicModel model;
+    EpidemicModel twin;  // Same seed, must stay identical
+    EpidemicModel cared;
+    model.reset(shares, links, seed);
+    twin.reset(shares, links, seed);
+    cared.reset(shares, links, seed);
+    model.step(input);  // Settles everyone before the outbreak
+    twin.step(input);
+    cared.step(careful);
+    model.seedOutbreak(regionCount / 2, CITIZEN_MERCHANT, 20);
+    twin.seedOutbreak(regionCount / 2, CITIZEN_MERCHANT, 20);
+    cared.seedOutbreak(regionCount / 2, CITIZEN_MERCHANT, 20);
+
+    // Everyone left alive is in exactly one compartment
+    auto isAccountedFor = [](const EpidemicModel& m, const EpidemicTurnInput& in) {
+        for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+            long long people = 0;
+            for (int r = 0; r < m.getRegionCount(); r++) {
+                people += (long long)m.getSusceptible(r, c) + m.getInfected(r, c) + m.getRecovered(r, c);
+            }
+            if (people != in.people[c]) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    long long infections = 0;
+    long long caredInfections = 0;
+    long long peak = 0;
+    long long deaths = 0;
+    int badTurn = -1;
+    long long stepNanoseconds = 0;
+    for (int t = 1; t <= turns && badTurn < 0; t++) {
+        input.turn = t;
+        careful.turn = t;
+        auto start = chrono::steady_clock::now();
+        EpidemicTurnResult result = model.step(input);
+        stepNanoseconds += (long long)chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - start).count();
+        twin.step(input);
+        EpidemicTurnResult caredResult = cared.step(careful);
+
+        for (int c = 0; c < CITIZEN_CLASS_COUNT; c++) {
+            input.people[c] -= result.deaths[c];
+            careful.people[c] -= caredResult.deaths[c];
+        }
+        if (!isAccountedFor(model, input) || !isAccountedFor(cared, careful)) {
+            badTurn = t;
+        }
+        infections += result.infections;
+        caredInfections += caredResult.infections;
+        deaths += result.totalDeaths;
+        peak = result.infected > peak ? result.infected : peak;
+    }
+    bool isRepeatable = model.serialize() == twin.serialize();
+
+    long long people = (long long)regionCount * 100;
+    Visual::printInfo(VFMT("{} regions, {} links, {} turns: {} us per step, {} ns per link"), regionCount,
+        model.getLinkCount(), turns, stepNanoseconds / turns / 1000.0,
+        (double)stepNanoseconds / turns / model.getLinkCount());
+    Visual::printInfo(VFMT("Infected {}% of the people, {}% at the peak, {}% died; {}% with full public services"),
+        infections * 100.0 / people, peak * 100.0 / people, deaths * 100.0 / people, caredInfections * 100.0 / people);
+    if (badTurn >= 0) {
+        Visual::printError(VFMT("Epidemic check failed: turn {} lost track of people."), badTurn);
+        return false;
+    }
+    if (!isRepeatable) {
+        Visual::printError("Epidemic check failed: the same seed gave a different epidemic.");
+        return false;
+    }
+    if (caredInfections >= infections) {
+        Visual::printError("Epidemic check failed: public services did not slow the plague.");
+        return false;
+    }
+    Visual::printSuccess("Epidemic check passed.");
+    return true;
 }
\ No newline at end of file
@@ -6,22 +6,79 @@
 #include <string>   
 #include <windows.h>
 #include <ctime>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <queue>
+#include <limits>
+#include <functional>
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+#include <climits>
+#include <chrono>
+#include <cstring>
+#include <cstddef>
+#include <cstdio>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#ifndef _WIN32
+#include <termios.h>
+#endif
 
 using namespace std;
 
 // Forward declarations
 class Economy;
 class Population;
+class Diplomacy;
 class Kingdom;
+class ActionHistory;
+class TileMap;
+struct CaravanRoute;
+
+struct TurnCommand;
 
 // Function declarations
 void handleRandomEvent(Kingdom& kingdom);
-void updateGameState(Kingdom& kingdom);
+void applyRandomEvent(Kingdom& kingdom);   // Headless part of handleRandomEvent
+void executeCommand(Kingdom& kingdom, const TurnCommand& command);
+void updateGameState(Kingdom& kingdom);    // Standard stages from UPDATE_STAGE on; advances the turn
+void runTurn(Kingdom& kingdom, const TurnCommand& command);  // Headless turn
+void runWorldTurn(Kingdom* const* kingdoms, const TurnCommand* commands, int count);  // Kingdoms sharing one world
+bool runLockstepLoopback(int playerCount, int turns, unsigned long long seed);
+bool runPipelineCheck(int kingdomCount, int turns, unsigned long long seed);  // Parallel vs sequential turns
+bool recordScriptedReplay(const string& path, int turns, unsigned long long seed);
+bool verifyReplay(const string& path);  // Re-run a replay and report the first divergent turn
+bool runMemoryReport(int turns, unsigned long long seed);  // Memory per kingdom, turn, action and site
+bool runRulesCheck(const string& path, int evaluations);   // Compiled rules against the hand-written ones
+bool runRealTimeCheck(int ticks, int periodMilliseconds, unsigned long long seed);  // Tick jitter of real-time mode
+bool runLoanCheck(int loanCount, int turns, unsigned long long seed);  // Loan schedules and accrual cost
+bool runWorldCheck(int kingdomCount, int turns, unsigned long long seed);  // World aggregates and their cost
+bool runClimateCheck(int regionCount, int turns, unsigned long long seed);  // Climate chain statistics and step cost
+bool runEpidemicCheck(int regionCount, int turns, unsigned long long seed);  // Epidemic bookkeeping and step cost
 
 // Visual utility functions
 namespace Visual {
+    // Quiet mode silences all output, used by headless simulations
+    inline bool& quietMode() {
+        static bool quiet = false;
+        return quiet;
+    }
+
+    inline void setQuiet(bool quiet) { quietMode() = quiet; }
+
+    // Pause for effect; skipped in quiet mode
+    inline void pause(int milliseconds) {
+        if (!quietMode()) Sleep(milliseconds);
+    }
+
     // Clear screen function
     inline void clearScreen() {
+        if (quietMode()) return;
         #ifdef _WIN32
             system("cls");
         #else
@@ -29,43 +86,161 @@ namespace Visual {
         #endif
     }
 
-    // Print a horizontal line
+    // Print a horizontal line, filled straight into the stream
     inline void printLine(char ch = '=', int length = 50) {
-        cout << string(length, ch) << endl;
+        if (quietMode()) return;
+        fill_n(ostreambuf_iterator<char>(cout), length, ch);
+        cout << endl;
     }
 
-    // Print a message
-    inline void printMessage(const string& message) {
-        cout << message << endl;
+    // Messages are formatted into a fixed per-thread buffer so printing
+    // never touches the heap. Long messages are cut off at CAPACITY.
+    class MessageBuffer {
+        static const int CAPACITY = 512;
+        char* data;
+        int length;
+
+    public:
+        MessageBuffer() : length(0) {
+            static thread_local char storage[CAPACITY];
+            data = storage;
+        }
+
+        void append(const char* text, size_t count) {
+            size_t room = (size_t)(CAPACITY - length);
+            if (count > room) count = room;
+            memcpy(data + length, text, count);
+            length += (int)count;
+        }
+
+        void append(const char* text) { append(text, strlen(text)); }
+
+        void emit() const {
+            cout.write(data, length);
+            cout << endl;
+        }
+    };
+
+    // Number of "{}" placeholders in a format string, or -1 for a stray brace
+    constexpr int countPlaceholders(const char* text) {
+        int count = 0;
+        for (int i = 0; text[i] != '\0'; i++) {
+            if (text[i] == '{') {
+                if (text[i + 1] != '}') return -1;
+                count++;
+                i++;
+            }
+            else if (text[i] == '}') {
+                return -1;
+            }
+        }
+        return count;
     }
 
-    // Print a success message
-    inline void printSuccess(const string& message) {
-        printMessage("SUCCESS: " + message);
+    // Format string tagged with its placeholder count; build it with VFMT
+    template <int N>
+    struct FormatString {
+        const char* text;
+        explicit constexpr FormatString(const char* t) : text(t) {}
+    };
+
+    inline void appendValue(MessageBuffer& out, unsigned long long value) {
+        char digits[20];
+        int count = 0;
+        do {
+            digits[count++] = (char)('0' + value % 10);
+            value /= 10;
+        } while (value > 0);
+        char text[20];
+        for (int i = 0; i < count; i++) {
+            text[i] = digits[count - 1 - i];
+        }
+        out.append(text, count);
     }
 
-    // Print an error message
-    inline void printError(const string& message) {
-        printMessage("ERROR: " + message);
+    inline void appendValue(MessageBuffer& out, long long value) {
+        if (value < 0) {
+            out.append("-", 1);
+            appendValue(out, 0ULL - (unsigned long long)value);
+            return;
+        }
+        appendValue(out, (unsigned long long)value);
     }
 
-    // Print a warning message
-    inline void printWarning(const string& message) {
-        printMessage("WARNING: " + message);
+    inline void appendValue(MessageBuffer& out, int value) { appendValue(out, (long long)value); }
+    inline void appendValue(MessageBuffer& out, long value) { appendValue(out, (long long)value); }
+    inline void appendValue(MessageBuffer& out, unsigned value) { appendValue(out, (unsigned long long)value); }
+    inline void appendValue(MessageBuffer& out, unsigned long value) { appendValue(out, (unsigned long long)value); }
+
+    inline void appendValue(MessageBuffer& out, double value) {
+        char text[32];
+        int count = snprintf(text, sizeof(text), "%g", value);
+        out.append(text, count > 0 ? (size_t)count : 0);
     }
 
-    // Print an info message
-    inline void printInfo(const string& message) {
-        printMessage("INFO: " + message);
+    inline void appendValue(MessageBuffer& out, const char* value) { out.append(value); }
+    inline void appendValue(MessageBuffer& out, const string& value) { out.append(value.data(), value.size()); }
+
+    // Copies text up to the next "{}" and returns the text after it
+    inline const char* copyToPlaceholder(MessageBuffer& out, const char* text) {
+        const char* end = text;
+        while (*end != '\0' && *end != '{') end++;
+        out.append(text, (size_t)(end - text));
+        return *end != '\0' ? end + 2 : end;
+    }
+
+    template <int N, typename... Args>
+    void printFormatted(const char* prefix, FormatString<N> format, const Args&... args) {
+        static_assert(N >= 0, "Stray brace in format string");
+        static_assert(N == (int)sizeof...(Args), "Format string placeholders do not match the arguments");
+        if (quietMode()) return;
+        MessageBuffer out;
+        out.append(prefix);
+        const char* text = format.text;
+        ((text = copyToPlaceholder(out, text), appendValue(out, args)), ...);
+        out.append(text);
+        out.emit();
     }
 
+    // Print a message
+    template <int N, typename... Args>
+    void printMessage(FormatString<N> format, const Args&... args) { printFormatted("", format, args...); }
+    inline void printMessage(const char* message) { printFormatted("", FormatString<1>("{}"), message); }
+    inline void printMessage(const string& message) { printFormatted("", FormatString<1>("{}"), message); }
+
+    // Print a success message
+    template <int N, typename... Args>
+    void printSuccess(FormatString<N> format, const Args&... args) { printFormatted("SUCCESS: ", format, args...); }
+    inline void printSuccess(const char* message) { printFormatted("SUCCESS: ", FormatString<1>("{}"), message); }
+    inline void printSuccess(const string& message) { printFormatted("SUCCESS: ", FormatString<1>("{}"), message); }
+
+    // Print an error message
+    template <int N, typename... Args>
+    void printError(FormatString<N> format, const Args&... args) { printFormatted("ERROR: ", format, args...); }
+    inline void printError(const char* message) { printFormatted("ERROR: ", FormatString<1>("{}"), message); }
+    inline void printError(const string& message) { printFormatted("ERROR: ", FormatString<1>("{}"), message); }
+
+    // Print a warning message
+    template <int N, typename... Args>
+    void printWarning(FormatString<N> format, const Args&... args) { printFormatted("WARNING: ", format, args...); }
+    inline void printWarning(const char* message) { printFormatted("WARNING: ", FormatString<1>("{}"), message); }
+    inline void printWarning(const string& message) { printFormatted("WARNING: ", FormatString<1>("{}"), message); }
+
+    // Print an info message
+    template <int N, typename... Args>
+    void printInfo(FormatString<N> format, const Args&... args) { printFormatted("INFO: ", format, args...); }
+    inline void printInfo(const char* message) { printFormatted("INFO: ", FormatString<1>("{}"), message); }
+    inline void printInfo(const string& message) { printFormatted("INFO: ", FormatString<1>("{}"), message); }
+
     // Print a menu item
-    inline void printMenuItem(int number, const string& text) {
+    inline void printMenuItem(int number, const char* text) {
+        if (quietMode()) return;
         cout << number << ". " << text << endl;
     }
 
     // Print a section header
-    inline void printSection(const string& title) {
+    inline void printSection(const char* title) {
+        if (quietMode()) return;
         cout << endl;
         printLine('-', 50);
         cout << title << endl;
@@ -73,37 +248,237 @@ namespace Visual {
     }
 }
 
-// Enhanced Resource template class
-template <typename T>
-class Resource {
-    T quantity;
-    T maxQuantity;  // Maximum capacity
-    bool isDepleted;  // Resource depletion status
+// Checked format string for the Visual print functions, e.g.
+// Visual::printInfo(VFMT("Spent {} gold"), amount). A placeholder count that
+// does not match the arguments fails to compile.
+#define VFMT(text) Visual::FormatString<Visual::countPlaceholders(text)>(text)
+
+// Subsystems that memory is charged to
+enum MemoryTag {
+    MEMORY_OTHER, MEMORY_KINGDOM, MEMORY_POPULATION, MEMORY_ECONOMY, MEMORY_ARMY, MEMORY_BANK,
+    MEMORY_MARKET, MEMORY_POLITICS, MEMORY_DIPLOMACY, MEMORY_COMMUNICATION, MEMORY_TERRITORY,
+    MEMORY_STATUS, MEMORY_HISTORY, MEMORY_SAVE, MEMORY_REPLAY,
+    MEMORY_TAG_COUNT
+};
+
+struct MemoryStats {
+    long long liveBytes;
+    long long liveCount;
+    long long allocatedBytes;   // Since the account was opened
+    long long allocationCount;
+};
 
+// Allocation accounting. Every block from operator new carries a small
+// header with the account (normally one per kingdom) and tag that were
+// current on the allocating thread, so a free is credited back to the
+// same place on whichever thread it happens. Call sites are counted
+// globally, and every Nth allocation can be sampled into a trace.
+class MemoryTracker {
 public:
-    Resource() : quantity(0), maxQuantity(1000), isDepleted(false) {}
+    static const int MAX_ACCOUNTS = 256;  // Account 0 is the global one
+    static const int MAX_SITES = 256;
+    static const int MAX_ACTIONS = 32;
+    static const int TRACE_SIZE = 4096;
+
+    struct TraceEntry {
+        unsigned long long sequence;
+        unsigned long long size;
+        int account;
+        int tag;
+        const char* site;
+    };
+
+    static void* allocate(size_t size);  // Used by operator new
+    static void release(void* block);    // Used by operator delete
+
+    static int openAccount(const char* name);  // Falls back to 0 when the table is full
+    static void closeAccount(int account);
+    static int findSite(const char* site);     // -1 when the table is full
+    static void endTurn(int account);          // Closes the turn's allocation window
+    static void recordAction(int action, const MemoryStats& before, const MemoryStats& after);
+    static void setSampleRate(int everyN);     // 0 turns the trace off
+
+    static MemoryStats getStats(int account, int tag);
+    static MemoryStats getTotal(int account);
+    static MemoryStats getLastTurn(int account);  // Allocations of the last finished turn
+    static const char* getTagName(int tag);
+    static int copyTrace(TraceEntry* out, int max);  // Oldest first
+
+    static void printAccount(int account);
+    static void printSites();
+    static void printActions();
+    static void printTrace(int max);
+};
 
-    void setQuantity(T q) {
-        if (q < 0) {
-            Visual::printError("Error: Cannot set negative quantity");
-            return;
-        }
-        quantity = q;
-        if (quantity >= maxQuantity) {
-            quantity = maxQuantity;
-            isDepleted = true;
-        }
+// Charges allocations on this thread to an account, tag and call site
+// until the scope ends. The one-argument forms keep the current account.
+class MemoryScope {
+    int previousAccount;
+    int previousTag;
+    int previousSite;
+    bool isActive;
+
+public:
+    MemoryScope(int account, int tag, const char* site);
+    explicit MemoryScope(int tag, const char* site = nullptr);
+    ~MemoryScope() { end(); }
+
+    void end();  // Restores the previous scope early
+};
+
+// Seeded xorshift64* generator. Every peer that starts from the same seed
+// draws the same numbers, unlike rand() which differs between C runtimes.
+class GameRandom {
+    unsigned long long state;
+
+public:
+    GameRandom(unsigned long long seed = 1) { setSeed(seed); }
+
+    void setSeed(unsigned long long seed) { state = seed != 0 ? seed : 0x9E3779B97F4A7C15ULL; }
+    unsigned long long getState() const { return state; }
+
+    unsigned long long next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+
+    // Uniform value in [0, bound)
+    int nextInt(int bound) { return bound > 0 ? (int)(next() % (unsigned long long)bound) : 0; }
+};
+
+// Fixed-point gold amount stored in hundredths. All arithmetic is integer and
+// saturating, so results are identical on every compiler and platform.
+class Money {
+    long long raw;  // Gold * SCALE
+
+    static long long saturatedAdd(long long a, long long b) {
+        if (b > 0 && a > LLONG_MAX - b) return LLONG_MAX;
+        if (b < 0 && a < LLONG_MIN - b) return LLONG_MIN;
+        return a + b;
+    }
+
+    static long long saturatedMul(long long a, long long b) {
+        if (a == 0 || b == 0) return 0;
+        bool negative = (a < 0) != (b < 0);
+        unsigned long long ua = a < 0 ? 0ULL - (unsigned long long)a : (unsigned long long)a;
+        unsigned long long ub = b < 0 ? 0ULL - (unsigned long long)b : (unsigned long long)b;
+        if (ua > (unsigned long long)LLONG_MAX / ub) return negative ? LLONG_MIN : LLONG_MAX;
+        long long product = (long long)(ua * ub);
+        return negative ? -product : product;
+    }
+
+public:
+    static const long long SCALE = 100;
+
+    Money() : raw(0) {}
+    Money(int gold) : raw((long long)gold * SCALE) {}
+
+    static Money fromRaw(long long r) { Money m; m.raw = r; return m; }
+    static Money fromWhole(long long gold) { return fromRaw(saturatedMul(gold, SCALE)); }
+
+    long long getRaw() const { return raw; }
+    long long getWhole() const { return raw / SCALE; }  // Truncates toward zero
+    double toDouble() const { return (double)raw / SCALE; }  // Display only
+
+    // Multiply by num/den, truncating toward zero
+    Money scaled(long long num, long long den) const { return fromRaw(saturatedMul(raw, num) / den); }
+    Money percent(int p) const { return scaled(p, 100); }
+
+    Money operator-() const { return fromRaw(raw == LLONG_MIN ? LLONG_MAX : -raw); }
+    Money& operator+=(const Money& other) { raw = saturatedAdd(raw, other.raw); return *this; }
+    Money& operator-=(const Money& other) { return *this += -other; }
+    Money operator*(long long factor) const { return fromRaw(saturatedMul(raw, factor)); }
+
+    friend Money operator+(Money a, const Money& b) { return a += b; }
+    friend Money operator-(Money a, const Money& b) { return a -= b; }
+    friend bool operator==(const Money& a, const Money& b) { return a.raw == b.raw; }
+    friend bool operator!=(const Money& a, const Money& b) { return a.raw != b.raw; }
+    friend bool operator<(const Money& a, const Money& b) { return a.raw < b.raw; }
+    friend bool operator<=(const Money& a, const Money& b) { return a.raw <= b.raw; }
+    friend bool operator>(const Money& a, const Money& b) { return a.raw > b.raw; }
+    friend bool operator>=(const Money& a, const Money& b) { return a.raw >= b.raw; }
+
+    int format(char* buffer) const;  // Writes "123.45" without allocating, returns length
+    string toString() const;
+    static bool parse(const string& text, Money& out);
+};
+
+ostream& operator<<(ostream& out, const Money& money);
+istream& operator>>(istream& in, Money& money);
+
+namespace Visual {
+    // Money placeholders print as "123.45"
+    inline void appendValue(MessageBuffer& out, const Money& value) {
+        char text[24];
+        out.append(text, (size_t)value.format(text));
     }
+}
+
+// Every resource a kingdom holds, as slots in its ResourceLedger
+enum LedgerSlot {
+    LEDGER_GOLD,     // Money in hundredths (Money::getRaw)
+    LEDGER_WOOD,
+    LEDGER_STONE,
+    LEDGER_IRON,
+    LEDGER_FOOD,     // Market food, granary and population food supply
+    LEDGER_WEAPONS,  // Market weapons and the army's armory
+    LEDGER_SLOT_COUNT
+};
+
+// One change to one ledger slot
+struct LedgerEntry {
+    int slot;
+    long long amount;
+};
+
+// A set of resource changes that commit or roll back together
+class LedgerTransaction {
+public:
+    static const int MAX_ENTRIES = 8;
+
+private:
+    LedgerEntry entries[MAX_ENTRIES];
+    int entryCount;
+    bool isOverflow;  // Too many entries were added
+
+public:
+    LedgerTransaction() : entryCount(0), isOverflow(false) {}
 
-    T getQuantity() const { return quantity; }
-    T getMaxQuantity() const { return maxQuantity; }
-    bool getIsDepleted() const { return isDepleted; }
-    void setMaxQuantity(T max) { maxQuantity = max; }
+    LedgerTransaction& add(int slot, long long amount);
+    LedgerTransaction& addGold(Money amount) { return add(LEDGER_GOLD, amount.getRaw()); }
+
+    int getEntryCount() const { return entryCount; }
+    const LedgerEntry& getEntry(int index) const { return entries[index]; }
+    bool getIsOverflow() const { return isOverflow; }
+};
+
+// All of a kingdom's resources in one cache-line aligned block
+class alignas(64) ResourceLedger {
+    long long quantities[LEDGER_SLOT_COUNT];
+    long long capacities[LEDGER_SLOT_COUNT];
+    int revisions[LEDGER_SLOT_COUNT];  // Bumped whenever a slot changes
+
+public:
+    ResourceLedger();
+
+    bool apply(const LedgerTransaction& transaction);  // All or nothing
+    int applyBatch(const LedgerTransaction* transactions, int count, bool* committed);
+
+    long long get(int slot) const { return quantities[slot]; }
+    void set(int slot, long long quantity);
+    long long getCapacity(int slot) const { return capacities[slot]; }
+    void setCapacity(int slot, long long capacity) { capacities[slot] = capacity; }
+    int getRevision(int slot) const { return revisions[slot]; }
+
+    Money getGold() const { return Money::fromRaw(quantities[LEDGER_GOLD]); }
 };
 
 // Enhanced Leader class with more features
 class Leader {
 protected:
+    friend class ActionHistory;  // Restores fields on undo/redo
     string name;
     int skill;
     int popularity;  // Leader's popularity
@@ -113,7 +488,6 @@ protected:
 public:
     Leader(string n, int s) : name(n), skill(s), popularity(50), isCorrupt(false), health(100) {}
 
-    virtual void applyPolicy() = 0;
     virtual ~Leader() {}
 
     string getName() const { return name; }
@@ -129,20 +503,106 @@ public:
 
 // Enhanced King class
 class King : public Leader {
+    friend class ActionHistory;  // Restores fields on undo/redo
     int reignLength;  // Years in power
     int assassinationAttempts;  // Number of assassination attempts
 
 public:
     King(string n, int s) : Leader(n, s), reignLength(0), assassinationAttempts(0) {}
 
-    void applyPolicy() override;
     void faceAssassinationAttempt();
     int getReignLength() const { return reignLength; }
     void incrementReign() { reignLength++; }
 };
 
+enum CitizenClass {
+    CITIZEN_PEASANT, CITIZEN_MERCHANT, CITIZEN_NOBLE, CITIZEN_SOLDIER,
+    CITIZEN_CLASS_COUNT
+};
+
+enum CitizenJob {
+    JOB_NONE,  // Children and the old
+    JOB_FARMER, JOB_CRAFTSMAN, JOB_TRADER, JOB_OFFICIAL, JOB_SOLDIER
+};
+
+// Conditions one agent turn runs under
+struct CitizenTurnInput {
+    int turn;
+    int foodPercent;  // Food available as percent of what everyone needs
+    int birthRate;    // Population birth rate in percent
+};
+
+// Components of up to CAPACITY citizens, one array per component. Living
+// citizens are packed at the front; a death moves the last one into its place.
+struct CitizenChunk {
+    static const int CAPACITY = 4096;
+    static const unsigned char SICK = 1;  // Set by CitizenPool::applyEpidemic
+    static const int ARRAY_COUNT = 5;     // Byte arrays below, in serialized order
+
+    int count;
+    unsigned char socialClass[CAPACITY];
+    unsigned char job[CAPACITY];
+    unsigned char age[CAPACITY];     // In turns
+    unsigned char health[CAPACITY];  // 0-100
+    unsigned char flags[CAPACITY];
+
+    CitizenChunk() : count(0) {}
+};
+
+// Agent-based population. Each turn, births, deaths and class mobility run
+// over the chunks in parallel; every chunk draws from its own random stream
+// keyed by seed, turn and chunk index, so results do not depend on the
+// thread count. Class totals are kept as agents change. The plague is the
+// epidemic model's alone: it says how many are sick and how many die, and
+// the pool only picks who.
+class CitizenPool {
+    // What one chunk's turn changed, merged serially afterwards
+    struct ChunkResult {
+        int classChange[CITIZEN_CLASS_COUNT];
+        vector<unsigned char> births;  // Class of each newborn
+    };
+
+    vector<CitizenChunk*> chunks;
+    vector<ChunkResult> results;
+    int classTotals[CITIZEN_CLASS_COUNT];
+    int total;
+    int firstOpenChunk;  // No chunk before this one has room
+    unsigned long long seed;
+    GameRandom random;   // Used outside turns, e.g. to pick plague victims
+
+    void stepChunk(int index, const CitizenTurnInput& input);
+    void removeAt(CitizenChunk& chunk, int slot);
+    void remove(int chunkIndex, int slot);  // removeAt, keeping the totals
+    int countSick() const;
+    // Picks count of the available citizens whose sick flag is isSick,
+    // uniformly in one pass; slots are visited last first, so pick may remove
+    void sample(bool isSick, int available, int count, const function<void(int, int)>& pick);
+    static unsigned char jobFor(int socialClass, int age);
+
+public:
+    CitizenPool(unsigned long long s);
+    ~CitizenPool();
+
+    void addCitizen(int socialClass, int age, int health);
+    void addCitizens(int count, int socialClass);  // Adults of one class
+    void removeRandom(int count);
+    void applyEpidemic(int deaths, int sick);  // Deaths come from the sick first; then exactly sick are flagged
+    int reassign(int count, int fromClass, int toClass);  // Adults only; returns how many moved
+    void simulateTurn(const CitizenTurnInput& input);
+    string serialize() const;  // Random state, then every chunk's agents. Used by the undo history.
+    bool deserialize(const string& data);
+
+    int getTotal() const { return total; }
+    int getClassTotal(int socialClass) const { return classTotals[socialClass]; }
+    int getChunkCount() const { return (int)chunks.size(); }
+    const CitizenChunk& getChunk(int index) const { return *chunks[index]; }
+    unsigned long long getRandomState() const { return random.getState(); }
+};
+
 // Enhanced Population class
 class Population {
+    friend class ActionHistory;  // Restores fields on undo/redo
+    friend class PolicyBatch;    // Applies policies in bulk
     int totalPeople;
     int peasants;
     int merchants;
@@ -151,19 +611,28 @@ class Population {
     int birthRate;      // Population growth rate
     int deathRate;      // Population death rate
     bool isPlague;      // Plague status
-    int foodSupply;     // Food supply level
+    int sick;           // Infected by the epidemic
+    ResourceLedger& ledger;  // Food supply lives in the kingdom ledger
+    CitizenPool* agents;     // Optional agent model; the counts above mirror it
+    int revision;  // Bumped when a shown field changes
+
+    void syncFromAgents();  // Copies agent totals into the counts
 
 public:
-    Population();
+    Population(ResourceLedger& l);
     ~Population();
 
     void updatePeople(int change);
     void checkSocialClasses();
-    void handlePlague();  // Handle plague outbreaks
+    void handlePlague(int deaths, int infected);  // Applies a turn of the epidemic
     void updateFoodSupply(int amount);  // Update food supply
     void calculateGrowth();  // Calculate population growth
     void decreasePopulation(int amount); // Decrease population by specific amount
     void increasePopulation(int amount); // Increase population by specific amount
+    void enableAgents(unsigned long long seed);  // Switch to the agent-based model
+    void updateAgents(int turn);                 // One turn of the agent model
+    bool hasAgents() const { return agents != nullptr; }
+    const CitizenPool* getAgents() const { return agents; }
 
     int getTotalPeople() const { return totalPeople; }
     int getPeasants() const { return peasants; }
@@ -174,11 +643,18 @@ public:
     int getBirthRate() const { return birthRate; }
     int getDeathRate() const { return deathRate; }
     bool getIsPlague() const { return isPlague; }
-    int getFoodSupply() const { return foodSupply; }
+    int getSick() const { return sick; }
+    void splitByClass(int people[CITIZEN_CLASS_COUNT]) const;  // The total in the class mix
+    int getFoodSupply() const { return (int)ledger.get(LEDGER_FOOD); }
+    int getRevision() const { return revision; }
+    bool arePeasantsUnhappy() const { return peasants * 10LL > totalPeople * 7LL; }   // Over 70%
+    bool isNobilityTooSmall() const { return nobility * 20LL < (long long)totalPeople; }  // Under 5%
 };
 
 // Enhanced Army class
 class Army {
+    friend class ActionHistory;  // Restores fields on undo/redo
+    friend class PolicyBatch;    // Applies policies in bulk
     int size;
     int morale;
     bool isPaid;
@@ -186,8 +662,11 @@ class Army {
     int equipment;      // Equipment quality
     int casualties;     // Battle casualties
     bool isRebelling;   // Rebellion status
+    int revision;  // Bumped when a shown field changes
 
 public:
+    static const int POWER_ONE = 1024;  // Fighting power of an average soldier
+
     Army(int s);
     ~Army();
 
@@ -196,6 +675,8 @@ public:
     void updateEquipment(int quality);  // Update equipment
     void decreaseSize(int amount);      // Decrease army size
     void increaseSize(int amount);      // Increase army size
+    void applyBattleOutcome(int losses, bool won);  // Apply losses from a battle
+    int getFightingPower(int weapons) const;        // Strength of one soldier, POWER_ONE = average
 
     int getSize() const { return size; }
     int getMorale() const { return morale; }
@@ -205,73 +686,391 @@ public:
     int getEquipment() const { return equipment; }
     int getCasualties() const { return casualties; }
     bool getIsRebelling() const { return isRebelling; }
+    int getRevision() const { return revision; }
+};
+
+// Outcome of one resolved battle
+struct BattleResult {
+    int attackerLosses;
+    int defenderLosses;
+    bool attackerWon;
+};
+
+// Lanchester attrition engine that resolves many battles at once. All
+// arithmetic is in integers so every lockstep peer and replay gets the
+// same casualties.
+class BattleEngine {
+    static const int ROUNDS = 10;
+    static const int ROUND_LENGTH = 30;  // Per mille of a unit of time
+    static const int SIZE_ONE = 256;     // Soldiers are tracked in 1/256ths
+
+    // Per-battle side totals, stored as separate arrays
+    vector<long long> attackerSize;
+    vector<long long> attackerPower;
+    vector<long long> defenderSize;
+    vector<long long> defenderPower;
+    vector<BattleResult> results;
+
+    // Armies taking part, so losses can be shared out afterwards
+    vector<Army*> armies;
+    vector<int> armyBattle;
+    vector<bool> armyIsAttacker;
+    vector<int> armySize;
+
+    void addForceTotals(int battle, int size, int power, bool attacker);
+    void runAttrition(long long* aSize, const long long* aPower, long long* dSize, const long long* dPower, int count);
+
+public:
+    BattleEngine() {}
+
+    int addBattle();
+    void addArmy(int battle, Army& army, int weapons, bool attacker);
+    void addForce(int battle, int size, int power, bool attacker);  // Force without an Army object
+    void resolveAll();
+    void clear();
+
+    const BattleResult& getResult(int battle) const { return results[battle]; }
+    int getBattleCount() const { return (int)attackerSize.size(); }
 };
 
 // Enhanced Economy class
 class Economy {
-    Resource<double>* gold;
-    double taxRate;
-    double inflation;  // Inflation rate
+    friend class ActionHistory;  // Restores fields on undo/redo
+    friend class PolicyBatch;    // Applies policies in bulk
+    friend class WorldEconomy;   // Feeds world inflation and recession back
+    ResourceLedger& ledger;  // Gold lives in the kingdom ledger
+    int taxRate;       // Tax per person in percent of one gold
+    int inflationRate;  // Basis points per turn, from the world economy; integer so every peer agrees
     bool isRecession;  // Recession status
     int publicServices;  // Public services funding
+    long long worldDemand;  // World money supply plus trade volume, as of last turn
+    long long worldOutput;  // World goods output, as of last turn
+    int shrinkingTurns;     // Turns in a row world output fell
+    int revision;  // Bumped when a shown field changes
 
 public:
-    Economy();
+    Economy(ResourceLedger& l);
     ~Economy();
 
     void collectTaxes(const Population& pop);
-    void spendGold(double amount);
+    void spendGold(Money amount);
     void fundPublicServices(int amount);  // Fund public services
-    void decreaseGold(double amount);     // Decrease gold by specific amount
-    void increaseGold(double amount);     // Increase gold by specific amount
-
-    double getGold() const { return gold->getQuantity(); }
-    void setTaxRate(double rate);
+    void decreaseGold(Money amount);      // Decrease gold by specific amount
+    void increaseGold(Money amount);      // Increase gold by specific amount
+    void handleArrears(int loansInArrears);  // Missed loan payments this turn
+
+    Money getGold() const { return ledger.getGold(); }
+    ResourceLedger& getLedger() { return ledger; }
+    void setTaxRate(int percent);
+    int getTaxRate() const { return taxRate; }
     
-    double getInflation() const { return inflation; }
+    int getInflationRate() const { return inflationRate; }
     bool getIsRecession() const { return isRecession; }
     int getPublicServices() const { return publicServices; }
+    long long getWorldOutput() const { return worldOutput; }
+    int getRevision() const { return revision; }
+};
+
+// What one turn of interest did to a kingdom's loans
+struct LoanTurnResult {
+    Money interest;      // Added to the balances
+    Money due;           // Scheduled payments, capped at what was owed
+    Money paid;
+    int loansInArrears;  // Loans that missed some of this turn's payment
+    int worstMissed;     // Longest run of missed payments among them
+    int paidOff;         // Loans closed this turn
+    int writtenOff;      // Loans the lenders gave up on this turn
+    Money lost;          // What the written off loans still owed
+};
+
+// Every loan one kingdom owes, one array per field, so a turn of interest
+// is a straight pass down memory with no branches. Each loan is a fixed
+// payment annuity: the payment and the balance it should have at any age
+// come from the closed form, so nothing is stepped through turn by turn.
+// Large books are split into chunks that accrue in parallel.
+class LoanBook {
+    static const int RATE_SHIFT = 20;  // Per-turn rates are kept in 1/2^20 units
+    static const int CHUNK = 16384;    // Loans per parallel task
+
+    vector<long long> balance;    // Money raw, interest included
+    vector<long long> payment;    // Scheduled payment per turn, Money raw
+    vector<long long> principal;  // Money raw
+    vector<long long> rateScaled; // Interest per turn << RATE_SHIFT
+    vector<int> rate;             // Interest per turn in basis points
+    vector<int> term;             // Turns to pay it off
+    vector<int> age;              // Turns since it was taken
+    vector<int> missed;           // Payments missed in a row
+    vector<long long> due;        // This turn's payment, filled by accrue
+    vector<LoanTurnResult> chunkResults;
+    vector<long long> chunkTotals;
+    Money total;                  // Sum of the balances
+    int arrearsCount;             // Loans with missed > 0
+
+    void accrueChunk(int chunk);
+    void settleChunk(int chunk, long long share);
+    void removePaidOff();
+
+public:
+    static constexpr int MAX_RATE = 1000;  // Basis points per turn
+    static const long long MAX_BALANCE = 1LL << 46;  // Money raw; keeps the products in 64 bits
+    static constexpr int WRITE_OFF_MISSES = 6;  // Missed payments in a row before a loan is written off
+
+    LoanBook() : arrearsCount(0) {}
+
+    bool add(Money amount, int rateBasisPoints, int turns);
+    Money repay(Money amount);  // Early repayment, oldest loans first; returns what was used
+    LoanTurnResult accrue(Money available);  // One turn: interest, payments out of available, write-offs
+    void clear();
+
+    string serialize() const;
+    bool deserialize(const string& data);
+
+    static Money schedulePayment(Money amount, int rateBasisPoints, int turns);
+    static Money scheduledBalance(Money amount, int rateBasisPoints, int turns, int age);
+
+    int getCount() const { return (int)balance.size(); }
+    Money getTotal() const { return total; }
+    int getArrearsCount() const { return arrearsCount; }
+    Money getBalance(int loan) const { return Money::fromRaw(balance[loan]); }
+    Money getPayment(int loan) const { return Money::fromRaw(payment[loan]); }
+    Money getPrincipal(int loan) const { return Money::fromRaw(principal[loan]); }
+    Money getScheduledBalance(int loan) const {
+        return scheduledBalance(getPrincipal(loan), rate[loan], term[loan], age[loan]);
+    }
+    int getRate(int loan) const { return rate[loan]; }
+    int getTerm(int loan) const { return term[loan]; }
+    int getAge(int loan) const { return age[loan]; }
+    int getMissed(int loan) const { return missed[loan]; }
 };
 
 // Enhanced Bank class
 class Bank {
-    double loanAmount;
-    double interestRate;
+    friend class ActionHistory;  // Restores fields on undo/redo
+    LoanBook loans;
+    int interestRate;   // Base interest per turn in basis points (100 = 1%)
     bool isCorrupt;  // Bank corruption status
     int securityLevel;  // Bank security level
     int auditCost;  // Cost of auditing
+    int revision;  // Bumped when a shown field changes
 
 public:
+    static constexpr int BASE_RATE = 100;         // Basis points per turn
+    static constexpr int TERM_PREMIUM = 2;        // Extra basis points per turn of term
+    static constexpr int ARREARS_PREMIUM = 25;    // Added to the base rate per loan in arrears
+    static constexpr int MIN_TERM = 4;
+    static constexpr int MAX_TERM = 48;
+    static constexpr int DEFAULT_TERM = 12;
+    static constexpr int MAX_LOAN = 100000;       // Gold per loan
+    static constexpr int MAX_DEBT = 1000000;      // Gold owed before lenders refuse more
+    static constexpr int MAX_LOANS = 32;          // Open loans before lenders refuse more
+
     Bank();
     ~Bank();
 
-    void takeLoan(double amount, Economy& economy);
-    void repayLoan(double amount, Economy& economy);
+    void takeLoan(Money amount, int turns, Economy& economy);
+    void repayLoan(Money amount, Economy& economy);
+    void restoreDebt(const string& book, Money amount);  // The saved book, or one loan of amount for older saves
+    int quoteRate(int turns) const { return interestRate + turns * TERM_PREMIUM; }
+
+    // One turn of interest and scheduled payments for every loan of every
+    // kingdom. Missed payments raise the kingdom's rate, cut its public
+    // services and cost the crown stability; a loan missed too long is
+    // written off, at a far higher rate and stability cost.
+    static void accrueInterest(Kingdom* const* kingdoms, int count);
 
-    double getLoanAmount() const { return loanAmount; }
+    Money getLoanAmount() const { return loans.getTotal(); }
+    const LoanBook& getLoans() const { return loans; }
+    int getInterestRate() const { return interestRate; }
     
     bool getIsCorrupt() const { return isCorrupt; }
     int getSecurityLevel() const { return securityLevel; }
     int getAuditCost() const { return auditCost; }
+    int getRevision() const { return revision; }
+};
+
+enum Climate {
+    CLIMATE_NORMAL, CLIMATE_DROUGHT, CLIMATE_HARSH_WINTER, CLIMATE_GOOD,
+    CLIMATE_COUNT
+};
+
+enum Season {
+    SEASON_SPRING, SEASON_SUMMER, SEASON_AUTUMN, SEASON_WINTER,
+    SEASON_COUNT
 };
 
+// Regional weather as a seasonal Markov chain. Each region holds a condition
+// and the turns it has left, one array per field. When the turns run out the
+// next condition and its length are drawn from cumulative tables built once
+// per season. Each region's draw is a hash of (seed, turn, region), so the
+// draws for a block of regions are computed in one vector pass and sampled
+// without branches, in any order.
+class ClimateModel {
+public:
+    static constexpr int MAX_DURATION = 6;  // Turns
+    static constexpr int SEASON_TURNS = 3;
+    static constexpr unsigned TABLE_ONE = 1 << 16;  // Cumulative tables are in 1/65536ths
+    static constexpr int STEP_BLOCK = 256;  // Regions hashed together in one pass
+
+private:
+    static const short TRANSITIONS[SEASON_COUNT][CLIMATE_COUNT][CLIMATE_COUNT];  // Per mille, rows sum to 1000
+    static const short SHORT_SPELL[MAX_DURATION];  // Per mille for 1..MAX_DURATION turns
+    static const short LONG_SPELL[MAX_DURATION];
+    static const int FOOD_PERCENT[CLIMATE_COUNT];
+
+    struct Tables {
+        unsigned transition[SEASON_COUNT][CLIMATE_COUNT][CLIMATE_COUNT];  // P(next <= k)
+        unsigned duration[SEASON_COUNT][CLIMATE_COUNT][MAX_DURATION];     // P(length <= d + 1)
+        Tables();
+    };
+    static const Tables& tables();
+
+    unsigned long long seed;
+    vector<unsigned char> condition;
+    vector<unsigned char> remaining;  // Turns left, at least 1
+
+public:
+    ClimateModel() : seed(0) {}
+
+    void reset(int regionCount, unsigned long long s);  // Every region starts in a short normal spell
+    void step(int turn);
+
+    int getRegionCount() const { return (int)condition.size(); }
+    int getCondition(int region) const { return condition[region]; }
+    int getRemaining(int region) const { return remaining[region]; }
+    string serialize() const;
+    bool deserialize(const string& data);
+
+    static int getSeason(int turn) { return (turn / SEASON_TURNS) % SEASON_COUNT; }
+    static int getFoodPercent(int climate) { return FOOD_PERCENT[climate]; }
+    static bool isHarshClimate(int climate) { return climate == CLIMATE_DROUGHT || climate == CLIMATE_HARSH_WINTER; }
+    static const char* getClimateName(int climate);
+    static const char* getSeasonName(int season);
+    static double getTransitionProbability(int season, int from, int to) { return TRANSITIONS[season][from][to] / 1000.0; }
+};
+
+// Kingdom weather: one climate region per territory chunk, each scaling the
+// food its farms grow, plus a summary of the most common condition.
 class Weather {
 private:
+    friend class ActionHistory;  // Restores fields on undo/redo
+    ClimateModel regions;
     string currentCondition;
-    int duration;
-    double foodProductionMultiplier;
+    int duration;               // Turns the most common condition has left at most
+    int foodProductionPercent;  // Farm-weighted average over the regions
     bool isHarsh;
 
 public:
-    Weather() : currentCondition("Normal"), duration(0), foodProductionMultiplier(1.0), isHarsh(false) {}
+    Weather() : currentCondition("Normal"), duration(0), foodProductionPercent(100), isHarsh(false) {}
     
-    void updateWeather();
+    void reset(int regionCount, unsigned long long seed) { regions.reset(regionCount, seed); }
+    void updateWeather(int turn, const TileMap& territory);
+    long long getFoodProduction(const TileMap& territory) const;  // Farm output of each region times its condition
+    const ClimateModel& getRegions() const { return regions; }
     string getCurrentCondition() const { return currentCondition; }
-    double getFoodProductionMultiplier() const { return foodProductionMultiplier; }
+    double getFoodProductionMultiplier() const { return foodProductionPercent / 100.0; }  // Display only
+    int getFoodProductionPercent() const { return foodProductionPercent; }
     bool isHarshWeather() const { return isHarsh; }
     int getDuration() const { return duration; }
 };
 
+// Contact between two regions. Weights are in 1/256ths of a region's
+// contact with itself.
+struct ContactLink {
+    int from;
+    int to;
+    int proximity;  // Always in effect
+    int trade;      // Scaled by how much was traded this turn
+};
+
+// Conditions one epidemic turn runs under
+struct EpidemicTurnInput {
+    int turn;
+    int people[CITIZEN_CLASS_COUNT];  // Class totals to spread over the regions
+    int publicServices;  // 0-100; slows spread, speeds recovery
+    int foodPercent;     // Food available as percent of need, at most 100
+    int tradeLevel;      // 0-256, scales the trade links
+};
+
+struct EpidemicTurnResult {
+    int infections;
+    int recoveries;
+    int deaths[CITIZEN_CLASS_COUNT];
+    int totalDeaths;
+    long long infected;  // Sick after the turn
+};
+
+// SIR epidemic over regions and social classes. Susceptible, infected and
+// recovered counts are kept per region and class, one array per compartment.
+// Regions meet over a sparse contact graph in CSR form, and each turn the
+// contact-weighted infected and people around every region are one sparse
+// matrix product over it, computed in row blocks in parallel. Fractions of a
+// person are rounded up or down with a hash of (seed, turn, cell), so the
+// results do not depend on the thread count.
+class EpidemicModel {
+public:
+    static constexpr int ROW_BLOCK = 1024;           // Regions per parallel task
+    static constexpr int SELF_WEIGHT = 256;          // A region's contact with itself
+    static constexpr int PROXIMITY_WEIGHT = 64;      // Neighbouring chunks of a territory
+    static constexpr int TRADE_WEIGHT = 128;         // Chunks and their market town at full trade
+    static constexpr int BASE_TRANSMISSION = 29491;  // 0.45 per turn, in 1/65536ths
+    static constexpr int BASE_RECOVERY = 13107;      // 0.20
+    static constexpr int BASE_MORTALITY = 983;       // 0.015
+    static constexpr int FULL_TRADE = 1000;          // Gold traded in a turn that opens trade links fully
+
+private:
+    static const int CLASS_CONTACT[CITIZEN_CLASS_COUNT][CITIZEN_CLASS_COUNT];  // Percent
+
+    // What one row block's turn changed, summed serially afterwards
+    struct BlockResult {
+        int infections;
+        int recoveries;
+        int deaths[CITIZEN_CLASS_COUNT];
+        long long infected;
+    };
+
+    unsigned long long seed;
+    int regionCount;
+    int largestRegion;  // Takes the rounding remainders when people are spread
+    vector<int> share;  // Each region's share of the people
+    long long shareTotal;
+
+    // Contact graph, self links included
+    vector<int> rowStart;
+    vector<int> column;
+    vector<unsigned short> proximity;
+    vector<unsigned short> trade;
+
+    // Index region * CITIZEN_CLASS_COUNT + class
+    vector<int> susceptible;
+    vector<int> infected;
+    vector<int> recovered;
+    vector<int> contacts;  // Per region, the infected then the people of each class, packed for the product
+    vector<long long> exposedInfected;  // Contact-weighted sums over each region's links
+    vector<long long> exposedPeople;
+    vector<BlockResult> blockResults;
+
+    void spreadPeople(const int* people);  // Matches the class totals to the population
+    void packBlock(int block);
+    void exposeBlock(int block, int tradeLevel);
+    void stepBlock(int block, const EpidemicTurnInput& input, unsigned key);
+
+public:
+    EpidemicModel() : seed(0), regionCount(0), largestRegion(0), shareTotal(0) {}
+
+    void reset(const vector<int>& regionShares, const vector<ContactLink>& links, unsigned long long s);
+    void resetForTerritory(const TileMap& territory, unsigned long long s);  // One region per chunk
+    int seedOutbreak(int region, int socialClass, int count);  // Returns how many fell ill
+    EpidemicTurnResult step(const EpidemicTurnInput& input);
+
+    int getRegionCount() const { return regionCount; }
+    int getLinkCount() const { return (int)column.size(); }
+    int getSusceptible(int region, int socialClass) const { return susceptible[region * CITIZEN_CLASS_COUNT + socialClass]; }
+    int getInfected(int region, int socialClass) const { return infected[region * CITIZEN_CLASS_COUNT + socialClass]; }
+    int getRecovered(int region, int socialClass) const { return recovered[region * CITIZEN_CLASS_COUNT + socialClass]; }
+    string serialize() const;
+    bool deserialize(const string& data);
+};
+
 class TradeRoute {
 private:
     bool isSecure;
@@ -281,92 +1080,385 @@ private:
 public:
     TradeRoute() : isSecure(true), riskLevel(0.0), attackProbability(0) {}
     
-    void updateSecurity();
+    void updateSecurity(GameRandom& random);
     bool getIsSecure() const { return isSecure; }
     double getRiskLevel() const { return riskLevel; }
     int getAttackProbability() const { return attackProbability; }
     void setRiskLevel(double level) { riskLevel = level; }
 };
 
+// Trade network between kingdoms
+struct TradeEdge {
+    int to;
+    double riskLevel;
+    int attackProbability;
+    double cost;  // Risk weight used for routing
+};
+
+class TradeNetwork {
+private:
+    // Lowest-risk route tree rooted at one kingdom
+    struct RouteTree {
+        vector<double> risk;  // Accumulated risk from the source
+        vector<int> parent;   // Previous kingdom on the route (-1 for none)
+    };
+
+    typedef priority_queue<pair<double, int>, vector<pair<double, int>>, greater<pair<double, int>>> RouteQueue;
+
+    static const int MAX_CACHED_TREES = 64;
+
+    vector<string> kingdomNames;
+    vector<vector<TradeEdge>> adjacency;
+    unordered_map<int, RouteTree> routeTrees;  // Cached trees by source kingdom
+    list<int> treeOrder;                       // Most recently used source first
+    vector<char> affectedMark;                 // Scratch marks for incremental updates
+
+    static double edgeCost(double riskLevel, int attackProbability);
+    bool isValidKingdom(int id) const;
+    TradeEdge* findEdge(int from, int to);
+    RouteTree& getRouteTree(int source);
+    void buildRouteTree(int source, RouteTree& tree);
+    void relaxFrom(RouteTree& tree, RouteQueue& queue);
+    void applyCostChange(RouteTree& tree, int from, int to, double oldCost, double newCost);
+
+public:
+    TradeNetwork() {}
+
+    int addKingdom(const string& name);
+    void connect(int a, int b, double riskLevel, int attackProbability);
+    void updateSecurity(int a, int b, double riskLevel, int attackProbability);
+    void updateSecurity(int a, int b, const TradeRoute& route);
+
+    vector<int> getRoute(int from, int to);
+    double getRouteRisk(int from, int to);
+    int getRouteAttackProbability(int from, int to);
+
+    int getKingdomCount() const { return (int)kingdomNames.size(); }
+    string getKingdomName(int id) const;
+    int getCachedTreeCount() const { return (int)routeTrees.size(); }
+    const vector<TradeEdge>& getRoads(int id) const { return adjacency[id]; }
+    string serialize() const;  // Road security only; the layout is fixed at setup
+    bool deserialize(const string& data);
+};
+
 class Market {
 private:
+    friend class ActionHistory;  // Restores fields on undo/redo
+    friend class WorldEconomy;   // Moves prices with world inflation
     static const int MAX_RESOURCES = 5;
     string resourceNames[MAX_RESOURCES] = {"wood", "stone", "iron", "food", "weapons"};
-    int resourceQuantities[MAX_RESOURCES];
-    double priceMultiplier;
-    TradeRoute tradeRoute;
-    int foodStockpile;
-    int weaponsStockpile;
-    double foodConsumptionRate;
+    ResourceLedger& ledger;  // Goods and stockpiles live in the kingdom ledger
+    GameRandom& random;      // Kingdom random generator for caravan attacks
+    int priceLevel;  // Price multiplier in basis points (10000 = 1.0)
+    TradeNetwork roads;  // Trading post and the foreign markets it reaches
+    int foodConsumptionRate;  // Percent of one food eaten per person
+    Money tradeVolume;  // Gold traded this turn; cleared by WorldEconomy
+    int revision;  // Bumped when a shown field changes
 
     // Helper function declaration
-    int findResourceIndex(const string& resource) const;
+    int findResourceIndex(const string& resource) const;  // Returns the ledger slot
 
 public:
     // Constructor and destructor
-    Market();
+    Market(ResourceLedger& l, GameRandom& r);
     ~Market();
 
     // Resource management
-    void tradeResource(string resource, int amount, Economy& economy);
+    void tradeResource(string resource, int amount, Economy& economy, const Diplomacy& diplomacy,
+        const CaravanRoute& route);
     int getResource(string resource) const;
     void decreaseResource(string resource, int amount);
-    void updateFoodStockpile(int population, const Weather& weather);
-    void consumeFood(int population);
+    void updateFoodStockpile(int population, long long foodProduced);  // Food already scaled by the weather
+    void addProduction(const TileMap& territory);  // Wood, stone, iron and weapons
     bool checkFoodShortage() const;
     int getFoodStockpile() const;
     void updateWeaponsStockpile(int armySize);
     int getWeaponsStockpile() const;
-    TradeRoute& getTradeRoute();
+    void updateRoadSecurity();  // Rolls the security of one road
+    const TradeNetwork& getRoads() const { return roads; }
     
     // Price management
-    double getPriceMultiplier() const;
+    double getPriceMultiplier() const;  // Display only
+    int getPriceLevel() const;
+    Money getTradeVolume() const { return tradeVolume; }
+    int getRevision() const { return revision; }
+};
+
+// World aggregates for one turn, summed over every kingdom
+struct WorldTotals {
+    long long money;   // Gold held, Money raw
+    long long output;  // Goods produced this turn
+    long long trade;   // Gold traded this turn, Money raw
+    long long people;
+
+    WorldTotals() : money(0), output(0), trade(0), people(0) {}
+    WorldTotals& operator+=(const WorldTotals& other);
+};
+
+// The economy all kingdoms of one game share. Every turn the money supply,
+// goods output and trade volume are summed with a parallel tree reduction:
+// leaves of LEAF kingdoms are summed in parallel, then pairs of partial
+// sums are merged level by level. The sums are integers, so the result is
+// the same for any thread count. Each Economy then gets inflation from
+// demand growing faster than output, a recession when output keeps
+// falling, and its Market's price level moves with inflation.
+class WorldEconomy {
+    static WorldTotals sumLeaf(Kingdom* const* kingdoms, int count);
+    static void applyLeaf(Kingdom* const* kingdoms, int count, const WorldTotals& world);
+
+public:
+    static const int LEAF = 256;  // Kingdoms per leaf task
+    static constexpr int MAX_INFLATION = 1000;  // Basis points per turn either way
+    static constexpr int RECESSION_TURNS = 3;   // Turns of falling output
+    static constexpr int MIN_PRICE_LEVEL = 2500;
+    static constexpr int MAX_PRICE_LEVEL = 40000;
+
+    static WorldTotals aggregate(Kingdom* const* kingdoms, int count);
+    static void update(Kingdom* const* kingdoms, int count);  // Aggregate, then feed back to every kingdom
+};
+
+// Voting rules for elections
+enum ElectoralSystem {
+    ELECTION_PLURALITY,         // Most first preferences wins
+    ELECTION_RANKED_CHOICE,     // Instant runoff over full rankings
+    ELECTION_WEIGHTED_ESTATES,  // Each estate's vote share counts at its estate weight
+    ELECTION_SYSTEM_COUNT
+};
+
+enum Estate { ESTATE_PEASANTS, ESTATE_MERCHANTS, ESTATE_NOBILITY, ESTATE_MILITARY, ESTATE_COUNT };
+
+struct Candidate {
+    string name;
+    int skill;                 // 50-100, becomes the king's skill
+    int popularity;            // 0-100, liked by every estate
+    int corruption;            // 0-100, buys noble votes at a corrupt court
+    int appeal[ESTATE_COUNT];  // -20 to 20 per estate
+};
+
+struct ElectionResult {
+    static const int MAX_CANDIDATES = 5;
+
+    int winner;
+    int rounds;  // Ranked-choice rounds, 1 for the other systems
+    long long ballots;
+    long long firstPreferences[MAX_CANDIDATES];
+    long long estateVotes[ESTATE_COUNT][MAX_CANDIDATES];  // First preferences per estate
+    long long finalVotes[MAX_CANDIDATES];  // Last ranked-choice round, or per-mille score for estates
+};
+
+// One ballot per citizen, ranking every candidate by estate preference
+// plus personal noise. Ballots are made and ranked eight at a time and
+// only the ranking is counted, so no ballot is ever stored and every
+// voting system tallies from the same counts.
+class ElectionEngine {
+    vector<Candidate> candidates;
+    vector<long long> rankings;       // Ballot count per estate and ranking code
+    int codeCount;                    // candidates ^ candidates
+    int estateWeights[ESTATE_COUNT];  // Per mille, for weighted estates
+
+    void castBallots(long long* counts, long long voters, const short* preference, unsigned* lanes) const;
+    void decodeRanking(int code, int* order) const;  // Best candidate first
+    int runRankedChoice(ElectionResult& result) const;
+
+public:
+    ElectionEngine();
+
+    void generateCandidates(GameRandom& random, int count);
+    void setCandidates(const vector<Candidate>& list) { candidates = list; }
+    bool setEstateWeights(const int* weights);  // Per mille, must sum to 1000
+    ElectionResult hold(const long long* voters, int system, int corruptionLevel, GameRandom& random);
+
+    int getCandidateCount() const { return (int)candidates.size(); }
+    const Candidate& getCandidate(int index) const { return candidates[index]; }
+    static const char* getSystemName(int system);
 };
 
 // Enhanced Politics class
+enum PolicyKind {
+    POLICY_TAX_REFORM, POLICY_CONSCRIPTION, POLICY_RATIONING, POLICY_PUBLIC_WORKS, POLICY_FESTIVALS,
+    POLICY_COUNT
+};
+
 class Politics {
+    friend class ActionHistory;  // Restores fields on undo/redo
+    friend class PolicyBatch;    // Applies policies in bulk
     King* currentKing;
     int electionTimer;
     int stability;  // Kingdom stability
     bool isCoup;  // Coup status
     int corruptionLevel;  // Political corruption
+    unsigned policies;    // One bit per PolicyKind in force
+    GameRandom& random;   // Kingdom random generator for elections
+    ElectionEngine election;
+    int revision;  // Bumped when a shown field changes
 
 public:
-    Politics();
+    Politics(GameRandom& r);
     ~Politics();
 
-    void holdElection();
+    void holdElection(const Population& people, int system);  // system is an ElectoralSystem
     void decreaseStability(int amount);  // Decrease kingdom stability
+    void togglePolicy(int policy);       // Enact a PolicyKind, or repeal it if in force
     string getKingName() const;
+    static const char* getPolicyName(int policy);
     
     int getStability() const { return stability; }
     bool getIsCoup() const { return isCoup; }
     int getCorruptionLevel() const { return corruptionLevel; }
+    int getKingSkill() const { return currentKing->getSkill(); }
+    unsigned getPolicies() const { return policies; }
+    bool hasPolicy(int policy) const { return (policies >> policy) & 1; }
+    int getRevision() const { return revision; }
+
+    static constexpr int MAX_POLICIES = 3;  // In force at once
+};
+
+// Applies the policies in force for one turn across a batch of kingdoms.
+// Kingdoms are gathered BLOCK at a time into one array per field, each row
+// of the policy table is applied to the whole block with a 0/1 mask rather
+// than a branch, and the results are written back. There are no virtual
+// calls and no allocation on the way.
+class PolicyBatch {
+    static const int BLOCK = 64;
+
+    struct Block {
+        int count;
+        unsigned policies[BLOCK];
+        long long people[BLOCK];
+        long long peasants[BLOCK];
+        long long drafted[BLOCK];
+        long long gold[BLOCK];  // Money raw value
+        long long food[BLOCK];
+        int services[BLOCK];
+        int stability[BLOCK];
+        int popularity[BLOCK];
+    };
+
+    static void gather(Kingdom* const* kingdoms, Block& block);
+    static void applyEffects(Block& block);
+    static void scatter(Kingdom* const* kingdoms, const Block& block);
+
+public:
+    static void apply(Kingdom* const* kingdoms, int count);
+};
+
+// Set of kingdom ids with O(1) insert and erase
+class KingdomSet {
+    vector<int> items;
+    unordered_map<int, int> positions;  // Kingdom id -> index in items
+
+public:
+    bool insert(int id);
+    bool erase(int id);
+    bool contains(int id) const { return positions.count(id) > 0; }
+    const vector<int>& getItems() const { return items; }
+    int getSize() const { return (int)items.size(); }
+};
+
+// Treaty text interned to a small integer id
+class TreatyRegistry {
+    vector<string> names;
+    unordered_map<string, int> ids;
+
+public:
+    static const int NO_TREATY = 0;
+
+    TreatyRegistry();
+
+    int intern(const string& treaty);
+    const string& getName(int id) const;
+    int getCount() const { return (int)names.size(); }
+};
+
+// Diplomatic state between one pair of kingdoms
+struct DiplomaticTie {
+    int relations;
+    int treatyId;
+    bool isAlliance;
+    int sanctionsAtoB;  // Sanctions imposed by the lower id on the higher id
+    int sanctionsBtoA;  // Sanctions imposed by the higher id on the lower id
+};
+
+// Diplomacy between many kingdoms
+class DiplomacyNetwork {
+    static const int DEFAULT_RELATIONS = 50;
+    static const int ENEMY_THRESHOLD = 20;
+
+    vector<string> kingdomNames;
+    unordered_map<unsigned long long, DiplomaticTie> ties;  // Only pairs that have interacted
+    vector<KingdomSet> allies;
+    vector<KingdomSet> enemies;
+    vector<KingdomSet> sanctioned;  // Kingdoms each kingdom has sanctioned
+    TreatyRegistry treaties;
+
+    static unsigned long long pairKey(int a, int b);
+    bool isValidPair(int a, int b) const;
+    DiplomaticTie& getTie(int a, int b);
+    const DiplomaticTie* findTie(int a, int b) const;
+    void updateStanding(int a, int b, const DiplomaticTie& tie);
+
+public:
+    DiplomacyNetwork() {}
+
+    int addKingdom(const string& name);
+    void makeTreaty(int a, int b, const string& treaty);
+    void breakTreaty(int a, int b);
+    void changeRelations(int a, int b, int amount);
+    void imposeSanctions(int from, int to, int level);
+    void liftSanctions(int from, int to);
+    void simulateTurn();  // Drift all relations one step
+
+    int getRelations(int a, int b) const;
+    string getTreaty(int a, int b) const;
+    bool getIsAlliance(int a, int b) const;
+    int getTradeSanctions(int from, int to) const;
+    const vector<int>& getAllies(int id) const;
+    const vector<int>& getEnemies(int id) const;
+    vector<int> getSanctionChain(int from, int to) const;
+
+    int getKingdomCount() const { return (int)kingdomNames.size(); }
+    string getKingdomName(int id) const;
+    int getTieCount() const { return (int)ties.size(); }
+    int getTreatyTypeCount() const { return treaties.getCount(); }
+    string serialize() const;  // Ties only; kingdoms and treaty names are kept
+    bool deserialize(const string& data);
 };
 
 // Enhanced Diplomacy class
+// Relations with the neighbouring kingdoms. The player's kingdom is id 0
+// in a DiplomacyNetwork; neighbour i is id i, as in the Market's roads.
 class Diplomacy {
-    string treaty;
-    int relations;  // Diplomatic relations
-    bool isAlliance;  // Alliance status
-    int tradeSanctions;  // Trade sanctions
+    friend class ActionHistory;  // Restores fields on undo/redo
+    DiplomacyNetwork network;
+    int revision;  // Bumped when a shown field changes
+
+    int findNeighbour(const string& treaty) const;  // Neighbour named in the text, else the nearest
 
 public:
+    static const int HOME = 0;
+    static const int NEIGHBOUR_COUNT = 4;
+
     Diplomacy();
     ~Diplomacy();
 
     void makeTreaty(string t);
     void breakTreaty();
-
-    string getTreaty() const { return treaty; }
-    
-    int getRelations() const { return relations; }
-    bool getIsAlliance() const { return isAlliance; }
-    int getTradeSanctions() const { return tradeSanctions; }
+    int declareWar(GameRandom& random);  // Returns the neighbour that attacks
+    void simulateTurn();  // Relations drift; hostile neighbours impose sanctions
+
+    string getTreaty() const;  // Most recent treaty still in force
+    int getRelations() const;  // Average over all neighbours
+    bool getIsAlliance() const;
+    int getTradeSanctions() const;  // Neighbours refusing our trade
+    bool isSanctionedBy(int neighbour) const;
+    string getNeighbourName(int neighbour) const { return network.getKingdomName(neighbour); }
+    const DiplomacyNetwork& getNetwork() const { return network; }
+    int getRevision() const { return revision; }
 };
 
 // Enhanced Communication class
 class Communication {
+    friend class ActionHistory;  // Restores fields on undo/redo
     string messages[5];  // Store last 5 messages
     int messageCount;    // Current number of messages
 
@@ -380,9 +1472,259 @@ public:
     string getMessage(int index) const;
 };
 
+enum Terrain {
+    TERRAIN_PLAINS, TERRAIN_FOREST, TERRAIN_HILLS, TERRAIN_MOUNTAINS, TERRAIN_WATER,
+    TERRAIN_COUNT
+};
+
+// Each building produces one good: food, wood, stone, iron or weapons
+enum Building {
+    BUILDING_NONE, BUILDING_FARM, BUILDING_LUMBER_MILL, BUILDING_QUARRY, BUILDING_MINE, BUILDING_SMITHY,
+    BUILDING_COUNT
+};
+
+// 32x32 tiles, one array per layer
+struct MapChunk {
+    static const int SIZE = 32;
+    static const int TILES = SIZE * SIZE;
+
+    alignas(16) unsigned char terrain[TILES];
+    alignas(16) unsigned char building[TILES];
+    alignas(16) unsigned short yield[TILES];  // Output of the tile's building per turn
+    int production[BUILDING_COUNT];           // Cached sum of yield per building
+    unsigned revision;                        // Bumped on every edit
+    bool isDirty;
+};
+
+// Kingdom territory. Edits mark their chunk dirty, and only dirty chunks
+// are summed again when production is updated.
+class TileMap {
+    static const unsigned char YIELDS[BUILDING_COUNT][TERRAIN_COUNT];
+
+    int width;   // In tiles, a multiple of MapChunk::SIZE
+    int height;
+    int chunksX;
+    int chunksY;
+    vector<MapChunk> chunks;
+    vector<int> dirtyChunks;
+    long long production[BUILDING_COUNT];  // Totals over all chunks
+    unsigned revision;                     // Bumped on every edit anywhere on the map
+
+    MapChunk& chunkAt(int x, int y) { return chunks[(y / MapChunk::SIZE) * chunksX + x / MapChunk::SIZE]; }
+    const MapChunk& chunkAt(int x, int y) const { return chunks[(y / MapChunk::SIZE) * chunksX + x / MapChunk::SIZE]; }
+    static int tileIndex(int x, int y) { return (y % MapChunk::SIZE) * MapChunk::SIZE + x % MapChunk::SIZE; }
+    void markDirty(MapChunk& chunk);
+    static void sumChunk(MapChunk& chunk);
+
+public:
+    TileMap(int w, int h);
+
+    void generate(unsigned long long seed);  // Random terrain plus starting buildings
+    bool setTerrain(int x, int y, int terrain);
+    bool build(int x, int y, int building);  // Fails where the building would produce nothing
+    void updateProduction();
+
+    bool isInside(int x, int y) const { return x >= 0 && y >= 0 && x < width && y < height; }
+    int getTerrain(int x, int y) const { return chunkAt(x, y).terrain[tileIndex(x, y)]; }
+    int getBuilding(int x, int y) const { return chunkAt(x, y).building[tileIndex(x, y)]; }
+    long long getProduction(int building) const { return production[building]; }  // As of updateProduction
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    int getDirtyChunkCount() const { return (int)dirtyChunks.size(); }
+    int getChunksX() const { return chunksX; }
+    int getChunksY() const { return chunksY; }
+    unsigned getRevision() const { return revision; }
+    unsigned getChunkRevision(int chunk) const { return chunks[chunk].revision; }
+    int getChunkProduction(int chunk, int building) const { return chunks[chunk].production[building]; }
+    static int getYield(int building, int terrain) { return YIELDS[building][terrain]; }
+};
+
+// A caravan route across the territory map
+struct CaravanRoute {
+    bool isFound;
+    int cost;    // Travel cost summed over the tiles entered
+    int danger;  // Ambush danger in basis points summed over the tiles entered
+    int length;  // Tiles travelled
+    vector<pair<short, short>> waypoints;  // Start, chunk border crossings, goal
+
+    CaravanRoute() : isFound(false), cost(0), danger(0), length(0) {}
+    int getAttackProbability(int securityPercent) const;  // Percent, worse on insecure routes
+};
+
+// Hierarchical A* over the territory. Each map chunk is a cluster and the
+// crossings between chunks form the abstract graph. Paths inside a cluster
+// are searched only when the cluster is first used, and found routes are
+// kept in an LRU cache that is dropped region by region as chunks change.
+class CaravanRouter {
+    static const int MAX_PORTALS = 64;  // Four sides of at most 16 crossings
+    static const int MAX_CACHED_ROUTES = 4096;
+
+    // Border tile of a cluster that leads into the neighbouring cluster
+    struct Portal {
+        short x;
+        short y;
+        int side;         // 0 east, 1 west, 2 south, 3 north
+        int sideIndex;    // Order along that side, matches the neighbour's portal
+    };
+
+    struct Cluster {
+        vector<Portal> portals;
+        int sideStart[5];     // First portal of each side, plus the end
+        vector<int> cost;     // portals x portals, -1 when unreachable inside the cluster
+        vector<int> danger;
+        vector<int> length;
+        unsigned revision;    // Chunk revision the portals were built from
+        bool hasEdges;
+    };
+
+    typedef pair<unsigned long long, CaravanRoute> CachedRoute;
+    typedef priority_queue<pair<int, int>, vector<pair<int, int>>, greater<pair<int, int>>> SearchQueue;
+
+    const TileMap& map;
+    unsigned mapRevision;
+    vector<Cluster> clusters;
+    list<CachedRoute> cacheOrder;  // Most recently used first
+    unordered_map<unsigned long long, list<CachedRoute>::iterator> cache;
+    vector<vector<unsigned long long>> clusterRoutes;  // Cached route keys crossing each cluster
+
+    // Search scratch, reused between queries
+    vector<int> tileCost;
+    vector<int> tileDanger;
+    vector<int> tileLength;
+    vector<int> nodeCost;
+    vector<int> nodeDanger;
+    vector<int> nodeLength;
+    vector<int> nodeParent;
+    vector<unsigned> nodeStamp;
+    unsigned stamp;
+    int searchedNodes;
+
+    static int stepCost(int terrain, int building);    // 0 means impassable
+    static int stepDanger(int terrain, int building);  // Basis points per tile
+    int clusterOf(int x, int y) const;
+    static int tileIndexOf(int x, int y) { return (y % MapChunk::SIZE) * MapChunk::SIZE + x % MapChunk::SIZE; }
+    int portalNode(int cluster, int side, int sideIndex) const;
+    void buildPortals(int cluster);
+    void buildEdges(int cluster);
+    void searchCluster(int cluster, int x, int y);
+    void syncMap();
+    void invalidateCluster(int cluster);
+    CaravanRoute search(int startX, int startY, int goalX, int goalY);
+    bool nearestPassable(int& x, int& y) const;
+
+public:
+    CaravanRouter(const TileMap& m);
+
+    CaravanRoute findRoute(int startX, int startY, int goalX, int goalY);
+    CaravanRoute findTradeRoute();  // Capital to the trading post on the east border
+
+    int getCachedRouteCount() const { return (int)cache.size(); }
+    int getSearchedNodes() const { return searchedNodes; }  // Abstract nodes expanded by the last search
+};
+
+// Sections of the kingdom status screen
+enum StatusSection {
+    STATUS_BASIC, STATUS_SOCIAL, STATUS_ECONOMY, STATUS_RESOURCES, STATUS_POLITICS,
+    STATUS_SECTION_COUNT
+};
+
+// Plain copy of everything the status screen shows. Safe to hand to
+// dashboards or a server without touching the live kingdom.
+struct StatusSnapshot {
+    string name;
+    int turn;
+    int totalPeople;
+
+    int peasants;
+    int merchants;
+    int nobility;
+    int military;
+    int foodSupply;
+    int sick;
+    bool peasantsUnhappy;   // Over 70% peasants
+    bool nobilityTooSmall;  // Under 5% nobility
+
+    Money gold;
+    int inflationRate;  // Basis points per turn
+    bool isRecession;
+    int publicServices;
+    int armySize;
+    int armyMorale;
+    int trainingLevel;
+    int equipment;
+    bool soldiersPaid;
+    Money debt;
+    int loanCount;
+    int loansInArrears;
+
+    int wood;
+    int stone;
+    int iron;
+    int food;
+    double priceMultiplier;
+
+    string kingName;
+    int stability;
+    int corruptionLevel;
+    string policies;  // Names of the policies in force
+    string treaty;
+    int relations;
+};
+
+// Status snapshot kept up to date from subsystem revision counters.
+// Only sections whose sources changed are re-read and re-formatted.
+class KingdomStatus {
+    // Revision counters each section was last built from
+    enum Source {
+        SOURCE_PEOPLE, SOURCE_ECONOMY, SOURCE_ARMY, SOURCE_BANK, SOURCE_MARKET,
+        SOURCE_POLITICS, SOURCE_DIPLOMACY, SOURCE_TURN,
+        SOURCE_GOLD, SOURCE_WOOD, SOURCE_STONE, SOURCE_IRON, SOURCE_FOOD,
+        SOURCE_COUNT
+    };
+
+    StatusSnapshot snapshot;
+    string sectionText[STATUS_SECTION_COUNT];  // Formatted lines per section
+    bool dirty[STATUS_SECTION_COUNT];
+    int seen[SOURCE_COUNT];
+
+    void readSection(Kingdom& kingdom, int section);
+    void formatSection(int section);
+
+public:
+    KingdomStatus();
+
+    int refresh(Kingdom& kingdom);  // Returns the number of sections rebuilt
+    void markAllDirty();
+    void render() const;
+
+    bool isDirty(int section) const { return dirty[section]; }
+    const StatusSnapshot& getSnapshot() const { return snapshot; }
+    const string& getSectionText(int section) const { return sectionText[section]; }
+    static const char* getSectionTitle(int section);
+};
+
+// Everything saveGame writes, copied out so it can be written on another thread
+struct SaveState {
+    string name;
+    int turn;
+    int totalPeople;
+    Money gold;
+    int armySize;
+    int armyMorale;
+    Money loan;
+    int messageCount;
+    string messages[5];
+    string loans;  // LoanBook::serialize(); empty in saves from before it was kept
+};
+
 // Enhanced Kingdom class
 class Kingdom {
 private:
+    friend class ActionHistory;  // Restores fields on undo/redo
+    int memoryAccount;               // Must come first, before any member allocates
+    MemoryScope constructionScope;   // Charges construction to this kingdom
+    ResourceLedger ledger;  // Must outlive the subsystems that reference it
+    GameRandom random;      // All game randomness for this kingdom
     string name;
     Population* people;
     Economy* economy;
@@ -394,17 +1736,28 @@ private:
     Communication* communication;
     bool isGameOver;
     int turn;
+    KingdomStatus status;  // Cached status screen
+    TileMap territory;
+    CaravanRouter caravans;  // Routes over the territory
+    EpidemicModel epidemic;  // One region per territory chunk
 
 public:
     Weather weather;  // Make weather public
-    int turnsSinceLastWeatherUpdate;  // Make turnsSinceLastWeatherUpdate public
 
     Kingdom(string n);
+    Kingdom(string n, unsigned long long seed);  // Deterministic kingdom for lockstep play
     ~Kingdom();
 
     void saveGame() const;
-    void loadGame();
-    void updateWeather();  // Weather update method
+    SaveState captureSaveState() const;
+    void applySaveState(const SaveState& state);
+    static string formatSave(const SaveState& state);
+    static bool readSave(istream& in, SaveState& state);
+    static bool writeSave(const SaveState& state, const string& path);  // Temp file, sync, rename
+    void loadGame(const string& path = "score.txt");
+    void updateWeather();  // Steps the regional climate, warns when harsh weather sets in
+    void updateEpidemic();  // Spreads disease for a turn and buries the dead
+    int startPlague();      // Outbreak in a random region; returns how many fell ill
 
     string getName() const { return name; }
     Population& getPeople() { return *people; }
@@ -415,11 +1768,563 @@ public:
     Politics& getPolitics() { return *politics; }
     Diplomacy& getDiplomacy() { return *diplomacy; }
     Communication& getCommunication() { return *communication; }
+    ResourceLedger& getLedger() { return ledger; }
+    GameRandom& getRandom() { return random; }
+    KingdomStatus& getStatus() { return status; }
+    TileMap& getTerritory() { return territory; }
+    CaravanRouter& getCaravans() { return caravans; }
+    const EpidemicModel& getEpidemic() const { return epidemic; }
+    unsigned long long computeStateHash() const;
     
     int getTurn() const { return turn; }
+    void nextTurn();
+    int getMemoryAccount() const { return memoryAccount; }
     bool getIsGameOver() const { return isGameOver; }
-    void incrementTurnsSinceLastWeatherUpdate() { turnsSinceLastWeatherUpdate++; }
-    void resetTurnsSinceLastWeatherUpdate() { turnsSinceLastWeatherUpdate = 0; }
+};
+
+// Undo/redo stack of turns. Each turn is stored as a field-level diff:
+// numeric fields keep the XOR of their old and new values, so the same
+// entry both undoes and redoes the change.
+class ActionHistory {
+    enum Field {
+        FIELD_TURN, FIELD_GAME_OVER, FIELD_RANDOM,
+        FIELD_GOLD, FIELD_WOOD, FIELD_STONE, FIELD_IRON, FIELD_FOOD, FIELD_WEAPONS,
+        FIELD_PEOPLE, FIELD_PEASANTS, FIELD_MERCHANTS, FIELD_NOBILITY, FIELD_MILITARY,
+        FIELD_BIRTH_RATE, FIELD_DEATH_RATE, FIELD_PLAGUE, FIELD_SICK,
+        FIELD_TAX_RATE, FIELD_INFLATION, FIELD_RECESSION, FIELD_PUBLIC_SERVICES,
+        FIELD_WORLD_DEMAND, FIELD_WORLD_OUTPUT, FIELD_SHRINKING,
+        FIELD_ARMY_SIZE, FIELD_MORALE, FIELD_PAID, FIELD_TRAINING, FIELD_EQUIPMENT,
+        FIELD_CASUALTIES, FIELD_REBELLING,
+        FIELD_INTEREST, FIELD_BANK_CORRUPT, FIELD_SECURITY, FIELD_AUDIT_COST,
+        FIELD_PRICE_LEVEL, FIELD_FOOD_RATE,
+        FIELD_ELECTION_TIMER, FIELD_STABILITY, FIELD_COUP, FIELD_CORRUPTION, FIELD_POLICIES,
+        FIELD_KING_SKILL, FIELD_KING_POPULARITY, FIELD_KING_CORRUPT, FIELD_KING_HEALTH,
+        FIELD_KING_REIGN, FIELD_KING_ATTEMPTS,
+        FIELD_MESSAGE_COUNT,
+        FIELD_WEATHER_DURATION, FIELD_WEATHER_PERCENT, FIELD_WEATHER_HARSH,
+        FIELD_COUNT
+    };
+
+    enum TextField {
+        TEXT_NAME, TEXT_DIPLOMACY, TEXT_WEATHER, TEXT_CLIMATE, TEXT_EPIDEMIC, TEXT_KING, TEXT_LOANS, TEXT_ROADS, TEXT_AGENTS,
+        TEXT_MESSAGE, TEXT_COUNT = TEXT_MESSAGE + 5
+    };
+
+    static const size_t MAX_BYTES = 64 * 1024;  // Oldest turns are dropped past this
+
+    long long before[FIELD_COUNT];  // Fields captured by begin()
+    string beforeText[TEXT_COUNT];
+    bool isRecording;
+
+    vector<unsigned char> data;  // All diffs back to back
+    vector<size_t> offsets;      // Start of each diff in data
+    size_t cursor;               // Diffs before this can be undone, from it on redone
+
+    static long long readField(const Kingdom& kingdom, int field);
+    static void writeField(Kingdom& kingdom, int field, long long value);
+    static string readText(const Kingdom& kingdom, int field);
+    static void writeText(Kingdom& kingdom, int field, const string& value);
+    static void putVarint(vector<unsigned char>& out, unsigned long long value);
+    static unsigned long long getVarint(const unsigned char*& in);
+    static void putAgentsDelta(vector<unsigned char>& out, const string& before, const string& after);
+    static string applyAgentsDelta(const string& current, const unsigned char*& in, bool undo);
+    void applyDiff(Kingdom& kingdom, size_t index, bool undo);
+    void dropOldest();
+
+public:
+    ActionHistory() : isRecording(false), cursor(0) {}
+
+    void begin(const Kingdom& kingdom);   // Call before the turn runs
+    void commit(const Kingdom& kingdom);  // Call after the turn; records the diff
+    bool undo(Kingdom& kingdom);
+    bool redo(Kingdom& kingdom);
+    void clear();
+
+    bool canUndo() const { return cursor > 0; }
+    bool canRedo() const { return cursor < offsets.size(); }
+    int getUndoCount() const { return (int)cursor; }
+    size_t getMemoryUsage() const { return data.size() + offsets.size() * sizeof(size_t); }
+};
+
+// One player's action for one turn. Action numbers match the game menu.
+struct TurnCommand {
+    int action;        // Menu choice (0 = no action)
+    long long value;   // Cycles, amount, quality, or Money raw value for loans
+    string text;       // Resource name, treaty or message text
+
+    TurnCommand(int a = 0, long long v = 0, const string& t = "") : action(a), value(v), text(t) {}
+
+    int encode(unsigned char* buffer) const;                       // Returns bytes written
+    int decode(const unsigned char* buffer, int length);           // Returns bytes read, 0 on error
+};
+
+// Writes save files off the game thread. submit() only copies a SaveState;
+// a worker serializes it, syncs it to disk and renames it over the save.
+// Submissions that arrive while a write is running replace each other, so
+// only the newest state is written next.
+class AutosaveService {
+    string path;
+    mutex lock;
+    condition_variable wake;  // Worker waits here for a new state
+    condition_variable idle;  // flush() waits here for the worker
+    SaveState pending;
+    bool hasPending;
+    bool isWriting;
+    bool isStopping;
+    int savedCount;
+    int failedCount;
+    thread worker;  // Started last, after the fields above are ready
+
+    void run();
+
+public:
+    AutosaveService(const string& p = "autosave.txt");  // Never the manual save file
+    ~AutosaveService();  // Writes any pending state before returning
+
+    void submit(const Kingdom& kingdom);
+    void flush();  // Blocks until nothing is pending or being written
+
+    int getSavedCount();
+    int getFailedCount();
+    const string& getPath() const { return path; }
+};
+
+// One fixed-size record of the save catalog. Records are read straight out
+// of the memory-mapped catalog file, so the layout must not change.
+struct SaveCatalogEntry {
+    char slot[32];      // Slot name, zero padded
+    char kingdom[32];   // Kingdom name, zero padded
+    int turn;
+    int population;
+    long long goldRaw;  // Money::getRaw()
+    unsigned long long blobOffset;  // Compressed save in the pack file
+    unsigned blobSize;
+    unsigned rawSize;
+    unsigned long long contentHash;  // Identical saves share one blob
+    unsigned long long checksum;     // Over all fields above; catches torn writes
+    char reserved[16];
+};
+
+// Named save slots. Saves are compressed and stored once per distinct
+// content in an append-only pack file; a catalog of fixed records holds the
+// name, turn, gold and population of every slot and is memory-mapped so
+// listing never opens or parses a save. Records are only ever appended:
+// saving a slot again adds a new record and the header count flips to it,
+// so a crash leaves the old save intact. The last record of a slot wins.
+class SaveStore {
+    static const int HEADER_SIZE = 64;
+    static const int MAX_BLOB = 1 << 20;
+
+    string catalogPath;
+    string packPath;
+    const unsigned char* mapped;  // Read-only view of the catalog file
+    size_t mappedSize;
+#ifdef _WIN32
+    HANDLE fileHandle;
+    HANDLE mappingHandle;
+#endif
+    unordered_map<unsigned long long, int> blobsByHash;  // Content hash -> catalog record
+    bool isHashIndexBuilt;
+    unordered_map<string, int> latestBySlot;  // Padded slot name -> its last good record, built on mapping
+
+    bool mapCatalog();
+    void unmapCatalog();
+    void indexSlots();
+    int findSlot(const string& slot) const;  // Latest record of the slot
+    static unsigned long long recordChecksum(const SaveCatalogEntry& entry);
+    static void compress(const string& in, string& out);
+    static bool decompress(const unsigned char* in, size_t length, size_t rawSize, string& out);
+
+public:
+    SaveStore(const string& baseName = "saves");
+    ~SaveStore();
+
+    bool save(const string& slot, const Kingdom& kingdom);
+    bool load(const string& slot, Kingdom& kingdom);
+    void listSlots() const;
+
+    int getSlotCount() const;
+    const SaveCatalogEntry* getEntry(int index) const;  // Null for a damaged record
+};
+
+// Deterministic lockstep peer: every peer simulates every kingdom and only
+// the per-turn commands plus the state and rule hashes go over the socket.
+// A peer running other rules is refused rather than left to drift apart.
+class LockstepSession {
+    static const int MAX_PACKET = 160;
+
+    // Command received for a turn this peer has not reached yet
+    struct PendingPacket {
+        int turn;
+        int player;
+        unsigned long long hash;
+        unsigned long long rulesHash;
+        TurnCommand command;
+    };
+
+    int playerId;
+    int playerCount;
+    int basePort;
+    long long socketHandle;  // SOCKET on Windows, file descriptor elsewhere
+    vector<Kingdom*> kingdoms;  // One per player, identical on every peer
+    vector<TurnCommand> commands;
+    vector<bool> received;
+    vector<PendingPacket> future;
+    unsigned char lastPacket[MAX_PACKET];      // Our packet for this turn
+    int lastPacketSize;
+    unsigned char previousPacket[MAX_PACKET];  // Our packet for the previous turn
+    int previousPacketSize;
+    unsigned long long lastHash;  // Combined hash after the previous turn
+    int turn;
+    bool isDesynced;
+    bool isRulesMismatch;  // A peer sent another rules hash; no further turn runs
+    long long bytesSent;
+
+    void sendPacket(const unsigned char* packet, int size);
+    void acceptPacket(const PendingPacket& packet);
+
+public:
+    LockstepSession(int id, int count, int port, unsigned long long seed);
+    ~LockstepSession();
+
+    bool open();
+    void sendCommand(const TurnCommand& command);
+    bool receiveCommands(int timeoutMs);  // True once every player's command has arrived under our rules
+    void advance();                       // Run the turn for all kingdoms
+
+    unsigned long long getStateHash() const { return lastHash; }
+    bool getIsDesynced() const { return isDesynced; }
+    bool getIsRulesMismatch() const { return isRulesMismatch; }
+    int getTurn() const { return turn; }
+    long long getBytesSent() const { return bytesSent; }
+    Kingdom& getKingdom(int player) { return *kingdoms[player]; }
+};
+
+// Seed plus one command per turn, enough to re-run a game exactly. The
+// chained state hash after every turn is kept as well, so a replay can be
+// checked turn by turn against another build or another run.
+class Replay {
+    static const unsigned VERSION = 2;  // 2 added the rules; version 1 replays ran the built-in ones
+
+    // The rules in force from one turn on; a reload starts a new entry
+    struct RuleChange {
+        int turn;  // First turn, counted from 0, that ran with them
+        unsigned long long hash;
+        string source;
+    };
+
+    string kingdomName;
+    unsigned long long seed;
+    unsigned long long agentSeed;  // 0 without the agent model
+    vector<TurnCommand> commands;
+    vector<unsigned long long> turnHashes;  // Chained hash after each turn, empty if not stored
+    vector<RuleChange> ruleChanges;
+    int length;                             // Turns in use; undone turns stay for redo
+    bool isRecording;
+
+public:
+    Replay(const string& name = "", unsigned long long s = 0, unsigned long long agents = 0);
+
+    void record(const TurnCommand& command, const Kingdom& kingdom);  // Call after the turn has run
+    void seek(int turns);                                             // Follow undo and redo
+    void stop() { isRecording = false; }
+    bool save(const string& path) const;
+    bool load(const string& path);
+    vector<unsigned long long> run() const;  // Headless re-run, chained hash after each turn; empty on failure
+
+    static unsigned long long chainHash(unsigned long long previous, unsigned long long stateHash);
+    static int findDivergence(const vector<unsigned long long>& a, const vector<unsigned long long>& b);  // -1 if none
+
+    int getTurnCount() const { return length; }
+    bool hasTurnHashes() const { return length > 0 && (int)turnHashes.size() >= length; }
+    vector<unsigned long long> getTurnHashes() const;
+    bool getIsRecording() const { return isRecording; }
+};
+
+// Threads kept for parallel loops, so a loop costs a wake-up rather than
+// starting and joining threads. The caller works too. One loop runs at a
+// time; a loop started while another runs, from a body or another thread,
+// runs on its caller instead. Which thread takes an index never matters.
+class WorkerPool {
+    vector<thread> workers;
+    mutex jobLock;                // Held by the loop that has the workers
+    mutex lock;
+    condition_variable wake;      // Workers wait here for a loop
+    condition_variable finished;  // run() waits here for the workers
+    const function<void(int)>* body;
+    int count;
+    atomic<int> next;             // Next index to hand out
+    int busyWorkers;              // Workers not yet done with the current loop
+    unsigned long long generation;  // Bumped per loop, so each worker joins it once
+    bool isStopping;
+
+    void work();
+    void workerLoop();
+
+public:
+    WorkerPool(int threadCount);
+    ~WorkerPool();
+
+    void run(int count, const function<void(int)>& body);  // body(i) for every i in [0, count)
+
+    static WorkerPool& shared();  // One worker per core, started on first use
+};
+
+// End-of-turn work split into stages that declare the kingdom state they
+// read and write. A stage waits only for earlier stages it conflicts with,
+// so independent stages, and all stages of different kingdoms, run in
+// parallel while making exactly the decisions of the sequential order.
+class TurnPipeline {
+public:
+    enum Data {
+        DATA_TURN = 1 << 0,
+        DATA_RANDOM = 1 << 1,
+        DATA_WEATHER = 1 << 2,
+        DATA_ROUTE = 1 << 3,
+        DATA_PEOPLE = 1 << 4,
+        DATA_ARMY = 1 << 5,
+        DATA_POLITICS = 1 << 6,
+        DATA_GOLD = 1 << 7,
+        DATA_FOOD = 1 << 8,
+        DATA_WEAPONS = 1 << 9,
+        DATA_GOODS = 1 << 10,      // Wood, stone and iron
+        DATA_ECONOMY = 1 << 11,    // Taxes and public services
+        DATA_BANK = 1 << 12,
+        DATA_DIPLOMACY = 1 << 13,
+        DATA_MESSAGES = 1 << 14,
+        DATA_TERRITORY = 1 << 15,  // Tile map and its production totals
+        DATA_ALL = (1 << 16) - 1
+    };
+
+    typedef void (*StageFunction)(Kingdom& kingdom, const TurnCommand& command);
+
+private:
+    struct Stage {
+        const char* name;
+        unsigned reads;
+        unsigned writes;
+        StageFunction run;
+        vector<int> dependents;  // Later stages that must wait for this one
+        int dependencyCount;
+    };
+
+    vector<Stage> stages;
+
+    // Current batch; task = kingdom * stage count + stage
+    Kingdom* const* batchKingdoms;
+    const TurnCommand* batchCommands;
+    vector<int> waitingOn;  // Unfinished dependencies per task
+    vector<int> readyTasks;
+    int unfinishedTasks;
+
+    mutex lock;
+    condition_variable wake;      // Workers wait here for ready tasks
+    condition_variable finished;  // runParallel waits here for the batch
+    vector<thread> workers;
+    bool isStopping;
+
+    void workerLoop();
+    void runTask(int task);
+
+public:
+    TurnPipeline(int threadCount);
+    ~TurnPipeline();
+
+    void addStage(const char* name, unsigned reads, unsigned writes, StageFunction run);
+    void addStandardStages();  // The turn order; every way of running a turn goes through these
+    static const int UPDATE_STAGE = 2;  // First standard stage after the command and the random event
+
+    // One kingdom on the calling thread; policies and interest act first when starting from stage 0
+    void runSequential(Kingdom& kingdom, const TurnCommand& command, int firstStage = 0) const;
+    void runParallel(Kingdom* const* kingdoms, const TurnCommand* commands, int count);
+
+    int getStageCount() const { return (int)stages.size(); }
+    const char* getStageName(int stage) const { return stages[stage].name; }
+    int getDependencyCount(int stage) const { return stages[stage].dependencyCount; }
+};
+
+// Values a rule can read. Each rule may only use the inputs listed for it.
+enum RuleInput {
+    INPUT_ROLL, INPUT_PEOPLE, INPUT_SHORTAGE, INPUT_RESOURCE, INPUT_BIRTH_RATE, INPUT_DEATH_RATE,
+    INPUT_FOOD, INPUT_STABILITY,
+    RULE_INPUT_COUNT
+};
+
+enum RuleId {
+    RULE_EVENT,  // Which RandomEvent a 0-99 roll gives
+    RULE_PLAGUE_LOSS, RULE_WAR_RESOURCE_LOSS, RULE_WAR_GOLD_PERCENT, RULE_DISASTER_LOSS,
+    RULE_ASSASSINATION_STABILITY, RULE_REVOLT_GOLD_PERCENT, RULE_REVOLT_STABILITY, RULE_WINDFALL_PERCENT,
+    RULE_BASE_PRICE, RULE_GROWTH, RULE_SHORTAGE_PENALTY,
+    RULE_COUNT
+};
+
+enum RandomEvent {
+    EVENT_PLAGUE, EVENT_WAR, EVENT_DISASTER, EVENT_ASSASSINATION, EVENT_REVOLT, EVENT_WINDFALL, EVENT_NONE
+};
+
+// One rule compiled to a tree of nodes. Constants are folded while
+// compiling, and each node gets the evaluate function made for its operator
+// and the kinds of its operands (input, constant or node), so run() costs
+// one direct call per node and values stay in registers; a bytecode loop
+// paid a mispredicted dispatch and a store per instruction. Division by a
+// constant is a multiply and a shift, and chains of tests on one input
+// become a table scan or lookup. run() never allocates.
+class RuleProgram {
+    friend class RuleCompiler;
+
+public:
+    static const int MAX_DEPTH = 32;  // Nested nodes; bounds the recursion in run()
+
+    struct Node;
+    typedef long long (*Evaluate)(const RuleProgram& program, const Node& node, const long long* inputs);
+
+    struct Node {
+        Evaluate evaluate;
+        int operand[3];          // Input or node index; the third is a select's else
+        long long constant[3];   // Constant operands, or where a scan's table starts
+        long long magic;         // Division by a constant: multiplier,
+        int shift;               // shift after it,
+        int correction;          // and 1 to add the dividend first, 2 to subtract it
+    };
+
+private:
+    vector<Node> nodes;
+    vector<long long> tables;  // Arms of table scans and lookups
+    bool isConstant;
+    long long constant;  // The result when isConstant
+    int root;
+
+public:
+    RuleProgram() : isConstant(true), constant(0), root(0) {}
+
+    long long run(const long long* inputs) const {  // inputs has RULE_INPUT_COUNT values
+        return isConstant ? constant : evaluateNode(root, inputs);
+    }
+    long long evaluateNode(int index, const long long* inputs) const {
+        const Node& node = nodes[index];
+        return node.evaluate(*this, node, inputs);
+    }
+    const Node& getNode(int index) const { return nodes[index]; }
+    const long long* getTable(long long offset) const { return &tables[(size_t)offset]; }
+    int getSize() const { return (int)nodes.size(); }
+};
+
+// Every rule, compiled from a rule file laid over the built-in defaults.
+// A file holds lines of "name = expression" and # comments.
+class RuleSet {
+    RuleProgram programs[RULE_COUNT];
+    string source;            // The text last compiled in, over the built-in rules
+    unsigned long long hash;  // Of source; peers and replays compare it
+
+public:
+    RuleSet() : hash(0) {}
+
+    bool compile(const string& text, const string& fileName);  // Prints errors; false if there were any
+
+    long long run(int rule, const long long* inputs) const { return programs[rule].run(inputs); }
+    const RuleProgram& getProgram(int rule) const { return programs[rule]; }
+    const string& getSource() const { return source; }
+    unsigned long long getHash() const { return hash; }
+
+    static const char* getRuleName(int rule);
+    static const char* getDefaultSource();
+    static unsigned long long hashSource(const string& text);  // FNV-1a
+};
+
+// The rules in force. Readers take one pointer; load() compiles a new set
+// to the side and swaps it in whole, so no turn sees half a rule file.
+class Rules {
+    static atomic<const RuleSet*> current;
+    static vector<const RuleSet*> retired;  // Kept until exit; a reader may still hold one
+
+    static const RuleSet& getDefaults();
+
+public:
+    static const RuleSet& get();
+    static long long evaluate(int rule, const long long* inputs) { return get().run(rule, inputs); }
+    static bool load(const string& path);  // Keeps the current rules if the file has errors
+    static bool loadSource(const string& source, const string& name);  // Same, from text already read
+    static void reset();                   // Back to the built-in rules
+};
+
+// Reports when one file is written or replaced: inotify on Linux, change
+// notifications on Windows. poll() never blocks.
+class FileWatcher {
+    string directory;
+    string fileName;
+#ifdef _WIN32
+    HANDLE change;
+    FILETIME lastWrite;  // Changes elsewhere in the directory are ignored
+#else
+    int descriptor;
+#endif
+
+public:
+    FileWatcher();
+    ~FileWatcher();
+
+    bool open(const string& path);
+    bool poll();  // True if the file changed since the last poll
+};
+
+// Keyboard for real-time mode: raw (no echo, no line buffering) and
+// non-blocking. The terminal is restored by close() or the destructor.
+// Arrow and function keys come in as several bytes starting with Escape;
+// they are read whole and reported as KEY_SPECIAL, so only a lone Escape
+// is KEY_ESCAPE.
+class RawInput {
+    static const int ESCAPE_WAIT_MILLISECONDS = 30;  // A sequence's bytes arrive within this
+
+#ifdef _WIN32
+    HANDLE console;
+    DWORD savedMode;
+#else
+    struct termios saved;
+#endif
+    bool isRaw;
+
+public:
+    static const int KEY_ESCAPE = 27;
+    static const int KEY_SPECIAL = 256;  // Arrow, function and other multi-byte keys
+
+    RawInput() : isRaw(false) {}
+    ~RawInput() { close(); }
+
+    bool open();   // False if input is not a terminal
+    void close();
+    int readKey();                      // Next key, or -1 at once if none is waiting
+    bool waitForKey(int milliseconds);  // True as soon as a key is waiting
+};
+
+// Fixed-timestep clock. Tick k is due at a fixed point on a grid, so a late
+// tick does not push back the ones after it. How late each tick ran is
+// kept in a histogram so the jitter can be reported.
+class FixedTimestep {
+    static const int BUCKETS = 64;
+    static const int BUCKET_MICROSECONDS = 250;  // The last bucket takes everything later
+
+    chrono::steady_clock::time_point origin;  // Where the grid starts
+    chrono::microseconds period;
+    long long gridTicks;    // Ticks taken or skipped since origin
+    long long tickCount;
+    long long skippedCount;
+    long long totalLateness;  // Microseconds
+    long long maxLateness;
+    long long histogram[BUCKETS];
+
+public:
+    FixedTimestep(int periodMilliseconds);
+
+    void restart();  // Next tick is due now, e.g. after a pause; statistics are kept
+    int collectDueTicks(int maxTicks);  // Ticks due by now, up to maxTicks; a longer backlog is skipped
+    chrono::steady_clock::time_point getNextTick() const { return origin + period * gridTicks; }
+
+    int getPeriodMilliseconds() const { return (int)(period.count() / 1000); }
+    long long getTickCount() const { return tickCount; }
+    long long getSkippedCount() const { return skippedCount; }
+    long long getMaxLateness() const { return maxLateness; }  // Microseconds
+    long long getMeanLateness() const { return tickCount > 0 ? totalLateness / tickCount : 0; }
+    long long getLatenessPercentile(int percent) const;  // Upper bound, to the bucket width
 };
 
 #endif
\ No newline at end of file
@@ -37,9 +37,12 @@ void displayMenu()
     Visual::printMenuItem(14, "Update Army Equipment");
     Visual::printMenuItem(15, "Send Message");
     Visual::printMenuItem(16, "View Messages");
-    Visual::printMenuItem(17, "Exit");
+    Visual::printMenuItem(17, "Enact or Repeal Policy");
+    Visual::printMenuItem(18, "Undo Last Turn");
+    Visual::printMenuItem(19, "Redo Turn");
+    Visual::printMenuItem(20, "Exit");
     Visual::printLine();
-    std::cout << "Enter choice (1-17): ";
+    std::cout << "Enter choice (1-20): ";
 }
 
 // Third: Function to view kingdom status
@@ -50,210 +53,57 @@ void viewStatus(Kingdom& kingdom)
     cout << "Kingdom Status" << endl;
     Visual::printLine();
 
-    Visual::printSection("Basic Information");
-    std::cout << "Name: " << kingdom.getName() << std::endl;
-    std::cout << "Turn: " << kingdom.getTurn() << std::endl;
-    std::cout << "Population: " << kingdom.getPeople().getTotalPeople() << std::endl;
-
-    Visual::printSection("Social Classes");
-    std::cout << "- Peasants: " << kingdom.getPeople().getPeasants() << std::endl;
-    std::cout << "- Merchants: " << kingdom.getPeople().getMerchants() << std::endl;
-    std::cout << "- Nobility: " << kingdom.getPeople().getNobility() << std::endl;
-    std::cout << "- Military: " << kingdom.getPeople().getMilitary() << std::endl;
-    std::cout << "- Food Supply: " << kingdom.getPeople().getFoodSupply() << std::endl;
-
-    Visual::printSection("Economy & Military");
-    std::cout << "Gold: " << kingdom.getEconomy().getGold() << std::endl;
-    std::cout << "Inflation: " << kingdom.getEconomy().getInflation() * 100 << "%" << std::endl;
-    std::cout << "Public Services: " << kingdom.getEconomy().getPublicServices() << std::endl;
-    std::cout << "Army Size: " << kingdom.getArmy().getSize() << std::endl;
-    std::cout << "Army Morale: " << kingdom.getArmy().getMorale() << std::endl;
-    std::cout << "Training Level: " << kingdom.getArmy().getTrainingLevel() << std::endl;
-    std::cout << "Equipment Quality: " << kingdom.getArmy().getEquipment() << std::endl;
-    std::cout << "Soldiers Paid: " << (kingdom.getArmy().getIsPaid() ? "Yes" : "No") << std::endl;
-    std::cout << "Debt: " << kingdom.getBank().getLoanAmount() << std::endl;
-
-    Visual::printSection("Resources");
-    std::cout << "- Wood: " << kingdom.getMarket().getResource("wood") << std::endl;
-    std::cout << "- Stone: " << kingdom.getMarket().getResource("stone") << std::endl;
-    std::cout << "- Iron: " << kingdom.getMarket().getResource("iron") << std::endl;
-    std::cout << "- Food: " << kingdom.getMarket().getResource("food") << std::endl;
-    std::cout << "- Price Multiplier: " << kingdom.getMarket().getPriceMultiplier() << std::endl;
-
-    Visual::printSection("Politics & Diplomacy");
-    std::cout << "King: " << kingdom.getPolitics().getKingName() << std::endl;
-    std::cout << "Stability: " << kingdom.getPolitics().getStability() << std::endl;
-    std::cout << "Corruption Level: " << kingdom.getPolitics().getCorruptionLevel() << std::endl;
-    std::cout << "Treaty: " << kingdom.getDiplomacy().getTreaty() << std::endl;
-    std::cout << "Relations: " << kingdom.getDiplomacy().getRelations() << std::endl;
+    KingdomStatus& status = kingdom.getStatus();
+    status.refresh(kingdom);  // Only re-reads sections that changed
+    status.render();
 
     Visual::printLine();
     waitForUser();
 }
 
-// Function to handle loan repayment
-bool handleLoanRepayment(Kingdom& kingdom)
+// Function to list the loans on the kingdom's books
+void showLoans(Kingdom& kingdom)
 {
-    if (kingdom.getBank().getLoanAmount() > 0)
+    const LoanBook& loans = kingdom.getBank().getLoans();
+    if (loans.getCount() == 0)
     {
-        double minRepayment = kingdom.getBank().getLoanAmount() * 0.1;
-        double repay;
-        bool validInput = false;
+        Visual::printInfo("The kingdom owes nothing.");
+        return;
+    }
 
-        while (!validInput)
+    const int MAX_SHOWN = 10;
+    for (int i = 0; i < loans.getCount() && i < MAX_SHOWN; i++)
+    {
+        Visual::printInfo(VFMT("Loan {}: {} of {} gold left, {} per turn, turn {} of {}, scheduled {}"),
+            i + 1, loans.getBalance(i), loans.getPrincipal(i), loans.getPayment(i), loans.getAge(i),
+            loans.getTerm(i), loans.getScheduledBalance(i));
+        if (loans.getMissed(i) > 0)
         {
-            Visual::clearScreen();
-            Visual::printLine();
-            cout << "Loan Repayment Required" << endl;
-            Visual::printLine();
-            Visual::printWarning("You have an outstanding loan of " + std::to_string(kingdom.getBank().getLoanAmount()) + " gold.");
-            Visual::printInfo("You must repay at least 10% of the loan amount.");
-            Visual::printInfo("Enter repayment amount (minimum " + std::to_string(minRepayment) + "): ");
-
-            if (!(cin >> repay))
-            {
-                clearInputBuffer();
-                Visual::clearScreen();
-                Visual::printError("Please enter a valid number!");
-                waitForUser();
-                continue;
-            }
-
-            if (repay < minRepayment)
-            {
-                clearInputBuffer();
-                Visual::clearScreen();
-                Visual::printError("Repayment amount must be at least " + std::to_string(minRepayment) + "!");
-                waitForUser();
-                continue;
-            }
-
-            if (repay > kingdom.getEconomy().getGold())
-            {
-                clearInputBuffer();
-                Visual::clearScreen();
-                Visual::printError("You don't have enough gold!");
-                waitForUser();
-                continue;
-            }
-
-            validInput = true;
+            Visual::printWarning(VFMT("Loan {} has missed {} payments in a row!"), i + 1, loans.getMissed(i));
         }
-
-        // Clear input buffer after getting valid input
-        clearInputBuffer();
-
-        // Clear screen before showing success message
-        Visual::clearScreen();
-        kingdom.getBank().repayLoan(repay, kingdom.getEconomy());
-        Visual::printSuccess("Loan repayment successful!");
-        waitForUser();
     }
-    return true;
+    if (loans.getCount() > MAX_SHOWN)
+    {
+        Visual::printInfo(VFMT("...and {} more."), loans.getCount() - MAX_SHOWN);
+    }
+    Visual::printInfo(VFMT("Total debt: {} gold."), loans.getTotal());
 }
 
 // Function to handle random events
 void handleRandomEvent(Kingdom& kingdom)
 {
-    srand(time(0));
-    int event = rand() % 100;
-    
     Visual::clearScreen();
     Visual::printLine();
     cout << "Random Event" << endl;
     Visual::printLine();
-    
-    // Update weather every 3 turns
-    kingdom.turnsSinceLastWeatherUpdate++;
-    if (kingdom.turnsSinceLastWeatherUpdate >= 3) {
-        kingdom.weather.updateWeather();
-        kingdom.turnsSinceLastWeatherUpdate = 0;
-        
-        if (kingdom.weather.isHarshWeather()) {
-            Visual::printWarning("Weather Alert: " + kingdom.weather.getCurrentCondition());
-            Visual::printInfo("Food production will be affected for " + 
-                            to_string(kingdom.weather.getDuration()) + " turns.");
-        }
-    }
-    
-    // Update trade route security
-    kingdom.getMarket().getTradeRoute().updateSecurity();
-    
-    if (event < 15) // 15% chance for plague
-    {
-        if (kingdom.getMarket().checkFoodShortage()) {
-            int populationLoss = kingdom.getPeople().getTotalPeople() * 0.15; // 15% population loss due to starvation
-            kingdom.getPeople().decreasePopulation(populationLoss);
-            Visual::printWarning("Food shortage has led to starvation!");
-            Visual::printError("Population decreased by " + to_string(populationLoss) + " people.");
-        }
-        else {
-            int populationLoss = kingdom.getPeople().getTotalPeople() * 0.1; // 10% population loss
-            kingdom.getPeople().decreasePopulation(populationLoss);
-            Visual::printWarning("A deadly plague has struck the kingdom!");
-            Visual::printError("Population decreased by " + to_string(populationLoss) + " people.");
-        }
-    }
-    else if (event < 30) // 15% chance for war
-    {
-        int goldLoss = kingdom.getEconomy().getGold() * 0.2; // 20% gold loss
-        int armyLoss = kingdom.getArmy().getSize() * 0.15; // 15% army loss
-        int resourceLoss = 30; // Fixed resource loss
-        
-        kingdom.getEconomy().decreaseGold(goldLoss);
-        kingdom.getArmy().decreaseSize(armyLoss);
-        kingdom.getMarket().decreaseResource("weapons", resourceLoss);
-        kingdom.getMarket().decreaseResource("food", resourceLoss);
-        
-        Visual::printWarning("A neighboring kingdom has declared war!");
-        Visual::printError("Lost " + to_string(goldLoss) + " gold, " + 
-                         to_string(armyLoss) + " soldiers, and resources.");
-    }
-    else if (event < 45) // 15% chance for natural disaster
-    {
-        int resourceLoss = 20; // Fixed resource loss
-        kingdom.getMarket().decreaseResource("food", resourceLoss);
-        kingdom.getMarket().decreaseResource("wood", resourceLoss);
-        Visual::printWarning("A natural disaster has struck!");
-        Visual::printError("Lost " + std::to_string(resourceLoss) + " units of food and wood.");
-    }
-    else if (event < 60) // 15% chance for assassination attempt
-    {
-        if (rand() % 2 == 0) // 50% chance of success
-        {
-            kingdom.getPolitics().decreaseStability(20);
-            Visual::printWarning("An assassination attempt on the king has failed!");
-            Visual::printError("Kingdom stability decreased by 20%.");
-        }
-        else
-        {
-            kingdom.getPolitics().holdElection(); // Force new election
-            Visual::printWarning("The king has been assassinated!");
-            Visual::printInfo("A new election must be held.");
-        }
-    }
-    else if (event < 75) // 15% chance for revolt
-    {
-        int goldLoss = kingdom.getEconomy().getGold() * 0.1; // 10% gold loss
-        kingdom.getEconomy().decreaseGold(goldLoss);
-        kingdom.getPolitics().decreaseStability(15);
-        Visual::printWarning("The peasants are revolting!");
-        Visual::printError("Lost " + std::to_string(goldLoss) + " gold and stability decreased by 15%.");
-    }
-    else if (event < 90) // 15% chance for good event
-    {
-        int goldGain = kingdom.getEconomy().getGold() * 0.1; // 10% gold gain
-        kingdom.getEconomy().increaseGold(goldGain);
-        Visual::printSuccess("A wealthy merchant has donated to the kingdom!");
-        Visual::printInfo("Gained " + std::to_string(goldGain) + " gold.");
-    }
-    // 10% chance for nothing to happen
-    
+
+    applyRandomEvent(kingdom);
+
     waitForUser();
 }
 
 // Function to send a message
-void sendMessage(Kingdom& kingdom)
+TurnCommand sendMessage(Kingdom& kingdom)
 {
     Visual::clearScreen();
     Visual::printLine();
@@ -267,11 +117,13 @@ void sendMessage(Kingdom& kingdom)
     {
         Visual::printError("Message too long! Maximum 100 characters.");
         waitForUser();
-        return;
+        return TurnCommand();
     }
     
-    kingdom.getCommunication().sendMessage(message);
+    TurnCommand command(15, 0, message);
+    executeCommand(kingdom, command);
     waitForUser();
+    return command;
 }
 
 // Function to view messages
@@ -285,11 +137,284 @@ void viewMessages(Kingdom& kingdom)
     waitForUser();
 }
 
+// Draws the real-time screen in one go; escape codes are cheaper than a clear command
+void renderRealTime(Kingdom& kingdom, const FixedTimestep& clock, int queued, bool isPaused, const string& message)
+{
+    cout << "\x1b[H\x1b[2J";
+    Visual::printLine();
+    cout << "Turn " << kingdom.getTurn() << (isPaused ? " (paused)" : "") << endl;
+    Visual::printLine();
+
+    KingdomStatus& status = kingdom.getStatus();
+    status.refresh(kingdom);  // Only re-reads sections that changed
+    status.render();
+
+    Visual::printLine();
+    cout << "t taxes  a train  p pay  f fund services  b buy food  e election" << endl;
+    cout << "1-5 policies  space pause  q quit" << endl;
+    cout << message << " (" << queued << " orders queued)" << endl;
+    cout << "Tick " << clock.getPeriodMilliseconds() << " ms, started late by " << clock.getMeanLateness()
+         << " us on average, " << clock.getMaxLateness() << " us at most" << endl;
+}
+
+// Real-time mode: one turn passes every tick whether or not a key is
+// pressed. Keys queue orders for the coming ticks and are read without
+// blocking, and the screen is redrawn on its own schedule.
+void runRealTime(Kingdom& kingdom, AutosaveService& autosave, Replay& replay, FileWatcher& ruleWatcher,
+    int periodMilliseconds)
+{
+    const int RENDER_MILLISECONDS = 100;
+    const int MAX_CATCH_UP = 4;  // Ticks run back to back after a stall
+    const size_t MAX_ORDERS = 8;
+
+    RawInput input;
+    if (periodMilliseconds < 1 || !input.open())
+    {
+        Visual::printError("Real-time mode needs a terminal and a tick of at least 1 ms!");
+        waitForUser();
+        return;
+    }
+
+    FixedTimestep clock(periodMilliseconds);
+    queue<TurnCommand> orders;
+    string message = "Press a key to give an order.";
+    bool running = true;
+    bool isPaused = false;
+    bool isDirty = true;
+    chrono::steady_clock::time_point nextRender = chrono::steady_clock::now();
+
+    while (running && !kingdom.getIsGameOver())
+    {
+        // Drain every waiting key; none of this blocks
+        for (int key = input.readKey(); key >= 0; key = input.readKey())
+        {
+            TurnCommand order;
+            switch (key)
+            {
+            case 't': order = TurnCommand(2); message = "Queued: collect taxes."; break;
+            case 'a': order = TurnCommand(3, 1); message = "Queued: train army."; break;
+            case 'p': order = TurnCommand(4); message = "Queued: pay soldiers."; break;
+            case 'f': order = TurnCommand(13, 10); message = "Queued: fund public services."; break;
+            case 'b': order = TurnCommand(7, 10, "food"); message = "Queued: buy 10 food."; break;
+            case 'e': order = TurnCommand(8, ELECTION_PLURALITY); message = "Queued: hold election."; break;
+            case ' ':
+                isPaused = !isPaused;
+                if (!isPaused) clock.restart();  // Do not catch up on the pause
+                break;
+            case 'q':
+            case RawInput::KEY_ESCAPE:
+                running = false;
+                break;
+            default:
+                if (key >= '1' && key < '1' + POLICY_COUNT)
+                {
+                    order = TurnCommand(17, key - '1');
+                    message = string("Queued: enact or repeal ") + Politics::getPolicyName(key - '1') + ".";
+                }
+                break;
+            }
+            if (order.action != 0)
+            {
+                if (orders.size() < MAX_ORDERS) orders.push(order);
+                else message = "Too many orders queued!";
+            }
+            isDirty = true;
+        }
+
+        Visual::setQuiet(true);
+        if (ruleWatcher.poll())
+        {
+            message = Rules::load("rules.txt") ? "Rules reloaded." : "rules.txt has errors; rules unchanged.";
+            isDirty = true;
+        }
+
+        // Run the ticks that are due, one order each
+        int due = isPaused ? 0 : clock.collectDueTicks(MAX_CATCH_UP);
+        for (int i = 0; i < due && !kingdom.getIsGameOver(); i++)
+        {
+            TurnCommand command;
+            if (!orders.empty())
+            {
+                command = orders.front();
+                orders.pop();
+            }
+            runTurn(kingdom, command);
+            autosave.submit(kingdom);
+            replay.record(command, kingdom);
+            isDirty = true;
+        }
+        Visual::setQuiet(false);
+
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        if (isDirty && now >= nextRender)
+        {
+            renderRealTime(kingdom, clock, (int)orders.size(), isPaused, message);
+            nextRender = now + chrono::milliseconds(RENDER_MILLISECONDS);
+            isDirty = false;
+        }
+
+        // Sleep until the next tick or redraw, waking early for a key
+        chrono::steady_clock::time_point wake = isPaused ? now + chrono::milliseconds(RENDER_MILLISECONDS) : clock.getNextTick();
+        if (isDirty && nextRender < wake) wake = nextRender;
+        long long wait = (long long)chrono::duration_cast<chrono::milliseconds>(wake - chrono::steady_clock::now()).count();
+        if (wait > 0 && input.waitForKey((int)wait)) continue;
+        this_thread::sleep_until(wake);  // The part of a millisecond poll cannot wait for
+    }
+    input.close();
+}
+
+// Reads argument i as a number, or fallback when it was not given
+static int numberArgument(const vector<string>& arguments, size_t i, int fallback)
+{
+    return i < arguments.size() ? atoi(arguments[i].c_str()) : fallback;
+}
+
+// A headless command that runs instead of the game and sets the exit code
+struct CommandOption
+{
+    const char* name;
+    int requiredArguments;  // Leading arguments without a default
+    const char* usage;
+    bool (*run)(const vector<string>& arguments, unsigned long long seed);
+};
+
+static const CommandOption COMMANDS[] =
+{
+    // Headless check that lockstep peers stay in sync
+    {"--lockstep-check", 0, "[players] [turns]", [](const vector<string>& arguments, unsigned long long seed)
+        { return runLockstepLoopback(numberArgument(arguments, 0, 2), numberArgument(arguments, 1, 1000), seed); }},
+    // Headless check that the parallel turn pipeline matches runTurn
+    {"--pipeline-check", 0, "[kingdoms] [turns]", [](const vector<string>& arguments, unsigned long long seed)
+        { return runPipelineCheck(numberArgument(arguments, 0, 8), numberArgument(arguments, 1, 1000), seed); }},
+    // Record a replay
+    {"--replay-record", 1, "<file> [turns]", [](const vector<string>& arguments, unsigned long long seed)
+        { return recordScriptedReplay(arguments[0], numberArgument(arguments, 1, 100000), seed); }},
+    // Re-run a replay and report the first turn that differs
+    {"--replay-verify", 1, "<file>", [](const vector<string>& arguments, unsigned long long)
+        { return verifyReplay(arguments[0]); }},
+    // Where a kingdom's memory goes
+    {"--memory-report", 0, "[turns]", [](const vector<string>& arguments, unsigned long long seed)
+        { return runMemoryReport(numberArgument(arguments, 0, 1000), seed); }},
+    // Headless check of real-time tick jitter
+    {"--realtime-check", 0, "[ticks] [tick ms]", [](const vector<string>& arguments, unsigned long long seed)
+        { return runRealTimeCheck(numberArgument(arguments, 0, 500), numberArgument(arguments, 1, 10), seed); }},
+    // Check loan schedules against the closed form and time accrual
+    {"--loan-check", 0, "[loans] [turns]", [](const vector<string>& arguments, unsigned long long seed)
+        { return runLoanCheck(numberArgument(arguments, 0, 1000000), numberArgument(arguments, 1, 48), seed); }},
+    // Check the world aggregates and time them
+    {"--world-check", 0, "[kingdoms] [turns]", [](const vector<string>& arguments, unsigned long long seed)
+        { return runWorldCheck(numberArgument(arguments, 0, 2000), numberArgument(arguments, 1, 20), seed); }},
+    // Check the climate chain and time a step
+    {"--climate-check", 0, "[regions] [turns]", [](const vector<string>& arguments, unsigned long long seed)
+        { return runClimateCheck(numberArgument(arguments, 0, 10000), numberArgument(arguments, 1, 1200), seed); }},
+    // Check the epidemic and time a step
+    {"--epidemic-check", 0, "[regions] [turns]", [](const vector<string>& arguments, unsigned long long seed)
+        { return runEpidemicCheck(numberArgument(arguments, 0, 100000), numberArgument(arguments, 1, 100), seed); }},
+    // Check the compiled rules against the built-in C++ ones, or check a rule file
+    {"--rules-check", 0, "[file]", [](const vector<string>& arguments, unsigned long long)
+        { return runRulesCheck(arguments.empty() ? "" : arguments[0], 10000000); }},
+};
+
+// Everything given on the command line, in any order
+struct GameOptions
+{
+    const CommandOption* command = nullptr;  // Run instead of the game when set
+    vector<string> arguments;                // The command's arguments
+    bool hasAgents = false;                  // --agents: simulate every citizen
+    bool isRealTime = false;                 // --realtime [tick ms]: the world runs on its own
+    int tickMilliseconds = 1000;
+};
+
+static void printUsage()
+{
+    cout << "Usage: game [--agents] [--realtime [tick ms]]" << endl;
+    for (const CommandOption& command : COMMANDS)
+    {
+        cout << "       game " << command.name << " " << command.usage << endl;
+    }
+}
+
+// Arguments are words that do not start with "--"
+static bool isArgument(int i, int argc, char* argv[])
+{
+    return i < argc && string(argv[i]).compare(0, 2, "--") != 0;
+}
+
+static bool parseOptions(int argc, char* argv[], GameOptions& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+        if (option == "--agents")
+        {
+            options.hasAgents = true;
+            continue;
+        }
+        if (option == "--realtime")
+        {
+            options.isRealTime = true;
+            if (isArgument(i + 1, argc, argv)) options.tickMilliseconds = atoi(argv[++i]);
+            continue;
+        }
+
+        const CommandOption* command = nullptr;
+        for (const CommandOption& candidate : COMMANDS)
+        {
+            if (option == candidate.name) command = &candidate;
+        }
+        if (command == nullptr)
+        {
+            Visual::printError(VFMT("Unknown option {}!"), option);
+            return false;
+        }
+        if (options.command != nullptr)
+        {
+            Visual::printError(VFMT("{} and {} cannot run together!"), options.command->name, option);
+            return false;
+        }
+        options.command = command;
+        while (isArgument(i + 1, argc, argv))
+        {
+            options.arguments.push_back(argv[++i]);
+        }
+    }
+
+    if (options.command != nullptr && (int)options.arguments.size() < options.command->requiredArguments)
+    {
+        Visual::printError(VFMT("{} needs {}!"), options.command->name, options.command->usage);
+        return false;
+    }
+    if (options.command != nullptr && (options.hasAgents || options.isRealTime))
+    {
+        Visual::printError(VFMT("--agents and --realtime only apply to the game, not to {}!"), options.command->name);
+        return false;
+    }
+    return true;
+}
+
 // Fourth: Main game function
-int main()
+int main(int argc, char* argv[])
 {
+    GameOptions options;
+    if (!parseOptions(argc, argv, options))
+    {
+        printUsage();
+        return 1;
+    }
+    if (options.command != nullptr)
+    {
+        return options.command->run(options.arguments, (unsigned long long)time(0)) ? 0 : 1;
+    }
+
     // Initialize the kingdom
-    Kingdom kingdom("Westland");
+    unsigned long long seed = (unsigned long long)time(0);
+    unsigned long long agentSeed = 0;
+    Kingdom kingdom("Westland", seed);
+    if (options.hasAgents)
+    {
+        agentSeed = seed ^ 0xA6E7;
+        kingdom.getPeople().enableAgents(agentSeed);  // Simulate every citizen
+    }
     Visual::clearScreen();
     Visual::printLine();
     cout << "Welcome to Stronghold!" << endl;
@@ -300,7 +425,24 @@ int main()
     // Game loop variables
     int choice = 0;
     bool running = true;
-    int turnCounter = 0; // Counter for random events
+    ActionHistory history;  // Undo/redo of whole turns
+    AutosaveService autosave;  // Saves every turn in the background
+    SaveStore saves;           // Named save slots
+    Replay replay("Westland", seed, agentSeed);  // Written to replay.shr for bug reports
+    FileWatcher ruleWatcher;  // Reloads rules.txt whenever it is saved
+    if (ifstream("rules.txt").good())
+    {
+        Rules::load("rules.txt");
+        waitForUser();
+    }
+    ruleWatcher.open("rules.txt");
+
+    // The world runs on its own instead of waiting at the menu
+    if (options.isRealTime)
+    {
+        runRealTime(kingdom, autosave, replay, ruleWatcher, options.tickMilliseconds);
+        running = false;
+    }
 
     // Main game loop
     while (running && !kingdom.getIsGameOver())
@@ -324,6 +466,28 @@ int main()
 
         // Clear screen before performing action
         Visual::clearScreen();
+        if (ruleWatcher.poll())
+        {
+            Rules::load("rules.txt");  // Swapped in whole, between turns
+        }
+
+        // Undo and redo do not take a turn
+        if (choice == 18 || choice == 19)
+        {
+            if (choice == 18) history.undo(kingdom);
+            else history.redo(kingdom);
+            replay.seek(kingdom.getTurn() - 1);
+            waitForUser();
+            continue;
+        }
+        history.begin(kingdom);
+        TurnCommand command;  // Stays empty for choices that change nothing
+        if (choice != 20)
+        {
+            Kingdom* self = &kingdom;
+            PolicyBatch::apply(&self, 1);  // Policies in force and loans act at the start of the turn, as in runTurn
+            Bank::accrueInterest(&self, 1);
+        }
 
         // Process user choice
         switch (choice)
@@ -333,7 +497,8 @@ int main()
             break;
 
         case 2: // Collect Taxes
-            kingdom.getEconomy().collectTaxes(kingdom.getPeople());
+            command = TurnCommand(2);
+            executeCommand(kingdom, command);
             waitForUser();
             break;
 
@@ -356,8 +521,9 @@ int main()
                 {
                     clearInputBuffer();
                     Visual::clearScreen();
-                    kingdom.getArmy().train(cycles);
-                    Visual::printSuccess("Army training completed for " + std::to_string(cycles) + " cycles.");
+                    command = TurnCommand(3, cycles);
+                    executeCommand(kingdom, command);
+                    Visual::printSuccess(VFMT("Army training completed for {} cycles."), cycles);
                     waitForUser();
                 }
             }
@@ -367,16 +533,19 @@ int main()
             Visual::printLine();
             cout << "Pay Soldiers" << endl;
             Visual::printLine();
-            kingdom.getArmy().paySoldiers(kingdom.getEconomy());
+            command = TurnCommand(4);
+            executeCommand(kingdom, command);
             waitForUser();
             break;
 
         case 5: // Take Loan
             {
-                double loan;
+                Money loan;
+                int turns;
                 Visual::printLine();
                 cout << "Take Loan" << endl;
                 Visual::printLine();
+                showLoans(kingdom);
                 Visual::printInfo("Enter loan amount: ");
 
                 if (!(cin >> loan) || loan <= 0)
@@ -385,13 +554,23 @@ int main()
                     Visual::clearScreen();
                     Visual::printError("Loan amount must be positive!");
                     waitForUser();
+                    break;
+                }
+                Visual::printInfo(VFMT("Repay over how many turns ({}-{})? "), Bank::MIN_TERM, Bank::MAX_TERM);
+                if (!(cin >> turns) || turns < Bank::MIN_TERM || turns > Bank::MAX_TERM)
+                {
+                    clearInputBuffer();
+                    Visual::clearScreen();
+                    Visual::printError(VFMT("Loan term must be between {} and {} turns!"), Bank::MIN_TERM,
+                        Bank::MAX_TERM);
+                    waitForUser();
                 }
                 else
                 {
                     clearInputBuffer();
                     Visual::clearScreen();
-                    kingdom.getBank().takeLoan(loan, kingdom.getEconomy());
-                    Visual::printSuccess("Loan of " + std::to_string(loan) + " gold received.");
+                    command = TurnCommand(5, loan.getRaw(), to_string(turns));
+                    executeCommand(kingdom, command);
                     waitForUser();
                 }
             }
@@ -399,10 +578,11 @@ int main()
 
         case 6: // Repay Loan
             {
-                double repay;
+                Money repay;
                 Visual::printLine();
                 cout << "Repay Loan" << endl;
                 Visual::printLine();
+                showLoans(kingdom);
                 Visual::printInfo("Enter repayment amount: ");
 
                 if (!(cin >> repay) || repay <= 0)
@@ -416,8 +596,9 @@ int main()
                 {
                     clearInputBuffer();
                     Visual::clearScreen();
-                    kingdom.getBank().repayLoan(repay, kingdom.getEconomy());
-                    Visual::printSuccess("Successfully repaid " + std::to_string(repay) + " gold.");
+                    command = TurnCommand(6, repay.getRaw());
+                    executeCommand(kingdom, command);
+                    Visual::printSuccess(VFMT("Successfully repaid {} gold."), repay);
                     waitForUser();
                 }
             }
@@ -445,19 +626,38 @@ int main()
                 {
                     clearInputBuffer();
                     Visual::clearScreen();
-                    kingdom.getMarket().tradeResource(resource, amount, kingdom.getEconomy());
-                    Visual::printSuccess("Trade completed for " + resource + ".");
+                    command = TurnCommand(7, amount, resource);
+                    executeCommand(kingdom, command);
+                    Visual::printSuccess(VFMT("Trade completed for {}."), resource);
                     waitForUser();
                 }
             }
             break;
 
         case 8: // Hold Election
-            Visual::printLine();
-            cout << "Hold Election" << endl;
-            Visual::printLine();
-            kingdom.getPolitics().holdElection();
-            waitForUser();
+            {
+                int system;
+                Visual::printLine();
+                cout << "Hold Election" << endl;
+                Visual::printLine();
+                Visual::printInfo("Voting system (1 plurality, 2 ranked choice, 3 weighted estates): ");
+
+                if (!(cin >> system) || system < 1 || system > ELECTION_SYSTEM_COUNT)
+                {
+                    clearInputBuffer();
+                    Visual::clearScreen();
+                    Visual::printError("Voting system must be 1-3!");
+                    waitForUser();
+                }
+                else
+                {
+                    clearInputBuffer();
+                    Visual::clearScreen();
+                    command = TurnCommand(8, system - 1);
+                    executeCommand(kingdom, command);
+                    waitForUser();
+                }
+            }
             break;
 
         case 9: // Make Treaty
@@ -469,8 +669,9 @@ int main()
                 Visual::printInfo("Enter treaty (e.g., Peace with Eastland): ");
                 getline(cin, treaty);
                 Visual::clearScreen();
-                kingdom.getDiplomacy().makeTreaty(treaty);
-                Visual::printSuccess("Treaty established: " + treaty);
+                command = TurnCommand(9, 0, treaty);
+                executeCommand(kingdom, command);
+                Visual::printSuccess(VFMT("Treaty established: {}"), treaty);
                 waitForUser();
             }
             break;
@@ -479,24 +680,57 @@ int main()
             Visual::printLine();
             cout << "Break Treaty" << endl;
             Visual::printLine();
-            kingdom.getDiplomacy().breakTreaty();
+            command = TurnCommand(10);
+            executeCommand(kingdom, command);
             waitForUser();
             break;
 
         case 11: // Save Game
-            Visual::printLine();
-            cout << "Save Game" << endl;
-            Visual::printLine();
-            kingdom.saveGame();
-            waitForUser();
+            {
+                string slot;
+                Visual::printLine();
+                cout << "Save Game" << endl;
+                Visual::printLine();
+                saves.listSlots();
+                Visual::printInfo("Enter slot name (empty for score.txt): ");
+                getline(cin, slot);
+                if (slot.empty())
+                {
+                    kingdom.saveGame();
+                }
+                else
+                {
+                    saves.save(slot, kingdom);
+                }
+                waitForUser();
+            }
             break;
 
         case 12: // Load Game
-            Visual::printLine();
-            cout << "Load Game" << endl;
-            Visual::printLine();
-            kingdom.loadGame();
-            waitForUser();
+            {
+                string slot;
+                Visual::printLine();
+                cout << "Load Game" << endl;
+                Visual::printLine();
+                saves.listSlots();
+                Visual::printInfo("Enter slot name (empty for score.txt, \"autosave\" for the last autosave): ");
+                getline(cin, slot);
+                if (slot.empty())
+                {
+                    kingdom.loadGame();
+                }
+                else if (slot == "autosave")
+                {
+                    autosave.flush();  // Never read a half-written autosave
+                    kingdom.loadGame(autosave.getPath());
+                }
+                else
+                {
+                    saves.load(slot, kingdom);
+                }
+                replay.stop();  // A loaded kingdom cannot be replayed from the seed
+                waitForUser();
+            }
             break;
 
         case 13: // Fund Public Services
@@ -518,8 +752,9 @@ int main()
                 {
                     clearInputBuffer();
                     Visual::clearScreen();
-                    kingdom.getEconomy().fundPublicServices(funding);
-                    Visual::printSuccess("Successfully funded public services with " + std::to_string(funding) + " gold.");
+                    command = TurnCommand(13, funding);
+                    executeCommand(kingdom, command);
+                    Visual::printSuccess(VFMT("Successfully funded public services with {} gold."), funding);
                     waitForUser();
                 }
             }
@@ -544,22 +779,54 @@ int main()
                 {
                     clearInputBuffer();
                     Visual::clearScreen();
-                    kingdom.getArmy().updateEquipment(quality);
-                    Visual::printSuccess("Army equipment updated to quality level " + std::to_string(quality) + ".");
+                    command = TurnCommand(14, quality);
+                    executeCommand(kingdom, command);
+                    Visual::printSuccess(VFMT("Army equipment updated to quality level {}."), quality);
                     waitForUser();
                 }
             }
             break;
 
         case 15: // Send Message
-            sendMessage(kingdom);
+            command = sendMessage(kingdom);
             break;
 
         case 16: // View Messages
             viewMessages(kingdom);
             break;
 
-        case 17: // Exit
+        case 17: // Enact or Repeal Policy
+            {
+                int policy;
+                Visual::printLine();
+                cout << "Enact or Repeal Policy" << endl;
+                Visual::printLine();
+                for (int p = 0; p < POLICY_COUNT; p++)
+                {
+                    Visual::printInfo(VFMT("{}. {}{}"), p + 1, Politics::getPolicyName(p),
+                        kingdom.getPolitics().hasPolicy(p) ? " (in force)" : "");
+                }
+                Visual::printInfo("Choose a policy (1-5): ");
+
+                if (!(cin >> policy) || policy < 1 || policy > POLICY_COUNT)
+                {
+                    clearInputBuffer();
+                    Visual::clearScreen();
+                    Visual::printError("Policy must be 1-5!");
+                    waitForUser();
+                }
+                else
+                {
+                    clearInputBuffer();
+                    Visual::clearScreen();
+                    command = TurnCommand(17, policy - 1);
+                    executeCommand(kingdom, command);
+                    waitForUser();
+                }
+            }
+            break;
+
+        case 20: // Exit
             running = false;
             break;
 
@@ -569,27 +836,24 @@ int main()
             break;
         }
 
-        // Increment turn counter and check for random events
-        if (running && choice != 17)
+        // Random event every 4 turns, same rule as runTurn
+        if (running && choice != 20)
         {
-            turnCounter++;
-            if (turnCounter >= 4)
+            if (kingdom.getTurn() % 4 == 0)
             {
                 handleRandomEvent(kingdom);
-                turnCounter = 0; // Reset counter after event
             }
-        }
 
-        // Update resources at the end of each turn
-        kingdom.getMarket().updateFoodStockpile(kingdom.getPeople().getTotalPeople(), kingdom.weather);
-        kingdom.getMarket().updateWeaponsStockpile(kingdom.getArmy().getSize());
-        
-        // Check for food shortage effects
-        if (kingdom.getMarket().checkFoodShortage()) {
-            kingdom.getPolitics().decreaseStability(5); // Decrease stability due to food shortage
-            Visual::printWarning("Food shortage is causing unrest among the population!");
+            // The standard stages after the command and the event, then the world economy, as in runTurn
+            updateGameState(kingdom);
+            Kingdom* self = &kingdom;
+            WorldEconomy::update(&self, 1);
+            history.commit(kingdom);
+            autosave.submit(kingdom);
+            replay.record(command, kingdom);
         }
     }
+    replay.save("replay.shr");
 
     Visual::clearScreen();
     Visual::printLine();